@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+// Host time of the subsystems for -bench. Sections nest, time goes to the
+// innermost one; whatever is in no section is the cpu's.
+#define BENCH_CPU      0
+#define BENCH_SVC      1
+#define BENCH_SERVICES 2
+#define BENCH_GPU      3
+#define BENCH_DSP      4
+#define BENCH_SECTIONS 5
+
+// Set by -bench, the hooks check it first.
+extern bool bench_enabled;
+
+// bench.c
+void bench_Init(u32 frames);
+void bench_Enter(u32 section);
+void bench_Leave();
+bool bench_Frame(u32 frame);
+
+#endif
@@ -5,4 +5,8 @@ extern bool config_slotone;
 extern bool config_usesys;
 extern bool config_nand_cfg_save;
 extern char config_sysdataoutpath[0x200];
-extern u32 config_region;
\ No newline at end of file
+extern u32 config_region;
+extern char config_codecache_path[0x200];
+extern bool config_codecache;
+extern char config_overlay_path[0x200];
+extern bool config_overlay;
\ No newline at end of file
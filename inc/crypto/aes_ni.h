@@ -0,0 +1,37 @@
+/*
+* Copyright (C) 2014 - plutoo
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _AES_NI_H_
+#define _AES_NI_H_
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_AES_NI
+#endif
+
+#ifdef HAVE_AES_NI
+
+bool aesni_Supported();
+
+// Runs AES-CTR over num 16 byte blocks. round_keys are the (nr+1)*16 bytes
+// of the expanded encryption key, ctr is the big-endian 128 bit counter of
+// the first block. input may be NULL to produce the bare keystream.
+void aesni_CtrCrypt(const u8* round_keys, int nr, const u8 ctr[16],
+                    const u8* input, u8* output, u32 num);
+
+#endif
+
+#endif
@@ -0,0 +1,35 @@
+/*
+* Copyright (C) 2014 - plutoo
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SHA_NI_H_
+#define _SHA_NI_H_
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_SHA_NI
+#endif
+
+#ifdef HAVE_SHA_NI
+
+bool shani_Supported();
+
+// Runs the SHA-256 compression function over num 64 byte blocks. state is
+// the eight working words in native order, a..h.
+void shani_Process(u32 state[8], const u8* data, u32 num);
+
+#endif
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef _DSP_H_
+#define _DSP_H_
+
 typedef struct {
     u8 data_offset[4];
     u8 dest_offset[4];
@@ -20,3 +23,51 @@ typedef struct {
     u8 zero[8];
     dsp_segment segment[0x9];
 } dsp_header;
+
+#define DSPAUDIO_RATE  32728 // Output rate, also the CSND's.
+#define DSPAUDIO_FRAME 160   // Samples per audio frame.
+#define DSPAUDIO_HIST  7     // Input samples the resampler looks back.
+
+#define CSND_CHANNELS  32
+
+// Resampler state of a source, kept by its owner between frames.
+typedef struct {
+    u32   frac;
+    float hist[2][DSPAUDIO_HIST];
+} dspaudio_stream;
+
+// Fills count new input samples, out[0] only for mono sources.
+typedef void (*dspaudio_pull)(void* arg, float* out[2], u32 count);
+
+typedef struct {
+    u32  addr;
+    u32  size; // Bytes.
+    u32  pos;  // Bytes, where this frame starts.
+    bool repeat;
+    bool pcm8;
+} dspaudio_capture;
+
+// dsp/dspemu.c
+// Teak decoder, one handler per encoding through a precomputed table. Most
+// handlers only disassemble so far, nothing in the emulator runs firmware
+// through it.
+void DSP_LoadFirm(u8* bin, u32 len);
+void DSP_Run(u32 cycles);
+
+// dsp/audio.c
+int  dspaudio_Init(const char* wav_path);
+void dspaudio_Shutdown();
+void dspaudio_Start();
+void dspaudio_Stop();
+void dspaudio_Line();
+void dspaudio_AddSource(dspaudio_stream* s, float rate, bool interp, const float gain[2][2],
+                        dspaudio_pull pull, void* arg);
+void dspaudio_Capture(u32 unit, const dspaudio_capture* cap);
+
+// dsp/csnd.c
+void csnd_Reset();
+void csnd_ExecuteCommands(u32 offset);
+void csnd_Frame();
+bool csnd_Active();
+
+#endif
@@ -17,6 +17,7 @@
 */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #ifdef __APPLE__
 #undef _POSIX_C_SOURCE
 #endif
@@ -84,12 +85,30 @@ struct _archive {
 typedef struct _dir_type dir_type;
 struct _dir_type {
     u32(*fnRead) (dir_type* self, u32 ptr, u32 entrycount, u32* read_out);
+    u32(*fnClose)(dir_type* self);
     file_path f_path;
     archive* self;
     u8 path[256];
     DIR* dir;
+
+    union {
+        struct {
+            u32 next_dir;  // Metadata offsets of the next entries to list.
+            u32 next_file;
+        } romfs;
+
+        struct {
+            u8*  entries;  // Snapshot of the listing, in FS entry format.
+            u32  num;
+            u32  max;
+            u32  next;
+            bool valid;
+        } hostdir;
+    } type_specific;
 };
 
+typedef struct _cached_file cached_file;
+
 typedef struct _file_type file_type;
 struct _file_type {
     u32 (*fnRead) (file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out);
@@ -101,22 +120,73 @@ struct _file_type {
     u32 handle;
 
     union {
-        struct {
-            FILE* fd;
-            u64   sz;
-        } sharedextd;
-
         struct {
             FILE* fd;
             u64   sz;
             char *path;
         } sysdata;
 
+        struct {
+            u64 off;
+            u64 sz;
+        } romfs;
+
+        struct {
+            cached_file* cf;
+            bool writable;
+        } hostcache;
+
     } type_specific;
 };
 
 
 
+// fs/async.c
+#define FSASYNC_MIN_READ 0x20000 // Smaller reads are done in place.
+
+typedef struct _fsasync_req fsasync_req;
+
+void fsasync_Lock();
+void fsasync_Unlock();
+fsasync_req* fsasync_Read(file_type* file, u32 ptr, u32 sz, u64 off);
+bool fsasync_Poll(fsasync_req* req, u32* rc, u32* read);
+void fsasync_Cancel(fsasync_req* req);
+
+// fs/hostdir.c
+u32 hostdir_Read(dir_type* self, u32 ptr, u32 entrycount, u32* read_out);
+u32 hostdir_Close(dir_type* self);
+
+// fs/hostfile.c
+u32 hostfile_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out);
+u32 hostfile_Write(file_type* self, u32 ptr, u32 sz, u64 off, u32 flush_flags, u32* written_out);
+u32 hostfile_Flush(file_type* self);
+u64 hostfile_GetSize(file_type* self);
+u32 hostfile_SetSize(file_type* self, u64 sz);
+u32 hostfile_Close(file_type* self);
+int hostfile_OpenCached(file_type* file, const char* path, FILE* fd, const char* mode);
+void hostfile_Unlinked(const char* path);
+void hostfile_Renamed(const char* from, const char* to);
+int hostfile_CommitAll();
+void hostfile_Tick();
+bool hostfile_IsHostFile(file_type* file);
+
+// fs/overlay.c
+#define OVERLAY_PATH_MAX 512 // Host paths, delta root included.
+
+typedef int (*overlay_list_fn)(void* arg, const char* name, struct stat* st);
+
+int   overlay_Init(const char* path);
+bool  overlay_Enabled();
+FILE* overlay_FOpen(const char* p, const char* mode, char* host_out);
+int   overlay_Open(const char* p, int flags, int mode);
+int   overlay_Stat(const char* p, struct stat* st);
+int   overlay_Remove(const char* p);
+int   overlay_Mkdir(const char* p);
+int   overlay_Rmdir(const char* p);
+int   overlay_Rename(const char* from, const char* to);
+DIR*  overlay_OpenDir(const char* p);
+int   overlay_ListDir(const char* p, overlay_list_fn fn, void* arg);
+
 // fs/romfs.c
 archive* romfs_OpenArchive(file_path path);
 void romfs_Setup(FILE* fd, u32 off, u32 sz);
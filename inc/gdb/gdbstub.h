@@ -77,6 +77,21 @@ struct armcpu_ctrl_iface {
 
 typedef void *gdbstub_handle_t;
 
+/*
+ * Pages holding a breakpoint or watchpoint, one bit per kind. The CPU only
+ * calls through the memory interface for accesses that hit a marked page,
+ * so with nothing set the hooks cost a single test of gdb_traps.
+ */
+#define GDB_TRAP_EXEC  1
+#define GDB_TRAP_READ  2
+#define GDB_TRAP_WRITE 4
+
+extern u8 gdb_trap_pages[1 << 20];
+extern u32 gdb_traps;
+
+#define gdb_Trapped(kind, adr) \
+    ((gdb_traps & (kind)) && (gdb_trap_pages[(u32)(adr) >> 12] & (kind)))
+
 /*
  * The function interface
  */
@@ -171,6 +171,44 @@ u32 convertvirtualtopys(u32 addr);
 void updateFramebuffer();
 void updateFramebufferaddr(u32 addr, bool bot);
 
+//y2r.c
+#define Y2R_INPUT_YUV422_8   0
+#define Y2R_INPUT_YUV420_8   1
+#define Y2R_INPUT_YUV422_16  2
+#define Y2R_INPUT_YUV420_16  3
+#define Y2R_INPUT_YUYV422    4
+
+#define Y2R_OUTPUT_RGBA8     0
+#define Y2R_OUTPUT_RGB8      1
+#define Y2R_OUTPUT_RGB5A1    2
+#define Y2R_OUTPUT_RGB565    3
+
+#define Y2R_BLOCK_LINE       0
+#define Y2R_BLOCK_8X8        1
+
+typedef struct {
+    u32 addr;
+    u32 size;
+    u32 unit; // Bytes per transfer, then gap bytes are skipped.
+    u32 gap;
+} y2r_dma;
+
+typedef struct {
+    u8  input_format;
+    u8  output_format;
+    u8  rotation;
+    u8  block_alignment;
+    u16 line_width;
+    u16 lines;
+    s16 coefficients[8];
+    u16 alpha;
+    y2r_dma src_y, src_u, src_v, src_yuyv;
+    y2r_dma dst;
+} y2r_params;
+
+void y2r_StandardCoefficients(u32 index, s16* out);
+int y2r_Convert(const y2r_params* p);
+
 //clipper.c
 void Clipper_ProcessTriangle(struct OutputVertex *v0, struct OutputVertex *v1, struct OutputVertex *v2);
 
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "util.h"
 #include "armdefs.h"
 
 #define HANDLES_BASE    0x0DADBABE
@@ -164,15 +165,24 @@ u32 handle_New(u32 type, uintptr_t subtype);
 u32 *curprocesshandlelist;
 #endif
 
-u32 curprocesshandle;
+// The process running on this host thread.
+extern THREAD_LOCAL u32 curprocesshandle;
 
 //handles.h
 u32 wrapWaitSynchronizationN(u32 nanoseconds1, u32 handles_ptr, u32 handles_count, u32 wait_all, u32 nanoseconds2, u32 out);
 
 // services/srv.c
 u32 services_SyncRequest(handleinfo* h, bool *locked);
+const char* services_GetName(handleinfo* h);
 u32 services_WaitSynchronization(handleinfo* h, bool *locked);
 
+// services/http_c.c
+u32 httpc_WaitSynchronization(handleinfo* h, bool *locked);
+
+// services/soc_u.c
+u32 soc_NumWaiting();
+u32 soc_Poll(u32 timeout);
+
 // svc/syn.c
 u32 mutex_WaitSynchronization(handleinfo* h, bool *locked);
 u32 mutex_SyncRequest(handleinfo* h, bool *locked);
@@ -184,6 +194,7 @@ u32 port_SyncRequest(handleinfo* h, bool *locked);
 u32 event_WaitSynchronization(handleinfo* h, bool *locked);
 
 u32 file_SyncRequest(handleinfo* h, bool *locked);
+u32 file_WaitSynchronization(handleinfo* h, bool *locked);
 u32 dir_SyncRequest(handleinfo* h, bool *locked);
 
 //arm11/threads.c
@@ -281,7 +292,7 @@ static struct {
         "file",
         &file_SyncRequest,
         &file_CloseHandle,
-        NULL
+        &file_WaitSynchronization
     },
     {
         "semaphore",
@@ -317,7 +328,7 @@ static struct {
         "httpcont",
         NULL,
         NULL,
-        NULL
+        &httpc_WaitSynchronization
     },
     {
         "UNMOUNTED",
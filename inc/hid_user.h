@@ -22,4 +22,33 @@ u32 hid_user_SyncRequest();
 u32 translate_to_bit(const SDL_KeyboardEvent* key);
 void hid_keyup(const SDL_KeyboardEvent* key);
 void hid_keypress(const SDL_KeyboardEvent* key);
-void hid_position(const Sint32 x, const  Sint32 y);
\ No newline at end of file
+void hid_position(const Sint32 x, const  Sint32 y);
+
+#define HID_A            (1 << 0)
+#define HID_B            (1 << 1)
+#define HID_SELECT       (1 << 2)
+#define HID_START        (1 << 3)
+#define HID_RIGHT        (1 << 4)
+#define HID_LEFT         (1 << 5)
+#define HID_UP           (1 << 6)
+#define HID_DOWN         (1 << 7)
+#define HID_R            (1 << 8)
+#define HID_L            (1 << 9)
+#define HID_X            (1 << 10)
+#define HID_Y            (1 << 11)
+#define HID_ZL           (1 << 14)
+#define HID_ZR           (1 << 15)
+#define HID_TOUCH        (1 << 20)
+#define HID_CIRCLE_RIGHT (1u << 28)
+#define HID_CIRCLE_LEFT  (1u << 29)
+#define HID_CIRCLE_UP    (1u << 30)
+#define HID_CIRCLE_DOWN  (1u << 31)
+
+#define HID_CIRCLE_DEADZONE 40 // Of +-156.
+
+void hid_SetPad(u32 buttons, s16 circle_x, s16 circle_y);
+void hid_SetTouch(bool down, u16 x, u16 y);
+
+// input.c
+int  input_Load(const char* path);
+void input_Frame(u32 frame);
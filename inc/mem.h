@@ -25,11 +25,22 @@ int mem_Write32(uint32_t addr, uint32_t w);
 u32 mem_Read32(uint32_t addr);
 int mem_Write(uint8_t* in_buff, uint32_t addr, uint32_t size);
 int mem_Read(uint8_t* buf_out, uint32_t addr, uint32_t size);
+typedef void (*mem_release)(u8* data, u32 size);
+
 int mem_AddMappingShared(uint32_t base, uint32_t size, u8* data);
+int mem_AdoptMapping(uint32_t base, uint32_t size, u8* data, mem_release release);
+int mem_RemoveMappingShared(uint32_t base);
 bool mem_test(uint32_t addr);
 u8* mem_rawaddr(uint32_t addr, uint32_t size);
+u8* mem_rawspan(uint32_t addr, uint32_t size, uint32_t* span);
 void mem_Dbugdump();
 
+struct mem_table;
+struct mem_table* mem_CurrentTable();
+void mem_UseTable(struct mem_table* t);
+void mem_LockMappings();
+void mem_UnlockMappings();
+
 #ifdef MODULE_SUPPORT
 void ModuleSupport_MemInit(u32 modulenum);
 #endif
\ No newline at end of file
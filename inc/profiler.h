@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#define PROFILER_DEFAULT_INTERVAL 10007 // Prime, so we don't alias with loops.
+
+// Set by -profile. The cpu loop only looks at its own countdown, set from
+// profiler_Countdown, so this is for the loaders to skip symbol parsing when
+// nobody wants it.
+extern bool profiler_enabled;
+
+// profiler.c
+int  profiler_Init(const char* out_path, u32 interval);
+u32  profiler_Countdown();
+u32  profiler_Sample(u32 pc, u32 lr);
+void profiler_AddSymbol(u32 addr, u32 size, const char* name);
+int  profiler_LoadMap(const char* path);
+void profiler_Dump();
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SAVESTATE_H_
+#define _SAVESTATE_H_
+
+#define SAVESTATE_BUSY 1 // Not at a point we can save, try again later.
+#define SAVESTATE_LOST 2 // Load failed and the machine could not be put back.
+
+// savestate.c
+int  savestate_Save(const char* path);
+int  savestate_Load(const char* path);
+
+// For the modules' *_CollectState/*_SaveState/*_LoadState, listed in the
+// table in savestate.c. Errors stick, savestate_Save/savestate_Load check
+// once at the end.
+void savestate_AddBuffer(void* ptr, u64 size);
+void savestate_Put(const void* data, u64 size);
+void savestate_Get(void* data, u64 size);
+void savestate_PutPtr(const void* ptr);
+void* savestate_GetPtr();
+bool savestate_ClaimPtr(void* ptr);
+void savestate_PutPages(const void* data, u64 size);
+void savestate_GetPages(void* data, u64 size);
+void savestate_Relocate(void* fn_ptrs, u32 num);
+void savestate_Fail();
+
+// mem.c
+int  mem_CollectState();
+void mem_SaveState();
+void mem_LoadState();
+
+// handles.c
+int  handle_CollectState();
+void handle_SaveState();
+void handle_LoadState();
+
+// arm11/threads.c
+void threads_SaveState();
+void threads_LoadState();
+
+// gpu/gpu.c, gpu/io.c
+void gpu_SaveState();
+void gpu_LoadState();
+void gpu_SaveIoState();
+void gpu_LoadIoState();
+
+// dsp/audio.c
+void dspaudio_SaveState();
+void dspaudio_LoadState();
+
+// dsp/csnd.c
+void csnd_SaveState();
+void csnd_LoadState();
+
+// services/ldr_ro.c
+void ldr_ro_SaveState();
+void ldr_ro_LoadState();
+
+// syscalls/memory.c
+void memory_SaveState();
+void memory_LoadState();
+
+// services/apt_u.c, services/apt_s.c
+int  apt_u_CollectState();
+void apt_u_SaveState();
+void apt_u_LoadState();
+int  apt_s_CollectState();
+void apt_s_SaveState();
+void apt_s_LoadState();
+
+// services/cecd_u.c
+void cecd_u_SaveState();
+void cecd_u_LoadState();
+
+// services/csnd_SND.c
+int  csnd_SND_CollectState();
+void csnd_SND_SaveState();
+void csnd_SND_LoadState();
+
+// services/dsp_dsp.c
+void dsp_dsp_SaveState();
+void dsp_dsp_LoadState();
+
+// services/gsp_gpu.c
+void gsp_gpu_SaveState();
+void gsp_gpu_LoadState();
+
+// services/hid_user.c, services/hid_SPVR.c
+void hid_user_SaveState();
+void hid_user_LoadState();
+void hid_SPVR_SaveState();
+void hid_SPVR_LoadState();
+
+// services/http_c.c
+int  httpc_CollectState();
+
+// services/ir_u.c
+void ir_u_SaveState();
+void ir_u_LoadState();
+
+// services/mcu_GPU.c
+void mcu_GPU_SaveState();
+void mcu_GPU_LoadState();
+
+// services/soc_u.c
+int  soc_u_CollectState();
+void soc_u_SaveState();
+void soc_u_LoadState();
+
+// services/srv.c
+void srv_SaveState();
+void srv_LoadState();
+
+// services/y2r_u.c
+void y2r_u_SaveState();
+void y2r_u_LoadState();
+
+#endif
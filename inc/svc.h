@@ -25,6 +25,7 @@
 
 // svc.c
 void svc_Execute(ARMul_State * state, u8 num);
+const char* svc_GetName(u8 num);
 
 // arm11/threads.c
 u32 svcCreateThread();
@@ -19,6 +19,8 @@
 #ifndef _THREADS_H_
 #define _THREADS_H_
 
+#define MAX_WAIT_HANDLES 256 // Kernel limit for svcWaitSynchronizationN.
+
 typedef enum {
     RUNNING,
     STOPPED,
@@ -46,7 +48,7 @@ typedef struct {
     thread_state state;
 
     /* WAITING_SYNC */
-    u32* wait_list;
+    u32  wait_list[MAX_WAIT_HANDLES];
     u32  wait_list_size;
     bool wait_all;
 
@@ -68,6 +70,8 @@ u32  threads_New(u32 handle);
 bool threads_IsThreadActive(u32 id);
 void threads_Execute();
 u32  threads_Count();
+u32  threads_GetFrameCount();
+u64  threads_GetInstructionCount();
 void threads_GetAllActive(u32* handles, u32* size);
 u32  threads_GetCurrentThreadHandle();
 void threads_GetPrintableInfo(u32 handle, char* string); // String must be at last 0x1000 in size
@@ -76,7 +80,7 @@ void threads_StopCurrentThread();
 u32  threads_FindIdByHandle(u32 handle);
 bool threads_IsThreadAlive(u32 handle);
 void threads_SaveContextCurrentThread();
-void threads_SetCurrentThreadWaitList(u32* wait_list, bool wait_all, u32 num);
+void threads_SetCurrentThreadWaitList(const u32* wait_list, bool wait_all, u32 num);
 
 void threads_SetCurrentThreadArbitrationSuspend(u32 arbiter, u32 addr);
 void threads_ResumeArbitratedThread(thread* t);
@@ -88,11 +92,20 @@ u32 svcGetThreadId();
 u32 svcCreateThread();
 void threads_Reschedule();
 
+extern THREAD_LOCAL thread* threads;
+
 #ifdef MODULE_SUPPORT
 void ModuleSupport_ThreadsInit(u32 modulenum);
 void ModuleSupport_MemInit(u32 modulenum);
 void ModuleSupport_SwapProcessMem(u32 newproc);
 void ModuleSupport_SwapProcessThreads(u32 newproc);
+void ModuleSupport_Arm11Init(u32 modulenum);
+void ModuleSupport_SwapProcessArm11(u32 newproc);
+void threads_LockKernel();
+void threads_UnlockKernel();
+#else
+#define threads_LockKernel()
+#define threads_UnlockKernel()
 #endif
 #define MAX_THREADS 32
 
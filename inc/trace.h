@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#define TRACE_KIND_SVC 0
+#define TRACE_KIND_IPC 1
+
+// One record of the binary trace stream (-ipctrace).
+typedef struct {
+    u64 start_ns;
+    u32 latency_ns;
+    u16 kind;
+    u16 svc;
+    u32 handle;
+    u32 cmd;
+} trace_record;
+
+// Set when -ipcstats or -ipctrace is given, hooks are no-ops otherwise.
+extern bool trace_enabled;
+
+// trace.c
+int  trace_Init(const char* stats_path, const char* ring_path);
+u64  trace_Now();
+void trace_Svc(u8 num, u64 start_ns, u64 latency_ns);
+void trace_Ipc(const char* service, u32 handle, u32 cmd, u64 start_ns, u64 latency_ns);
+void trace_Poll();
+void trace_Dump();
+
+#endif
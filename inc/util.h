@@ -71,6 +71,13 @@ typedef int64_t s64;
 #define __func__ __FUNCTION__
 #endif
 
+// Per host thread variables, MODULE_SUPPORT runs every process on its own.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 #ifdef _WIN32
 static int _wincolors[] = {
     0,                                                          // black
@@ -453,6 +453,7 @@ So, if lateabtSig=1, then it means Late Abort Model(Base Updated Abort Model)
 
 
     uint32_t NumInstrsToExecute;
+    uint32_t ProfileCountdown; /* instructions to the next profiler sample, 0 = off */
 
     uint32_t currentexaddr;
     uint32_t currentexval;
@@ -22,6 +22,7 @@
 #include "armdefs.h"
 #include "armemu.h"
 #include "svc.h"
+#include "profiler.h"
 
 //ichfly
 //#define callstacker 1
@@ -438,32 +439,35 @@ ARMul_Emulate26 (ARMul_State * state)
         isize = INSN_SIZE;
 
 #ifdef GDB_STUB
+        // Instruction breakpoints only cost anything once one is set.
+        if (gdb_traps & GDB_TRAP_EXEC) {
+            ARMword fetch;
 
+            switch (state->NextInstr) {
+            case SEQ:
+            /* Advance the pipeline, and an S cycle.  */
+            case NONSEQ:
+            /* Advance the pipeline, and an N cycle.  */
+            case PCINCEDSEQ:
+            /* Program counter advanced, and an S cycle.  */
+            case PCINCEDNONSEQ:
+                /* Program counter advanced, and an N cycle.  */
+                fetch = pc + isize;
+                break;
 
-        switch (state->NextInstr) {
-        case SEQ:
-        /* Advance the pipeline, and an S cycle.  */
-        case NONSEQ:
-        /* Advance the pipeline, and an N cycle.  */
-        case PCINCEDSEQ:
-        /* Program counter advanced, and an S cycle.  */
-        case PCINCEDNONSEQ:
-            /* Program counter advanced, and an N cycle.  */
-            if (isize == 2)
-                gdb_memio->prefetch16(gdb_memio->data, pc + isize);
-            else
-                gdb_memio->prefetch32(gdb_memio->data, pc + isize);
-            break;
-
-        case RESUME:
-        /* The program counter has been changed.  */
-        default:
+            case RESUME:
             /* The program counter has been changed.  */
-            if (isize == 2)
-                gdb_memio->prefetch16(gdb_memio->data, state->Reg[15]);
-            else
-                gdb_memio->prefetch32(gdb_memio->data, state->Reg[15]);
-            break;
+            default:
+                /* The program counter has been changed.  */
+                fetch = state->Reg[15];
+                break;
+            }
+            if (gdb_Trapped(GDB_TRAP_EXEC, fetch)) {
+                if (isize == 2)
+                    gdb_memio->prefetch16(gdb_memio->data, fetch);
+                else
+                    gdb_memio->prefetch32(gdb_memio->data, fetch);
+            }
         }
         if (!state->NumInstrsToExecute)
             goto exit;
@@ -979,6 +983,8 @@ ARMul_Emulate26 (ARMul_State * state)
         }
         //io_do_cycle (state);
         state->NumInstrs++;
+        if (state->ProfileCountdown != 0 && --state->ProfileCountdown == 0)
+            state->ProfileCountdown = profiler_Sample(pc, state->Reg[14]);
 #if 0
         if (state->NumInstrs % 10000000 == 0) {
             printf("10 MIPS instr have been executed\n");
@@ -15,6 +15,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include "util.h"
 #include "handles.h"
 #include "arm11.h"
@@ -26,53 +30,119 @@
 #include "threads.h"
 
 #include "gpu.h"
+#include "dsp.h"
+#include "savestate.h"
+#include "hid_user.h"
+#include "bench.h"
 
 #ifdef GDB_STUB
 #include "gdb/gdbstub.h"
 #endif
 
 
-thread threads[MAX_THREADS];
-static u32    num_threads = 0;
-static s32    current_thread = 0;
-static u32    reschedule = 0;
+typedef struct {
+    thread threads[MAX_THREADS];
+    u32    num_threads;
+    s32    current_thread;
+    u32    reschedule;
+} thread_table;
+
+// The thread table of the process running on this host thread, see
+// ModuleSupport_SwapProcessThreads. Process 0 is the application, it alone
+// drives time.
+static thread_table threads_default;
+static THREAD_LOCAL thread_table* proc = &threads_default;
+THREAD_LOCAL thread* threads = threads_default.threads;
+static u32 num_procs = 1;
 
-extern ARMul_State s;
+extern THREAD_LOCAL ARMul_State* arm11_state;
 
 //#define PROPER_THREADING
+#define SOCKET_IDLE_MS 100 // Sleeping longer starves the SDL event loop.
+#define KERNEL_IDLE_MS 1
 //#define THREADING_DEBUG
 #define THREAD_ID_OFFSET 0xC
 
 
 #ifdef MODULE_SUPPORT
 
-thread** threadsproc;
-u32*    num_threadsproc;
-u32     current_proc = 0;
+// The processes only synchronize in the kernel: SVCs, the HLE services and
+// the handle table all run under kernel_lock, guest code runs outside of
+// it. Idle processes sleep until another one leaves the kernel.
+#ifdef _WIN32
+static CRITICAL_SECTION kernel_lock;
+static HANDLE kernel_event;
+#else
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  kernel_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static thread_table** tablesproc;
 
 void ModuleSupport_ThreadsInit(u32 modulenum)
 {
     u32 i;
-    threadsproc = (thread **)malloc(sizeof(thread *)*(modulenum + 1));
-    for (i = 0; i < (modulenum + 1); i++) {
-        *(threadsproc + i) = (thread *)malloc(sizeof(thread)*(MAX_THREADS));
-        memset(*(threadsproc + i), 0, sizeof(thread)*(MAX_THREADS));
-    }
-    num_threadsproc = (u32 *)malloc(sizeof(u32)*(modulenum + 1));
-    memset(num_threadsproc, 0, sizeof(u32*)*(modulenum + 1));
+
+    tablesproc = malloc(sizeof(thread_table*) * (modulenum + 1));
+    num_procs = modulenum + 1;
+
+    // Process 0 owns whatever was created so far.
+    tablesproc[0] = &threads_default;
+    for (i = 1; i < modulenum + 1; i++)
+        tablesproc[i] = calloc(1, sizeof(thread_table));
+
+#ifdef _WIN32
+    InitializeCriticalSection(&kernel_lock);
+    kernel_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
 }
+
+// Every process has its own CPU too, so there is no context to move.
 void ModuleSupport_SwapProcessThreads(u32 newproc)
 {
-    threads_SaveContextCurrentThread();
-    memcpy(*(threadsproc + current_proc), threads, sizeof(thread)*(MAX_THREADS)); //save maps
-    *(num_threadsproc + current_proc) = num_threads;
+    proc = tablesproc[newproc];
+    threads = proc->threads;
+    curprocesshandle = curprocesshandlelist[newproc];
+}
 
-    memcpy(threads, *(threadsproc + newproc), sizeof(thread)*(MAX_THREADS)); //save maps
-    current_thread = 0;
-    num_threads = *(num_threadsproc + newproc);
-    curprocesshandle = *(curprocesshandlelist + newproc);
-    current_proc = newproc;
-    arm11_LoadContext(&threads[0]);
+void threads_LockKernel()
+{
+#ifdef _WIN32
+    EnterCriticalSection(&kernel_lock);
+#else
+    pthread_mutex_lock(&kernel_lock);
+#endif
+}
+
+void threads_UnlockKernel()
+{
+#ifdef _WIN32
+    SetEvent(kernel_event);
+    LeaveCriticalSection(&kernel_lock);
+#else
+    pthread_cond_broadcast(&kernel_cond);
+    pthread_mutex_unlock(&kernel_lock);
+#endif
+}
+
+// Caller holds the kernel lock.
+static void WaitKernel()
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&kernel_lock);
+    WaitForSingleObject(kernel_event, KERNEL_IDLE_MS);
+    EnterCriticalSection(&kernel_lock);
+#else
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += KERNEL_IDLE_MS * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&kernel_cond, &kernel_lock, &until);
+#endif
 }
 
 #endif
@@ -80,20 +150,19 @@ void ModuleSupport_SwapProcessThreads(u32 newproc)
 
 u32 threads_New(u32 handle)
 {
-    if(num_threads == MAX_THREADS) {
+    if(proc->num_threads == MAX_THREADS) {
         ERROR("Too many threads..\n");
         arm11_Dump();
         PAUSE();
         exit(1);
     }
 
-    threads[num_threads].priority = 50;
-    threads[num_threads].handle = handle;
-    threads[num_threads].state = RUNNING;
-    threads[num_threads].wait_list = NULL;
-    threads[num_threads].wait_list_size = 0;
+    threads[proc->num_threads].priority = 50;
+    threads[proc->num_threads].handle = handle;
+    threads[proc->num_threads].state = RUNNING;
+    threads[proc->num_threads].wait_list_size = 0;
 
-    return num_threads++;
+    return proc->num_threads++;
 }
 
 // Returns true if given thread is ready to execute.
@@ -142,8 +211,8 @@ bool threads_IsThreadActive(u32 id)
             }
 
             if (ret) {
-                if (current_thread == id)
-                    s.Reg[1] = threads[id].wait_list_size;
+                if (proc->current_thread == id)
+                    arm11_state->Reg[1] = threads[id].wait_list_size;
                 else
                     threads[id].r[1] = threads[id].wait_list_size;
                 threads[id].state = RUNNING;
@@ -166,8 +235,8 @@ bool threads_IsThreadActive(u32 id)
                             is_waiting ? "true" : "false");
 
                 if(!ret && !is_waiting) {
-                    if (current_thread == id)
-                        s.Reg[1] = i;
+                    if (proc->current_thread == id)
+                        arm11_state->Reg[1] = i;
                     else
                         threads[id].r[1] = i;
                     threads[id].state = RUNNING;
@@ -201,13 +270,13 @@ void threads_RemoveZombies()
         for(i=id; i<threads_Count(); i++)
             threads[i] = threads[i + 1];
 
-        num_threads--;
+        proc->num_threads--;
     }
 }
 
 void threads_Switch(/*u32 from,*/ u32 to)
 {
-    u32 from = current_thread;
+    u32 from = proc->current_thread;
 
     if (from == to) {
         THREADDEBUG("Trying to switch to current thread..\n");
@@ -220,16 +289,60 @@ void threads_Switch(/*u32 from,*/ u32 to)
         exit(1);
     }
 
-    if (current_thread != -1) {
+    if (proc->current_thread != -1) {
         THREADDEBUG("Thread switch %d->%d (%08X->%08X)\n", from, to, threads[from].handle, threads[to].handle);
         arm11_SaveContext(&threads[from]);
     }
 
     arm11_LoadContext(&threads[to]);
-    current_thread = to;
+    proc->current_thread = to;
 }
 
 u32 line = 0;
+static u32 frames; // VBlanks so far.
+static u64 executed; // Guest instructions actually run, without the idle credit.
+
+// One of the 400 lines of a frame.
+static void Line()
+{
+    gpu_SendInterruptToAll(2);
+
+    if (bench_enabled)
+        bench_Enter(BENCH_DSP);
+    dspaudio_Line();
+    if (bench_enabled)
+        bench_Leave();
+
+    line++;
+    if (line == 400) {
+        gpu_SendInterruptToAll(3);
+        line = 0;
+        frames++;
+        input_Frame(frames);
+    }
+}
+
+static u32 LiveThreads()
+{
+    u32 i, n = 0;
+
+    for (i = 0; i < proc->num_threads; i++) {
+        if (threads[i].state != STOPPED)
+            n++;
+    }
+    return n;
+}
+
+// Guest code runs outside of the kernel lock.
+static void Run(u32 num)
+{
+    u64 before = arm11_state->NumInstrs;
+
+    threads_UnlockKernel();
+    arm11_Run(num);
+    threads_LockKernel();
+    executed += arm11_state->NumInstrs - before;
+}
 
 void threads_DoReschedule()
 {
@@ -242,7 +355,7 @@ void threads_DoReschedule()
     //threads_RemoveZombies();
 
     for (t = 0; t < threads_Count(); t++) {
-        if (t == current_thread) continue;
+        if (t == proc->current_thread) continue;
 
         if (!threads_IsThreadActive(t)) {
             THREADDEBUG("Skipping thread %d..\n", t);
@@ -265,36 +378,31 @@ void threads_Execute()
 {
 
 #ifdef PROPER_THREADING
-    if (reschedule) {
+    threads_LockKernel();
+    if (proc->reschedule) {
         threads_DoReschedule();
-        reschedule = 0;
+        proc->reschedule = 0;
     }
 
-    gpu_SendInterruptToAll(2);
-    line++;
-    if (line == 400) {
-        gpu_SendInterruptToAll(3);
-        line = 0;
-    }
-
-    arm11_Run(0x7FFFFFFF);
+    Line();
+    Run(0x7FFFFFFF);
+    threads_UnlockKernel();
 #else
     u32 t;
     bool nothreadused = true;
+    bool timekeeper = proc == &threads_default;
+
+    threads_LockKernel();
     for (t = 0; t < threads_Count(); t++) {
 
-        signed long long diff = s.NumInstrs - last_one;
+        if (timekeeper) {
+            signed long long diff = arm11_state->NumInstrs - last_one;
 
-        for (; diff >(11172 * 16); diff -= (11172 * 16)) {
-            gpu_SendInterruptToAll(2);
-            line++;
-            if (line == 400) {
-                gpu_SendInterruptToAll(3);
-                line = 0;
-            }
+            for (; diff >(11172 * 16); diff -= (11172 * 16))
+                Line();
+            arm11_state->NumInstrs += 11172; //should be less but we have to debug stuff and that makes if faster (normal ~1000)
+            last_one = arm11_state->NumInstrs - diff;//the cycels we have not used
         }
-        s.NumInstrs += 11172; //should be less but we have to debug stuff and that makes if faster (normal ~1000)
-        last_one = s.NumInstrs - diff;//the cycels we have not used
         if (!threads_IsThreadActive(t)) {
             THREADDEBUG("Skipping thread %d..\n", t);
             continue;
@@ -308,47 +416,64 @@ void threads_Execute()
         wait_while_stall();
 #endif
         //arm11_Run(11172 * 16);
-        arm11_Run(0xFFFFFFFF); //state->NumInstrsToExecute don't count down
+        Run(0xFFFFFFFF); //state->NumInstrsToExecute don't count down
 #ifdef GDB_STUB
         wait_while_stall();
 #endif
 
     }
 
+    // Threads blocked in soc:u only wake up on host sockets, so when they
+    // are all that is left sleep on those instead of spinning.
+    // Not while other processes need the kernel lock though.
+    if (soc_NumWaiting() != 0)
+        soc_Poll(nothreadused && soc_NumWaiting() == LiveThreads() && num_procs == 1 ? SOCKET_IDLE_MS : 0);
+
     if (nothreadused) { //waiting
-        gpu_SendInterruptToAll(2);
-        line++;
-        if (line == 400) {
-            gpu_SendInterruptToAll(3);
-            line = 0;
-        }
+        if (timekeeper)
+            Line();
+#ifdef MODULE_SUPPORT
+        else
+            WaitKernel();
+#endif
     }
 
     threads_SaveContextCurrentThread();
     threads_RemoveZombies();
+    threads_UnlockKernel();
 #endif
 }
 
 void threads_Reschedule()
 {
-    reschedule = 1;
+    proc->reschedule = 1;
 }
 
 u32 threads_Count()
 {
-    return num_threads;
+    return proc->num_threads;
+}
+
+u32 threads_GetFrameCount()
+{
+    return frames;
+}
+
+u64 threads_GetInstructionCount()
+{
+    return executed;
 }
 
 u32 threads_GetCurrentThreadHandle()
 {
-    return threads[current_thread].handle;
+    return threads[proc->current_thread].handle;
 }
 
 void threads_GetAllActive(u32* handles, u32* size)
 {
-    threads[current_thread].handle;
+    threads[proc->current_thread].handle;
     
-    for (u32 i = 0; i < num_threads; i++)
+    for (u32 i = 0; i < proc->num_threads; i++)
     {
         if (threads[i].state != STOPPED)
         {
@@ -365,13 +490,13 @@ void threads_StopThread(u32 threadid)
 
 void threads_StopCurrentThread()
 {
-    threads_StopThread(current_thread);
+    threads_StopThread(proc->current_thread);
 }
 
 bool threads_IsThreadAlive(u32 handle)
 {
     int ret = -1;
-    for (u32 i = 0; i<num_threads; i++) {
+    for (u32 i = 0; i<proc->num_threads; i++) {
         if (threads[i].handle == handle)
             ret = i;
     }
@@ -385,7 +510,7 @@ u32 threads_FindIdByHandle(u32 handle)
     u32 i;
 
     if (handle == 0xffff8000)
-        return current_thread;
+        return proc->current_thread;
 
     for(i=0; i<threads_Count(); i++) {
         if (threads[i].handle == handle)
@@ -427,42 +552,43 @@ void threads_GetPrintableInfo(u32 handle, char* string)
 
 void threads_SaveContextCurrentThread()
 {
-    if (current_thread != -1) {
-        arm11_SaveContext(&threads[current_thread]);
+    if (proc->current_thread != -1) {
+        arm11_SaveContext(&threads[proc->current_thread]);
 
-        if (num_threads > 1)
-            current_thread = -1;
+        if (proc->num_threads > 1)
+            proc->current_thread = -1;
     }
 }
 
-extern ARMul_State s;
-
-void threads_SetCurrentThreadWaitList(u32* wait_list, bool wait_all, u32 num)
+// Copies the wait-list into the thread itself, so blocking never touches the heap.
+void threads_SetCurrentThreadWaitList(const u32* wait_list, bool wait_all, u32 num)
 {
-    if(threads[current_thread].wait_list != NULL)
-        free(threads[current_thread].wait_list);
+    if (num > MAX_WAIT_HANDLES) {
+        ERROR("Wait-list too long (%u), truncating.\n", num);
+        num = MAX_WAIT_HANDLES;
+    }
 
-    threads[current_thread].wait_list = wait_list;
-    threads[current_thread].state = WAITING_SYNC;
-    threads[current_thread].wait_all = wait_all;
-    threads[current_thread].wait_list_size = num;
+    memcpy(threads[proc->current_thread].wait_list, wait_list, num * sizeof(u32));
+    threads[proc->current_thread].state = WAITING_SYNC;
+    threads[proc->current_thread].wait_all = wait_all;
+    threads[proc->current_thread].wait_list_size = num;
 
-    s.NumInstrsToExecute = 0;
+    arm11_state->NumInstrsToExecute = 0;
 }
 
 // Sets current thread into arbitration suspend.
 void threads_SetCurrentThreadArbitrationSuspend(u32 arbiter, u32 addr)
 {
     // This should never happen.
-    if(threads[current_thread].state != RUNNING) {
+    if(threads[proc->current_thread].state != RUNNING) {
         ERROR("Warning: arbiting non-running thread!\n");
     }
 
-    threads[current_thread].state      = WAITING_ARB;
-    threads[current_thread].arb_addr   = addr;
-    threads[current_thread].arb_handle = arbiter;
+    threads[proc->current_thread].state      = WAITING_ARB;
+    threads[proc->current_thread].arb_addr   = addr;
+    threads[proc->current_thread].arb_handle = arbiter;
 
-    s.NumInstrsToExecute = 0;
+    arm11_state->NumInstrsToExecute = 0;
 }
 
 void threads_ResumeArbitratedThread(thread* t)
@@ -536,7 +662,7 @@ u32 svcGetThreadId()
     u32 handle = arm11_R(1);
 
     if (handle == 0xffff8000) {
-        arm11_SetR(1, THREAD_ID_OFFSET + current_thread);
+        arm11_SetR(1, THREAD_ID_OFFSET + proc->current_thread);
         return 0;
     } else {
         THREADDEBUG("svcGetThreadId not supported\n");
@@ -608,3 +734,36 @@ u32 thread_WaitSynchronization(handleinfo* h, bool *locked)
 
     return 0;
 }
+
+// Save states, see savestate.c. Taken between two threads_Execute, every
+// context is in the table by then.
+void threads_SaveState()
+{
+    savestate_Put(threads, sizeof(thread) * MAX_THREADS);
+    savestate_Put(&proc->num_threads, sizeof(proc->num_threads));
+    savestate_Put(&proc->current_thread, sizeof(proc->current_thread));
+    savestate_Put(&proc->reschedule, sizeof(proc->reschedule));
+    savestate_Put(&line, sizeof(line));
+    savestate_Put(&frames, sizeof(frames));
+    savestate_Put(&last_one, sizeof(last_one));
+    savestate_Put(&arm11_state->NumInstrs, sizeof(arm11_state->NumInstrs));
+}
+
+void threads_LoadState()
+{
+    savestate_Get(threads, sizeof(thread) * MAX_THREADS);
+    savestate_Get(&proc->num_threads, sizeof(proc->num_threads));
+    savestate_Get(&proc->current_thread, sizeof(proc->current_thread));
+    savestate_Get(&proc->reschedule, sizeof(proc->reschedule));
+    savestate_Get(&line, sizeof(line));
+    savestate_Get(&frames, sizeof(frames));
+    savestate_Get(&last_one, sizeof(last_one));
+    savestate_Get(&arm11_state->NumInstrs, sizeof(arm11_state->NumInstrs));
+
+    if (proc->num_threads > MAX_THREADS)
+        proc->num_threads = 0;
+
+    // threads_Switch does not reload the thread it is already on.
+    if (proc->current_thread != -1)
+        arm11_LoadContext(&threads[proc->current_thread]);
+}
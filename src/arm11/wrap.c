@@ -5,6 +5,7 @@
 #include "armdefs.h"
 #include "armemu.h"
 #include "threads.h"
+#include "profiler.h"
 
 #define dumpstack 1
 #define dumpstacksize 0x10
@@ -68,10 +69,12 @@ ARMul_ReLoadInstr (ARMul_State * state, ARMword address, ARMword isize)
     ARMword data;
 
 #ifdef GDB_STUB
-    if (isize == 2)
-        gdb_memio->prefetch16(gdb_memio->data, address);
-    else
-        gdb_memio->prefetch32(gdb_memio->data, address);
+    if (gdb_Trapped(GDB_TRAP_EXEC, address)) {
+        if (isize == 2)
+            gdb_memio->prefetch16(gdb_memio->data, address);
+        else
+            gdb_memio->prefetch32(gdb_memio->data, address);
+    }
 #endif
 
     if ((isize == 2) && (address & 0x2)) {
@@ -104,7 +107,8 @@ ARMword ARMul_ReadWord (ARMul_State * state, ARMword address)
     ARMword data;
 
 #ifdef GDB_STUB
-    gdb_memio->read32(gdb_memio->data, address);
+    if (gdb_Trapped(GDB_TRAP_READ, address))
+        gdb_memio->read32(gdb_memio->data, address);
 #endif
     data = mem_Read32(address);
     /*if (fault) {
@@ -129,7 +133,8 @@ ARMword ARMul_LoadWordN (ARMul_State * state, ARMword address)
 ARMword ARMul_LoadHalfWord (ARMul_State * state, ARMword address)
 {
 #ifdef GDB_STUB
-    gdb_memio->read16(gdb_memio->data, address);
+    if (gdb_Trapped(GDB_TRAP_READ, address))
+        gdb_memio->read16(gdb_memio->data, address);
 #endif
     ARMword data;
 
@@ -150,7 +155,8 @@ ARMword ARMul_LoadHalfWord (ARMul_State * state, ARMword address)
 ARMword ARMul_ReadByte (ARMul_State * state, ARMword address)
 {
 #ifdef GDB_STUB
-    gdb_memio->read8(gdb_memio->data, address);
+    if (gdb_Trapped(GDB_TRAP_READ, address))
+        gdb_memio->read8(gdb_memio->data, address);
 #endif
     ARMword data;
     data = (u8) mem_Read8(address);
@@ -175,7 +181,8 @@ void ARMul_StoreHalfWord (ARMul_State * state, ARMword address, ARMword data)
 {
     state->NumNcycles++;
 #ifdef GDB_STUB
-    gdb_memio->write16(gdb_memio->data, address, data);
+    if (gdb_Trapped(GDB_TRAP_WRITE, address))
+        gdb_memio->write16(gdb_memio->data, address, data);
 #endif
     mem_Write16(address, data);
     /*if (fault) {
@@ -205,8 +212,10 @@ void ARMul_StoreByte (ARMul_State * state, ARMword address, ARMword data)
 ARMword ARMul_SwapWord (ARMul_State * state, ARMword address, ARMword data)
 {
 #ifdef GDB_STUB
-    gdb_memio->read32(gdb_memio->data, address);
-    gdb_memio->write32(gdb_memio->data, address, data);
+    if (gdb_Trapped(GDB_TRAP_READ, address))
+        gdb_memio->read32(gdb_memio->data, address);
+    if (gdb_Trapped(GDB_TRAP_WRITE, address))
+        gdb_memio->write32(gdb_memio->data, address, data);
 #endif
     ARMword temp;
     state->NumNcycles++;
@@ -218,8 +227,10 @@ ARMword ARMul_SwapWord (ARMul_State * state, ARMword address, ARMword data)
 ARMword ARMul_SwapByte (ARMul_State * state, ARMword address, ARMword data)
 {
 #ifdef GDB_STUB
-    gdb_memio->read8(gdb_memio->data, address);
-    gdb_memio->write8(gdb_memio->data, address, data);
+    if (gdb_Trapped(GDB_TRAP_READ, address))
+        gdb_memio->read8(gdb_memio->data, address);
+    if (gdb_Trapped(GDB_TRAP_WRITE, address))
+        gdb_memio->write8(gdb_memio->data, address, data);
 #endif
     ARMword temp;
     temp = ARMul_LoadByte (state, address);
@@ -229,7 +240,8 @@ ARMword ARMul_SwapByte (ARMul_State * state, ARMword address, ARMword data)
 void ARMul_WriteWord (ARMul_State * state, ARMword address, ARMword data)
 {
 #ifdef GDB_STUB
-    gdb_memio->write32(gdb_memio->data, address, data);
+    if (gdb_Trapped(GDB_TRAP_WRITE, address))
+        gdb_memio->write32(gdb_memio->data, address, data);
 #endif
     mem_Write32(address, data);
     /*if (fault) {
@@ -243,7 +255,8 @@ void ARMul_WriteWord (ARMul_State * state, ARMword address, ARMword data)
 void ARMul_WriteByte (ARMul_State * state, ARMword address, ARMword data)
 {
 #ifdef GDB_STUB
-    gdb_memio->write8(gdb_memio->data, address, data);
+    if (gdb_Trapped(GDB_TRAP_WRITE, address))
+        gdb_memio->write8(gdb_memio->data, address, data);
 #endif
     mem_Write8(address, data);
 }
@@ -259,57 +272,94 @@ void ARMul_StoreWordN (ARMul_State * state, ARMword address, ARMword data)
 }
 
 /* WRAPPER */
-ARMul_State s;
+
+// The CPU of the process running on this host thread. Every process owns
+// one, see ModuleSupport_SwapProcessArm11, process 0 is the application.
+static ARMul_State arm11_default;
+THREAD_LOCAL ARMul_State* arm11_state = &arm11_default;
+
 void arm11_Disasm32(u32 opc)
 {
 
 }
 
+static void InitState(ARMul_State* state)
+{
+    memset(state, 0, sizeof(*state));
+    ARMul_NewState(state);
+
+    state->abort_model = 0;
+    state->bigendSig = LOW;
+
+    ARMul_SelectProcessor(state, ARM_v6_Prop | ARM_v5_Prop | ARM_v5e_Prop);
+    state->lateabtSig = LOW;
+
+    ARMul_CoProInit(state);
+
+    ARMul_Reset(state);
+    state->NextInstr = RESUME;
+    state->Emulate = 3;
+    state->servaddr = 0xFFFF0000 - 0x1000 * MAX_THREADS;
+    state->ProfileCountdown = profiler_Countdown();
+}
+
 void arm11_Init()
 {
     ARMul_EmulateInit();
+    InitState(&arm11_default);
+}
 
-    memset(&s, 0, sizeof(s));
-    ARMul_NewState(&s);
-
-    s.abort_model = 0;
-    s.bigendSig = LOW;
+#ifdef MODULE_SUPPORT
 
-    ARMul_SelectProcessor(&s, ARM_v6_Prop | ARM_v5_Prop | ARM_v5e_Prop);
-    s.lateabtSig = LOW;
+static ARMul_State** statesproc;
 
-    ARMul_CoProInit(&s);
+void ModuleSupport_Arm11Init(u32 modulenum)
+{
+    statesproc = calloc(modulenum + 1, sizeof(ARMul_State*));
+    statesproc[0] = &arm11_default;
+}
 
-    ARMul_Reset (&s);
-    s.NextInstr = RESUME;
-    s.Emulate = 3;
-    s.servaddr = 0xFFFF0000 - 0x1000 * MAX_THREADS;
+// Binds the calling host thread to the CPU of newproc, the modules get
+// theirs on first use, after arm11_Init.
+void ModuleSupport_SwapProcessArm11(u32 newproc)
+{
+    if (statesproc[newproc] == NULL) {
+        statesproc[newproc] = malloc(sizeof(ARMul_State));
+        if (statesproc[newproc] == NULL) {
+            ERROR("malloc failed\n");
+            exit(1);
+        }
+        InitState(statesproc[newproc]);
+    }
+    arm11_state = statesproc[newproc];
 }
 
+#endif
+
 u32 arm11_ServiceBufferAddress()
 {
-    return s.servaddr;
+    return arm11_state->servaddr;
 }
 
 void arm11_SkipToNextThread()
 {
-    s.NumInstrsToExecute = 0;
+    arm11_state->NumInstrsToExecute = 0;
 }
 
 bool arm11_Step()
 {
-    s.NumInstrsToExecute = 1;
-    ARMul_Emulate32(&s);
+    arm11_state->NumInstrsToExecute = 1;
+    ARMul_Emulate32(arm11_state);
 
     return true;
 }
 
 bool arm11_Run(int numInstructions)
 {
-    s.NumInstrsToExecute = numInstructions;
-    //s.TFlag = true;
+    arm11_state->NumInstrsToExecute = numInstructions;
+    //arm11_state->TFlag = true;
 
-    ARMul_Emulate32(&s);
+    ARMul_Emulate32(arm11_state);
 
     return true;
 }
@@ -321,7 +371,7 @@ u32 arm11_R(u32 n)
         return 0;
     }
 
-    return s.Reg[n];
+    return arm11_state->Reg[n];
 }
 void arm11_SetR(u32 n, u32 val)
 {
@@ -330,7 +380,7 @@ void arm11_SetR(u32 n, u32 val)
         return;
     }
 
-    s.Reg[n] = val;
+    arm11_state->Reg[n] = val;
 }
 bool aufloeser(char* a,u32 addr)
 {
@@ -384,98 +434,98 @@ void arm11_Dump()
     u32 i;
     for (i = 0; i < 4; i++) {
         ERROR("r%02d: %08x r%02d: %08x r%02d: %08x r%02d: %08x\n",
-              4 * i, s.Reg[4 * i], 4 * i + 1, s.Reg[4 * i + 1], 4 * i + 2, s.Reg[4 * i + 2], 4 * i + 3, s.Reg[4 * i + 3]);
+              4 * i, arm11_state->Reg[4 * i], 4 * i + 1, arm11_state->Reg[4 * i + 1], 4 * i + 2, arm11_state->Reg[4 * i + 2], 4 * i + 3, arm11_state->Reg[4 * i + 3]);
     }
     memset(a, 0, 256);
-    aufloeser(a, s.Reg[15]);
+    aufloeser(a, arm11_state->Reg[15]);
     ERROR("current pc %s\n", a);
     memset(a, 0, 256);
-    aufloeser(a, s.Reg[14]);
+    aufloeser(a, arm11_state->Reg[14]);
     ERROR("current lr %s\n", a);
     for (int i = 0; i < dumpstacksize; i++) {
 
-        if (mem_test(s.Reg[13] + i * 4)) {
-            aufloeser(a, mem_Read32(s.Reg[13] + i * 4));
-            ERROR("%08X %08x %s\n", s.Reg[13] + i * 4, mem_Read32(s.Reg[13] + i * 4), a);
+        if (mem_test(arm11_state->Reg[13] + i * 4)) {
+            aufloeser(a, mem_Read32(arm11_state->Reg[13] + i * 4));
+            ERROR("%08X %08x %s\n", arm11_state->Reg[13] + i * 4, mem_Read32(arm11_state->Reg[13] + i * 4), a);
         }
     }
     ERROR("\n");
 }
 void arm11_SetPCSP(u32 pc, u32 sp)
 {
-    s.Reg[13] = sp;
-    s.Reg[15] = pc;
-    s.pc = pc;
+    arm11_state->Reg[13] = sp;
+    arm11_state->Reg[15] = pc;
+    arm11_state->pc = pc;
 }
 void arm11_SaveContext(thread *t)
 {
-    for (int i = 0; i < 13; i++) t->r[i] = s.Reg[i];
-    t->sp = s.Reg[13];
-    t->lr = s.Reg[14];
-    t->pc = s.pc;
-    t->cpsr = s.Cpsr;
-    t->mode = s.NextInstr;
-    t->r15 = s.Reg[15];
+    for (int i = 0; i < 13; i++) t->r[i] = arm11_state->Reg[i];
+    t->sp = arm11_state->Reg[13];
+    t->lr = arm11_state->Reg[14];
+    t->pc = arm11_state->pc;
+    t->cpsr = arm11_state->Cpsr;
+    t->mode = arm11_state->NextInstr;
+    t->r15 = arm11_state->Reg[15];
 
-    for (int i = 0; i < 32; i++) t->fpu_r[i] = s.ExtReg[i];
-    t->fpunk = s.VFP[0];
-    t->fpscr = s.VFP[1];
-    t->fpexc = s.VFP[2];
+    for (int i = 0; i < 32; i++) t->fpu_r[i] = arm11_state->ExtReg[i];
+    t->fpunk = arm11_state->VFP[0];
+    t->fpscr = arm11_state->VFP[1];
+    t->fpexc = arm11_state->VFP[2];
 
-    t->currentexaddr = s.currentexaddr;
-    t->currentexval = s.currentexval;
+    t->currentexaddr = arm11_state->currentexaddr;
+    t->currentexval = arm11_state->currentexval;
 
-    t->decoded = s.decoded;
-    t->loaded = s.loaded;
-    t->decoded_addr = s.decoded_addr;
-    t->loaded_addr = s.loaded_addr;
+    t->decoded = arm11_state->decoded;
+    t->loaded = arm11_state->loaded;
+    t->decoded_addr = arm11_state->decoded_addr;
+    t->loaded_addr = arm11_state->loaded_addr;
 
     //more flags
-    t->NFlag = s.NFlag;
-    t->ZFlag = s.ZFlag;
-    t->CFlag = s.CFlag;
-    t->VFlag = s.VFlag;
-    t->IFFlags = s.IFFlags;
-    t->GEFlag = s.GEFlag;
-    t->EFlag = s.EFlag;
-    t->AFlag = s.AFlag;
-    t->QFlags = s.QFlag;
+    t->NFlag = arm11_state->NFlag;
+    t->ZFlag = arm11_state->ZFlag;
+    t->CFlag = arm11_state->CFlag;
+    t->VFlag = arm11_state->VFlag;
+    t->IFFlags = arm11_state->IFFlags;
+    t->GEFlag = arm11_state->GEFlag;
+    t->EFlag = arm11_state->EFlag;
+    t->AFlag = arm11_state->AFlag;
+    t->QFlags = arm11_state->QFlag;
 }
 void arm11_LoadContext(thread *t)
 {
-    for (int i = 0; i < 13; i++) s.Reg[i] = t->r[i];
-    s.Reg[13] = t->sp;
-    s.Reg[14] = t->lr;
-    s.pc = t->pc;
-    s.Cpsr = t->cpsr;
-    s.NextInstr = t->mode;
-    s.Reg[15] = t->r15;
+    for (int i = 0; i < 13; i++) arm11_state->Reg[i] = t->r[i];
+    arm11_state->Reg[13] = t->sp;
+    arm11_state->Reg[14] = t->lr;
+    arm11_state->pc = t->pc;
+    arm11_state->Cpsr = t->cpsr;
+    arm11_state->NextInstr = t->mode;
+    arm11_state->Reg[15] = t->r15;
 
-    for (int i = 0; i < 32; i++) s.ExtReg[i] = t->fpu_r[i];
-    s.VFP[0] = t->fpunk;
-    s.VFP[1] = t->fpscr;
-    s.VFP[2] = t->fpexc;
+    for (int i = 0; i < 32; i++) arm11_state->ExtReg[i] = t->fpu_r[i];
+    arm11_state->VFP[0] = t->fpunk;
+    arm11_state->VFP[1] = t->fpscr;
+    arm11_state->VFP[2] = t->fpexc;
 
-    s.currentexaddr = t->currentexaddr;
-    s.currentexval = t->currentexval;
-    s.servaddr = t->servaddr;
+    arm11_state->currentexaddr = t->currentexaddr;
+    arm11_state->currentexval = t->currentexval;
+    arm11_state->servaddr = t->servaddr;
 
-    if (s.Cpsr & 0x20)s.TFlag = true;
-    else s.TFlag = false;
+    if (arm11_state->Cpsr & 0x20)arm11_state->TFlag = true;
+    else arm11_state->TFlag = false;
 
-    s.decoded = t->decoded;
-    s.loaded = t->loaded;
-    s.decoded_addr = t->decoded_addr;
-    s.loaded_addr = t->loaded_addr;
+    arm11_state->decoded = t->decoded;
+    arm11_state->loaded = t->loaded;
+    arm11_state->decoded_addr = t->decoded_addr;
+    arm11_state->loaded_addr = t->loaded_addr;
 
     //more flags
-    s.NFlag = t->NFlag;
-    s.ZFlag = t->ZFlag;
-    s.CFlag = t->CFlag;
-    s.VFlag = t->VFlag;
-    s.IFFlags = t->IFFlags;
-    s.GEFlag = t->GEFlag;
-    s.EFlag = t->EFlag;
-    s.AFlag = t->AFlag;
-    s.QFlag = t->QFlags;
+    arm11_state->NFlag = t->NFlag;
+    arm11_state->ZFlag = t->ZFlag;
+    arm11_state->CFlag = t->CFlag;
+    arm11_state->VFlag = t->VFlag;
+    arm11_state->IFFlags = t->IFFlags;
+    arm11_state->GEFlag = t->GEFlag;
+    arm11_state->EFlag = t->EFlag;
+    arm11_state->AFlag = t->AFlag;
+    arm11_state->QFlag = t->QFlags;
 }
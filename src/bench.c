@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util.h"
+#include "threads.h"
+#include "trace.h"
+#include "bench.h"
+
+// -bench <frames>: runs headless and unthrottled from the first VBlank,
+// then prints frames/s, guest MIPS and where the host time went.
+
+#define MAX_DEPTH 16
+
+bool bench_enabled = false;
+
+static const char* section_names[BENCH_SECTIONS] = {
+    "cpu", "svc", "services", "gpu", "dsp"
+};
+
+static u32 frames;
+static bool started;
+static u32 start_frame;
+static u64 start_ns;
+static u64 start_instrs;
+
+static u64 section_ns[BENCH_SECTIONS];
+static u32 stack[MAX_DEPTH];
+static u32 depth;
+static u64 last_ns;
+
+// Sections are timed on the application's host thread only, MODULE_SUPPORT
+// modules run on their own.
+static THREAD_LOCAL bool timed;
+
+void bench_Init(u32 num_frames)
+{
+    frames = num_frames;
+    bench_enabled = true;
+    timed = true;
+}
+
+// Charges the time since the last switch to the running section.
+static void Switch()
+{
+    u64 now = trace_Now();
+
+    section_ns[depth != 0 ? stack[depth - 1] : BENCH_CPU] += now - last_ns;
+    last_ns = now;
+}
+
+void bench_Enter(u32 section)
+{
+    if (!started || !timed)
+        return;
+
+    Switch();
+    if (depth < MAX_DEPTH)
+        stack[depth] = section;
+    depth++;
+}
+
+void bench_Leave()
+{
+    if (!started || !timed || depth == 0)
+        return;
+
+    Switch();
+    depth--;
+}
+
+static void Report(u32 num)
+{
+    u64 total;
+    double secs;
+    u32 i;
+
+    Switch();
+    total = last_ns - start_ns;
+    secs = total / 1e9;
+
+    printf("bench: %u frames in %.2f s, %.1f frames/s, %.1f guest MIPS\n", num, secs,
+           num / secs, (threads_GetInstructionCount() - start_instrs) / secs / 1e6);
+
+    for (i = 0; i < BENCH_SECTIONS; i++)
+        printf("bench: %-8s %8.3f s %5.1f%%\n", section_names[i], section_ns[i] / 1e9,
+               total != 0 ? 100.0 * section_ns[i] / total : 0.0);
+}
+
+// Called with the VBlank count after each scheduler pass, true once the
+// run is over.
+bool bench_Frame(u32 frame)
+{
+    if (!started) {
+        started = true;
+        start_frame = frame;
+        start_ns = last_ns = trace_Now();
+        start_instrs = threads_GetInstructionCount();
+        return false;
+    }
+
+    if (frame - start_frame < frames)
+        return false;
+
+    Report(frame - start_frame);
+    bench_enabled = false;
+    return true;
+}
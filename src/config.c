@@ -9,3 +9,9 @@ bool config_nand_cfg_save = false;
 u32  config_region = 2; //EUROPE
 
 char config_sysdataoutpath[0x200]; //0x200 is MAX file path
+
+char config_codecache_path[0x200];
+bool config_codecache = false;
+
+char config_overlay_path[0x200];
+bool config_overlay = false;
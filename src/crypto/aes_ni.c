@@ -0,0 +1,109 @@
+/*
+* Copyright (C) 2014 - plutoo
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "util.h"
+#include "crypto/aes_ni.h"
+
+#ifdef HAVE_AES_NI
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AESNI_TARGET
+#define bswap64 _byteswap_uint64
+#else
+#include <cpuid.h>
+#if defined(__clang__)
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#else
+// Intrinsics are only worth it with the registers kept in registers, so
+// don't leave this one to the -O0 debug build.
+#define AESNI_TARGET __attribute__((target("aes,sse2"), optimize("O2")))
+#endif
+#define bswap64 __builtin_bswap64
+#endif
+
+#include <wmmintrin.h>
+#include <emmintrin.h>
+
+bool aesni_Supported()
+{
+    static int supported = -1;
+
+    if (supported < 0) {
+#ifdef _MSC_VER
+        int regs[4];
+        __cpuid(regs, 1);
+        supported = (regs[2] >> 25) & 1;
+#else
+        unsigned int eax, ebx, ecx, edx;
+        supported = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && ((ecx >> 25) & 1);
+#endif
+    }
+    return supported;
+}
+
+#define BATCH 8
+
+AESNI_TARGET
+void aesni_CtrCrypt(const u8* round_keys, int nr, const u8 ctr[16],
+                    const u8* input, u8* output, u32 num)
+{
+    __m128i rk[15];
+    __m128i b[BATCH];
+    u64 hi, lo;
+    int r;
+    u32 i, n;
+
+    for (r = 0; r <= nr; r++)
+        rk[r] = _mm_loadu_si128((const __m128i*)(round_keys + r * 16));
+
+    memcpy(&hi, ctr, 8);
+    memcpy(&lo, ctr + 8, 8);
+    hi = bswap64(hi);
+    lo = bswap64(lo);
+
+    // Eight independent blocks keep the aesenc pipeline full.
+    while (num != 0) {
+        n = num < BATCH ? num : BATCH;
+
+        for (i = 0; i < n; i++) {
+            b[i] = _mm_set_epi64x(bswap64(lo), bswap64(hi));
+            b[i] = _mm_xor_si128(b[i], rk[0]);
+            if (++lo == 0)
+                hi++;
+        }
+
+        for (r = 1; r < nr; r++) {
+            for (i = 0; i < n; i++)
+                b[i] = _mm_aesenc_si128(b[i], rk[r]);
+        }
+
+        for (i = 0; i < n; i++) {
+            b[i] = _mm_aesenclast_si128(b[i], rk[nr]);
+            if (input != NULL)
+                b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*)(input + i * 16)));
+            _mm_storeu_si128((__m128i*)(output + i * 16), b[i]);
+        }
+
+        if (input != NULL)
+            input += n * 16;
+        output += n * 16;
+        num -= n;
+    }
+}
+
+#endif
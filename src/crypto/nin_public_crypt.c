@@ -7,6 +7,7 @@
 
 #include "threads.h"
 #include "crypto/aes.h"
+#include "crypto/aes_ni.h"
 #include "loader.h"
 
 //from ctrtool
@@ -29,29 +30,23 @@ void ctr_set_counter(ctr_aes_context* ctx,
 void ctr_add_counter(ctr_aes_context* ctx,
                      u32 carry)
 {
-    u32 counter[4];
-    u32 sum;
+    u64 hi = 0, lo = 0;
     int i;
 
-    for (i = 0; i<4; i++)
-        counter[i] = (ctx->ctr[i * 4 + 0] << 24) | (ctx->ctr[i * 4 + 1] << 16) | (ctx->ctr[i * 4 + 2] << 8) | (ctx->ctr[i * 4 + 3] << 0);
-
-    for (i = 3; i >= 0; i--) {
-        sum = counter[i] + carry;
-
-        if (sum < counter[i])
-            carry = 1;
-        else
-            carry = 0;
-
-        counter[i] = sum;
+    for (i = 0; i < 8; i++) {
+        hi = (hi << 8) | ctx->ctr[i];
+        lo = (lo << 8) | ctx->ctr[i + 8];
     }
 
-    for (i = 0; i<4; i++) {
-        ctx->ctr[i * 4 + 0] = counter[i] >> 24;
-        ctx->ctr[i * 4 + 1] = counter[i] >> 16;
-        ctx->ctr[i * 4 + 2] = counter[i] >> 8;
-        ctx->ctr[i * 4 + 3] = counter[i] >> 0;
+    lo += carry;
+    if (lo < carry)
+        hi++;
+
+    for (i = 7; i >= 0; i--) {
+        ctx->ctr[i] = (u8)hi;
+        ctx->ctr[i + 8] = (u8)lo;
+        hi >>= 8;
+        lo >>= 8;
     }
 }
 
@@ -86,6 +81,80 @@ void ctr_crypt_counter_block(ctr_aes_context* ctx,
     ctr_add_counter(ctx, 1);
 }
 
+#define CTR_BATCH 8
+
+// Scalar fallback: eight counter blocks per round trip, the counter is
+// unpacked once and kept in two words instead of bumped byte by byte.
+static void CryptBlocksScalar(ctr_aes_context* ctx, const u8* input, u8* output, u32 num)
+{
+    u8 stream[CTR_BATCH * 16];
+    u64 hi = 0, lo = 0;
+    u32 i, n;
+    int j;
+
+    for (j = 0; j < 8; j++) {
+        hi = (hi << 8) | ctx->ctr[j];
+        lo = (lo << 8) | ctx->ctr[j + 8];
+    }
+    ctr_add_counter(ctx, num);
+
+    while (num != 0) {
+        n = num < CTR_BATCH ? num : CTR_BATCH;
+
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < 8; j++) {
+                stream[i * 16 + j] = (u8)(hi >> (56 - j * 8));
+                stream[i * 16 + j + 8] = (u8)(lo >> (56 - j * 8));
+            }
+            if (++lo == 0)
+                hi++;
+        }
+        for (i = 0; i < n; i++)
+            aes_crypt_ecb(&ctx->aes, AES_ENCRYPT, stream + i * 16, stream + i * 16);
+
+        if (input != NULL) {
+            for (i = 0; i < n * 16; i += 8) {
+                u64 a, b;
+                memcpy(&a, input + i, 8);
+                memcpy(&b, stream + i, 8);
+                a ^= b;
+                memcpy(output + i, &a, 8);
+            }
+            input += n * 16;
+        } else {
+            memcpy(output, stream, n * 16);
+        }
+
+        output += n * 16;
+        num -= n;
+    }
+}
+
+static void CryptBlocks(ctr_aes_context* ctx, const u8* input, u8* output, u32 num)
+{
+#ifdef HAVE_AES_NI
+    if (aesni_Supported()) {
+        u8 round_keys[15 * 16];
+        int i;
+
+        // PolarSSL keeps each round key word as a little-endian load of
+        // the key bytes.
+        for (i = 0; i < (ctx->aes.nr + 1) * 4; i++) {
+            u32 w = (u32)ctx->aes.rk[i];
+            round_keys[i * 4 + 0] = (u8)w;
+            round_keys[i * 4 + 1] = (u8)(w >> 8);
+            round_keys[i * 4 + 2] = (u8)(w >> 16);
+            round_keys[i * 4 + 3] = (u8)(w >> 24);
+        }
+
+        aesni_CtrCrypt(round_keys, ctx->aes.nr, ctx->ctr, input, output, num);
+        ctr_add_counter(ctx, num);
+        return;
+    }
+#endif
+    CryptBlocksScalar(ctx, input, output, num);
+}
+
 void ctr_crypt_counter(ctr_aes_context* ctx,
                        u8* input,
                        u8* output,
@@ -94,15 +163,13 @@ void ctr_crypt_counter(ctr_aes_context* ctx,
     u8 stream[16];
     u32 i;
 
-    while (size >= 16) {
-        ctr_crypt_counter_block(ctx, input, output);
+    if (size >= 16) {
+        CryptBlocks(ctx, input, output, size / 16);
 
         if (input)
-            input += 16;
-        if (output)
-            output += 16;
-
-        size -= 16;
+            input += size & ~0xF;
+        output += size & ~0xF;
+        size &= 0xF;
     }
 
     if (size) {
@@ -160,8 +227,23 @@ int ncch_extract_prepare(ctr_aes_context* ctx, ctr_ncchheader* h, u32 type, u8*
     u32 size = 0;
     u8 counter[16];
 
+    // Expanding the key is far more work than the small reads this is
+    // called for, and a title only ever uses one key. Keep the last one.
+    static u8 last_key[16];
+    static aes_context last_aes;
+    static bool have_last = false;
+
     ncch_get_counter(h, counter, type);
-    ctr_init_counter(ctx, key, counter);
+
+    if (!have_last || memcmp(last_key, key, 16) != 0) {
+        aes_setkey_enc(&last_aes, key, 128);
+        memcpy(last_key, key, 16);
+        have_last = true;
+    }
+
+    ctx->aes = last_aes;
+    ctx->aes.rk = ctx->aes.buf + (last_aes.rk - last_aes.buf);
+    ctr_set_counter(ctx, counter);
 
     return 1;
 }
@@ -37,6 +37,9 @@
 #include <string.h>
 #include <stdio.h>
 
+#include "util.h"
+#include "crypto/sha_ni.h"
+
 /*
  * 32-bit integer manipulation macros (big endian)
  */
@@ -224,6 +227,32 @@ static void sha2_process( sha2_context *ctx, const unsigned char data[64] )
     ctx->state[7] += H;
 }
 
+/*
+ * Whole blocks go to the SHA extensions when the host has them
+ */
+static void sha2_process_blocks( sha2_context *ctx, const unsigned char *data, int num )
+{
+#ifdef HAVE_SHA_NI
+    if( shani_Supported() ) {
+        u32 state[8];
+        int i;
+
+        for( i = 0; i < 8; i++ )
+            state[i] = (u32) ctx->state[i];
+
+        shani_Process( state, data, num );
+
+        for( i = 0; i < 8; i++ )
+            ctx->state[i] = state[i];
+        return;
+    }
+#endif
+    while( num-- > 0 ) {
+        sha2_process( ctx, data );
+        data += 64;
+    }
+}
+
 /*
  * SHA-256 process buffer
  */
@@ -247,16 +276,16 @@ void sha2_update( sha2_context *ctx, const unsigned char *input, int ilen )
     if( left && ilen >= fill ) {
         memcpy( (void *) (ctx->buffer + left),
                 (void *) input, fill );
-        sha2_process( ctx, ctx->buffer );
+        sha2_process_blocks( ctx, ctx->buffer, 1 );
         input += fill;
         ilen  -= fill;
         left = 0;
     }
 
-    while( ilen >= 64 ) {
-        sha2_process( ctx, input );
-        input += 64;
-        ilen  -= 64;
+    if( ilen >= 64 ) {
+        sha2_process_blocks( ctx, input, ilen / 64 );
+        input += ilen & ~63;
+        ilen  &= 63;
     }
 
     if( ilen > 0 ) {
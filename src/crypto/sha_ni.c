@@ -0,0 +1,141 @@
+/*
+* Copyright (C) 2014 - plutoo
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "util.h"
+#include "crypto/sha_ni.h"
+
+#ifdef HAVE_SHA_NI
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHANI_TARGET
+#else
+#include <cpuid.h>
+#if defined(__clang__)
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#else
+// See aes_ni.c, same reason.
+#define SHANI_TARGET __attribute__((target("sha,sse4.1,ssse3"), optimize("O2")))
+#endif
+#endif
+
+#include <immintrin.h>
+
+bool shani_Supported()
+{
+    static int supported = -1;
+
+    if (supported < 0) {
+        // SHA extensions in leaf 7 ebx bit 29, plus SSSE3 and SSE4.1 for
+        // the shuffles around them.
+#ifdef _MSC_VER
+        int regs[4];
+        __cpuid(regs, 0);
+        supported = 0;
+        if (regs[0] >= 7) {
+            __cpuid(regs, 1);
+            supported = ((regs[2] >> 9) & 1) && ((regs[2] >> 19) & 1);
+            __cpuidex(regs, 7, 0);
+            supported = supported && ((regs[1] >> 29) & 1);
+        }
+#else
+        unsigned int eax, ebx, ecx, edx;
+        supported = 0;
+        if (__get_cpuid_max(0, NULL) >= 7 && __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+            ((ecx >> 9) & 1) && ((ecx >> 19) & 1)) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            supported = (ebx >> 29) & 1;
+        }
+#endif
+    }
+    return supported;
+}
+
+static const u32 K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+// Four rounds per step. w[] is a ring of the last four message quads, each
+// refilled three steps ahead of its use. Written out so i is a constant and
+// the ring stays in registers.
+#define STEP(i)                                                                 \
+    do {                                                                        \
+        msg = _mm_add_epi32(w[(i) & 3], _mm_loadu_si128((const __m128i*)&K[(i) * 4])); \
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);                          \
+        if ((i) >= 3 && (i) < 15) {                                             \
+            tmp = _mm_alignr_epi8(w[(i) & 3], w[((i) - 1) & 3], 4);             \
+            w[((i) + 1) & 3] = _mm_add_epi32(w[((i) + 1) & 3], tmp);            \
+            w[((i) + 1) & 3] = _mm_sha256msg2_epu32(w[((i) + 1) & 3], w[(i) & 3]); \
+        }                                                                       \
+        msg = _mm_shuffle_epi32(msg, 0x0E);                                     \
+        abef = _mm_sha256rnds2_epu32(abef, cdgh, msg);                          \
+        if ((i) >= 1 && (i) < 13)                                               \
+            w[((i) - 1) & 3] = _mm_sha256msg1_epu32(w[((i) - 1) & 3], w[(i) & 3]); \
+    } while (0)
+
+SHANI_TARGET
+void shani_Process(u32 state[8], const u8* data, u32 num)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+    __m128i abef, cdgh, abef_save, cdgh_save, msg, tmp;
+    __m128i w[4];
+    int i;
+
+    // The rounds instructions want the state split as ABEF/CDGH.
+    tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+    cdgh = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    cdgh = _mm_shuffle_epi32(cdgh, 0x1B);
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    while (num != 0) {
+        abef_save = abef;
+        cdgh_save = cdgh;
+
+        for (i = 0; i < 4; i++)
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), bswap);
+
+        STEP(0);  STEP(1);  STEP(2);  STEP(3);
+        STEP(4);  STEP(5);  STEP(6);  STEP(7);
+        STEP(8);  STEP(9);  STEP(10); STEP(11);
+        STEP(12); STEP(13); STEP(14); STEP(15);
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+
+        data += 64;
+        num--;
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    abef = _mm_blend_epi16(tmp, cdgh, 0xF0);
+    cdgh = _mm_alignr_epi8(cdgh, tmp, 8);
+
+    _mm_storeu_si128((__m128i*)&state[0], abef);
+    _mm_storeu_si128((__m128i*)&state[4], cdgh);
+}
+
+#endif
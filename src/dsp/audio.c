@@ -0,0 +1,1139 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define DSP_SSE
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "util.h"
+#include "handles.h"
+#include "mem.h"
+#include "gpu.h"
+#include "dsp.h"
+#include "savestate.h"
+
+/* ____ HLE audio ____ */
+
+// Stands in for the audio component of the DSP firmware. The application
+// talks to it through two copies of a block of structures in DSP RAM (the
+// addresses handed out on the audio pipe): it fills one while the DSP reads
+// the other, the one with the newer frame counter is the one to read.
+//
+// Every 160 samples (32728Hz) we read the source configurations, advance the
+// 24 voices through their buffer queues, decode what they play this frame
+// and write the statuses back, all on the emulation thread since the guest
+// sees the results. Resampling and mixing are done on an audio thread, which
+// hands the output to SDL through a lock-free ring, or to a .wav file.
+//
+// The CSND channels (dsp/csnd.c) ride the same frames as extra sources, mixed
+// straight to the output. The two capture units record them into guest
+// memory, that is done on the emulation thread, sink or not.
+
+#define SAMPLE_RATE   DSPAUDIO_RATE
+#define FRAME_SAMPLES DSPAUDIO_FRAME
+#define NUM_VOICES    24
+#define NUM_SOURCES   (NUM_VOICES + CSND_CHANNELS)
+
+// Region layout, offsets are the DSP word addresses from the audio pipe.
+#define REGION0        0x1FF50000
+#define REGION1        0x1FF70000
+#define REGION_OFF(w)  (((w) - 0x8000) * 2)
+
+#define FRAME_COUNTER  REGION_OFF(0xBFFF)
+#define SOURCE_CONFIG  REGION_OFF(0x9E8E)
+#define SOURCE_STATUS  REGION_OFF(0x8680)
+#define ADPCM_COEFFS   REGION_OFF(0xA78E)
+#define DSP_CONFIG     REGION_OFF(0x9430)
+
+#define CONFIG_SIZE    192
+#define STATUS_SIZE    12
+
+// Source configuration dirty bits.
+#define DIRTY_FORMAT          (1 << 0)
+#define DIRTY_MONO_STEREO     (1 << 1)
+#define DIRTY_ADPCM_COEFFS    (1 << 2)
+#define DIRTY_PARTIAL_RESET   (1 << 4)
+#define DIRTY_ENABLE          (1 << 16)
+#define DIRTY_INTERPOLATION   (1 << 17)
+#define DIRTY_RATE            (1 << 18)
+#define DIRTY_BUFFER_QUEUE    (1 << 19)
+#define DIRTY_PLAY_POSITION   (1 << 21)
+#define DIRTY_GAIN(n)         (1 << (25 + (n)))
+#define DIRTY_SYNC_COUNT      (1 << 28)
+#define DIRTY_RESET           (1 << 29)
+#define DIRTY_EMBEDDED_BUFFER (1 << 30)
+
+// DSP configuration dirty bits.
+#define DIRTY_VOLUME0         (1 << 16)
+#define DIRTY_VOLUME1         (1 << 24)
+#define DIRTY_VOLUME2         (1 << 25)
+
+#define FORMAT_PCM8   0
+#define FORMAT_PCM16  1
+#define FORMAT_ADPCM  2
+
+#define INTERP_POLYPHASE 0
+#define INTERP_LINEAR    1
+#define INTERP_NONE      2
+
+// Resampler: 8 tap windowed sinc, 64 phases. Positions are 16.16.
+#define HIST       DSPAUDIO_HIST
+#define TAPS       (HIST + 1)
+#define PHASE_BITS 6
+#define PHASES     (1 << PHASE_BITS)
+#define MAX_RATE   4
+#define MAX_IN     (FRAME_SAMPLES * MAX_RATE + HIST + 1)
+
+#define PI 3.14159265358979323846
+
+#define JOB_SLOTS  4
+#define RING_SIZE  8192 // Stereo frames, ~250ms.
+
+typedef struct {
+    u32 addr;
+    u32 length; // In samples.
+    u32 start;
+    u16 id;
+    u8  format;
+    u8  channels;
+    u8  looping;
+    u8  adpcm_dirty;
+    s16 adpcm_yn[2];
+} dsp_buffer;
+
+typedef struct {
+    bool enabled;
+    u8   format;
+    u8   channels;
+    u8   interp;
+    float rate;
+    float gain[3][4];
+    s16  coeffs[16];
+    u16  sync_count;
+
+    dsp_buffer queue[5];
+    u32  queued;
+
+    bool playing;
+    dsp_buffer cur;
+    u32  pos;
+    u16  cur_id;
+    bool id_dirty;
+
+    s16  yn1, yn2;
+
+    dspaudio_stream stream;
+} dsp_voice;
+
+typedef struct {
+    u8    channels;
+    u8    interp;
+    bool  csnd; // gain[0] is the output, gain[1] the capture units.
+    u32   frac;
+    u32   step;
+    float gain[3][2];
+    float in[2][MAX_IN];
+} dsp_job_voice;
+
+typedef struct {
+    u32   num;
+    float volume[3];
+    dsp_job_voice voice[NUM_SOURCES];
+    dspaudio_capture capture[2];
+} dsp_job;
+
+static dsp_voice voices[NUM_VOICES];
+static float volume[3] = { 1.0f, 0.0f, 0.0f };
+static bool started;
+static u32 clock_acc;
+static dsp_job* cur_job; // Set while a frame is built.
+
+static float filters[3][PHASES][TAPS];
+
+extern u32 myeventhandel;
+extern int noscreen;
+
+// Audio thread state.
+static bool  sink;
+static FILE* wav_fd;
+static u32   wav_bytes;
+static SDL_AudioDeviceID sdl_dev;
+
+static dsp_job jobs[JOB_SLOTS];
+static dsp_job scratch;
+static volatile u32 job_head, job_tail;
+static volatile bool stop;
+static u32 dropped;
+
+static s16 ring[RING_SIZE * 2];
+static volatile u32 ring_write, ring_read;
+
+#ifdef _WIN32
+static HANDLE job_sem;
+static HANDLE thread;
+
+#define BARRIER() MemoryBarrier()
+#define YIELD()   SwitchToThread()
+#else
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+
+#define BARRIER() __sync_synchronize()
+#define YIELD()   sched_yield()
+#endif
+
+
+static u32 ReadDsp32(const u8* p)
+{
+    // 32 bit values are stored as two 16 bit words, the high one first.
+    u32 raw = p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+    return (raw << 16) | (raw >> 16);
+}
+
+static u16 Read16(const u8* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static void Write16(u8* p, u16 v)
+{
+    p[0] = (u8)v;
+    p[1] = (u8)(v >> 8);
+}
+
+static float ReadFloat(const u8* p)
+{
+    float f;
+    memcpy(&f, p, 4);
+    return f;
+}
+
+static void InitFilters()
+{
+    u32 p, j;
+
+    for (p = 0; p < PHASES; p++) {
+        float f = (float)p / PHASES;
+        float sum = 0;
+
+        for (j = 0; j < TAPS; j++) {
+            // Distance of tap j from the position, which sits between taps
+            // TAPS/2-1 and TAPS/2.
+            double t = (double)j - (TAPS / 2 - 1) - f;
+            double w = 0.42 + 0.5 * cos(PI * t / (TAPS / 2)) + 0.08 * cos(2 * PI * t / (TAPS / 2));
+            double h = t == 0 ? 1.0 : sin(PI * t) / (PI * t);
+
+            filters[INTERP_POLYPHASE][p][j] = (float)(h * w);
+            sum += filters[INTERP_POLYPHASE][p][j];
+        }
+        for (j = 0; j < TAPS; j++)
+            filters[INTERP_POLYPHASE][p][j] /= sum;
+
+        memset(filters[INTERP_LINEAR][p], 0, sizeof(filters[0][0]));
+        filters[INTERP_LINEAR][p][TAPS / 2 - 1] = 1.0f - f;
+        filters[INTERP_LINEAR][p][TAPS / 2] = f;
+
+        memset(filters[INTERP_NONE][p], 0, sizeof(filters[0][0]));
+        filters[INTERP_NONE][p][TAPS / 2 - 1] = 1.0f;
+    }
+}
+
+static u8* PhysToHost(u32 addr, u32 size)
+{
+    if (addr >= 0x20000000 && addr < 0x28000000 && size <= 0x28000000 - addr)
+        return LINEmembuffer + (addr - 0x20000000);
+    if (addr >= 0x18000000 && addr < 0x18600000 && size <= 0x18600000 - addr)
+        return VRAMbuff + (addr - 0x18000000);
+    return NULL;
+}
+
+/* ____ Voices, emulation thread ____ */
+
+static void ResetVoice(dsp_voice* v)
+{
+    memset(v, 0, sizeof(*v));
+    v->format = FORMAT_PCM16;
+    v->channels = 1;
+    v->rate = 1.0f;
+}
+
+static void Enqueue(dsp_voice* v, dsp_buffer* b)
+{
+    if (v->queued == ARRAY_SIZE(v->queue)) {
+        ERROR("Voice %d: buffer queue full, dropping buffer %d.\n", (int)(v - voices), b->id);
+        return;
+    }
+
+    v->queue[v->queued++] = *b;
+}
+
+// Buffers play in order of their id.
+static bool Dequeue(dsp_voice* v)
+{
+    u32 i, best = 0;
+
+    if (v->queued == 0)
+        return false;
+
+    for (i = 1; i < v->queued; i++)
+        if (v->queue[i].id < v->queue[best].id)
+            best = i;
+
+    v->cur = v->queue[best];
+    v->queue[best] = v->queue[--v->queued];
+
+    v->playing = true;
+    v->pos = v->cur.start;
+    v->cur_id = v->cur.id;
+    v->id_dirty = true;
+
+    if (v->cur.adpcm_dirty) {
+        v->yn1 = v->cur.adpcm_yn[0];
+        v->yn2 = v->cur.adpcm_yn[1];
+    }
+    return true;
+}
+
+static void ReadBuffer(const u8* p, dsp_buffer* b, u8 format, u8 channels)
+{
+    b->addr = ReadDsp32(p);
+    b->length = ReadDsp32(p + 4);
+    b->adpcm_yn[0] = (s16)Read16(p + 10);
+    b->adpcm_yn[1] = (s16)Read16(p + 12);
+    b->adpcm_dirty = p[14] & 1;
+    b->looping = p[15] & 1;
+    b->id = Read16(p + 16);
+    b->start = 0;
+    b->format = format;
+    b->channels = channels;
+}
+
+static void ParseConfig(dsp_voice* v, u8* c, const u8* coeffs)
+{
+    u32 dirty = Read16(c) | Read16(c + 2) << 16;
+    u16 buffers_dirty = Read16(c + 74);
+    u32 i, j;
+
+    if (dirty & DIRTY_RESET)
+        ResetVoice(v);
+
+    if (dirty & DIRTY_PARTIAL_RESET) {
+        v->queued = 0;
+        v->playing = false;
+    }
+
+    if (dirty & DIRTY_ENABLE)
+        v->enabled = c[160] != 0;
+    if (dirty & DIRTY_SYNC_COUNT)
+        v->sync_count = Read16(c + 162);
+
+    if (dirty & DIRTY_RATE) {
+        v->rate = ReadFloat(c + 52);
+        if (!(v->rate >= 0.0f))
+            v->rate = 0.0f;
+        if (v->rate > MAX_RATE - 0.01f)
+            v->rate = MAX_RATE - 0.01f;
+    }
+    if (dirty & DIRTY_INTERPOLATION)
+        v->interp = c[56] <= INTERP_NONE ? c[56] : INTERP_POLYPHASE;
+
+    if (dirty & DIRTY_ADPCM_COEFFS)
+        for (i = 0; i < 16; i++)
+            v->coeffs[i] = (s16)Read16(coeffs + 2*i);
+
+    for (i = 0; i < 3; i++)
+        if (dirty & DIRTY_GAIN(i))
+            for (j = 0; j < 4; j++)
+                v->gain[i][j] = ReadFloat(c + 4 + 16*i + 4*j);
+
+    if (dirty & DIRTY_FORMAT)
+        v->format = (u8)Read16(c + 180);
+    if (dirty & DIRTY_MONO_STEREO)
+        v->channels = Read16(c + 178) == 2 ? 2 : 1;
+
+    if (dirty & DIRTY_EMBEDDED_BUFFER) {
+        dsp_buffer b;
+
+        b.addr = ReadDsp32(c + 170);
+        b.length = ReadDsp32(c + 174);
+        b.adpcm_yn[0] = (s16)Read16(c + 184);
+        b.adpcm_yn[1] = (s16)Read16(c + 186);
+        b.adpcm_dirty = c[188] & 1;
+        b.looping = (c[188] >> 1) & 1;
+        b.id = Read16(c + 190);
+        b.start = (dirty & DIRTY_PLAY_POSITION) ? ReadDsp32(c + 164) : 0;
+        b.format = v->format;
+        b.channels = v->channels;
+        Enqueue(v, &b);
+    }
+
+    if ((dirty & DIRTY_BUFFER_QUEUE) && buffers_dirty != 0) {
+        for (i = 0; i < 4; i++) {
+            if (buffers_dirty & (1 << i)) {
+                dsp_buffer b;
+
+                ReadBuffer(c + 76 + 20*i, &b, v->format, v->channels);
+                Enqueue(v, &b);
+            }
+        }
+    }
+
+    // Acknowledge.
+    memset(c, 0, 4);
+    memset(c + 74, 0, 2);
+}
+
+static void DecodeAdpcm(dsp_voice* v, const u8* data, float* out, u32 count)
+{
+    u32 pos = v->pos;
+    s32 yn1 = v->yn1, yn2 = v->yn2;
+    u32 i;
+
+    // 8 byte frames: a predictor/scale byte, then 14 4-bit samples.
+    for (i = 0; i < count; i++, pos++) {
+        const u8* frame = data + (pos / 14) * 8;
+        u32 n = pos % 14 + 2;
+        u8 header = frame[0];
+        s32 scale = 1 << (header & 0xF);
+        u32 idx = (header >> 4) & 7;
+        s32 nibble = (frame[n / 2] >> (n & 1 ? 0 : 4)) & 0xF;
+        s32 val;
+
+        if (nibble >= 8)
+            nibble -= 16;
+
+        val = ((nibble * scale) << 11) + 0x400 + v->coeffs[idx*2] * yn1 + v->coeffs[idx*2 + 1] * yn2;
+        val >>= 11;
+        if (val > 32767) val = 32767;
+        if (val < -32768) val = -32768;
+
+        yn2 = yn1;
+        yn1 = val;
+        out[i] = (float)val;
+    }
+
+    v->yn1 = (s16)yn1;
+    v->yn2 = (s16)yn2;
+}
+
+// Decodes count samples of the current buffer at v->pos.
+static bool Decode(dsp_voice* v, float* out[2], u32 count)
+{
+    dsp_buffer* b = &v->cur;
+    u32 ch = b->channels, i;
+    u8* data;
+
+    switch (b->format) {
+    case FORMAT_PCM8:
+        if ((data = PhysToHost(b->addr, b->length * ch)) == NULL)
+            return false;
+        data += v->pos * ch;
+        for (i = 0; i < count; i++) {
+            out[0][i] = (float)((s8)data[i*ch] << 8);
+            out[1][i] = (float)((s8)data[i*ch + ch - 1] << 8);
+        }
+        return true;
+
+    case FORMAT_PCM16:
+        if ((data = PhysToHost(b->addr, b->length * ch * 2)) == NULL)
+            return false;
+        data += v->pos * ch * 2;
+        for (i = 0; i < count; i++) {
+            out[0][i] = (float)(s16)Read16(data + 2*i*ch);
+            out[1][i] = (float)(s16)Read16(data + 2*(i*ch + ch - 1));
+        }
+        return true;
+
+    case FORMAT_ADPCM:
+        // Mono only.
+        if ((data = PhysToHost(b->addr, (b->length + 13) / 14 * 8)) == NULL)
+            return false;
+        DecodeAdpcm(v, data, out[0], count);
+        memcpy(out[1], out[0], count * sizeof(float));
+        return true;
+    }
+
+    return false;
+}
+
+// Pulls count new samples through the buffer queue, silence once it runs dry.
+static void Pull(dsp_voice* v, float* out[2], u32 count)
+{
+    u32 done = 0;
+
+    while (done < count) {
+        float* dst[2] = { out[0] + done, out[1] + done };
+        u32 n;
+
+        if (!v->playing && !Dequeue(v))
+            break;
+
+        if (v->pos >= v->cur.length) {
+            v->playing = false;
+            continue;
+        }
+
+        n = v->cur.length - v->pos;
+        if (n > count - done)
+            n = count - done;
+
+        if (!Decode(v, dst, n)) {
+            ERROR("Voice %d: bad buffer %08x+%x.\n", (int)(v - voices), v->cur.addr, v->cur.length);
+            v->playing = false;
+            continue;
+        }
+
+        v->pos += n;
+        done += n;
+
+        if (v->pos == v->cur.length) {
+            if (v->cur.looping) {
+                v->pos = 0;
+                if (v->cur.adpcm_dirty) {
+                    v->yn1 = v->cur.adpcm_yn[0];
+                    v->yn2 = v->cur.adpcm_yn[1];
+                }
+            } else {
+                v->playing = false;
+            }
+        }
+    }
+
+    memset(out[0] + done, 0, (count - done) * sizeof(float));
+    memset(out[1] + done, 0, (count - done) * sizeof(float));
+}
+
+// Pulls the input of one source for this frame into the job, the stream
+// carries the resampler position and the tail of the last frame's input.
+static dsp_job_voice* AddSource(dsp_job* job, dspaudio_stream* s, float rate, u8 channels,
+                                u8 interp, dspaudio_pull pull, void* arg)
+{
+    dsp_job_voice* jv = &job->voice[job->num];
+    u32 step, n, ch;
+    float* in[2] = { jv->in[0] + HIST, jv->in[1] + HIST };
+
+    if (!(rate >= 0.0f))
+        rate = 0.0f;
+    if (rate > MAX_RATE - 0.01f)
+        rate = MAX_RATE - 0.01f;
+
+    step = (u32)(rate * 0x10000);
+    n = (s->frac + FRAME_SAMPLES * step) >> 16;
+
+    memcpy(jv->in[0], s->hist[0], sizeof(s->hist[0]));
+    memcpy(jv->in[1], s->hist[1], sizeof(s->hist[1]));
+    pull(arg, in, n);
+
+    jv->channels = channels;
+    jv->interp = interp;
+    jv->csnd = false;
+    jv->frac = s->frac;
+    jv->step = step;
+
+    for (ch = 0; ch < 2; ch++)
+        memcpy(s->hist[ch], jv->in[ch] + n, sizeof(s->hist[ch]));
+    s->frac = (s->frac + FRAME_SAMPLES * step) & 0xFFFF;
+
+    job->num++;
+    return jv;
+}
+
+static void PullVoice(void* arg, float* out[2], u32 count)
+{
+    Pull((dsp_voice*)arg, out, count);
+}
+
+static void RunVoice(dsp_voice* v, dsp_job* job)
+{
+    dsp_job_voice* jv = AddSource(job, &v->stream, v->rate, v->channels, v->interp, PullVoice, v);
+    u32 i;
+
+    // Quadraphonic gains, folded to stereo.
+    for (i = 0; i < 3; i++) {
+        jv->gain[i][0] = v->gain[i][0] + v->gain[i][2];
+        jv->gain[i][1] = v->gain[i][1] + v->gain[i][3];
+    }
+}
+
+static void WriteStatus(dsp_voice* v, u8* st)
+{
+    u32 pos = v->playing ? v->pos : 0;
+
+    memset(st, 0, STATUS_SIZE);
+    st[0] = v->enabled;
+    st[1] = v->id_dirty;
+    Write16(st + 2, v->sync_count);
+    Write16(st + 4, (u16)(pos >> 16));
+    Write16(st + 6, (u16)pos);
+    Write16(st + 8, v->cur_id);
+
+    v->id_dirty = false;
+}
+
+static u32 ReadRegion()
+{
+    u16 c0 = mem_Read16(REGION0 + FRAME_COUNTER);
+    u16 c1 = mem_Read16(REGION1 + FRAME_COUNTER);
+
+    // The counter wraps.
+    if (c0 == 0xFFFF && c1 != 0xFFFE)
+        return REGION1;
+    if (c1 == 0xFFFF && c0 != 0xFFFE)
+        return REGION0;
+    return c0 > c1 ? REGION0 : REGION1;
+}
+
+static dsp_job* JobSlot()
+{
+    // A dump must not lose frames, wait for the audio thread instead.
+    while (sink && wav_fd != NULL && job_head - job_tail == JOB_SLOTS)
+        YIELD();
+
+    // Audio thread fell behind, this frame is not heard.
+    if (!sink || job_head - job_tail == JOB_SLOTS) {
+        if (sink)
+            dropped++;
+        return &scratch;
+    }
+
+    return &jobs[job_head % JOB_SLOTS];
+}
+
+static void PostJob(dsp_job* job)
+{
+    if (job == &scratch)
+        return;
+
+    BARRIER();
+    job_head++;
+
+#ifdef _WIN32
+    ReleaseSemaphore(job_sem, 1, NULL);
+#else
+    pthread_mutex_lock(&job_lock);
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+#endif
+}
+
+static void RunVoices(dsp_job* job)
+{
+    static u8 config[NUM_VOICES * CONFIG_SIZE];
+    static u8 coeffs[NUM_VOICES * 32];
+    static u8 status[NUM_VOICES * STATUS_SIZE];
+    u32 read = ReadRegion();
+    u32 write = read == REGION0 ? REGION1 : REGION0;
+    u8 dsp_config[16];
+    u32 dirty, i;
+
+    if (mem_Read(config, read + SOURCE_CONFIG, sizeof(config)) != 0 ||
+        mem_Read(coeffs, read + ADPCM_COEFFS, sizeof(coeffs)) != 0 ||
+        mem_Read(dsp_config, read + DSP_CONFIG, sizeof(dsp_config)) != 0) {
+        ERROR("DSP RAM is not mapped.\n");
+        return;
+    }
+
+    dirty = Read16(dsp_config) | Read16(dsp_config + 2) << 16;
+    if (dirty & DIRTY_VOLUME0) volume[0] = ReadFloat(dsp_config + 4);
+    if (dirty & DIRTY_VOLUME1) volume[1] = ReadFloat(dsp_config + 8);
+    if (dirty & DIRTY_VOLUME2) volume[2] = ReadFloat(dsp_config + 12);
+    memset(dsp_config, 0, 4);
+
+    memcpy(job->volume, volume, sizeof(volume));
+
+    for (i = 0; i < NUM_VOICES; i++) {
+        dsp_voice* v = &voices[i];
+
+        ParseConfig(v, config + i * CONFIG_SIZE, coeffs + i * 32);
+        if (v->enabled)
+            RunVoice(v, job);
+        WriteStatus(v, status + i * STATUS_SIZE);
+    }
+
+    mem_Write(config, read + SOURCE_CONFIG, sizeof(config));
+    mem_Write(dsp_config, read + DSP_CONFIG, 4);
+    mem_Write(status, write + SOURCE_STATUS, sizeof(status));
+}
+
+static void RunCaptures(dsp_job* job);
+
+static void Frame(bool hle)
+{
+    dsp_job* job = JobSlot();
+
+    job->num = 0;
+    memset(job->volume, 0, sizeof(job->volume));
+    memset(job->capture, 0, sizeof(job->capture));
+
+    if (hle)
+        RunVoices(job);
+
+    cur_job = job;
+    csnd_Frame();
+    cur_job = NULL;
+
+    RunCaptures(job);
+    PostJob(job);
+}
+
+/* ____ Mixing, audio thread ____ */
+
+static void Resample(const float* in, u32 frac, u32 step, float (*table)[TAPS], float* out)
+{
+    u32 k;
+
+    for (k = 0; k < FRAME_SAMPLES; k++, frac += step) {
+        const float* x = in + (frac >> 16);
+        const float* h = table[(frac >> (16 - PHASE_BITS)) & (PHASES - 1)];
+#ifdef DSP_SSE
+        __m128 acc = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x), _mm_loadu_ps(h)),
+                                _mm_mul_ps(_mm_loadu_ps(x + 4), _mm_loadu_ps(h + 4)));
+        acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+        acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+        out[k] = _mm_cvtss_f32(acc);
+#else
+        float acc = 0;
+        u32 j;
+
+        for (j = 0; j < TAPS; j++)
+            acc += x[j] * h[j];
+        out[k] = acc;
+#endif
+    }
+}
+
+static void Mix(float* bus, const float* in, float gain)
+{
+    u32 k = 0;
+
+#if defined(__AVX__)
+    __m256 g8 = _mm256_set1_ps(gain);
+    for (; k + 8 <= FRAME_SAMPLES; k += 8)
+        _mm256_storeu_ps(bus + k, _mm256_add_ps(_mm256_loadu_ps(bus + k),
+                                                _mm256_mul_ps(_mm256_loadu_ps(in + k), g8)));
+#endif
+#ifdef DSP_SSE
+    __m128 g4 = _mm_set1_ps(gain);
+    for (; k + 4 <= FRAME_SAMPLES; k += 4)
+        _mm_storeu_ps(bus + k, _mm_add_ps(_mm_loadu_ps(bus + k),
+                                          _mm_mul_ps(_mm_loadu_ps(in + k), g4)));
+#endif
+    for (; k < FRAME_SAMPLES; k++)
+        bus[k] += in[k] * gain;
+}
+
+// Interleaves and saturates the left and right channels into out.
+static void Output(const float* l, const float* r, s16* out)
+{
+    u32 k = 0;
+
+#ifdef DSP_SSE
+    for (; k + 4 <= FRAME_SAMPLES; k += 4) {
+        __m128 lo = _mm_unpacklo_ps(_mm_loadu_ps(l + k), _mm_loadu_ps(r + k));
+        __m128 hi = _mm_unpackhi_ps(_mm_loadu_ps(l + k), _mm_loadu_ps(r + k));
+        __m128i v = _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi));
+        _mm_storeu_si128((__m128i*)(out + 2*k), v);
+    }
+#endif
+    for (; k < FRAME_SAMPLES; k++) {
+        float s[2] = { l[k], r[k] };
+        u32 c;
+
+        for (c = 0; c < 2; c++) {
+            if (s[c] > 32767.0f) s[c] = 32767.0f;
+            if (s[c] < -32768.0f) s[c] = -32768.0f;
+            out[2*k + c] = (s16)s[c];
+        }
+    }
+}
+
+// The capture units record the CSND mix into guest memory.
+static void Capture(const dspaudio_capture* cap, const float* in)
+{
+    u32 bytes = cap->pcm8 ? 1 : 2;
+    u32 pos = cap->pos;
+    u8* data = PhysToHost(cap->addr, cap->size);
+    u32 k;
+
+    if (data == NULL || cap->size < bytes)
+        return;
+
+    for (k = 0; k < FRAME_SAMPLES; k++) {
+        float f = in[k];
+        s16 v;
+
+        if (pos + bytes > cap->size) {
+            if (!cap->repeat)
+                break;
+            pos = 0;
+        }
+
+        if (f > 32767.0f) f = 32767.0f;
+        if (f < -32768.0f) f = -32768.0f;
+        v = (s16)f;
+
+        if (cap->pcm8)
+            data[pos] = (u8)(v >> 8);
+        else
+            Write16(data + pos, (u16)v);
+        pos += bytes;
+    }
+}
+
+// Emulation thread, the capture buses are only mixed while a unit records.
+static void RunCaptures(dsp_job* job)
+{
+    static float cap_bus[2][FRAME_SAMPLES];
+    static float y[FRAME_SAMPLES];
+    u32 i, c;
+
+    if (job->capture[0].size == 0 && job->capture[1].size == 0)
+        return;
+
+    memset(cap_bus, 0, sizeof(cap_bus));
+
+    // CSND channels are mono.
+    for (i = 0; i < job->num; i++) {
+        dsp_job_voice* jv = &job->voice[i];
+
+        if (!jv->csnd || (jv->gain[1][0] == 0.0f && jv->gain[1][1] == 0.0f))
+            continue;
+
+        Resample(jv->in[0], jv->frac, jv->step, filters[jv->interp], y);
+        for (c = 0; c < 2; c++)
+            if (jv->gain[1][c] != 0.0f)
+                Mix(cap_bus[c], y, jv->gain[1][c]);
+    }
+
+    for (c = 0; c < 2; c++)
+        if (job->capture[c].size != 0)
+            Capture(&job->capture[c], cap_bus[c]);
+}
+
+static void MixJob(dsp_job* job, s16* out)
+{
+    static float bus[3][2][FRAME_SAMPLES];
+    static float csnd_bus[2][FRAME_SAMPLES];
+    static float y[2][FRAME_SAMPLES];
+    static float final[2][FRAME_SAMPLES];
+    u32 i, b, c;
+
+    memset(bus, 0, sizeof(bus));
+    memset(csnd_bus, 0, sizeof(csnd_bus));
+
+    for (i = 0; i < job->num; i++) {
+        dsp_job_voice* jv = &job->voice[i];
+        float (*dst)[2][FRAME_SAMPLES] = jv->csnd ? &csnd_bus : bus;
+        u32 buses = jv->csnd ? 1 : 3;
+
+        for (c = 0; c < jv->channels; c++)
+            Resample(jv->in[c], jv->frac, jv->step, filters[jv->interp], y[c]);
+        if (jv->channels == 1)
+            memcpy(y[1], y[0], sizeof(y[0]));
+
+        for (b = 0; b < buses; b++)
+            for (c = 0; c < 2; c++)
+                if (jv->gain[b][c] != 0.0f)
+                    Mix(dst[b][c], y[c], jv->gain[b][c]);
+    }
+
+    // No effects on the aux buses, they go straight to the output.
+    memset(final, 0, sizeof(final));
+    for (b = 0; b < 3; b++)
+        for (c = 0; c < 2; c++)
+            if (job->volume[b] != 0.0f)
+                Mix(final[c], bus[b][c], job->volume[b]);
+
+    for (c = 0; c < 2; c++)
+        Mix(final[c], csnd_bus[c], 1.0f);
+
+    Output(final[0], final[1], out);
+}
+
+static void RingPush(const s16* samples, u32 count)
+{
+    u32 w = ring_write;
+    u32 space = RING_SIZE - (w - ring_read);
+    u32 i;
+
+    // Emulation runs ahead of the device, drop what does not fit.
+    if (count > space)
+        count = space;
+
+    for (i = 0; i < count; i++) {
+        u32 at = (w + i) % RING_SIZE;
+        ring[2*at] = samples[2*i];
+        ring[2*at + 1] = samples[2*i + 1];
+    }
+
+    BARRIER();
+    ring_write = w + count;
+}
+
+static void SDLCALL AudioCallback(void* arg, Uint8* stream, int len)
+{
+    s16* out = (s16*)stream;
+    u32 want = len / 4;
+    u32 r = ring_read;
+    u32 avail = ring_write - r;
+    u32 i;
+
+    BARRIER();
+
+    if (avail > want)
+        avail = want;
+
+    for (i = 0; i < avail; i++) {
+        u32 at = (r + i) % RING_SIZE;
+        out[2*i] = ring[2*at];
+        out[2*i + 1] = ring[2*at + 1];
+    }
+    memset(out + 2*avail, 0, (want - avail) * 4);
+
+    BARRIER();
+    ring_read = r + avail;
+}
+
+static void WriteWavHeader()
+{
+    u8 h[44];
+    u32 v[] = { 36 + wav_bytes, 16, 1 | 2 << 16, SAMPLE_RATE, SAMPLE_RATE * 4, 4 | 16 << 16, wav_bytes };
+
+    memcpy(h, "RIFF", 4);
+    memcpy(h + 4, &v[0], 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    memcpy(h + 16, &v[1], 20);
+    memcpy(h + 36, "data", 4);
+    memcpy(h + 40, &v[6], 4);
+
+    fseek(wav_fd, 0, SEEK_SET);
+    fwrite(h, sizeof(h), 1, wav_fd);
+    fseek(wav_fd, 0, SEEK_END);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Worker(LPVOID arg)
+#else
+static void* Worker(void* arg)
+#endif
+{
+    static s16 out[FRAME_SAMPLES * 2];
+
+    for (;;) {
+#ifdef _WIN32
+        WaitForSingleObject(job_sem, INFINITE);
+#else
+        pthread_mutex_lock(&job_lock);
+        while (job_head == job_tail && !stop)
+            pthread_cond_wait(&job_cond, &job_lock);
+        pthread_mutex_unlock(&job_lock);
+#endif
+        // Queue drained before stopping.
+        if (job_head == job_tail) {
+            if (stop)
+                break;
+            continue;
+        }
+
+        BARRIER();
+        MixJob(&jobs[job_tail % JOB_SLOTS], out);
+        BARRIER();
+        job_tail++;
+
+        if (wav_fd != NULL) {
+            if (fwrite(out, sizeof(out), 1, wav_fd) == 1)
+                wav_bytes += sizeof(out);
+        } else {
+            RingPush(out, FRAME_SAMPLES);
+        }
+    }
+    return 0;
+}
+
+/* ____ Interface ____ */
+
+int dspaudio_Init(const char* wav_path)
+{
+    u32 i;
+
+    InitFilters();
+    for (i = 0; i < NUM_VOICES; i++)
+        ResetVoice(&voices[i]);
+
+    if (wav_path != NULL) {
+        wav_fd = fopen(wav_path, "wb");
+        if (wav_fd == NULL) {
+            ERROR("Failed to open %s\n", wav_path);
+            return -1;
+        }
+        WriteWavHeader();
+    } else if (!noscreen) {
+        SDL_AudioSpec want, have;
+
+        memset(&want, 0, sizeof(want));
+        want.freq = SAMPLE_RATE;
+        want.format = AUDIO_S16SYS;
+        want.channels = 2;
+        want.samples = 1024;
+        want.callback = AudioCallback;
+
+        // SDL converts to whatever the device takes.
+        sdl_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+        if (sdl_dev == 0) {
+            ERROR("No audio: %s\n", SDL_GetError());
+            return 0;
+        }
+        SDL_PauseAudioDevice(sdl_dev, 0);
+    } else {
+        // Headless without a dump, the voices still run for the guest.
+        return 0;
+    }
+
+#ifdef _WIN32
+    job_sem = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+    thread = CreateThread(NULL, 0, Worker, NULL, 0, NULL);
+    if (thread == NULL) {
+#else
+    if (pthread_create(&thread, NULL, Worker, NULL) != 0) {
+#endif
+        ERROR("Failed to start the audio thread.\n");
+        return -1;
+    }
+
+    sink = true;
+    return 0;
+}
+
+void dspaudio_Shutdown()
+{
+    if (!sink)
+        return;
+
+    sink = false;
+    stop = true;
+#ifdef _WIN32
+    ReleaseSemaphore(job_sem, 1, NULL);
+    WaitForSingleObject(thread, INFINITE);
+#else
+    pthread_mutex_lock(&job_lock);
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+    pthread_join(thread, NULL);
+#endif
+
+    if (sdl_dev != 0)
+        SDL_CloseAudioDevice(sdl_dev);
+
+    if (wav_fd != NULL) {
+        WriteWavHeader();
+        fclose(wav_fd);
+        wav_fd = NULL;
+    }
+
+    if (dropped != 0)
+        DEBUG("%u audio frames dropped.\n", dropped);
+}
+
+// Audio pipe: the application initializes the component, or shuts it down.
+void dspaudio_Start()
+{
+    u32 i;
+
+    for (i = 0; i < NUM_VOICES; i++)
+        ResetVoice(&voices[i]);
+    volume[0] = 1.0f;
+    volume[1] = volume[2] = 0.0f;
+    started = true;
+}
+
+void dspaudio_Stop()
+{
+    started = false;
+}
+
+// Called once per scanline, runs the audio frames that fall into it.
+void dspaudio_Line()
+{
+    handleinfo* h;
+    bool hle = started;
+
+    if (!hle && !csnd_Active())
+        return;
+
+    // 400 lines at 60Hz.
+    clock_acc += SAMPLE_RATE;
+    if (clock_acc < FRAME_SAMPLES * 400 * 60)
+        return;
+    clock_acc -= FRAME_SAMPLES * 400 * 60;
+
+    Frame(hle);
+
+    if (!hle)
+        return;
+
+    h = handle_Get(myeventhandel);
+    if (h != NULL)
+        h->locked = false;
+}
+
+// For the other sources, only while a frame is built (csnd_Frame).
+void dspaudio_AddSource(dspaudio_stream* s, float rate, bool interp, const float gain[2][2],
+                        dspaudio_pull pull, void* arg)
+{
+    dsp_job_voice* jv = AddSource(cur_job, s, rate, 1, interp ? INTERP_POLYPHASE : INTERP_NONE, pull, arg);
+
+    jv->csnd = true;
+    memcpy(jv->gain, gain, sizeof(float) * 2 * 2);
+}
+
+void dspaudio_Capture(u32 unit, const dspaudio_capture* cap)
+{
+    cur_job->capture[unit] = *cap;
+}
+
+void dspaudio_SaveState()
+{
+    savestate_Put(voices, sizeof(voices));
+    savestate_Put(volume, sizeof(volume));
+    savestate_Put(&started, sizeof(started));
+    savestate_Put(&clock_acc, sizeof(clock_acc));
+}
+
+void dspaudio_LoadState()
+{
+    savestate_Get(voices, sizeof(voices));
+    savestate_Get(volume, sizeof(volume));
+    savestate_Get(&started, sizeof(started));
+    savestate_Get(&clock_acc, sizeof(clock_acc));
+}
@@ -0,0 +1,584 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define CSND_SSE
+#include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "handles.h"
+#include "mem.h"
+#include "gpu.h"
+#include "dsp.h"
+#include "savestate.h"
+
+/* ____ CSND ____ */
+
+// The sound hardware the ARM11 drives directly. The application writes
+// chains of 0x20 byte commands into the shared memory and has them run with
+// ExecuteCommands; we run the whole chain at once and mark each command done.
+// Channel and capture unit statuses are written back to the shared memory
+// after each batch and each audio frame.
+//
+// The channels run on the DSP's audio frames (dsp/audio.c): they are decoded
+// on the emulation thread, resampled and mixed with the DSP's output on the
+// audio thread.
+
+#define CSND_CLOCK     67027964 // Timer ticks per second.
+#define NUM_CAPTURES   2
+
+#define CMD_SIZE       0x20
+
+#define FORMAT_PCM8    0
+#define FORMAT_PCM16   1
+#define FORMAT_ADPCM   2
+#define FORMAT_PSG     3
+
+#define LOOP_MANUAL    0
+#define LOOP_REPEAT    1
+#define LOOP_ONESHOT   2
+
+#define CHN_INFO_SIZE  0xC
+#define CAP_INFO_SIZE  0x8
+
+typedef struct {
+    bool  playing;
+    bool  active;  // Has not run off the end yet.
+    u8    format;
+    u8    loop;
+    bool  interp;
+    bool  noise;   // PSG: noise instead of a square wave.
+    u8    duty;
+    u16   timer;
+    u32   addr[2]; // Start, and where a repeat restarts.
+    u32   size;    // Bytes from addr[0].
+    float vol[2];
+    float capvol[2];
+
+    s16   adpcm_sample[2]; // Start and loop states.
+    u8    adpcm_index[2];
+    bool  adpcm_reload;
+
+    u32   pos;     // Samples from addr[0].
+    s32   sample;
+    u8    index;
+    u16   lfsr;
+
+    dspaudio_stream stream;
+} csnd_channel;
+
+typedef struct {
+    bool enabled;
+    bool repeat;
+    bool pcm8;
+    u16  timer;
+    u32  addr;
+    u32  size;
+    u32  pos;
+} csnd_capture;
+
+static csnd_channel channels[CSND_CHANNELS];
+static csnd_capture captures[NUM_CAPTURES];
+
+extern u8* CSND_sharedmem;
+extern u32 CSND_sharedmemsize;
+extern u32 CSND_offset1;
+extern u32 CSND_offset2;
+
+static const s8 ima_index[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static const u16 ima_step[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+
+static u32 Read32(const u8* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+static u8* PhysToHost(u32 addr, u32 size)
+{
+    if (addr >= 0x20000000 && addr < 0x28000000 && size <= 0x28000000 - addr)
+        return LINEmembuffer + (addr - 0x20000000);
+    if (addr >= 0x18000000 && addr < 0x18600000 && size <= 0x18600000 - addr)
+        return VRAMbuff + (addr - 0x18000000);
+    return NULL;
+}
+
+/* ____ Channels ____ */
+
+static u32 Samples(csnd_channel* c, u32 bytes)
+{
+    switch (c->format) {
+    case FORMAT_PCM8:
+        return bytes;
+    case FORMAT_PCM16:
+        return bytes / 2;
+    case FORMAT_ADPCM:
+        return bytes * 2;
+    }
+    return 0;
+}
+
+static void Restart(csnd_channel* c)
+{
+    c->active = true;
+    c->pos = 0;
+    c->sample = c->adpcm_sample[0];
+    c->index = c->adpcm_index[0];
+    c->lfsr = 0x7FFF;
+    memset(&c->stream, 0, sizeof(c->stream));
+}
+
+static void DecodePcm8(const u8* data, float* out, u32 count)
+{
+    u32 i = 0;
+
+#ifdef CSND_SSE
+    for (; i + 8 <= count; i += 8) {
+        __m128i b = _mm_loadl_epi64((const __m128i*)(data + i));
+        __m128i w = _mm_unpacklo_epi8(_mm_setzero_si128(), b); // s8 << 8
+        _mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16)));
+        _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16)));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = (float)((s8)data[i] << 8);
+}
+
+static void DecodePcm16(const u8* data, float* out, u32 count)
+{
+    u32 i = 0;
+
+#ifdef CSND_SSE
+    for (; i + 8 <= count; i += 8) {
+        __m128i w = _mm_loadu_si128((const __m128i*)(data + 2*i));
+        _mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16)));
+        _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16)));
+    }
+#endif
+    for (; i < count; i++)
+        out[i] = (float)(s16)(data[2*i] | data[2*i + 1] << 8);
+}
+
+// IMA ADPCM, low nibble first. Each sample depends on the last, no shortcut.
+static void DecodeAdpcm(csnd_channel* c, const u8* data, float* out, u32 count)
+{
+    u32 pos = c->pos;
+    s32 sample = c->sample;
+    s32 index = c->index;
+    u32 i;
+
+    for (i = 0; i < count; i++, pos++) {
+        u8 nibble = (data[pos / 2] >> ((pos & 1) * 4)) & 0xF;
+        s32 step = ima_step[index];
+        s32 diff = step >> 3;
+
+        if (nibble & 1) diff += step >> 2;
+        if (nibble & 2) diff += step >> 1;
+        if (nibble & 4) diff += step;
+        if (nibble & 8) diff = -diff;
+
+        sample += diff;
+        if (sample > 32767) sample = 32767;
+        if (sample < -32768) sample = -32768;
+
+        index += ima_index[nibble & 7];
+        if (index < 0) index = 0;
+        if (index > 88) index = 88;
+
+        out[i] = (float)sample;
+    }
+
+    c->sample = sample;
+    c->index = (u8)index;
+}
+
+static void DecodePsg(csnd_channel* c, float* out, u32 count)
+{
+    u32 i;
+
+    // A square wave has 8 steps, duty+1 of them high.
+    for (i = 0; i < count; i++, c->pos++) {
+        if (c->noise) {
+            u16 bit = c->lfsr & 1;
+            c->lfsr >>= 1;
+            if (bit)
+                c->lfsr ^= 0x6000;
+            out[i] = bit ? -32767.0f : 32767.0f;
+        } else {
+            out[i] = (c->pos & 7) <= c->duty ? 32767.0f : -32767.0f;
+        }
+    }
+}
+
+static void PullChannel(void* arg, float* out[2], u32 count)
+{
+    csnd_channel* c = arg;
+    u32 done = 0;
+
+    if (c->format == FORMAT_PSG) {
+        DecodePsg(c, out[0], count);
+        return;
+    }
+
+    while (done < count && c->active) {
+        u32 length = Samples(c, c->size);
+        u32 n = count - done;
+        u8* data;
+
+        if (c->pos >= length) {
+            u32 start = 0;
+
+            if (c->loop != LOOP_REPEAT) {
+                c->active = false;
+                break;
+            }
+
+            if (c->addr[1] > c->addr[0] && c->addr[1] < c->addr[0] + c->size)
+                start = Samples(c, c->addr[1] - c->addr[0]);
+            if (start >= length) {
+                c->active = false;
+                break;
+            }
+
+            c->pos = start;
+            if (c->format == FORMAT_ADPCM && c->adpcm_reload) {
+                c->sample = c->adpcm_sample[1];
+                c->index = c->adpcm_index[1];
+            }
+        }
+
+        if (n > length - c->pos)
+            n = length - c->pos;
+
+        if ((data = PhysToHost(c->addr[0], c->size)) == NULL) {
+            ERROR("Channel %d: bad buffer %08x+%x.\n", (int)(c - channels), c->addr[0], c->size);
+            c->active = false;
+            break;
+        }
+
+        switch (c->format) {
+        case FORMAT_PCM8:
+            DecodePcm8(data + c->pos, out[0] + done, n);
+            break;
+        case FORMAT_PCM16:
+            DecodePcm16(data + 2*c->pos, out[0] + done, n);
+            break;
+        case FORMAT_ADPCM:
+            DecodeAdpcm(c, data, out[0] + done, n);
+            break;
+        }
+
+        c->pos += n;
+        done += n;
+    }
+
+    memset(out[0] + done, 0, (count - done) * sizeof(float));
+}
+
+static void SetVolumes(float* vol, u32 v)
+{
+    vol[0] = (float)(v & 0xFFFF) / 0x8000;
+    vol[1] = (float)(v >> 16) / 0x8000;
+}
+
+static void WriteStatus()
+{
+    u32 i;
+
+    if (CSND_sharedmem == NULL)
+        return;
+
+    if (CSND_offset1 + CSND_CHANNELS * CHN_INFO_SIZE <= CSND_sharedmemsize) {
+        for (i = 0; i < CSND_CHANNELS; i++) {
+            csnd_channel* c = &channels[i];
+            u8* p = CSND_sharedmem + CSND_offset1 + i * CHN_INFO_SIZE;
+
+            memset(p, 0, CHN_INFO_SIZE);
+            p[0] = c->playing && c->active;
+            p[4] = (u8)c->sample;
+            p[5] = (u8)(c->sample >> 8);
+            p[6] = c->index;
+        }
+    }
+
+    if (CSND_offset2 + NUM_CAPTURES * CAP_INFO_SIZE <= CSND_sharedmemsize) {
+        for (i = 0; i < NUM_CAPTURES; i++) {
+            u8* p = CSND_sharedmem + CSND_offset2 + i * CAP_INFO_SIZE;
+
+            memset(p, 0, CAP_INFO_SIZE);
+            p[0] = captures[i].enabled;
+        }
+    }
+}
+
+/* ____ Commands ____ */
+
+static void Command(u16 id, const u8* arg)
+{
+    u32 p[6], i;
+    csnd_channel* c;
+    csnd_capture* cap;
+
+    for (i = 0; i < 6; i++)
+        p[i] = Read32(arg + 4*i);
+
+    // Channel commands take the channel first, capture commands the unit.
+    c = &channels[p[0] & (CSND_CHANNELS - 1)];
+    cap = &captures[p[0] & (NUM_CAPTURES - 1)];
+
+    switch (id) {
+    case 0x000: // SetPlayStateR
+    case 0x001: // SetPlayState
+        if (p[1] && !c->playing)
+            Restart(c);
+        c->playing = p[1] != 0;
+        break;
+    case 0x002: // SetEncoding
+        c->format = p[1] & 3;
+        c->noise = false;
+        break;
+    case 0x003: // SetBlock, block 0
+        c->addr[0] = p[1];
+        c->size = p[2];
+        break;
+    case 0x004: // SetLooping
+        c->loop = p[1] & 3;
+        break;
+    case 0x005: // SetBit7
+        break;
+    case 0x006: // SetInterp
+        c->interp = p[1] != 0;
+        break;
+    case 0x007: // SetDuty
+        c->duty = p[1] & 7;
+        break;
+    case 0x008: // SetTimer
+        c->timer = (u16)p[1];
+        break;
+    case 0x009: // SetVol
+        SetVolumes(c->vol, p[1]);
+        SetVolumes(c->capvol, p[2]);
+        break;
+    case 0x00A: // SetBlock, block 1
+        c->addr[1] = p[1];
+        break;
+    case 0x00B: // SetAdpcmState, block 0
+    case 0x00C: // SetAdpcmState, block 1
+        c->adpcm_sample[id - 0x00B] = (s16)p[1];
+        c->adpcm_index[id - 0x00B] = p[2] <= 88 ? p[2] : 88;
+        if (id == 0x00B && c->pos == 0) {
+            c->sample = c->adpcm_sample[0];
+            c->index = c->adpcm_index[0];
+        }
+        break;
+    case 0x00D: // SetAdpcmReload
+        c->adpcm_reload = p[1] != 0;
+        break;
+    case 0x00E: // SetChnRegs
+    case 0x00F: // SetChnRegsPSG
+    case 0x010: // SetChnRegsNoise
+        c->interp = (p[0] >> 6) & 1;
+        c->loop = (p[0] >> 10) & 3;
+        c->format = (p[0] >> 12) & 3;
+        c->timer = (u16)(p[0] >> 16);
+
+        if (id == 0x00E) {
+            c->addr[0] = p[1];
+            c->addr[1] = p[2];
+            c->size = p[3];
+            SetVolumes(c->vol, p[4]);
+            SetVolumes(c->capvol, p[5]);
+        } else {
+            c->format = FORMAT_PSG;
+            c->noise = id == 0x010;
+            SetVolumes(c->vol, p[1]);
+            SetVolumes(c->capvol, p[2]);
+            if (id == 0x00F)
+                c->duty = p[3] & 7;
+        }
+
+        c->playing = (p[0] >> 14) & 1;
+        if (c->playing)
+            Restart(c);
+        break;
+
+    case 0x100: // CapEnable
+        cap->enabled = p[1] != 0;
+        cap->pos = 0;
+        break;
+    case 0x101: // CapSetRepeat
+        cap->repeat = p[1] != 0;
+        break;
+    case 0x102: // CapSetFormat
+        cap->pcm8 = p[1] != 0;
+        break;
+    case 0x103: // CapSetBit2
+        break;
+    case 0x104: // CapSetTimer
+        cap->timer = (u16)p[1];
+        break;
+    case 0x105: // CapSetBuffer
+        cap->addr = p[1];
+        cap->size = p[2];
+        break;
+    case 0x106: // SetCapRegs
+        cap->repeat = !(p[1] & 1);
+        cap->pcm8 = (p[1] >> 1) & 1;
+        cap->timer = (u16)(p[1] >> 16);
+        cap->addr = p[2];
+        cap->size = p[3];
+        cap->enabled = (p[1] >> 15) & 1;
+        cap->pos = 0;
+        break;
+
+    case 0x300: // UpdateInfo
+        break;
+    default:
+        DEBUG("Unknown command %03x\n", id);
+        break;
+    }
+}
+
+void csnd_ExecuteCommands(u32 offset)
+{
+    u32 count = 0;
+
+    if (CSND_sharedmem == NULL)
+        return;
+
+    // Chained by offset, 0xFFFF ends it. Bounded in case the chain loops.
+    while (offset + CMD_SIZE <= CSND_sharedmemsize && count++ < CSND_sharedmemsize / CMD_SIZE) {
+        u8* cmd = CSND_sharedmem + offset;
+        u16 next = cmd[0] | cmd[1] << 8;
+
+        Command(cmd[2] | cmd[3] << 8, cmd + 8);
+        cmd[4] = 1; // Done.
+
+        if (next == 0xFFFF)
+            break;
+        offset = next;
+    }
+
+    WriteStatus();
+}
+
+/* ____ Interface ____ */
+
+void csnd_Reset()
+{
+    u32 i;
+
+    memset(channels, 0, sizeof(channels));
+    memset(captures, 0, sizeof(captures));
+
+    for (i = 0; i < CSND_CHANNELS; i++) {
+        channels[i].format = FORMAT_PCM16;
+        channels[i].interp = true;
+        channels[i].vol[0] = channels[i].vol[1] = 1.0f;
+    }
+}
+
+bool csnd_Active()
+{
+    u32 i;
+
+    for (i = 0; i < CSND_CHANNELS; i++)
+        if (channels[i].playing && channels[i].active)
+            return true;
+
+    for (i = 0; i < NUM_CAPTURES; i++)
+        if (captures[i].enabled)
+            return true;
+
+    return false;
+}
+
+// Runs one audio frame of the channels, from dspaudio.
+void csnd_Frame()
+{
+    u32 i;
+
+    for (i = 0; i < CSND_CHANNELS; i++) {
+        csnd_channel* c = &channels[i];
+        float gain[2][2];
+        float rate;
+
+        if (!c->playing || !c->active || c->timer == 0)
+            continue;
+
+        gain[0][0] = c->vol[0];
+        gain[0][1] = c->vol[1];
+        gain[1][0] = c->capvol[0];
+        gain[1][1] = c->capvol[1];
+        rate = (float)CSND_CLOCK / c->timer / DSPAUDIO_RATE;
+
+        dspaudio_AddSource(&c->stream, rate, c->interp, gain, PullChannel, c);
+    }
+
+    // Captures record at the output rate, the timer is not used.
+    for (i = 0; i < NUM_CAPTURES; i++) {
+        csnd_capture* cap = &captures[i];
+        u32 bytes = cap->pcm8 ? 1 : 2;
+        u32 at, total;
+        dspaudio_capture out;
+
+        if (!cap->enabled || cap->size < bytes)
+            continue;
+
+        out.addr = cap->addr;
+        out.size = cap->size;
+        out.pos = cap->pos;
+        out.repeat = cap->repeat;
+        out.pcm8 = cap->pcm8;
+        dspaudio_Capture(i, &out);
+
+        // Same steps as dspaudio takes, sample by sample.
+        at = cap->pos / bytes + DSPAUDIO_FRAME;
+        total = cap->size / bytes;
+        if (at >= total && !cap->repeat)
+            cap->enabled = false;
+        cap->pos = (at % total) * bytes;
+    }
+
+    WriteStatus();
+}
+
+void csnd_SaveState()
+{
+    savestate_Put(channels, sizeof(channels));
+    savestate_Put(captures, sizeof(captures));
+}
+
+void csnd_LoadState()
+{
+    savestate_Get(channels, sizeof(channels));
+    savestate_Get(captures, sizeof(captures));
+}
@@ -34,7 +34,9 @@
 //#define DISASM 1
 #define EMULATE 1
 
-u8 ram[0x20000];
+// Program and data memory are separate 64k word spaces on the Teak.
+static u16 pram[0x10000];
+static u16 dram[0x10000];
 
 //register
 u16 stt[3];
@@ -63,14 +65,17 @@ static u32 Read32(uint8_t p[4])
 
 static u16 FetchWord(u16 addr)
 {
-    u16 temp = ram[addr*2] | (ram[addr*2 + 1] << 8);
-    return temp;
+    return pram[addr];
+}
+
+static u16 readWord(u16 addr)
+{
+    return dram[addr];
 }
 
 static void writeWord(u16 addr,u16 data)
 {
-    ram[addr * 2] = data&0xFF;
-    ram[addr * 2 + 1] = (data >> 8) & 0xFF;
+    dram[addr] = data;
 }
 
 void DSPwrite16_8(u8 addr, u16 data)
@@ -84,11 +89,11 @@ void DSPwrite16_16(u16 addr, u16 data)
 
 u16 DSPread16_8(u8 addr)
 {
-    return FetchWord(addr | (st[1] << 8));
+    return readWord(addr | (st[1] << 8));
 }
 u16 DSPread16_16(u16 addr)
 {
-    return FetchWord(addr);
+    return readWord(addr);
 }
 
 
@@ -710,832 +715,1115 @@ void setmorpone(u16 morpone, u16 data)
         break;
     }
 }
-void DSP_Step()
+/* ____ Instructions ____ */
+
+// One handler per encoding, the main loop adds 1 to pc after each one.
+// Handlers that only print are instructions that are decoded but not
+// emulated yet.
+
+typedef void (*dsp_op)(u16 op);
+
+static dsp_op optable[0x10000];
+static bool optable_ready;
+static bool loaded;
+
+static void Op_Unknown(u16 op)
 {
-    // Currently a disassembler.
-    // Implemented up to MUL y, (rN).
+    DEBUG("? %04X\n", op);
+}
 
-    u16 op = FetchWord(pc);
-    u8 ax = op & (0x100) ? 1 : 0; // use a0 or a1
+// 0x0xxx
+static void Op_MovImmMorptwo(u16 op)
+{
+    u16 extra = FetchWord(pc + 1);
+    DEBUG("mov %04x, %s\n", extra, morptwo[op & 0x7]);
+    pc++;
+}
 
-    switch(op >> 12) {
-    case 0:
-        if ((op&~0x7) == 0x8) {
-            u16 extra = FetchWord(pc + 1);
-            DEBUG("mov %04x, %s\n", extra, morptwo[op & 0x7]);
-            pc++;
-            break;
-        }
-        if ((op&~0x7) == 0x30) { //correct this may be wrong
-            u16 extra1 = FetchWord(pc + 1);
+static void Op_MovImmMorpone(u16 op) //correct this may be wrong
+{
+    u16 extra1 = FetchWord(pc + 1);
 #ifdef DISASM
-            DEBUG("mov #0x%04x,%s\n", extra1, morpone[op&0x7]);
+    DEBUG("mov #0x%04x,%s\n", extra1, morpone[op&0x7]);
 #endif
 #ifdef EMULATE
-            setmorpone(op & 0x7,extra1);
+    setmorpone(op & 0x7,extra1);
 #endif
-            pc++;
-            break;
-        }
-        if (op == 0x20) {
-            DEBUG("trap\n");
-            break;
-        }
-        if (op == 0) {
+    pc++;
+}
+
+static void Op_Trap(u16 op)
+{
+    DEBUG("trap\n");
+}
+
+static void Op_Nop(u16 op)
+{
 #ifdef DISASM
-            DEBUG("nop\n");
+    DEBUG("nop\n");
 #endif
-            break;
-        }
-        if ((op & 0xE00) == 0x200) {
-            DEBUG("load modi #%04x\n", op & 0x1FF);
-            break;
-        }
-        if ((op & 0xE00) == 0xA00) {
-            DEBUG("load modj #%04x\n", op & 0x1FF);
-            break;
-        }
-        if ((op & 0xF00) == 0x400) {
+}
+
+static void Op_LoadModi(u16 op)
+{
+    DEBUG("load modi #%04x\n", op & 0x1FF);
+}
+
+static void Op_LoadModj(u16 op)
+{
+    DEBUG("load modj #%04x\n", op & 0x1FF);
+}
+
+static void Op_LoadPage(u16 op)
+{
 #ifdef DISASM
-            DEBUG("load page #%02x\n", op & 0xFF);
+    DEBUG("load page #%02x\n", op & 0xFF);
 #endif
 #ifdef EMULATE
-            st[1] = (st[1] & 0xFF00) | (op & 0xFF);
+    st[1] = (st[1] & 0xFF00) | (op & 0xFF);
 #endif
-            break;
-        }
-        if ((op & 0xF80) == 0x80) {
-            DEBUG("rets (r%d) (modifier=%s) (disable=%d)\n", op & 0x7, mm[(op >> 3) & 3],(op>>5)&0x1);
-            break;
-        }
-        if ((op & 0xF00) == 0x900) {
-            DEBUG("rets #%02x\n", op&0xFF);
-            break;
-        }
-        if ((op & 0xF80) == 0x100) {
-            DEBUG("movs %s, %s\n",rrrrr[op&0x1F],AB[(op >> 5)&0x3]);
-            break;
-        }
-        if ((op & 0xF80) == 0x180) {
-            DEBUG("movs (r%d) (modifier=%s), %s\n", op&0x7,mm[(op>>3)&3], AB[(op >> 5) & 0x3]);
-            break;
-        }
-        if ((op & 0xE00) == 0x600) {
-            DEBUG("movp (r%d) (modifier=%s), (r%d) (modifier=%s)\n", op & 0x7, mm[(op >> 3) & 3],(op>>5)&0x3,mm[(op>>7)&0x3]);
-            break;
-        }
-        if ((op & 0xFC0) == 0x040) {
-            DEBUG("movp a%d, %s\n", (op >> 5) & 0x1, rrrrr[op & 0x1F]);
-            break;
-        }
-        if ((op & 0xFC0) == 0x040) {
-            DEBUG("movp a%d, %s\n",(op >> 5) &0x1, rrrrr[op&0x1F]);
-            break;
-        }
-        if((op&0xF00) == 0x800) {
-            DEBUG("mpyi %02X\n", op & 0xFF);
-            break;
-        }
-        if((op & 0xE00) == 0xE00) {
-            // TODO: divs
-            DEBUG("divs??\n");
-            break;
-        }
-        if ((op & 0xF00) == 0x500) {
-            DEBUG("mov %02x, sv\n",op&0xFF);
-            break;
-        }
-        if ((op & 0xF00) == 0xD00) { //00001101...rrrrr
-            DEBUG("rep %s\n", rrrrr[op & 0x1F]);
-            break;
-        }
-        if ((op & 0xF00) == 0xC00) {
-            DEBUG("rep %02x\n", op&0xFF);
-            break;
-        }
-        DEBUG("? %04X\n", op);
-        break;
-    case 1:
-        if (!(op & 0x800)) {
-            DEBUG("callr %s %02x\n", cccc[op & 0xF], (op >> 4) & 0x7F);
-            break;
-        }
-        if ((op & 0xC00) == 0x800) {
-            DEBUG("mov %s, (r%d) (modifier=%s)\n",rrrrr[(op >> 5)&0x1F], op & 0x7, mm[(op >> 3) & 3]);
-            break;
-        }
-        if ((op & 0xC00) == 0xC00) {
-            DEBUG("mov (r%d) (modifier=%s), %s\n", op & 0x7, mm[(op >> 3) & 3], rrrrr[(op >> 5) & 0x1F]);
-            break;
-        }
-        DEBUG("? %04X\n", op);
-        break;
-    case 2:
-        if (!(op & 0x100)) {
-            DEBUG("mov %s, #%02x\n", rNstar[(op >> 9) & 0x7],op&0xFF);
-            break;
-        }
-    case 3:
-        if((op&0xF100) ==0x3000) {
+}
+
+static void Op_RetsR(u16 op)
+{
+    DEBUG("rets (r%d) (modifier=%s) (disable=%d)\n", op & 0x7, mm[(op >> 3) & 3],(op>>5)&0x1);
+}
+
+static void Op_RetsImm(u16 op)
+{
+    DEBUG("rets #%02x\n", op&0xFF);
+}
+
+static void Op_MovsReg(u16 op)
+{
+    DEBUG("movs %s, %s\n",rrrrr[op&0x1F],AB[(op >> 5)&0x3]);
+}
+
+static void Op_MovsR(u16 op)
+{
+    DEBUG("movs (r%d) (modifier=%s), %s\n", op&0x7,mm[(op>>3)&3], AB[(op >> 5) & 0x3]);
+}
+
+static void Op_MovpR(u16 op)
+{
+    DEBUG("movp (r%d) (modifier=%s), (r%d) (modifier=%s)\n", op & 0x7, mm[(op >> 3) & 3],(op>>5)&0x3,mm[(op>>7)&0x3]);
+}
+
+static void Op_MovpA(u16 op)
+{
+    DEBUG("movp a%d, %s\n", (op >> 5) & 0x1, rrrrr[op & 0x1F]);
+}
+
+static void Op_Mpyi(u16 op)
+{
+    DEBUG("mpyi %02X\n", op & 0xFF);
+}
+
+static void Op_Divs(u16 op)
+{
+    // TODO: divs
+    DEBUG("divs??\n");
+}
+
+static void Op_MovSv(u16 op)
+{
+    DEBUG("mov %02x, sv\n",op&0xFF);
+}
+
+static void Op_RepReg(u16 op) //00001101...rrrrr
+{
+    DEBUG("rep %s\n", rrrrr[op & 0x1F]);
+}
+
+static void Op_RepImm(u16 op)
+{
+    DEBUG("rep %02x\n", op&0xFF);
+}
+
+// 0x1xxx
+static void Op_Callr(u16 op)
+{
+    DEBUG("callr %s %02x\n", cccc[op & 0xF], (op >> 4) & 0x7F);
+}
+
+static void Op_MovRegR(u16 op)
+{
+    DEBUG("mov %s, (r%d) (modifier=%s)\n",rrrrr[(op >> 5)&0x1F], op & 0x7, mm[(op >> 3) & 3]);
+}
+
+static void Op_MovRReg(u16 op)
+{
+    DEBUG("mov (r%d) (modifier=%s), %s\n", op & 0x7, mm[(op >> 3) & 3], rrrrr[(op >> 5) & 0x1F]);
+}
+
+// 0x2xxx, 0x3xxx
+static void Op_MovRNImm(u16 op)
+{
+    DEBUG("mov %s, #%02x\n", rNstar[(op >> 9) & 0x7],op&0xFF);
+}
+
+static void Op_MovABLDirect(u16 op)
+{
 #ifdef DISASM
-            DEBUG("mov %s, #%02x\n",ABL[(op >>9)&0x7],op&0xFF);
+    DEBUG("mov %s, #%02x\n",ABL[(op >>9)&0x7],op&0xFF);
 #endif
 #ifdef EMULATE
-            DSPwrite16_8(op & 0xFF, getABL((op >> 9) & 0x7));
+    DSPwrite16_8(op & 0xFF, getABL((op >> 9) & 0x7));
 #endif
-            break;
-        }
-        if ((op & 0xF00) == 0x100) {
-            DEBUG("mov #%02x, a%dl\n", (op>>12)&0x1, op & 0xFF);
-            break;
-        }
-        if ((op & 0xF00) == 0x500) {
-            DEBUG("mov #%02x, a%dh\n", (op >> 12) & 0x1, op & 0xFF);
-            break;
-        }
-        if ((op & 0x300) == 0x300) {
-            DEBUG("mov #%02x, %s\n", op & 0xFF,rNstar[(op>>10)&0x7]);
-            break;
-        }
-        if ((op & 0xB00) == 0x900) {
-            DEBUG("mov #%02x, ext%d\n", op & 0xFF, ((op>>11)&0x2) | ((op >>10) &0x1));
-            break;
-        }
+}
 
-        DEBUG("? %04X\n", op);
-        break;
-    case 4:
+static void Op_MovImmAl(u16 op)
+{
+    DEBUG("mov #%02x, a%dl\n", (op>>12)&0x1, op & 0xFF);
+}
+
+static void Op_MovImmAh(u16 op)
+{
+    DEBUG("mov #%02x, a%dh\n", (op >> 12) & 0x1, op & 0xFF);
+}
 
-        if(!(op & 0x80)) {
-            int op3 = HasOp3(op);
+static void Op_MovImmRN(u16 op)
+{
+    DEBUG("mov #%02x, %s\n", op & 0xFF,rNstar[(op>>10)&0x7]);
+}
 
-            if(op3 != -1) {
-                // ALU (rb + #offset7), ax
-                DEBUG("%s (rb + %02x), a%d\n", ops3[op3], op & 0x7F, ax);
-                break;
-            }
-        }
-        if (op == 0x43C0) {
+static void Op_MovImmExt(u16 op)
+{
+    DEBUG("mov #%02x, ext%d\n", op & 0xFF, ((op>>11)&0x2) | ((op >>10) &0x1));
+}
+
+// 0x4xxx
+static void Op_AluRbOff7(u16 op)
+{
+    // ALU (rb + #offset7), ax
+    DEBUG("%s (rb + %02x), a%d\n", ops3[HasOp3(op)], op & 0x7F, op & 0x100 ? 1 : 0);
+}
+
+static void Op_Dint(u16 op)
+{
 #ifdef DISASM
-            DEBUG("dint\n");
+    DEBUG("dint\n");
 #endif
 #ifdef EMULATE
-            st[0] &= ~0x2;
+    st[0] &= ~0x2;
 #endif
-            break;
-        }
-        if (op == 0x4380) {
+}
+
+static void Op_Eint(u16 op)
+{
 #ifdef DISASM
-            DEBUG("eint\n");
+    DEBUG("eint\n");
 #endif
 #ifdef EMULATE
-            st[0] |= 0x2;
+    st[0] |= 0x2;
 #endif
-            break;
-        }
-        if ((op & ~0x3) == 0x4D80) {
-            DEBUG("load ps %d\n", op&0x3);
-            break;
-        }
-        if ((op & 0xFE0) == 0x5C0) {
-            DEBUG("reti %s (switch=%d)\n", cccc[op & 0xF],(op>>4)&1);
-            break;
-        }
-        if ((op & 0xFF0) == 0x580) {
+}
+
+static void Op_LoadPs(u16 op)
+{
+    DEBUG("load ps %d\n", op&0x3);
+}
+
+static void Op_Reti(u16 op)
+{
+    DEBUG("reti %s (switch=%d)\n", cccc[op & 0xF],(op>>4)&1);
+}
+
+static void Op_Ret(u16 op)
+{
 #ifdef DISASM
-            DEBUG("ret %s \n", cccc[op&0xF]);
+    DEBUG("ret %s \n", cccc[op&0xF]);
 #endif
 #ifdef EMULATE
-            if (cccccheck(op & 0xF)) {
-                pc = DSPread16_16(sp) - 1;//pc++; at the end
-                sp++;
-            }
+    if (cccccheck(op & 0xF)) {
+        pc = DSPread16_16(sp) - 1;//pc++; at the end
+        sp++;
+    }
 #endif
-            break;
-        }
-        if ((op & ~0xF00F) == 0x180) {
-            u16 extra = FetchWord(pc + 1);
+}
+
+static void Op_Br(u16 op)
+{
+    u16 extra = FetchWord(pc + 1);
 #ifdef DISASM
-            DEBUG("br %s %04x\n", cccc[op&0xF],extra);
+    DEBUG("br %s %04x\n", cccc[op&0xF],extra);
 #endif
-            pc++;
+    pc++;
 #ifdef EMULATE
-            if (cccccheck(op&0xF))pc = extra - 1;
+    if (cccccheck(op&0xF))pc = extra - 1;
 #endif
-            break;
-        }
-        if ((op&~0x7F) == 0x4B80) {
-            DEBUG("banke #%02x\n", op & 0x7F);
-            break;
-        }
-        if ((op&~0x3F) == 0x4980) {
-            DEBUG("swap %s\n", swap[op&0xF]);
-            break;
-        }
-        if ((op & 0xC0) == 0x40) { //0100111111-rrrrr
-            DEBUG("movsi %s, %s (#%02x)\n", rNstar[(op >> 9)&0x7], AB[(op >>5)&0x3],op&0x1F);
-            break;
-        }
-        if ((op & 0xFC0) == 0xFC0) { //0100111111-rrrrr
-            DEBUG("mov %s, icr\n", rrrrr[op&0x1F]);
-            break;
-        }
-        if ((op & 0xFC0) == 0xF80) { //0100111111-vvvvv
-            DEBUG("mov %d, icr\n", op & 0x1F);
-            break;
-        }
-        if((op & 0xFFFC) == 0x421C) {
-            // lim
-            switch(op & 3) {
-            case 0:
-                DEBUG("lim a0\n");
-                break;
-            case 1:
-                DEBUG("lim a0, a1\n");
-                break;
-            case 2:
-                DEBUG("lim a1, a0\n");
-                break;
-            case 3:
-                DEBUG("lim a1\n");
-                break;
-            }
-
-            break;
-        }
-        if((op & 0xFE0) == 0x7C0) {
-            DEBUG("mov mixp , %s\n", rrrrr[op & 0x1F]);
-            break;
-        }
-        if ((op & 0xFE0) == 0x7E0) {
-            DEBUG("mov sp, %s\n", rrrrr[op & 0x1F]);
-            break;
-        }
-        if ((op&0xFF0) == 0x1C0) {
-            u16 extra = FetchWord(pc + 1);
-            pc++;
+}
+
+static void Op_Banke(u16 op)
+{
+    DEBUG("banke #%02x\n", op & 0x7F);
+}
+
+static void Op_Swap(u16 op)
+{
+    DEBUG("swap %s\n", swap[op&0xF]);
+}
+
+static void Op_Movsi(u16 op)
+{
+    DEBUG("movsi %s, %s (#%02x)\n", rNstar[(op >> 9)&0x7], AB[(op >>5)&0x3],op&0x1F);
+}
+
+static void Op_MovRegIcr(u16 op) //0100111111-rrrrr
+{
+    DEBUG("mov %s, icr\n", rrrrr[op&0x1F]);
+}
+
+static void Op_MovImmIcr(u16 op) //0100111111-vvvvv
+{
+    DEBUG("mov %d, icr\n", op & 0x1F);
+}
+
+static void Op_Lim(u16 op)
+{
+    switch(op & 3) {
+    case 0:
+        DEBUG("lim a0\n");
+        break;
+    case 1:
+        DEBUG("lim a0, a1\n");
+        break;
+    case 2:
+        DEBUG("lim a1, a0\n");
+        break;
+    case 3:
+        DEBUG("lim a1\n");
+        break;
+    }
+}
+
+static void Op_MovMixp(u16 op)
+{
+    DEBUG("mov mixp , %s\n", rrrrr[op & 0x1F]);
+}
+
+static void Op_MovSp(u16 op)
+{
+    DEBUG("mov sp, %s\n", rrrrr[op & 0x1F]);
+}
+
+static void Op_Call(u16 op)
+{
+    u16 extra = FetchWord(pc + 1);
+    pc++;
 #ifdef DISASM
-            DEBUG("call %s %04x\n", cccc[op & 0xF], extra);
+    DEBUG("call %s %04x\n", cccc[op & 0xF], extra);
 #endif
 #ifdef EMULATE
-            if (cccccheck(op & 0xF)) {
-                sp--;
-                writeWord(sp, pc + 1);
-                pc = extra - 1;
-            }
+    if (cccccheck(op & 0xF)) {
+        sp--;
+        writeWord(sp, pc + 1);
+        pc = extra - 1;
+    }
 #endif
-            break;
-        }
-        if ((op&~0x7) == 0x4388) { //this is strange
-            u16 extra = FetchWord(pc + 1);
-            pc++;
+}
+
+static void Op_AlbMorpone1(u16 op) //this is strange
+{
+    u16 extra = FetchWord(pc + 1);
+    pc++;
 #ifdef DISASM
-            DEBUG("%s #%04x, %s\n", alb_ops[1], extra, morpone[op & 0x7]);
+    DEBUG("%s #%04x, %s\n", alb_ops[1], extra, morpone[op & 0x7]);
 #endif
 #ifdef EMULATE
-            setmorpone(op & 0x7, doalb_ops(1, getmorpone(op & 0x7), extra));
+    setmorpone(op & 0x7, doalb_ops(1, getmorpone(op & 0x7), extra));
 #endif
-            break;
-        }
-        if ((op&~0x7) == 0x43C8) { //this is strange
-            u16 extra = FetchWord(pc + 1);
-            pc++;
+}
+
+static void Op_AlbMorpone0(u16 op) //this is strange
+{
+    u16 extra = FetchWord(pc + 1);
+    pc++;
 #ifdef DISASM
-            DEBUG("%s #%04x, %s\n", alb_ops[0], extra, morpone[op & 0x7]);
+    DEBUG("%s #%04x, %s\n", alb_ops[0], extra, morpone[op & 0x7]);
 #endif
 #ifdef EMULATE
-            setmorpone(op & 0x7, doalb_ops(0, getmorpone(op & 0x7), extra));
+    setmorpone(op & 0x7, doalb_ops(0, getmorpone(op & 0x7), extra));
 #endif
-            break;
-        }
-        DEBUG("? %04X\n", op);
-        break;
-    case 0x5:
-        if (!(op & 0x800)) {
+}
+
+// 0x5xxx
+static void Op_Brr(u16 op)
+{
 #ifdef DISASM
-            DEBUG("brr %s %02x\n", cccc[op & 0xF], (op >> 4)&0x7F);
+    DEBUG("brr %s %02x\n", cccc[op & 0xF], (op >> 4)&0x7F);
 #endif
 #ifdef EMULATE
-            u32 brroffset = (op >> 4) & 0x7F;
-            if (brroffset & 0x40)
-                brroffset += 0xFF80;
-            if (cccccheck(op & 0xF))pc += brroffset; //pc++; is at the end
+    u32 brroffset = (op >> 4) & 0x7F;
+    if (brroffset & 0x40)
+        brroffset += 0xFF80;
+    if (cccccheck(op & 0xF))pc += brroffset; //pc++; is at the end
 #endif
-            break;
-        }
-        if ((op & 0xF00) == 0xC00) {
-            DEBUG("bkrep %02x\n", op & 0xFF);
-            break;
-        }
-        if ((op & 0xf80) == 0xD00) {
-            u16 extra = FetchWord(pc+1);
-            DEBUG("bkrep %s %d %04x\n", rrrrr[op & 0x1F], (op >> 5) & 0x3, extra);
-            break;
-        }
-        if ((op &0xF00) == 0xF00) {
-            DEBUG("movd r%d (modifier=%s),r%d (modifier=%s)\n",3 + (op >> 2) & 0x1, mm[(op >> 3) & 0x3] ,op & 0x3, mm[(op >> 5) & 0x3]);
-            break;
-        }
-        if ((op &~0x1F) == 0x5E60) {
+}
+
+static void Op_BkrepImm(u16 op)
+{
+    DEBUG("bkrep %02x\n", op & 0xFF);
+}
+
+static void Op_BkrepReg(u16 op)
+{
+    u16 extra = FetchWord(pc+1);
+    DEBUG("bkrep %s %d %04x\n", rrrrr[op & 0x1F], (op >> 5) & 0x3, extra);
+}
+
+static void Op_Movd(u16 op)
+{
+    DEBUG("movd r%d (modifier=%s),r%d (modifier=%s)\n",3 + (op >> 2) & 0x1, mm[(op >> 3) & 0x3] ,op & 0x3, mm[(op >> 5) & 0x3]);
+}
+
+static void Op_Pop(u16 op)
+{
 #ifdef DISASM
-            DEBUG("pop %s\n", rrrrr[op & 0x1F]);
+    DEBUG("pop %s\n", rrrrr[op & 0x1F]);
 #endif
 #ifdef EMULATE
-            setrrrrr(op & 0x1F, DSPread16_16(sp));
-            sp++;
+    setrrrrr(op & 0x1F, DSPread16_16(sp));
+    sp++;
 #endif
-            break;
-        }
-        if (op == 0x5F40) {
-            u16 extra = FetchWord(pc + 1);
-            DEBUG("push #%04x\n", extra);
-            pc++;
-            break;
-        }
-        if ((op & 0xFE0) == 0xE40) {
+}
+
+static void Op_PushImm(u16 op)
+{
+    u16 extra = FetchWord(pc + 1);
+    DEBUG("push #%04x\n", extra);
+    pc++;
+}
+
+static void Op_PushReg(u16 op)
+{
 #ifdef DISASM
-            DEBUG("push %s\n", rrrrr[op&0x1F]);
+    DEBUG("push %s\n", rrrrr[op&0x1F]);
 #endif
 #ifdef EMULATE
-            sp--;
-            DSPwrite16_16(sp, getrrrrr(op & 0x1F));
+    sp--;
+    DSPwrite16_16(sp, getrrrrr(op & 0x1F));
 #endif
-            break;
-        }
-        if ((op & 0xEE0) == 0xE00) { //0101111-000rrrrr
-            u16 extra = FetchWord(pc + 1);
+}
+
+static void Op_MovImm16Reg(u16 op) //0101111-000rrrrr
+{
+    u16 extra = FetchWord(pc + 1);
 #ifdef DISASM
-            DEBUG("mov #%04x, %s\n", extra, rrrrr[op&0x1F]);
+    DEBUG("mov #%04x, %s\n", extra, rrrrr[op&0x1F]);
 #endif
 #ifdef EMULATE
-            setrrrrr(op & 0x1F, extra);
+    setrrrrr(op & 0x1F, extra);
 #endif
-            pc++;
-            break;
-        }
-        if ((op & 0xEE0) == 0xEE0) { //0101111b001-----
-            u16 extra = FetchWord(pc + 1);
-            DEBUG("mov #%04x, b%d\n", extra, ax);
-            pc++;
-            break;
-        }
-        if ((op & 0xC00) == 0x800) {
+    pc++;
+}
+
+static void Op_MovImm16B(u16 op) //0101111b001-----
+{
+    u16 extra = FetchWord(pc + 1);
+    DEBUG("mov #%04x, b%d\n", extra, op & 0x100 ? 1 : 0);
+    pc++;
+}
+
+static void Op_MovRegReg(u16 op)
+{
 #ifdef DISASM
-            DEBUG("mov %s, %s\n",rrrrr[op & 0x1F] ,rrrrr[(op >> 5) & 0x1F] );
+    DEBUG("mov %s, %s\n",rrrrr[op & 0x1F] ,rrrrr[(op >> 5) & 0x1F] );
 #endif
 #ifdef EMULATE
-            u16 restt = getrrrrr(op & 0x1F);
+    u16 restt = getrrrrr(op & 0x1F);
 
 
-            u16 temp = st[0] & 0xF1BF;
-            if (restt == 0)temp |= 0x800; //Z
-            //M
-            //N
-            //E
-            st[0] = temp;
+    u16 temp = st[0] & 0xF1BF;
+    if (restt == 0)temp |= 0x800; //Z
+    //M
+    //N
+    //E
+    st[0] = temp;
 
-            setrrrrr((op >> 5) & 0x1F, restt);
+    setrrrrr((op >> 5) & 0x1F, restt);
 #endif
-            break;
-        }
-        if ((op & 0xFFC0) == 0x5EC0) {
-            DEBUG("mov %s, b%d\n", rrrrr[op& 0x1F],(op>>5)&0x1);
-            break;
-        }
-        if ((op & 0xFFE0) == 0x5F40) {
-            DEBUG("mov %s, mixp\n", rrrrr[op & 0x1F]);
-            break;
-        }
-        DEBUG("? %04X\n", op);
-        break;
-    case 0x6:
-    case 0x7:
-        if ((op & 0xF00) == 0x700) {
+}
+
+static void Op_MovRegB(u16 op)
+{
+    DEBUG("mov %s, b%d\n", rrrrr[op& 0x1F],(op>>5)&0x1);
+}
+
+static void Op_MovRegMixp(u16 op)
+{
+    DEBUG("mov %s, mixp\n", rrrrr[op & 0x1F]);
+}
+
+// 0x6xxx, 0x7xxx
+static void Op_Modr(u16 op)
+{
 #ifdef DISASM
-            DEBUG("%s %s a%d\n", ffff[(op>> 4)&0xF],cccc[op&0xF],(op>>12)&0x1);
+    DEBUG("%s %s a%d\n", ffff[(op>> 4)&0xF],cccc[op&0xF],(op>>12)&0x1);
 #endif
 #ifdef EMULATE
-            if (cccccheck(op & 0xF)) {
-                u8 MSB = (st[(op >> 12) & 0x1]) & 0xF;
-                a[(op >> 12) & 0x1] = doffff(a[(op >> 12) & 0x1], (op >> 4) & 0xF,&MSB);
-                st[(op >> 12) & 0x1] = st[(op >> 12) & 0x1] & 0xFFF | (MSB << 12);
-            }
+    if (cccccheck(op & 0xF)) {
+        u8 MSB = (st[(op >> 12) & 0x1]) & 0xF;
+        a[(op >> 12) & 0x1] = doffff(a[(op >> 12) & 0x1], (op >> 4) & 0xF,&MSB);
+        st[(op >> 12) & 0x1] = st[(op >> 12) & 0x1] & 0xFFF | (MSB << 12);
+    }
 #endif
-            break;
-        }
-        if ((op&0x700) == 0x300) {
-            DEBUG("movs %02x, %s\n",op&0xFF,AB[(op>> 11)&0x3]);
-            break;
-        }
-        if ((op & 0xEF80) == 0x6F00) {
-            DEBUG("%s b%d Bit %d\n",fff[(op >> 4)&0x7],(op >> 12)&0x1,op&0xF);
-            break;
-        }
-        if ((op & 0xE300) == 0x6000) {
-            DEBUG("mov #%02x ,%s\n",op&0xFF ,rNstar[(op >> 10)&0x7]);
-            break;
-        }
-        if ((op & 0xE700) == 0x6100) {
-            DEBUG("mov #%02x ,%s\n", op & 0xFF, AB[(op >> 11) & 0x3]);
-            break;
-        }
-        if ((op & 0xE300) == 0x6200) {
-            DEBUG("mov #%02x ,%s\n", op & 0xFF, ABL[(op >> 10) & 0x7]);
-            break;
-        }
-        if ((op & 0xEF00) == 0x6500) {
-            DEBUG("mov #%02x ,a%dHeu\n", op & 0xFF, (op >> 12)&0x1);
-            break;
-        }
-        if ((op & 0xFF00) == 0x6D00) {
-            DEBUG("mov #%02x ,sv\n", op & 0xFF);
-            break;
-        }
-        if ((op & 0xFF00) == 0x7D00) {
-            DEBUG("mov sv ,#%02x\n", op & 0xFF);
-            break;
-        }
-        DEBUG("? %04X\n", op);
-        break;
-    case 0x8:
-        if ((op & 0xE0) == 0xA0) {
-            //MUL y, (rN)
-            DEBUG("%s y, (a%d),(r%d) (modifier=%s)\n", mulXXX[(op >> 8) & 0x7], (op >> 11) & 0x1, op&0x7, mm[(op >> 3) & 3]);
-            break;
-        }
-        if ((op & 0xE0) == 0x80) {
-            //MUL y, register
-            DEBUG("%s y, (a%d),%s\n", mulXXX[(op >> 8) & 0x7], (op >> 11) & 0x1, rrrrr[op & 0x1F]);
-            break;
-        }
-        if ((op & 0xE0) == 0x00) {
-            //MUL (rN), ##long immediate
-            u16 longim = FetchWord(pc + 1);
-            DEBUG("%s %s, (a%d),%04x\n", mulXXX[(op >> 8) & 0x7], rrrrr[op & 0x1F], (op >> 11) & 0x1, longim);
-            pc++;
-            break;
-        }
-        if ((op&~0x8) == 0x8971) {
-            u16 extra = FetchWord(pc + 1);
-            DEBUG("mov %04x, %s\n", extra, restep[(op >> 3)&0x1]);
-            pc++;
-            break;
-        }
-    case 0x9:
-        if ((op & 0xE0) == 0xA0) {
-            int op3 = HasOp3(op);
+}
 
-            if (op3 != -1) {
+static void Op_MovsImm(u16 op)
+{
+    DEBUG("movs %02x, %s\n",op&0xFF,AB[(op>> 11)&0x3]);
+}
+
+static void Op_BitB(u16 op)
+{
+    DEBUG("%s b%d Bit %d\n",fff[(op >> 4)&0x7],(op >> 12)&0x1,op&0xF);
+}
+
+static void Op_MovImm8RN(u16 op)
+{
+    DEBUG("mov #%02x ,%s\n",op&0xFF ,rNstar[(op >> 10)&0x7]);
+}
+
+static void Op_MovImm8AB(u16 op)
+{
+    DEBUG("mov #%02x ,%s\n", op & 0xFF, AB[(op >> 11) & 0x3]);
+}
+
+static void Op_MovImm8ABL(u16 op)
+{
+    DEBUG("mov #%02x ,%s\n", op & 0xFF, ABL[(op >> 10) & 0x7]);
+}
+
+static void Op_MovImm8AHeu(u16 op)
+{
+    DEBUG("mov #%02x ,a%dHeu\n", op & 0xFF, (op >> 12)&0x1);
+}
+
+static void Op_MovImm8Sv(u16 op)
+{
+    DEBUG("mov #%02x ,sv\n", op & 0xFF);
+}
+
+static void Op_MovSvImm8(u16 op)
+{
+    DEBUG("mov sv ,#%02x\n", op & 0xFF);
+}
+
+// 0x8xxx, 0x9xxx
+static void Op_MulYR(u16 op)
+{
+    //MUL y, (rN)
+    DEBUG("%s y, (a%d),(r%d) (modifier=%s)\n", mulXXX[(op >> 8) & 0x7], (op >> 11) & 0x1, op&0x7, mm[(op >> 3) & 3]);
+}
+
+static void Op_MulYReg(u16 op)
+{
+    //MUL y, register
+    DEBUG("%s y, (a%d),%s\n", mulXXX[(op >> 8) & 0x7], (op >> 11) & 0x1, rrrrr[op & 0x1F]);
+}
+
+static void Op_MulLongImm(u16 op)
+{
+    //MUL (rN), ##long immediate
+    u16 longim = FetchWord(pc + 1);
+    DEBUG("%s %s, (a%d),%04x\n", mulXXX[(op >> 8) & 0x7], rrrrr[op & 0x1F], (op >> 11) & 0x1, longim);
+    pc++;
+}
+
+static void Op_MovImmRestep(u16 op)
+{
+    u16 extra = FetchWord(pc + 1);
+    DEBUG("mov %04x, %s\n", extra, restep[(op >> 3)&0x1]);
+    pc++;
+}
+
+static void Op_AluAlReg(u16 op)
+{
+    int op3 = HasOp3(op);
+    u8 ax = op & (0x100) ? 1 : 0;
 #ifdef DISASM
-                DEBUG("%s a%dl, %s\n", ops3[op3], ax, rrrrr[op & 0x1F]);
+    DEBUG("%s a%dl, %s\n", ops3[op3], ax, rrrrr[op & 0x1F]);
 #endif
 #ifdef EMULATE
-                u8 MSB = 0;
-                a[ax] = (doops3(op3, a[ax] & 0xFFFF, getrrrrr(op & 0x1F), &MSB) & 0xFFFF) | a[ax] & ~0xFFFF;
+    u8 MSB = 0;
+    a[ax] = (doops3(op3, a[ax] & 0xFFFF, getrrrrr(op & 0x1F), &MSB) & 0xFFFF) | a[ax] & ~0xFFFF;
 #endif
-                break;
-            }
-        }
-        if ((op & 0xF240) == 0x9240) {
-            DEBUG("shfi %s, %s %02x\n", AB[(op >> 10) & 0x3], AB[(op >> 7) & 0x3], fixending(op & 0x3F,6));
-            break;
-        }
+}
 
-        if ((op & 0xFEE0) == 0x9CC0) {
-            DEBUG("movr %s ,a%d\n", rrrrr[op&0x1F], ax);
-            break;
-        }
-        if ((op & 0xFEE0) == 0x9CC0) {
-            DEBUG("mov (r%d) (modifier=%s) ,a%d\n", op & 0x7, mm[(op >> 3) & 3], ax);
-            break;
-        }
-        if ((op & 0xFEE0) == 0x98C0) {
-            DEBUG("mov (r%d) (modifier=%s) ,b%d\n", op & 0x7, mm[(op >> 3) & 3], ax);
-            break;
-        }
-        if ((op & 0xFEE0) == 0x9840) {
-            DEBUG("exp r%d (modifier=%s), a%d\n", op & 0x7, mm[(op >> 3) & 3], ax);
-            break;
-        }
-        if ((op & 0xFEE0) == 0x9040) {
-            DEBUG("exp %s, a%d\n", rrrrr[op & 0x1F], ax);
-            break;
-        }
-        if ((op & 0xFEFE) == 0x9060) {
-            DEBUG("exp b%d, a%d\n", op & 0x1, ax);
-            break;
-        }
-        if ((op & 0xFEFE) == 0x9C40) {
-            DEBUG("exp r%d (modifier=%s), sv\n", op & 0x7, mm[(op >> 3) & 3]);
-            break;
-        }
-        if ((op & 0xFEFE) == 0x9440) {
-            DEBUG("exp %s, sv\n", rrrrr[op & 0x1F]);
-            break;
-        }
-        if ((op & 0xFFFE) == 0x9460) {
-            DEBUG("exp b%d, sv\n", op & 0x1);
-            break;
-        }
+static void Op_Shfi(u16 op)
+{
+    DEBUG("shfi %s, %s %02x\n", AB[(op >> 10) & 0x3], AB[(op >> 7) & 0x3], fixending(op & 0x3F,6));
+}
 
-        if((op & 0xFEE0) == 0x90C0) {
-            u16 extra = FetchWord(pc + 1);
-            DEBUG("msu (a%d) (r%d), %04x (modifier=%s)\n",ax, op & 0x7,extra, mm[(op >> 3) & 3]);
-            pc++;
-            break;
-        }
-        if((op&0xF0E0) == 0x9020) {
-            DEBUG("tstb (r%d) (modifier=%s) (bit=%d)\n", op & 0x7, mm[(op >> 3) & 3],(op >> 8)&0xF);
-            break;
-        }
-        if ((op & 0xF0E0) == 0x9000) {
-            DEBUG("tstb %s (bit=%d)\n", rrrrr[op&0x1F], (op >> 8) & 0xF);
-            break;
-        }
-        if ((op & 0xE0) == 0x80) {
-            // ALM (rN)
-            DEBUG("%s (r%d), a%d (modifier=%s)\n", ops[(op >> 9) & 0xF], op & 0x7, ax, mm[(op >> 3) & 3]);
-            break;
-        }
-        if ((op & 0xE0) == 0xA0) {
-            // ALM register
-            u16 r = op & 0x1F;
-
-            if(r < 22) {
-                DEBUG("%s %s, a%d\n", ops[(op >> 9) & 0xF], rrrrr[r], ax);
-                break;
-            }
-
-            DEBUG("? %04X\n", op);
-        } else if(((op >> 6) & 0x7) == 7) {
-            u16 extra = FetchWord(pc+1);
-            pc++;
-
-            if(!(op & 0x100)) {
-                // ALB (rN)
-                DEBUG("%s (r%d), %04x (modifier=%s)\n", alb_ops[(op >> 9) & 0x7], op & 0x7,
-                      extra & 0xFFFF, mm[(op >> 3) & 3]);
-                break;
-            } else {
-                // ALB register
-                u16 r = op & 0x1F;
-
-                if(r < 22) {
+static void Op_Movr(u16 op)
+{
+    DEBUG("movr %s ,a%d\n", rrrrr[op&0x1F], op & 0x100 ? 1 : 0);
+}
+
+static void Op_MovRB(u16 op)
+{
+    DEBUG("mov (r%d) (modifier=%s) ,b%d\n", op & 0x7, mm[(op >> 3) & 3], op & 0x100 ? 1 : 0);
+}
+
+static void Op_ExpRA(u16 op)
+{
+    DEBUG("exp r%d (modifier=%s), a%d\n", op & 0x7, mm[(op >> 3) & 3], op & 0x100 ? 1 : 0);
+}
+
+static void Op_ExpRegA(u16 op)
+{
+    DEBUG("exp %s, a%d\n", rrrrr[op & 0x1F], op & 0x100 ? 1 : 0);
+}
+
+static void Op_ExpBA(u16 op)
+{
+    DEBUG("exp b%d, a%d\n", op & 0x1, op & 0x100 ? 1 : 0);
+}
+
+static void Op_ExpRSv(u16 op)
+{
+    DEBUG("exp r%d (modifier=%s), sv\n", op & 0x7, mm[(op >> 3) & 3]);
+}
+
+static void Op_ExpRegSv(u16 op)
+{
+    DEBUG("exp %s, sv\n", rrrrr[op & 0x1F]);
+}
+
+static void Op_ExpBSv(u16 op)
+{
+    DEBUG("exp b%d, sv\n", op & 0x1);
+}
+
+static void Op_Msu(u16 op)
+{
+    u16 extra = FetchWord(pc + 1);
+    DEBUG("msu (a%d) (r%d), %04x (modifier=%s)\n",op & 0x100 ? 1 : 0, op & 0x7,extra, mm[(op >> 3) & 3]);
+    pc++;
+}
+
+static void Op_TstbR(u16 op)
+{
+    DEBUG("tstb (r%d) (modifier=%s) (bit=%d)\n", op & 0x7, mm[(op >> 3) & 3],(op >> 8)&0xF);
+}
+
+static void Op_TstbReg(u16 op)
+{
+    DEBUG("tstb %s (bit=%d)\n", rrrrr[op&0x1F], (op >> 8) & 0xF);
+}
+
+static void Op_AlmR(u16 op)
+{
+    // ALM (rN)
+    DEBUG("%s (r%d), a%d (modifier=%s)\n", ops[(op >> 9) & 0xF], op & 0x7, op & 0x100 ? 1 : 0, mm[(op >> 3) & 3]);
+}
+
+static void Op_AlmReg(u16 op)
+{
+    // ALM register
+    DEBUG("%s %s, a%d\n", ops[(op >> 9) & 0xF], rrrrr[op & 0x1F], op & 0x100 ? 1 : 0);
+}
+
+static void Op_AlbR(u16 op)
+{
+    // ALB (rN)
+    u16 extra = FetchWord(pc+1);
+    pc++;
+    DEBUG("%s (r%d), %04x (modifier=%s)\n", alb_ops[(op >> 9) & 0x7], op & 0x7,
+          extra & 0xFFFF, mm[(op >> 3) & 3]);
+}
+
+static void Op_AlbReg(u16 op)
+{
+    // ALB register
+    u16 extra = FetchWord(pc+1);
+    pc++;
 #ifdef DISASM
-                    DEBUG("%s %s, %04x\n", alb_ops[(op >> 9) & 0x7], rrrrr[r], extra & 0xFFFF);
+    DEBUG("%s %s, %04x\n", alb_ops[(op >> 9) & 0x7], rrrrr[op & 0x1F], extra & 0xFFFF);
 #endif
 #ifdef EMULATE
-                    setrrrrr(op & 0x1F,doalb_ops((op >> 9) & 0x7, getrrrrr(op & 0x1F), extra));
+    setrrrrr(op & 0x1F,doalb_ops((op >> 9) & 0x7, getrrrrr(op & 0x1F), extra));
 #endif
-                    break;
-                }
-
-                DEBUG("? %04X\n", op);
-            }
-            break;
-        } else if((op & 0xF0FF) == 0x80C0) {
-            int op3 = HasOp3(op);
-
-            if (op3 != -1) {
-                // ALU ##long immediate
-                u16 extra = FetchWord(pc + 1);
-                pc++;
+}
+
+static void Op_AlbRegUnknown(u16 op)
+{
+    pc++;
+    DEBUG("? %04X\n", op);
+}
+
+static void Op_AluLongImm(u16 op)
+{
+    // ALU ##long immediate
+    int op3 = HasOp3(op);
+    u8 ax = op & (0x100) ? 1 : 0;
+    u16 extra = FetchWord(pc + 1);
+    pc++;
 #ifdef DISASM
-                DEBUG("%s %04x, a%d\n", ops3[op3], extra & 0xFFFF, ax);
+    DEBUG("%s %04x, a%d\n", ops3[op3], extra & 0xFFFF, ax);
 #endif
 #ifdef EMULATE
-                u8 MSB = (st[(op >> 12) & 0x1] >> 12) & 0xF;
-                a[ax] = doops3(op3,a[ax],extra,&MSB);
-                st[(op >> 12) & 0x1] = (st[(op >> 12) & 0x1] & 0xFFF) | MSB << 12;
+    u8 MSB = (st[(op >> 12) & 0x1] >> 12) & 0xF;
+    a[ax] = doops3(op3,a[ax],extra,&MSB);
+    st[(op >> 12) & 0x1] = (st[(op >> 12) & 0x1] & 0xFFF) | MSB << 12;
 #endif
+}
 
-                break;
-            }
-
-            DEBUG("? %04X\n", op);
-            break;
-        } else if((op & 0xFF70) == 0x8A60) {
-            // TODO: norm
-            u16 extra = FetchWord(pc+1);
-            pc++;
-
-            DEBUG("norm??\n");
-            break;
-        } else if((op & 0xF8E7) == 0x8060) {
-            // maxd
-            int d = op & (1 << 10);
-            int f = op & (1 << 9);
-            DEBUG("max%s %s, a%d\n", d ? "d" : "", f ? "gt" : "ge", ax);
-            break;
-        }
+static void Op_Norm(u16 op)
+{
+    // TODO: norm
+    pc++;
+    DEBUG("norm??\n");
+}
 
-        DEBUG("? %04X\n", op);
-        break;
+static void Op_Maxd(u16 op)
+{
+    int d = op & (1 << 10);
+    int f = op & (1 << 9);
+    DEBUG("max%s %s, a%d\n", d ? "d" : "", f ? "gt" : "ge", op & 0x100 ? 1 : 0);
+}
 
-    case 0xA:
-    case 0xB:
-        // ALM direct
+// 0xAxxx, 0xBxxx
+static void Op_AlmDirect(u16 op)
+{
+    u8 ax = op & (0x100) ? 1 : 0;
 #ifdef DISASM
-        DEBUG("%s %02x, a%d\n", ops[(op >> 9) & 0xF], op & 0xFF, ax);
+    DEBUG("%s %02x, a%d\n", ops[(op >> 9) & 0xF], op & 0xFF, ax);
 #endif
 #ifdef EMULATE
-        {
-            u8 MSB = (st[ax] >> 12);
-            doops((op >> 9) & 0xF, a[ax], &MSB, DSPread16_8(op & 0xFF), 0);
-            st[ax] = (MSB << 12) | st[ax]&0xFFF;
-        }
+    u8 MSB = (st[ax] >> 12);
+    doops((op >> 9) & 0xF, a[ax], &MSB, DSPread16_8(op & 0xFF), 0);
+    st[ax] = (MSB << 12) | st[ax]&0xFFF;
 #endif
-        break;
+}
 
-    case 0xC: {
-        int op3 = HasOp3(op);
+// 0xCxxx
+static void Op_AluShortImm(u16 op)
+{
+    // ALU #short immediate
+    DEBUG("%s %02x, a%d\n", ops3[HasOp3(op)], op & 0xFF, op & 0x100 ? 1 : 0);
+}
 
-        if(op3 != -1) {
-            // ALU #short immediate
-            DEBUG("%s %02x, a%d\n", ops3[op3], op & 0xFF, ax);
-            break;
-        }
-        DEBUG("? %04X\n", op);
-        break;
-    }
+// 0xDxxx
+static void Op_CntxR(u16 op)
+{
+    DEBUG("cntx r\n");
+}
 
+static void Op_CntxS(u16 op)
+{
+    DEBUG("cntx s\n");
+}
 
-    case 0xD:
-        if (op == 0xD390) {
-            DEBUG("cntx r\n");
-            break;
-        }
-        if (op == 0xD380) {
-            DEBUG("cntx s\n");
-            break;
-        }
-        if (op == 0xD7C0) {
-            DEBUG("retid\n");
-            break;
-        }
-        if (op == 0xD780) {
-            DEBUG("retd\n");
-            break;
-        }
-        if ((op & ~0xF010) == 0x381) {
+static void Op_Retid(u16 op)
+{
+    DEBUG("retid\n");
+}
+
+static void Op_Retd(u16 op)
+{
+    DEBUG("retd\n");
+}
+
+static void Op_CallA(u16 op)
+{
 #ifdef DISASM
-            DEBUG("call a%d\n",(op>>4)&0x1);
+    DEBUG("call a%d\n",(op>>4)&0x1);
 #endif
 #ifdef EMULATE
-            sp--;
-            writeWord(sp, pc + 1);
-            pc = a[(op >> 4) & 0x1] - 1;//pc++;
+    sp--;
+    writeWord(sp, pc + 1);
+    pc = a[(op >> 4) & 0x1] - 1;//pc++;
 #endif
-            break;
-        }
-        if (op == 0xD3C0) {
-            DEBUG("break\n");
-            break;
-        }
-        if ((op & 0xF80) == 0xF80) {
-            DEBUG("load stepj #%02x\n", op&0x7F);
-            break;
-        }
-        if ((op & 0xF80) == 0xB80) {
-            DEBUG("load stepi #%02x\n", op & 0x7F);
-            break;
-        }
-        if ((op & 0xFEFC) == 0xD498) { //1101010A100110--
-            u16 extra = FetchWord(pc + 1);
-            pc++;
-            DEBUG("mov (rb + #%04x), a%d\n", extra, ax);
-            break;
-        }
-        if ((op & 0xFE80) == 0xDC80) { //1101110a1ooooooo
-            DEBUG("mov (rb + #%02x), a%d\n", op&0x7F,ax);
-            break;
-        }
-        if ((op & 0xFE80) == 0xD880) { //1101100a1ooooooo
-            DEBUG("move a%dl, (rb + #%02x)\n", op & 0x7F, ax);
-            break;
-        }
-        if ((op & 0xF39F) == 0xD290) { //1101ab101AB10000
-            DEBUG("mov %s, %s\n", AB[(op >> 5) & 0x3], AB[(op >> 10) & 0x3]);
-            break;
-        }
-        if ((op & 0xFF9F) == 0xD490) {
-            DEBUG("mov repc, %s\n", AB[(op >> 5) & 0x3]);
-            break;
-        }
-        if ((op & 0xFF9F) == 0xD491) {
-            DEBUG("mov dvm, %s\n", AB[(op >> 5) & 0x3]);
-            break;
-        }
-        if ((op & 0xFF9F) == 0xD492) {
-            DEBUG("mov icr, %s\n", AB[(op >> 5) & 0x3]);
-            break;
-        }
-        if ((op & 0xFF9F) == 0xD493) {
-            DEBUG("mov x, %s\n", AB[(op >> 5) & 0x3]);
-            break;
-        }
-        if ((op & 0xE80) == 0x080) {
-            //msu (rJ), (rI) 1101000A1jjiiwqq
-            DEBUG("msu r%d (modifier=%s),r%d (modifier=%s) a%d\n", op & 0x3, mm[(op >> 5) & 0x3], 3 + (op >> 2) & 0x1, mm[(op >> 3) & 0x3], ax);
-            break;
-        }
-        if ((op & 0xFEFC) == 0xD4B8) { //1101010a101110--
-            u16 extra = FetchWord(pc + 1);
-            DEBUG("mov [%04x], a%d\n",extra,ax);
-            pc++;
-            break;
-        }
-        if ((op & 0xFEFC) == 0xD4BC) { //1101010a101111--
-            u16 extra = FetchWord(pc + 1);
-            DEBUG("mov a%dl, [%04x]\n", ax,extra);
-            pc++;
-            break;
-        }
+}
 
-        if ((op & 0xF3FF) == 0xD2D8) {
-            DEBUG("mov %s,x\n",AB[(op>>10) & 0x3]);
-            break;
-        }
-        if ((op & 0xF3FF) == 0xD298) {
-            DEBUG("mov %s,dvm\n", AB[(op >> 10) & 0x3]);
-            break;
-        }
-        if (!(op & 0x80)) {
-            //MUL (rJ), (rI) 1101AXXX0jjiiwqq
-            DEBUG("%s r%d (modifier=%s),r%d (modifier=%s) a%d\n", mulXXX[(op >> 8) & 0x7], op & 0x3, mm[(op >> 5) & 0x3], 3 + (op >> 2) & 0x1, mm[(op >> 3) & 0x3], (op >> 11) & 0x1);
-            break;
-        }
-        if ((op & 0xFE80) == 0xD080) {
-            //msu (rJ), (rI)
-            DEBUG("msu r%d (modifier=%s),r%d (modifier=%s) a%d\n", op & 0x3, mm[(op >> 5) & 0x3], 3 + (op >> 2) & 0x1, mm[(op >> 3) & 0x3], ax);
-            break;
-        }
-        if ((op & 0xF390) == 0xD280) {
-            //shfc
-            DEBUG("shfc %s %s %s\n", AB[(op >> 10) & 0x3], AB[(op >> 5) & 0x3], cccc[op&0xF]);
-            break;
-        }
-        if((op & 0xFED8) == 0xD4D8) {
-            int op3 = HasOp3(op);
-
-            if(op3 != -1) {
-                u16 extra = FetchWord(pc+1);
-                pc+=2;
-
-                if(op & (1 << 5)) {  // ALU [##direct add.],ax
-                    DEBUG("%s [%04x], a%d\n",
-                          ops3[op3],
-                          extra & 0xFFFF,
-                          op & (0x1000) ? 1 : 0);
-                    break;
-                } else { // ALU (rb + ##offset),ax
-                    DEBUG("%s (rb + %04x), a%d\n",
-                          ops3[op3],
-                          extra & 0xFFFF,
-                          op & (0x1000) ? 1 : 0);
-                    break;
-                }
-            }
-        }
-        DEBUG("? %04X\n", op);
-        break;
+static void Op_Break(u16 op)
+{
+    DEBUG("break\n");
+}
+
+static void Op_LoadStepj(u16 op)
+{
+    DEBUG("load stepj #%02x\n", op&0x7F);
+}
+
+static void Op_LoadStepi(u16 op)
+{
+    DEBUG("load stepi #%02x\n", op & 0x7F);
+}
+
+static void Op_MovRbOff16A(u16 op) //1101010A100110--
+{
+    u16 extra = FetchWord(pc + 1);
+    pc++;
+    DEBUG("mov (rb + #%04x), a%d\n", extra, op & 0x100 ? 1 : 0);
+}
+
+static void Op_MovRbOff7A(u16 op) //1101110a1ooooooo
+{
+    DEBUG("mov (rb + #%02x), a%d\n", op&0x7F,op & 0x100 ? 1 : 0);
+}
+
+static void Op_MovARbOff7(u16 op) //1101100a1ooooooo
+{
+    DEBUG("move a%dl, (rb + #%02x)\n", op & 0x7F, op & 0x100 ? 1 : 0);
+}
+
+static void Op_MovABAB(u16 op) //1101ab101AB10000
+{
+    DEBUG("mov %s, %s\n", AB[(op >> 5) & 0x3], AB[(op >> 10) & 0x3]);
+}
+
+static void Op_MovRepc(u16 op)
+{
+    DEBUG("mov repc, %s\n", AB[(op >> 5) & 0x3]);
+}
+
+static void Op_MovDvm(u16 op)
+{
+    DEBUG("mov dvm, %s\n", AB[(op >> 5) & 0x3]);
+}
+
+static void Op_MovIcr(u16 op)
+{
+    DEBUG("mov icr, %s\n", AB[(op >> 5) & 0x3]);
+}
+
+static void Op_MovX(u16 op)
+{
+    DEBUG("mov x, %s\n", AB[(op >> 5) & 0x3]);
+}
+
+static void Op_MsuRR(u16 op)
+{
+    //msu (rJ), (rI) 1101000A1jjiiwqq
+    DEBUG("msu r%d (modifier=%s),r%d (modifier=%s) a%d\n", op & 0x3, mm[(op >> 5) & 0x3], 3 + (op >> 2) & 0x1, mm[(op >> 3) & 0x3], op & 0x100 ? 1 : 0);
+}
+
+static void Op_MovDirectA(u16 op) //1101010a101110--
+{
+    u16 extra = FetchWord(pc + 1);
+    DEBUG("mov [%04x], a%d\n",extra,op & 0x100 ? 1 : 0);
+    pc++;
+}
+
+static void Op_MovADirect(u16 op) //1101010a101111--
+{
+    u16 extra = FetchWord(pc + 1);
+    DEBUG("mov a%dl, [%04x]\n", op & 0x100 ? 1 : 0,extra);
+    pc++;
+}
+
+static void Op_MovABX(u16 op)
+{
+    DEBUG("mov %s,x\n",AB[(op>>10) & 0x3]);
+}
+
+static void Op_MovABDvm(u16 op)
+{
+    DEBUG("mov %s,dvm\n", AB[(op >> 10) & 0x3]);
+}
+
+static void Op_MulRR(u16 op)
+{
+    //MUL (rJ), (rI) 1101AXXX0jjiiwqq
+    DEBUG("%s r%d (modifier=%s),r%d (modifier=%s) a%d\n", mulXXX[(op >> 8) & 0x7], op & 0x3, mm[(op >> 5) & 0x3], 3 + (op >> 2) & 0x1, mm[(op >> 3) & 0x3], (op >> 11) & 0x1);
+}
 
+static void Op_Shfc(u16 op)
+{
+    DEBUG("shfc %s %s %s\n", AB[(op >> 10) & 0x3], AB[(op >> 5) & 0x3], cccc[op&0xF]);
+}
+
+static void Op_AluDirect16(u16 op)
+{
+    u16 extra = FetchWord(pc+1);
+    pc+=2;
+
+    if(op & (1 << 5)) {  // ALU [##direct add.],ax
+        DEBUG("%s [%04x], a%d\n",
+              ops3[HasOp3(op)],
+              extra & 0xFFFF,
+              op & (0x1000) ? 1 : 0);
+    } else { // ALU (rb + ##offset),ax
+        DEBUG("%s (rb + %04x), a%d\n",
+              ops3[HasOp3(op)],
+              extra & 0xFFFF,
+              op & (0x1000) ? 1 : 0);
+    }
+}
+
+// 0xExxx
+static void Op_AlbDirect(u16 op)
+{
+    u16 extra = FetchWord(pc+2);
+
+    DEBUG("%s %02x, %04x\n", alb_ops[(op >> 9) & 0x7], op & 0xFF, extra & 0xFFFF);
+    pc++;
+}
+
+static void Op_MulImm8(u16 op)
+{
+    DEBUG("%s a%d #%02x\n", mulXX[(op >> 9) & 0x3], (op >> 11) & 0x1,op&0xFF);
+}
+
+// 0xFxxx
+static void Op_TstbImm(u16 op)
+{
+    DEBUG("tstb #%02x (bit=%d)\n", op&0xFF, (op >> 8) & 0xF);
+}
+
+/* ____ Decoder ____ */
+
+// Same order as the encodings overlap, first match wins.
+
+static dsp_op Decode0(u16 op)
+{
+    if ((op&~0x7) == 0x8) return Op_MovImmMorptwo;
+    if ((op&~0x7) == 0x30) return Op_MovImmMorpone;
+    if (op == 0x20) return Op_Trap;
+    if (op == 0) return Op_Nop;
+    if ((op & 0xE00) == 0x200) return Op_LoadModi;
+    if ((op & 0xE00) == 0xA00) return Op_LoadModj;
+    if ((op & 0xF00) == 0x400) return Op_LoadPage;
+    if ((op & 0xF80) == 0x80) return Op_RetsR;
+    if ((op & 0xF00) == 0x900) return Op_RetsImm;
+    if ((op & 0xF80) == 0x100) return Op_MovsReg;
+    if ((op & 0xF80) == 0x180) return Op_MovsR;
+    if ((op & 0xE00) == 0x600) return Op_MovpR;
+    if ((op & 0xFC0) == 0x040) return Op_MovpA;
+    if ((op & 0xF00) == 0x800) return Op_Mpyi;
+    if ((op & 0xE00) == 0xE00) return Op_Divs;
+    if ((op & 0xF00) == 0x500) return Op_MovSv;
+    if ((op & 0xF00) == 0xD00) return Op_RepReg;
+    if ((op & 0xF00) == 0xC00) return Op_RepImm;
+    return Op_Unknown;
+}
+
+static dsp_op Decode1(u16 op)
+{
+    if (!(op & 0x800)) return Op_Callr;
+    if ((op & 0xC00) == 0x800) return Op_MovRegR;
+    if ((op & 0xC00) == 0xC00) return Op_MovRReg;
+    return Op_Unknown;
+}
+
+static dsp_op Decode3(u16 op)
+{
+    if ((op&0xF100) == 0x3000) return Op_MovABLDirect;
+    if ((op & 0xF00) == 0x100) return Op_MovImmAl;
+    if ((op & 0xF00) == 0x500) return Op_MovImmAh;
+    if ((op & 0x300) == 0x300) return Op_MovImmRN;
+    if ((op & 0xB00) == 0x900) return Op_MovImmExt;
+    return Op_Unknown;
+}
+
+static dsp_op Decode4(u16 op)
+{
+    if (!(op & 0x80) && HasOp3(op) != -1) return Op_AluRbOff7;
+    if (op == 0x43C0) return Op_Dint;
+    if (op == 0x4380) return Op_Eint;
+    if ((op & ~0x3) == 0x4D80) return Op_LoadPs;
+    if ((op & 0xFE0) == 0x5C0) return Op_Reti;
+    if ((op & 0xFF0) == 0x580) return Op_Ret;
+    if ((op & ~0xF00F) == 0x180) return Op_Br;
+    if ((op&~0x7F) == 0x4B80) return Op_Banke;
+    if ((op&~0x3F) == 0x4980) return Op_Swap;
+    if ((op & 0xC0) == 0x40) return Op_Movsi;
+    if ((op & 0xFC0) == 0xFC0) return Op_MovRegIcr;
+    if ((op & 0xFC0) == 0xF80) return Op_MovImmIcr;
+    if ((op & 0xFFFC) == 0x421C) return Op_Lim;
+    if ((op & 0xFE0) == 0x7C0) return Op_MovMixp;
+    if ((op & 0xFE0) == 0x7E0) return Op_MovSp;
+    if ((op&0xFF0) == 0x1C0) return Op_Call;
+    if ((op&~0x7) == 0x4388) return Op_AlbMorpone1;
+    if ((op&~0x7) == 0x43C8) return Op_AlbMorpone0;
+    return Op_Unknown;
+}
+
+static dsp_op Decode5(u16 op)
+{
+    if (!(op & 0x800)) return Op_Brr;
+    if ((op & 0xF00) == 0xC00) return Op_BkrepImm;
+    if ((op & 0xf80) == 0xD00) return Op_BkrepReg;
+    if ((op &0xF00) == 0xF00) return Op_Movd;
+    if ((op &~0x1F) == 0x5E60) return Op_Pop;
+    if (op == 0x5F40) return Op_PushImm;
+    if ((op & 0xFE0) == 0xE40) return Op_PushReg;
+    if ((op & 0xEE0) == 0xE00) return Op_MovImm16Reg;
+    if ((op & 0xEE0) == 0xEE0) return Op_MovImm16B;
+    if ((op & 0xC00) == 0x800) return Op_MovRegReg;
+    if ((op & 0xFFC0) == 0x5EC0) return Op_MovRegB;
+    if ((op & 0xFFE0) == 0x5F40) return Op_MovRegMixp;
+    return Op_Unknown;
+}
+
+static dsp_op Decode7(u16 op)
+{
+    if ((op & 0xF00) == 0x700) return Op_Modr;
+    if ((op&0x700) == 0x300) return Op_MovsImm;
+    if ((op & 0xEF80) == 0x6F00) return Op_BitB;
+    if ((op & 0xE300) == 0x6000) return Op_MovImm8RN;
+    if ((op & 0xE700) == 0x6100) return Op_MovImm8AB;
+    if ((op & 0xE300) == 0x6200) return Op_MovImm8ABL;
+    if ((op & 0xEF00) == 0x6500) return Op_MovImm8AHeu;
+    if ((op & 0xFF00) == 0x6D00) return Op_MovImm8Sv;
+    if ((op & 0xFF00) == 0x7D00) return Op_MovSvImm8;
+    return Op_Unknown;
+}
+
+static dsp_op Decode9(u16 op)
+{
+    if ((op & 0xE0) == 0xA0 && HasOp3(op) != -1) return Op_AluAlReg;
+    if ((op & 0xF240) == 0x9240) return Op_Shfi;
+    if ((op & 0xFEE0) == 0x9CC0) return Op_Movr;
+    if ((op & 0xFEE0) == 0x98C0) return Op_MovRB;
+    if ((op & 0xFEE0) == 0x9840) return Op_ExpRA;
+    if ((op & 0xFEE0) == 0x9040) return Op_ExpRegA;
+    if ((op & 0xFEFE) == 0x9060) return Op_ExpBA;
+    if ((op & 0xFEFE) == 0x9C40) return Op_ExpRSv;
+    if ((op & 0xFEFE) == 0x9440) return Op_ExpRegSv;
+    if ((op & 0xFFFE) == 0x9460) return Op_ExpBSv;
+    if ((op & 0xFEE0) == 0x90C0) return Op_Msu;
+    if ((op&0xF0E0) == 0x9020) return Op_TstbR;
+    if ((op & 0xF0E0) == 0x9000) return Op_TstbReg;
+    if ((op & 0xE0) == 0x80) return Op_AlmR;
+    if ((op & 0xE0) == 0xA0) return (op & 0x1F) < 22 ? Op_AlmReg : Op_Unknown;
+    if (((op >> 6) & 0x7) == 7) {
+        if (!(op & 0x100)) return Op_AlbR;
+        return (op & 0x1F) < 22 ? Op_AlbReg : Op_AlbRegUnknown;
+    }
+    if ((op & 0xF0FF) == 0x80C0) return HasOp3(op) != -1 ? Op_AluLongImm : Op_Unknown;
+    if ((op & 0xFF70) == 0x8A60) return Op_Norm;
+    if ((op & 0xF8E7) == 0x8060) return Op_Maxd;
+    return Op_Unknown;
+}
+
+static dsp_op Decode8(u16 op)
+{
+    if ((op & 0xE0) == 0xA0) return Op_MulYR;
+    if ((op & 0xE0) == 0x80) return Op_MulYReg;
+    if ((op & 0xE0) == 0x00) return Op_MulLongImm;
+    if ((op&~0x8) == 0x8971) return Op_MovImmRestep;
+    return Decode9(op);
+}
+
+static dsp_op DecodeD(u16 op)
+{
+    if (op == 0xD390) return Op_CntxR;
+    if (op == 0xD380) return Op_CntxS;
+    if (op == 0xD7C0) return Op_Retid;
+    if (op == 0xD780) return Op_Retd;
+    if ((op & ~0xF010) == 0x381) return Op_CallA;
+    if (op == 0xD3C0) return Op_Break;
+    if ((op & 0xF80) == 0xF80) return Op_LoadStepj;
+    if ((op & 0xF80) == 0xB80) return Op_LoadStepi;
+    if ((op & 0xFEFC) == 0xD498) return Op_MovRbOff16A;
+    if ((op & 0xFE80) == 0xDC80) return Op_MovRbOff7A;
+    if ((op & 0xFE80) == 0xD880) return Op_MovARbOff7;
+    if ((op & 0xF39F) == 0xD290) return Op_MovABAB;
+    if ((op & 0xFF9F) == 0xD490) return Op_MovRepc;
+    if ((op & 0xFF9F) == 0xD491) return Op_MovDvm;
+    if ((op & 0xFF9F) == 0xD492) return Op_MovIcr;
+    if ((op & 0xFF9F) == 0xD493) return Op_MovX;
+    if ((op & 0xE80) == 0x080) return Op_MsuRR;
+    if ((op & 0xFEFC) == 0xD4B8) return Op_MovDirectA;
+    if ((op & 0xFEFC) == 0xD4BC) return Op_MovADirect;
+    if ((op & 0xF3FF) == 0xD2D8) return Op_MovABX;
+    if ((op & 0xF3FF) == 0xD298) return Op_MovABDvm;
+    if (!(op & 0x80)) return Op_MulRR;
+    if ((op & 0xFE80) == 0xD080) return Op_MsuRR;
+    if ((op & 0xF390) == 0xD280) return Op_Shfc;
+    if ((op & 0xFED8) == 0xD4D8 && HasOp3(op) != -1) return Op_AluDirect16;
+    return Op_Unknown;
+}
+
+static dsp_op Decode(u16 op)
+{
+    switch(op >> 12) {
+    case 0x0:
+        return Decode0(op);
+    case 0x1:
+        return Decode1(op);
+    case 0x2:
+        if (!(op & 0x100)) return Op_MovRNImm;
+        return Decode3(op);
+    case 0x3:
+        return Decode3(op);
+    case 0x4:
+        return Decode4(op);
+    case 0x5:
+        return Decode5(op);
+    case 0x6:
+    case 0x7:
+        return Decode7(op);
+    case 0x8:
+        return Decode8(op);
+    case 0x9:
+        return Decode9(op);
+    case 0xA:
+    case 0xB:
+        return Op_AlmDirect;
+    case 0xC:
+        return HasOp3(op) != -1 ? Op_AluShortImm : Op_Unknown;
+    case 0xD:
+        return DecodeD(op);
     case 0xE:
-        // ALB direct
-        if(op & (1 << 8)) {
-            u16 extra = FetchWord(pc+2);
-
-            DEBUG("%s %02x, %04x\n", alb_ops[(op >> 9) & 0x7], op & 0xFF, extra & 0xFFFF);
-            pc++;
-            break;
-        } else {
-            DEBUG("%s a%d #%02x\n", mulXX[(op >> 9) & 0x3], (op >> 11) & 0x1,op&0xFF);
-            break;
-        }
-        DEBUG("? %04X\n", op);
-        break;
-    case 0xF:
-        DEBUG("tstb #%02x (bit=%d)\n", op&0xFF, (op >> 8) & 0xF);
-        break;
+        return op & (1 << 8) ? Op_AlbDirect : Op_MulImm8;
     default:
-        DEBUG("? %04X\n",op);
+        return Op_TstbImm;
     }
+}
+
+static void BuildOpTable()
+{
+    u32 op;
+
+    for (op = 0; op < 0x10000; op++)
+        optable[op] = Decode((u16)op);
+
+    optable_ready = true;
+}
 
+void DSP_Step()
+{
+    u16 op;
+
+    if (!optable_ready)
+        BuildOpTable();
+
+    op = FetchWord(pc);
+    optable[op](op);
     pc++;
 }
 
-void DSP_Run()
+// Runs the loaded firmware for a number of instructions and returns.
+void DSP_Run(u32 cycles)
 {
-    pc = 0x0; //reset
-    while (1) {
-        //DEBUG("op:%04x (%04x) %04x\n", FetchWord(pc),pc,sp);
-        DSP_Step();
+    if (!loaded)
+        return;
+
+    if (!optable_ready)
+        BuildOpTable();
+
+    while (cycles-- != 0) {
+        //DEBUG("op:%04x (%04x) %04x\n", FetchWord(pc), pc, sp);
+        u16 op = pram[pc];
+        optable[op](op);
+        pc++;
     }
 }
 
-void DSP_LoadFirm(u8* bin)
+// <len> is what the guest handed over, the header is not trusted with it.
+void DSP_LoadFirm(u8* bin, u32 len)
 {
     dsp_header head;
+
+    if (len < sizeof(head)) {
+        ERROR("firmware too small: %08X\n", len);
+        return;
+    }
     memcpy(&head, bin, sizeof(head));
 
     u32 magic = Read32(head.magic);
@@ -1547,15 +1835,30 @@ void DSP_LoadFirm(u8* bin)
     DEBUG("head %08X %08X %08X %08X %08X %02X %02X %02X %02X\n",
           magic, contsize, unk1, unk6, unk7, head.unk2, head.unk3, head.num_sec, head.unk5);
 
-    for (int i = 0; i < head.num_sec; i++) {
+    if (contsize > len) {
+        ERROR("firmware claims %08X bytes, got %08X\n", contsize, len);
+        return;
+    }
+
+    for (int i = 0; i < head.num_sec && i < 9; i++) {
         u32 dataoffset = Read32(head.segment[i].data_offset);
         u32 destoffset = Read32(head.segment[i].dest_offset);
         u32 size = Read32(head.segment[i].size);
         u32 select = Read32(head.segment[i].select);
+        u16* dest = (select >> 24) == 2 ? dram : pram; // Memory type in the top byte.
+        u32 j;
 
         DEBUG("segment %08X %08X %08X %08X\n", dataoffset, destoffset, size, select);
-        memcpy(ram + (destoffset *2), bin + dataoffset, size);
+
+        if ((u64)destoffset + size / 2 > 0x10000 || (u64)dataoffset + size > contsize) {
+            DEBUG("segment out of range\n");
+            continue;
+        }
+
+        for (j = 0; j < size / 2; j++)
+            dest[destoffset + j] = bin[dataoffset + 2*j] | bin[dataoffset + 2*j + 1] << 8;
     }
 
-    DSP_Run();
+    pc = 0x0; //reset
+    loaded = true;
 }
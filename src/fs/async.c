@@ -0,0 +1,257 @@
+/*
+* Copyright (C) 2014 - plutoo
+* Copyright (C) 2014 - ichfly
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "util.h"
+#include "mem.h"
+#include "fs.h"
+
+/* ____ Asynchronous file reads ____ */
+
+// Large reads are handed to an I/O thread, the requesting guest thread is
+// parked on the file handle meanwhile and the others keep running. The
+// archive backends share state (RomFS page cache, save cache), so they
+// still only ever run one at a time: the I/O thread holds the FS lock
+// while it reads, the FS services hold it while they handle a request.
+// Hence a single I/O thread, more would only queue on the lock.
+//
+// Since the services hold the FS lock, a request they look at is either
+// still queued or already done, never half way through.
+//
+// The guest memory written is that of the requesting process, which keeps
+// running meanwhile. The I/O thread uses its mapping table and holds the
+// mapping lock while it reads, so the table cannot change under it.
+
+struct _fsasync_req {
+    file_type* file;
+    u32 ptr;
+    u32 sz;
+    u64 off;
+    struct mem_table* mem; // The requesting process.
+
+    u32 rc;
+    u32 read;
+    bool done;
+
+    fsasync_req* next;
+};
+
+static bool started;
+static fsasync_req* queue_head;
+static fsasync_req* queue_tail;
+
+#ifdef _WIN32
+static CRITICAL_SECTION fs_lock;
+static CRITICAL_SECTION queue_lock;
+static HANDLE queue_sem;
+
+#define LOCK(l)   EnterCriticalSection(&(l))
+#define UNLOCK(l) LeaveCriticalSection(&(l))
+#else
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queue_cond = PTHREAD_COND_INITIALIZER;
+
+#define LOCK(l)   pthread_mutex_lock(&(l))
+#define UNLOCK(l) pthread_mutex_unlock(&(l))
+#endif
+
+
+static fsasync_req* Pop()
+{
+    fsasync_req* req = queue_head;
+
+    if (req != NULL) {
+        queue_head = req->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+    }
+    return req;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Worker(LPVOID arg)
+#else
+static void* Worker(void* arg)
+#endif
+{
+    for (;;) {
+#ifdef _WIN32
+        WaitForSingleObject(queue_sem, INFINITE);
+#else
+        LOCK(queue_lock);
+        while (queue_head == NULL)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        UNLOCK(queue_lock);
+#endif
+
+        // Take the request only once we own the backends, it may have been
+        // cancelled in between.
+        LOCK(fs_lock);
+        LOCK(queue_lock);
+        fsasync_req* req = Pop();
+        UNLOCK(queue_lock);
+
+        if (req != NULL) {
+            u32 read = 0;
+            u32 rc;
+
+            mem_UseTable(req->mem);
+            mem_LockMappings();
+            rc = req->file->fnRead(req->file, req->ptr, req->sz, req->off, &read);
+            mem_UnlockMappings();
+
+            LOCK(queue_lock);
+            req->rc = rc;
+            req->read = read;
+            req->done = true;
+            UNLOCK(queue_lock);
+        }
+        UNLOCK(fs_lock);
+    }
+    return 0;
+}
+
+static void Init()
+{
+#ifdef _WIN32
+    static bool inited;
+
+    if (!inited) {
+        InitializeCriticalSection(&fs_lock);
+        InitializeCriticalSection(&queue_lock);
+        queue_sem = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+        inited = true;
+    }
+#endif
+}
+
+static int Start()
+{
+#ifdef _WIN32
+    if (CreateThread(NULL, 0, Worker, NULL, 0, NULL) == NULL) {
+#else
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, Worker, NULL) != 0) {
+#endif
+        ERROR("Failed to start the FS I/O thread.\n");
+        return -1;
+    }
+
+    started = true;
+    return 0;
+}
+
+void fsasync_Lock()
+{
+    Init();
+    LOCK(fs_lock);
+}
+
+void fsasync_Unlock()
+{
+    UNLOCK(fs_lock);
+}
+
+// Queues file->fnRead, returns NULL if it has to be done synchronously.
+fsasync_req* fsasync_Read(file_type* file, u32 ptr, u32 sz, u64 off)
+{
+    if (sz < FSASYNC_MIN_READ || file->fnRead == NULL)
+        return NULL;
+
+    if (!started && Start() != 0)
+        return NULL;
+
+    fsasync_req* req = calloc(1, sizeof(fsasync_req));
+    if (req == NULL)
+        return NULL;
+
+    req->file = file;
+    req->ptr = ptr;
+    req->sz = sz;
+    req->off = off;
+    req->mem = mem_CurrentTable();
+
+    LOCK(queue_lock);
+    if (queue_tail != NULL)
+        queue_tail->next = req;
+    else
+        queue_head = req;
+    queue_tail = req;
+#ifdef _WIN32
+    ReleaseSemaphore(queue_sem, 1, NULL);
+#else
+    pthread_cond_signal(&queue_cond);
+#endif
+    UNLOCK(queue_lock);
+
+    return req;
+}
+
+// Returns true and frees the request once it is done.
+bool fsasync_Poll(fsasync_req* req, u32* rc, u32* read)
+{
+    bool done;
+
+    LOCK(queue_lock);
+    done = req->done;
+    UNLOCK(queue_lock);
+
+    if (!done)
+        return false;
+
+    *rc = req->rc;
+    *read = req->read;
+    free(req);
+    return true;
+}
+
+// Drops a request that has not been started, it completes with an error.
+// Caller holds the FS lock.
+void fsasync_Cancel(fsasync_req* req)
+{
+    fsasync_req* prev = NULL;
+    fsasync_req* it;
+
+    LOCK(queue_lock);
+    for (it = queue_head; it != NULL; prev = it, it = it->next) {
+        if (it == req) {
+            if (prev != NULL)
+                prev->next = it->next;
+            else
+                queue_head = it->next;
+            if (queue_tail == it)
+                queue_tail = prev;
+            break;
+        }
+    }
+
+    if (!req->done) {
+        req->rc = -1;
+        req->read = 0;
+        req->done = true;
+    }
+    UNLOCK(queue_lock);
+}
@@ -0,0 +1,197 @@
+/*
+* Copyright (C) 2014 - plutoo
+* Copyright (C) 2014 - ichfly
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+#include "util.h"
+#include "mem.h"
+#include "handles.h"
+#include "fs.h"
+
+/* ____ Host directory backend ____ */
+
+// Directory handles of the archives that sit on a host directory. The
+// listing is taken once, on the first Read: a single pass over readdir,
+// entries stat'ed relative to the open directory instead of walking the
+// full path each time, all converted to the 0x228 byte FS entry format up
+// front. Reads then hand out the next entries with one guest copy.
+
+#define DIR_ENTRY_SIZE  0x228
+#define DIR_NAME_CHARS  0x105 // UTF-16 name at 0x000, up to the 8.3 name.
+
+static int StatEntry(dir_type* self, const char* name, struct stat* st)
+{
+#ifdef _WIN32
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%s", self->path, name);
+    return stat(path, st);
+#else
+    return fstatat(dirfd(self->dir), name, st, 0);
+#endif
+}
+
+static void FillEntry(u8* entry, const char* name, struct stat* st)
+{
+    u32 i;
+
+    memset(entry, 0, DIR_ENTRY_SIZE);
+
+    // Paths are ascii only all through the FS code, names are widened as is.
+    for (i = 0; i < DIR_NAME_CHARS && name[i] != '\0'; i++) {
+        entry[2*i] = (u8)name[i];
+        entry[2*i + 1] = 0;
+    }
+
+    // XXX: 8.3 name @ 0x20C
+    entry[0x215] = 0xA; // Unknown
+    // XXX: 8.3 ext @ 0x216
+
+    entry[0x21A] = 0x1; // Unknown
+    entry[0x21B] = 0x0; // Unknown
+
+    // XXX: hidden flag @ 0x21D
+    // XXX: archive flag @ 0x21E
+    // XXX: readonly flag @ 0x21F
+
+    if (S_ISDIR(st->st_mode)) {
+        entry[0x21C] = 0x1; // Is directory flag
+
+        entry[0x216] = ' '; // 8.3 file extension
+        entry[0x217] = ' ';
+        entry[0x218] = ' ';
+    } else {
+        u64 size = (u64)st->st_size;
+
+        for (i = 0; i < 8; i++)
+            entry[0x220 + i] = (u8)(size >> (8*i));
+    }
+}
+
+static int AddEntry(void* arg, const char* name, struct stat* st)
+{
+    dir_type* self = arg;
+
+    if (self->type_specific.hostdir.num == self->type_specific.hostdir.max) {
+        u32 max = self->type_specific.hostdir.max ? self->type_specific.hostdir.max * 2 : 0x40;
+        u8* n = realloc(self->type_specific.hostdir.entries, max * DIR_ENTRY_SIZE);
+        if (n == NULL) {
+            ERROR("Not enough mem.\n");
+            return -1;
+        }
+        self->type_specific.hostdir.entries = n;
+        self->type_specific.hostdir.max = max;
+    }
+
+    FillEntry(self->type_specific.hostdir.entries +
+              self->type_specific.hostdir.num * DIR_ENTRY_SIZE, name, st);
+    self->type_specific.hostdir.num++;
+    return 0;
+}
+
+static int Snapshot(dir_type* self)
+{
+    struct dirent* ent;
+
+    // The overlay merges its two layers itself.
+    if (overlay_Enabled()) {
+        if (overlay_ListDir((const char*)self->path, AddEntry, self) != 0)
+            goto fail;
+
+        self->type_specific.hostdir.valid = true;
+        return 0;
+    }
+
+    rewinddir(self->dir);
+
+    for (;;) {
+        struct stat st;
+
+        errno = 0;
+        if ((ent = readdir(self->dir)) == NULL) {
+            if (errno == 0)
+                break;
+
+            ERROR("readdir() failed.\n");
+            goto fail;
+        }
+
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        if (StatEntry(self, ent->d_name, &st) != 0) {
+            ERROR("Failed to stat: %s/%s\n", self->path, ent->d_name);
+            continue;
+        }
+
+        if (AddEntry(self, ent->d_name, &st) != 0)
+            goto fail;
+    }
+
+    self->type_specific.hostdir.valid = true;
+    return 0;
+
+fail:
+    free(self->type_specific.hostdir.entries);
+    self->type_specific.hostdir.entries = NULL;
+    self->type_specific.hostdir.num = 0;
+    self->type_specific.hostdir.max = 0;
+    return -1;
+}
+
+u32 hostdir_Read(dir_type* self, u32 ptr, u32 entrycount, u32* read_out)
+{
+    u32 left, count;
+
+    *read_out = 0;
+
+    if (!self->type_specific.hostdir.valid && Snapshot(self) != 0)
+        return -1;
+
+    left = self->type_specific.hostdir.num - self->type_specific.hostdir.next;
+    count = entrycount < left ? entrycount : left;
+
+    if (count != 0 && mem_Write(self->type_specific.hostdir.entries +
+                                self->type_specific.hostdir.next * DIR_ENTRY_SIZE,
+                                ptr, count * DIR_ENTRY_SIZE) != 0) {
+        ERROR("mem_Write failed.\n");
+        return -1;
+    }
+
+    self->type_specific.hostdir.next += count;
+    *read_out = count;
+    return 0;
+}
+
+u32 hostdir_Close(dir_type* self)
+{
+    // Close dir and free yourself
+    closedir(self->dir);
+    free(self->type_specific.hostdir.entries);
+    free(self);
+
+    return 0;
+}
@@ -0,0 +1,917 @@
+/*
+* Copyright (C) 2014 - plutoo
+* Copyright (C) 2014 - ichfly
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+#include "util.h"
+#include "mem.h"
+#include "handles.h"
+#include "fs.h"
+
+/* ____ Host file backend ____ */
+
+// File handles of the archives that sit on a plain host file (sdmc, save
+// data, extdata, sysdata). The FILE* is only kept for open/close, all I/O
+// goes positioned through the descriptor straight into guest memory, so
+// there is no bounce buffer, no seek and no stdio buffer to flush. The size
+// is tracked in the handle instead of asking the host after every write.
+
+#define FLUSH_FLAG 1
+
+#ifdef _WIN32
+static s64 PRead(int fd, void* buf, u32 sz, u64 off)
+{
+    if (_lseeki64(fd, off, SEEK_SET) == -1)
+        return -1;
+    return _read(fd, buf, sz);
+}
+
+static s64 PWrite(int fd, const void* buf, u32 sz, u64 off)
+{
+    if (_lseeki64(fd, off, SEEK_SET) == -1)
+        return -1;
+    return _write(fd, buf, sz);
+}
+#else
+#define PRead  pread
+#define PWrite pwrite
+#endif
+
+// Positioned transfers between the host file and a guest buffer, split at
+// guest mapping boundaries. Return the bytes moved or -1.
+static s64 ReadToGuest(int fd, u32 ptr, u32 sz, u64 off)
+{
+    u32 read = 0;
+
+    while (read < sz) {
+        u32 span;
+        u8* p = mem_rawspan(ptr + read, sz - read, &span);
+
+        if (p == NULL) {
+            ERROR("mem_rawspan failed.\n");
+            return -1;
+        }
+
+        s64 n = PRead(fd, p, span, off + read);
+        if (n < 0) {
+            ERROR("pread failed.\n");
+            return -1;
+        }
+
+        read += (u32)n;
+        if ((u32)n != span) // Someone truncated the file under us.
+            break;
+    }
+    return read;
+}
+
+static s64 WriteFromGuest(int fd, u32 ptr, u32 sz, u64 off)
+{
+    u32 written = 0;
+
+    while (written < sz) {
+        u32 span;
+        u8* p = mem_rawspan(ptr + written, sz - written, &span);
+
+        if (p == NULL) {
+            ERROR("mem_rawspan failed.\n");
+            return -1;
+        }
+
+        s64 n = PWrite(fd, p, span, off + written);
+        if (n <= 0) {
+            ERROR("pwrite failed.\n");
+            return -1;
+        }
+
+        written += (u32)n;
+    }
+    return written;
+}
+
+static int SyncFd(int fd)
+{
+#ifdef _WIN32
+    if (_commit(fd) != 0) {
+#else
+    if (fsync(fd) != 0) {
+#endif
+        ERROR("fsync failed.\n");
+        return -1;
+    }
+    return 0;
+}
+
+u32 hostfile_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
+{
+    *read_out = 0;
+
+    if (off >> 32) {
+        ERROR("64-bit offset not supported.\n");
+        return -1;
+    }
+
+    // Like the real thing, reading past the end is a short read, not an error.
+    if (off >= self->type_specific.sysdata.sz)
+        return 0;
+    if (sz > self->type_specific.sysdata.sz - off)
+        sz = (u32)(self->type_specific.sysdata.sz - off);
+
+    s64 read = ReadToGuest(fileno(self->type_specific.sysdata.fd), ptr, sz, off);
+    if (read < 0)
+        return -1;
+
+    *read_out = (u32)read;
+    return 0; // Result
+}
+
+u32 hostfile_Write(file_type* self, u32 ptr, u32 sz, u64 off, u32 flush_flags, u32* written_out)
+{
+    *written_out = 0;
+
+    if (off >> 32) {
+        ERROR("64-bit offset not supported.\n");
+        return -1;
+    }
+
+    s64 written = WriteFromGuest(fileno(self->type_specific.sysdata.fd), ptr, sz, off);
+    if (written < 0)
+        return -1;
+
+    if (off + written > self->type_specific.sysdata.sz)
+        self->type_specific.sysdata.sz = off + written;
+
+    if (flush_flags & FLUSH_FLAG)
+        hostfile_Flush(self);
+
+    *written_out = (u32)written;
+    return 0; // Result
+}
+
+u32 hostfile_Flush(file_type* self)
+{
+    return SyncFd(fileno(self->type_specific.sysdata.fd));
+}
+
+u64 hostfile_GetSize(file_type* self)
+{
+    return self->type_specific.sysdata.sz;
+}
+
+u32 hostfile_SetSize(file_type* self, u64 sz)
+{
+    FILE* fd = self->type_specific.sysdata.fd;
+
+    if (ftruncate(fileno(fd), sz) == -1) {
+        ERROR("ftruncate failed.\n");
+        return -1;
+    }
+
+    self->type_specific.sysdata.sz = sz;
+    return 0;
+}
+
+u32 hostfile_Close(file_type* self)
+{
+    // Close file and free yourself
+    fclose(self->type_specific.sysdata.fd);
+    free(self->type_specific.sysdata.path);
+    free(self);
+
+    return 0;
+}
+
+
+
+/* ____ Write-back cache ____ */
+
+// Save archives go through a cache of 4KiB pages instead. Writes only
+// touch the cache. A commit first writes the dirty pages and the new size
+// to <path>.journal and syncs it, then cuts the file back to the lowest size
+// it had since the last commit, writes the pages in place, syncs the file
+// and removes the journal. The journal ends in a checksummed footer,
+// so one that was cut short is ignored. A killed emulator leaves either the
+// old file or a complete journal behind, and the next open finishes the
+// commit from it. A commit costs what is dirty, not the size of the file.
+//
+// A commit happens on a write with the flush flag, on ControlArchive,
+// when the last handle of the file closes, when too much is dirty, once
+// the oldest dirty data is a few seconds old (hostfile_Tick, every frame)
+// and at exit. Handles opened on the same path share one cached file, so
+// they never see each other's stale data.
+
+#define CACHE_PAGE_SIZE    0x1000
+#define CACHE_HASH_SIZE    64
+#define CACHE_MAX_DIRTY    1024 // Pages, 4MiB.
+#define CACHE_COMMIT_SECS  5
+
+#define JOURNAL_MAGIC      0x4C4E524A // "JRNL"
+#define JOURNAL_SUM_SEED   2166136261u
+
+// After the pages, each one is its u32 index and CACHE_PAGE_SIZE of data.
+typedef struct {
+    u64 sz;
+    u64 keep_sz;   // Old bytes that survive, the rest was truncated away.
+    u32 num_pages;
+    u32 sum;
+    u32 magic;
+    u32 pad;
+} journal_footer;
+
+typedef struct cache_page {
+    u32 index;
+    struct cache_page* next;
+    u8  data[CACHE_PAGE_SIZE];
+} cache_page;
+
+struct _cached_file {
+    char* path;
+    FILE* fd;
+    u64   sz;       // Size the guest sees.
+    u64   disk_sz;  // Bytes of the host file that are still valid.
+    u32   refs;
+    bool  writable; // fd is open for writing, a commit needs that.
+    bool  unlinked; // Deleted or replaced on the host, path is stale.
+
+    bool   dirty;
+    time_t dirty_since;
+    u32    num_pages;
+    cache_page* pages[CACHE_HASH_SIZE];
+
+    cached_file* next;
+};
+
+static cached_file* cached_files;
+
+
+static cache_page* FindPage(cached_file* cf, u32 index)
+{
+    cache_page* page = cf->pages[index % CACHE_HASH_SIZE];
+
+    while (page != NULL && page->index != index)
+        page = page->next;
+    return page;
+}
+
+// Returns the page, read in from the host file when it is not cached yet.
+static cache_page* GetPage(cached_file* cf, u32 index)
+{
+    cache_page* page = FindPage(cf, index);
+    u64 off = (u64)index * CACHE_PAGE_SIZE;
+
+    if (page != NULL)
+        return page;
+
+    page = malloc(sizeof(cache_page));
+    if (page == NULL) {
+        ERROR("Not enough mem.\n");
+        return NULL;
+    }
+
+    memset(page->data, 0, CACHE_PAGE_SIZE);
+
+    if (off < cf->disk_sz) {
+        u32 len = cf->disk_sz - off < CACHE_PAGE_SIZE ? (u32)(cf->disk_sz - off) : CACHE_PAGE_SIZE;
+
+        if (PRead(fileno(cf->fd), page->data, len, off) < 0) {
+            ERROR("pread failed.\n");
+            free(page);
+            return NULL;
+        }
+    }
+
+    page->index = index;
+    page->next = cf->pages[index % CACHE_HASH_SIZE];
+    cf->pages[index % CACHE_HASH_SIZE] = page;
+    cf->num_pages++;
+    return page;
+}
+
+// Drops every page at or above <first>.
+static void DropPages(cached_file* cf, u32 first)
+{
+    u32 i;
+
+    for (i = 0; i < CACHE_HASH_SIZE; i++) {
+        cache_page** link = &cf->pages[i];
+
+        while (*link != NULL) {
+            cache_page* page = *link;
+
+            if (page->index >= first) {
+                *link = page->next;
+                free(page);
+                cf->num_pages--;
+            } else {
+                link = &page->next;
+            }
+        }
+    }
+}
+
+static void MarkDirty(cached_file* cf)
+{
+    if (!cf->dirty) {
+        cf->dirty = true;
+        cf->dirty_since = time(NULL);
+    }
+}
+
+// Makes a file created in or removed from the directory of <path> stick.
+static int SyncDir(const char* path)
+{
+#ifdef _WIN32
+    return 0; // NTFS journals its metadata itself.
+#else
+    char dir[OVERLAY_PATH_MAX + 16];
+    char* slash;
+    int fd, rc;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        slash[1] = '\0';
+    else
+        *slash = '\0';
+
+    fd = open(dir, O_RDONLY);
+    if (fd == -1) {
+        ERROR("Failed to open %s\n", dir);
+        return -1;
+    }
+
+    rc = SyncFd(fd);
+    close(fd);
+    return rc;
+#endif
+}
+
+// FNV-1a.
+static u32 Checksum(u32 sum, const void* data, u32 len)
+{
+    const u8* p = data;
+
+    while (len--)
+        sum = (sum ^ *p++) * 16777619;
+    return sum;
+}
+
+static int WriteJournal(cached_file* cf, const char* journal)
+{
+    journal_footer footer;
+    cache_page* page;
+    u32 i;
+
+    FILE* fd = fopen(journal, "wb");
+    if (fd == NULL) {
+        ERROR("Failed to create %s\n", journal);
+        return -1;
+    }
+
+    footer.sz = cf->sz;
+    footer.keep_sz = cf->disk_sz;
+    footer.num_pages = 0;
+    footer.sum = JOURNAL_SUM_SEED;
+    footer.magic = JOURNAL_MAGIC;
+    footer.pad = 0;
+
+    for (i = 0; i < CACHE_HASH_SIZE; i++) {
+        for (page = cf->pages[i]; page != NULL; page = page->next) {
+            if ((u64)page->index * CACHE_PAGE_SIZE >= cf->sz)
+                continue;
+
+            if (fwrite(&page->index, sizeof(u32), 1, fd) != 1 ||
+                fwrite(page->data, CACHE_PAGE_SIZE, 1, fd) != 1)
+                goto fail;
+
+            footer.sum = Checksum(footer.sum, &page->index, sizeof(u32));
+            footer.sum = Checksum(footer.sum, page->data, CACHE_PAGE_SIZE);
+            footer.num_pages++;
+        }
+    }
+
+    footer.sum = Checksum(footer.sum, &footer.sz, sizeof(footer.sz));
+    footer.sum = Checksum(footer.sum, &footer.keep_sz, sizeof(footer.keep_sz));
+
+    if (fwrite(&footer, sizeof(footer), 1, fd) != 1 || fflush(fd) != 0 ||
+        SyncFd(fileno(fd)) != 0)
+        goto fail;
+
+    fclose(fd);
+    return SyncDir(journal);
+
+fail:
+    ERROR("write to %s failed.\n", journal);
+    fclose(fd);
+    remove(journal);
+    return -1;
+}
+
+// Writes the cached pages over the host file, in place. Whatever was
+// truncated away since the last commit goes first, a grown file must not
+// bring the old bytes back.
+static int Apply(cached_file* cf)
+{
+    cache_page* page;
+    u32 i;
+
+    if (ftruncate(fileno(cf->fd), cf->disk_sz) != 0) {
+        ERROR("ftruncate %s failed.\n", cf->path);
+        return -1;
+    }
+
+    for (i = 0; i < CACHE_HASH_SIZE; i++) {
+        for (page = cf->pages[i]; page != NULL; page = page->next) {
+            u64 off = (u64)page->index * CACHE_PAGE_SIZE;
+            if (off >= cf->sz)
+                continue;
+
+            u32 len = cf->sz - off < CACHE_PAGE_SIZE ? (u32)(cf->sz - off) : CACHE_PAGE_SIZE;
+            if (PWrite(fileno(cf->fd), page->data, len, off) != len) {
+                ERROR("pwrite to %s failed.\n", cf->path);
+                return -1;
+            }
+        }
+    }
+
+    if (ftruncate(fileno(cf->fd), cf->sz) != 0) {
+        ERROR("ftruncate %s failed.\n", cf->path);
+        return -1;
+    }
+    return 0;
+}
+
+static int Commit(cached_file* cf)
+{
+    char journal[OVERLAY_PATH_MAX + 16];
+
+    if (!cf->dirty)
+        return 0;
+
+    // Deleted under us, the data only has to last as long as the handles.
+    if (cf->unlinked) {
+        if (Apply(cf) != 0)
+            return -1;
+    } else {
+        snprintf(journal, sizeof(journal), "%s.journal", cf->path);
+
+        if (WriteJournal(cf, journal) != 0)
+            return -1;
+
+        // From here on a crash is finished by Replay, keep the journal on failure.
+        if (Apply(cf) != 0 || SyncFd(fileno(cf->fd)) != 0)
+            return -1;
+
+        // A journal that came back after a crash would be replayed over
+        // whatever the file holds by then.
+        if (remove(journal) != 0 || SyncDir(journal) != 0) {
+            ERROR("Failed to remove %s\n", journal);
+            return -1;
+        }
+    }
+
+    DropPages(cf, 0);
+    cf->disk_sz = cf->sz;
+    cf->dirty = false;
+    return 0;
+}
+
+// Finishes the commit a killed emulator left behind on <path>, if any. Goes
+// through its own handle, the archive may have opened the file read-only.
+static void Replay(const char* path)
+{
+    char journal[OVERLAY_PATH_MAX + 16];
+    u8 entry[sizeof(u32) + CACHE_PAGE_SIZE];
+    journal_footer footer;
+    u32 sum = JOURNAL_SUM_SEED;
+    FILE *jfd, *fd;
+    long len;
+    u32 i;
+
+    snprintf(journal, sizeof(journal), "%s.journal", path);
+
+    jfd = fopen(journal, "rb");
+    if (jfd == NULL)
+        return;
+
+    if (fseek(jfd, 0, SEEK_END) != 0)
+        goto fail;
+
+    len = ftell(jfd);
+    if (len < (long)sizeof(footer) ||
+        PRead(fileno(jfd), &footer, sizeof(footer), len - sizeof(footer)) != sizeof(footer) ||
+        footer.magic != JOURNAL_MAGIC ||
+        (u64)len != sizeof(footer) + (u64)footer.num_pages * sizeof(entry))
+        goto discard;
+
+    for (i = 0; i < footer.num_pages; i++) {
+        if (PRead(fileno(jfd), entry, sizeof(entry), (u64)i * sizeof(entry)) != sizeof(entry))
+            goto fail;
+        sum = Checksum(sum, entry, sizeof(entry));
+    }
+
+    sum = Checksum(sum, &footer.sz, sizeof(footer.sz));
+    if (Checksum(sum, &footer.keep_sz, sizeof(footer.keep_sz)) != footer.sum)
+        goto discard;
+
+    DEBUG("Finishing the interrupted commit of %s\n", path);
+
+    fd = fopen(path, "r+b");
+    if (fd == NULL)
+        goto fail;
+
+    if (ftruncate(fileno(fd), footer.keep_sz) != 0)
+        goto fail_fd;
+
+    for (i = 0; i < footer.num_pages; i++) {
+        u32 index;
+        u64 off;
+
+        if (PRead(fileno(jfd), entry, sizeof(entry), (u64)i * sizeof(entry)) != sizeof(entry))
+            goto fail_fd;
+
+        memcpy(&index, entry, sizeof(u32));
+        off = (u64)index * CACHE_PAGE_SIZE;
+        if (off >= footer.sz)
+            continue;
+
+        u32 n = footer.sz - off < CACHE_PAGE_SIZE ? (u32)(footer.sz - off) : CACHE_PAGE_SIZE;
+        if (PWrite(fileno(fd), entry + sizeof(u32), n, off) != n)
+            goto fail_fd;
+    }
+
+    if (ftruncate(fileno(fd), footer.sz) != 0 || SyncFd(fileno(fd)) != 0)
+        goto fail_fd;
+    fclose(fd);
+
+discard:
+    // A journal cut short means the crash came before the commit started
+    // on the file, which is still intact.
+    fclose(jfd);
+    remove(journal);
+    SyncDir(journal);
+    return;
+
+fail_fd:
+    fclose(fd);
+fail:
+    ERROR("Replaying %s failed.\n", journal);
+    fclose(jfd);
+}
+
+static void MaybeCommit(cached_file* cf, u32 flush_flags)
+{
+    if ((flush_flags & FLUSH_FLAG) || cf->num_pages >= CACHE_MAX_DIRTY)
+        Commit(cf);
+}
+
+static u32 hostcache_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
+{
+    cached_file* cf = self->type_specific.hostcache.cf;
+    u32 read = 0;
+    *read_out = 0;
+
+    if (off >> 32) {
+        ERROR("64-bit offset not supported.\n");
+        return -1;
+    }
+
+    if (off >= cf->sz)
+        return 0;
+    if (sz > cf->sz - off)
+        sz = (u32)(cf->sz - off);
+
+    while (read < sz) {
+        u64 pos = off + read;
+        u32 index = (u32)(pos / CACHE_PAGE_SIZE);
+        u32 in_page = (u32)(pos % CACHE_PAGE_SIZE);
+        u32 len = CACHE_PAGE_SIZE - in_page;
+        cache_page* page = FindPage(cf, index);
+
+        if (len > sz - read)
+            len = sz - read;
+
+        if (page != NULL) {
+            if (mem_Write(page->data + in_page, ptr + read, len) != 0) {
+                ERROR("mem_Write failed.\n");
+                return -1;
+            }
+            read += len;
+            continue;
+        }
+
+        // Run of uncached pages, straight from the host file.
+        while (read + len < sz && FindPage(cf, index + 1) == NULL) {
+            index++;
+            len = sz - read - len < CACHE_PAGE_SIZE ? sz - read : len + CACHE_PAGE_SIZE;
+        }
+
+        u32 from_disk = 0;
+        if (pos < cf->disk_sz)
+            from_disk = cf->disk_sz - pos < len ? (u32)(cf->disk_sz - pos) : len;
+
+        if (from_disk != 0 && ReadToGuest(fileno(cf->fd), ptr + read, from_disk, pos) != from_disk)
+            return -1;
+
+        // Grown but never written, reads as zeros.
+        while (from_disk < len) {
+            static const u8 zero[0x100];
+            u32 n = len - from_disk < sizeof(zero) ? len - from_disk : sizeof(zero);
+
+            if (mem_Write((u8*)zero, ptr + read + from_disk, n) != 0) {
+                ERROR("mem_Write failed.\n");
+                return -1;
+            }
+            from_disk += n;
+        }
+        read += len;
+    }
+
+    *read_out = read;
+    return 0; // Result
+}
+
+static u32 hostcache_Write(file_type* self, u32 ptr, u32 sz, u64 off, u32 flush_flags, u32* written_out)
+{
+    cached_file* cf = self->type_specific.hostcache.cf;
+    u32 written = 0;
+    *written_out = 0;
+
+    if (!self->type_specific.hostcache.writable) {
+        ERROR("Write to a file opened read-only.\n");
+        return -1;
+    }
+
+    if (off >> 32) {
+        ERROR("64-bit offset not supported.\n");
+        return -1;
+    }
+
+    while (written < sz) {
+        u64 pos = off + written;
+        u32 in_page = (u32)(pos % CACHE_PAGE_SIZE);
+        u32 len = CACHE_PAGE_SIZE - in_page;
+        cache_page* page = GetPage(cf, (u32)(pos / CACHE_PAGE_SIZE));
+
+        if (page == NULL)
+            return -1;
+        if (len > sz - written)
+            len = sz - written;
+
+        if (mem_Read(page->data + in_page, ptr + written, len) != 0) {
+            ERROR("mem_Read failed.\n");
+            return -1;
+        }
+        written += len;
+    }
+
+    if (off + written > cf->sz)
+        cf->sz = off + written;
+
+    if (written != 0)
+        MarkDirty(cf);
+    if (cf->dirty)
+        MaybeCommit(cf, flush_flags);
+
+    *written_out = written;
+    return 0; // Result
+}
+
+static u64 hostcache_GetSize(file_type* self)
+{
+    return self->type_specific.hostcache.cf->sz;
+}
+
+static void Truncate(cached_file* cf, u64 sz)
+{
+    u32 index = (u32)(sz / CACHE_PAGE_SIZE);
+    cache_page* page;
+
+    DropPages(cf, index + 1);
+
+    // Tail of the last page has to read back as zeros if the file grows again.
+    page = FindPage(cf, index);
+    if (page != NULL)
+        memset(page->data + sz % CACHE_PAGE_SIZE, 0, CACHE_PAGE_SIZE - sz % CACHE_PAGE_SIZE);
+
+    if (cf->disk_sz > sz)
+        cf->disk_sz = sz;
+}
+
+static u32 hostcache_SetSize(file_type* self, u64 sz)
+{
+    cached_file* cf = self->type_specific.hostcache.cf;
+
+    if (!self->type_specific.hostcache.writable) {
+        ERROR("SetSize on a file opened read-only.\n");
+        return -1;
+    }
+
+    if (sz < cf->sz)
+        Truncate(cf, sz);
+
+    cf->sz = sz;
+    MarkDirty(cf);
+    return 0;
+}
+
+static u32 hostcache_Close(file_type* self)
+{
+    cached_file* cf = self->type_specific.hostcache.cf;
+
+    if (--cf->refs == 0) {
+        cached_file** link = &cached_files;
+
+        Commit(cf);
+
+        while (*link != cf)
+            link = &(*link)->next;
+        *link = cf->next;
+
+        DropPages(cf, 0);
+        fclose(cf->fd);
+        free(cf->path);
+        free(cf);
+    }
+
+    free(self);
+    return 0;
+}
+
+// Takes over <fd>, freshly opened on <path> by the archive with <mode>.
+int hostfile_OpenCached(file_type* file, const char* path, FILE* fd, const char* mode)
+{
+    bool truncate = mode[0] == 'w';
+    bool writable = truncate || strchr(mode, '+') != NULL;
+    cached_file* cf;
+
+    for (cf = cached_files; cf != NULL; cf = cf->next) {
+        if (!cf->unlinked && strcmp(cf->path, path) == 0)
+            break;
+    }
+
+    if (cf != NULL) {
+        // Already open. Commits need a writable fd, keep the first one that is.
+        if (writable && !cf->writable) {
+            fclose(cf->fd);
+            cf->fd = fd;
+            cf->writable = true;
+        } else {
+            fclose(fd);
+        }
+
+        // If the archive just truncated it, follow.
+        if (truncate) {
+            Truncate(cf, 0);
+            cf->sz = 0;
+            MarkDirty(cf);
+        }
+    } else {
+        char journal[OVERLAY_PATH_MAX + 16];
+        long sz;
+
+        // A truncated file has nothing left an old journal could finish.
+        if (truncate) {
+            snprintf(journal, sizeof(journal), "%s.journal", path);
+            remove(journal);
+        } else {
+            Replay(path);
+        }
+
+        if (fseek(fd, 0, SEEK_END) != 0 || (sz = ftell(fd)) == -1) {
+            ERROR("ftell() failed.\n");
+            return -1;
+        }
+
+        cf = calloc(1, sizeof(cached_file));
+        if (cf == NULL) {
+            ERROR("calloc() failed.\n");
+            return -1;
+        }
+
+        cf->path = malloc(strlen(path) + 1);
+        if (cf->path == NULL) {
+            ERROR("malloc() failed.\n");
+            free(cf);
+            return -1;
+        }
+        strcpy(cf->path, path);
+
+        cf->fd = fd;
+        cf->writable = writable;
+        cf->sz = sz;
+        cf->disk_sz = sz;
+        cf->next = cached_files;
+        cached_files = cf;
+    }
+
+    cf->refs++;
+    file->type_specific.hostcache.cf = cf;
+    file->type_specific.hostcache.writable = writable;
+
+    file->fnRead = &hostcache_Read;
+    file->fnWrite = &hostcache_Write;
+    file->fnGetSize = &hostcache_GetSize;
+    file->fnSetSize = &hostcache_SetSize;
+    file->fnClose = &hostcache_Close;
+    return 0;
+}
+
+// The archive deleted <path>. Handles still open on it keep their data, but
+// a commit must not touch the path again and a new open starts fresh.
+void hostfile_Unlinked(const char* path)
+{
+    cached_file* cf;
+
+    for (cf = cached_files; cf != NULL; cf = cf->next) {
+        if (!cf->unlinked && strcmp(cf->path, path) == 0)
+            cf->unlinked = true;
+    }
+}
+
+// The archive renamed <from> to <to>, open handles follow the file.
+void hostfile_Renamed(const char* from, const char* to)
+{
+    cached_file* cf;
+
+    hostfile_Unlinked(to);
+
+    for (cf = cached_files; cf != NULL; cf = cf->next) {
+        if (cf->unlinked || strcmp(cf->path, from) != 0)
+            continue;
+
+        char* path = malloc(strlen(to) + 1);
+        if (path == NULL) {
+            ERROR("malloc() failed.\n");
+            cf->unlinked = true;
+            continue;
+        }
+
+        strcpy(path, to);
+        free(cf->path);
+        cf->path = path;
+    }
+}
+
+// Files on the host hold host resources, save states drop them.
+bool hostfile_IsHostFile(file_type* file)
+{
+    return file->fnClose == &hostfile_Close || file->fnClose == &hostcache_Close;
+}
+
+int hostfile_CommitAll()
+{
+    cached_file* cf;
+    int rc = 0;
+
+    for (cf = cached_files; cf != NULL; cf = cf->next) {
+        if (Commit(cf) != 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+// Commits what has been dirty for a while, even if the guest never writes
+// to the file again. Called every frame, does its work once a second.
+void hostfile_Tick()
+{
+    static time_t last;
+    time_t now = time(NULL);
+    cached_file* cf;
+
+    if (now == last)
+        return;
+    last = now;
+
+    fsasync_Lock();
+    for (cf = cached_files; cf != NULL; cf = cf->next) {
+        if (cf->dirty && now - cf->dirty_since >= CACHE_COMMIT_SECS)
+            Commit(cf);
+    }
+    fsasync_Unlock();
+}
@@ -0,0 +1,827 @@
+/*
+* Copyright (C) 2014 - plutoo
+* Copyright (C) 2014 - ichfly
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "util.h"
+#include "fs.h"
+
+/* ____ Copy-on-write overlay ____ */
+
+// With -overlay <dir> the sdmc, savedata and extdata directories are only
+// ever read, everything the guest changes goes to a per instance delta
+// directory (a tmpfs mount keeps it in memory). A host path "sdmc/a/b" is
+// shadowed by "<delta>/sdmc/a/b":
+//
+//  - files and directories that exist in the delta win,
+//  - files are copied up on their first open for writing,
+//  - deletes leave a whiteout, a directory recreated over one is opaque,
+//    it hides everything the base has below it.
+//
+// What lives in the delta, the whiteouts and the opaque directories are
+// all kept in an in-memory index, so resolving a path costs no syscalls
+// besides the one stat of the base. Starting up only reads the delta
+// (empty on a fresh instance), the base is never copied. Whiteouts and
+// opaque directories are also written to <delta>/.overlay so a delta can
+// be reused across runs.
+
+#define OVERLAY_HASH      1024
+#define OVERLAY_COPY      0x10000
+
+#ifdef _WIN32
+#define MKDIR(p) _mkdir(p)
+#define RMDIR(p) _rmdir(p)
+#else
+#define MKDIR(p) mkdir(p, 0777)
+#define RMDIR(p) rmdir(p)
+#endif
+
+enum {
+    NODE_NONE,      // Not in the delta, the base shows through.
+    NODE_PRESENT,   // In the delta.
+    NODE_OPAQUE,    // Directory in the delta, base below it is hidden.
+    NODE_WHITEOUT   // Deleted, base is hidden.
+};
+
+typedef struct _overlay_node overlay_node;
+struct _overlay_node {
+    char* key;
+    u32 state;
+    overlay_node* next;
+};
+
+typedef struct {
+    char base[OVERLAY_PATH_MAX];  // Normalized host path.
+    const char* key;              // base, relative, the index key.
+    char delta[OVERLAY_PATH_MAX];
+} overlay_path;
+
+static char* delta_root;
+static overlay_node* nodes[OVERLAY_HASH];
+
+
+static u32 Hash(const char* key)
+{
+    u32 h = 0x811C9DC5;
+
+    while (*key != '\0')
+        h = (h ^ (u8)*key++) * 0x01000193;
+    return h & (OVERLAY_HASH - 1);
+}
+
+static overlay_node* Lookup(const char* key)
+{
+    overlay_node* node;
+
+    for (node = nodes[Hash(key)]; node != NULL; node = node->next)
+        if (strcmp(node->key, key) == 0)
+            return node;
+    return NULL;
+}
+
+static u32 GetState(const char* key)
+{
+    overlay_node* node = Lookup(key);
+    return node != NULL ? node->state : NODE_NONE;
+}
+
+static void SetState(const char* key, u32 state)
+{
+    overlay_node* node = Lookup(key);
+
+    if (node == NULL) {
+        if (state == NODE_NONE)
+            return;
+
+        node = malloc(sizeof(overlay_node));
+        if (node == NULL || (node->key = malloc(strlen(key) + 1)) == NULL) {
+            ERROR("Not enough mem.\n");
+            free(node);
+            return;
+        }
+        strcpy(node->key, key);
+        node->next = nodes[Hash(key)];
+        nodes[Hash(key)] = node;
+    }
+    node->state = state;
+}
+
+// Forgets everything indexed below key, after its directory moved away.
+static void ForgetTree(const char* key)
+{
+    size_t len = strlen(key);
+    overlay_node* node;
+    u32 i;
+
+    for (i = 0; i < OVERLAY_HASH; i++)
+        for (node = nodes[i]; node != NULL; node = node->next)
+            if (strncmp(node->key, key, len) == 0 && node->key[len] == '/')
+                node->state = NODE_NONE;
+}
+
+static bool InDelta(const char* key)
+{
+    u32 state = GetState(key);
+    return state == NODE_PRESENT || state == NODE_OPAQUE;
+}
+
+// Base is hidden by a whiteout of the path itself or of a parent, or by an
+// opaque parent.
+static bool BaseVisible(const char* key)
+{
+    char prefix[OVERLAY_PATH_MAX];
+    size_t i;
+
+    for (i = 0; key[i] != '\0'; i++) {
+        if (key[i] != '/')
+            continue;
+
+        memcpy(prefix, key, i);
+        prefix[i] = '\0';
+
+        u32 state = GetState(prefix);
+        if (state == NODE_WHITEOUT || state == NODE_OPAQUE)
+            return false;
+    }
+
+    u32 state = GetState(key);
+    return state != NODE_WHITEOUT && state != NODE_OPAQUE;
+}
+
+// Collapses "//", drops "./" and trailing slashes. Paths are built as
+// "<archive dir>/<guest path>", so the guest part is often empty.
+static int Resolve(const char* p, overlay_path* out)
+{
+    size_t i = 0;
+
+    while (*p != '\0' && i < sizeof(out->base) - 1) {
+        if (p[0] == '/' && i > 0 && out->base[i - 1] == '/') {
+            p++;
+            continue;
+        }
+        if (p[0] == '.' && p[1] == '/' && (i == 0 || out->base[i - 1] == '/')) {
+            p += 2;
+            continue;
+        }
+        out->base[i++] = *p++;
+    }
+
+    if (*p != '\0') {
+        ERROR("Path too long.\n");
+        return -1;
+    }
+
+    while (i > 1 && out->base[i - 1] == '/')
+        i--;
+    out->base[i] = '\0';
+
+    out->key = out->base;
+    while (*out->key == '/')
+        out->key++;
+
+    if (snprintf(out->delta, sizeof(out->delta), "%s/%s", delta_root, out->key) >=
+            (int)sizeof(out->delta)) {
+        ERROR("Path too long.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int SaveIndex()
+{
+    char path[OVERLAY_PATH_MAX], tmp[OVERLAY_PATH_MAX];
+    overlay_node* node;
+    u32 i;
+
+    snprintf(path, sizeof(path), "%s/.overlay", delta_root);
+    snprintf(tmp, sizeof(tmp), "%s/.overlay.tmp", delta_root);
+
+    FILE* fd = fopen(tmp, "w");
+    if (fd == NULL) {
+        ERROR("Failed to open %s\n", tmp);
+        return -1;
+    }
+
+    for (i = 0; i < OVERLAY_HASH; i++) {
+        for (node = nodes[i]; node != NULL; node = node->next) {
+            if (node->state == NODE_WHITEOUT)
+                fprintf(fd, "W %s\n", node->key);
+            else if (node->state == NODE_OPAQUE)
+                fprintf(fd, "O %s\n", node->key);
+        }
+    }
+    fclose(fd);
+
+#ifdef _WIN32
+    remove(path);
+#endif
+    return rename(tmp, path);
+}
+
+static void LoadIndex()
+{
+    char path[OVERLAY_PATH_MAX], line[OVERLAY_PATH_MAX + 4];
+
+    snprintf(path, sizeof(path), "%s/.overlay", delta_root);
+
+    FILE* fd = fopen(path, "r");
+    if (fd == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        size_t len = strlen(line);
+
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len < 3 || line[1] != ' ')
+            continue;
+
+        if (line[0] == 'W')
+            SetState(line + 2, NODE_WHITEOUT);
+        else if (line[0] == 'O')
+            SetState(line + 2, NODE_OPAQUE);
+    }
+    fclose(fd);
+}
+
+// Registers what an existing delta already has.
+static void ScanDelta(const char* key)
+{
+    char path[OVERLAY_PATH_MAX], child[OVERLAY_PATH_MAX];
+    struct dirent* ent;
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", delta_root, key);
+
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        if (key[0] == '\0' && strncmp(ent->d_name, ".overlay", 8) == 0)
+            continue;
+
+        if (key[0] == '\0')
+            snprintf(child, sizeof(child), "%s", ent->d_name);
+        else
+            snprintf(child, sizeof(child), "%s/%s", key, ent->d_name);
+
+        SetState(child, NODE_PRESENT);
+
+        snprintf(path, sizeof(path), "%s/%s", delta_root, child);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            ScanDelta(child);
+    }
+    closedir(dir);
+}
+
+int overlay_Init(const char* path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0 && MKDIR(path) != 0) {
+        ERROR("Failed to create overlay dir %s\n", path);
+        return -1;
+    }
+
+    delta_root = malloc(strlen(path) + 1);
+    if (delta_root == NULL) {
+        ERROR("Not enough mem.\n");
+        return -1;
+    }
+    strcpy(delta_root, path);
+
+    ScanDelta("");
+    LoadIndex();
+    return 0;
+}
+
+bool overlay_Enabled()
+{
+    return delta_root != NULL;
+}
+
+// Stat of the merged view.
+static int Lstat(overlay_path* op, struct stat* st)
+{
+    if (InDelta(op->key))
+        return stat(op->delta, st);
+
+    if (BaseVisible(op->key))
+        return stat(op->base, st);
+
+    errno = ENOENT;
+    return -1;
+}
+
+// Makes sure the parent directory of op exists in the delta, as long as the
+// merged view has it.
+static int MakeParents(overlay_path* op)
+{
+    overlay_path parent;
+    struct stat st;
+    char* slash;
+
+    strcpy(parent.base, op->base);
+    slash = strrchr(parent.base, '/');
+    if (slash == NULL || slash == parent.base)
+        return 0;
+    *slash = '\0';
+
+    if (Resolve(parent.base, &parent) != 0)
+        return -1;
+
+    if (parent.key[0] == '\0' || InDelta(parent.key))
+        return 0;
+
+    if (Lstat(&parent, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (MakeParents(&parent) != 0)
+        return -1;
+
+    if (MKDIR(parent.delta) != 0 && errno != EEXIST) {
+        ERROR("Failed to create %s\n", parent.delta);
+        return -1;
+    }
+
+    SetState(parent.key, NODE_PRESENT);
+    return 0;
+}
+
+static int CopyFile(const char* from, const char* to)
+{
+    FILE* in = fopen(from, "rb");
+    FILE* out;
+    u8* buf;
+    size_t n;
+    int rc = 0;
+
+    if (in == NULL)
+        return -1;
+
+    out = fopen(to, "wb");
+    buf = malloc(OVERLAY_COPY);
+
+    if (out == NULL || buf == NULL) {
+        ERROR("Failed to copy %s\n", from);
+        if (out != NULL)
+            fclose(out);
+        fclose(in);
+        free(buf);
+        return -1;
+    }
+
+    while ((n = fread(buf, 1, OVERLAY_COPY, in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            rc = -1;
+            break;
+        }
+    }
+
+    if (ferror(in))
+        rc = -1;
+
+    fclose(in);
+    if (fclose(out) != 0)
+        rc = -1;
+    free(buf);
+
+    if (rc != 0) {
+        ERROR("Failed to copy %s\n", from);
+        remove(to);
+    }
+    return rc;
+}
+
+// Gets op into the delta before it is changed.
+static int CopyUp(overlay_path* op, bool keep_contents)
+{
+    struct stat st;
+
+    if (InDelta(op->key))
+        return 0;
+
+    if (MakeParents(op) != 0)
+        return -1;
+
+    if (keep_contents && BaseVisible(op->key) && stat(op->base, &st) == 0 &&
+            S_ISREG(st.st_mode)) {
+        if (CopyFile(op->base, op->delta) != 0)
+            return -1;
+        SetState(op->key, NODE_PRESENT);
+    }
+    return 0;
+}
+
+// A path left the delta, whiteout whatever the base still has there.
+static void Drop(overlay_path* op)
+{
+    struct stat st;
+    u32 old = GetState(op->key);
+    u32 state = NODE_NONE;
+
+    if (BaseVisible(op->key) || old == NODE_OPAQUE) {
+        // An opaque directory hid the base, so a whiteout keeps it hidden.
+        if (old == NODE_OPAQUE || stat(op->base, &st) == 0)
+            state = NODE_WHITEOUT;
+    }
+
+    SetState(op->key, state);
+    if (old == NODE_OPAQUE || old == NODE_WHITEOUT || state == NODE_WHITEOUT)
+        SaveIndex();
+}
+
+// Copies the host path that is about to be opened to host_out, if not NULL.
+// The cache keys save files on it, a cut short one must not be used.
+static int SetHostOut(char* host_out, const char* path)
+{
+    if (host_out != NULL && strlen(path) >= OVERLAY_PATH_MAX) {
+        ERROR("Path too long.\n");
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (host_out != NULL)
+        strcpy(host_out, path);
+    return 0;
+}
+
+// Opens p in the merged view, copying it up first for any write mode. The
+// host path that was opened goes to host_out (OVERLAY_PATH_MAX bytes) if not
+// NULL.
+FILE* overlay_FOpen(const char* p, const char* mode, char* host_out)
+{
+    overlay_path op;
+    FILE* fd;
+
+    if (delta_root == NULL) {
+        if (SetHostOut(host_out, p) != 0)
+            return NULL;
+        return fopen(p, mode);
+    }
+
+    if (Resolve(p, &op) != 0)
+        return NULL;
+
+    if (strpbrk(mode, "wa+") == NULL) {
+        const char* path = InDelta(op.key) ? op.delta : BaseVisible(op.key) ? op.base : NULL;
+
+        if (path == NULL) {
+            errno = ENOENT;
+            return NULL;
+        }
+        if (SetHostOut(host_out, path) != 0)
+            return NULL;
+        return fopen(path, mode);
+    }
+
+    if (SetHostOut(host_out, op.delta) != 0)
+        return NULL;
+
+    // "w" truncates anyway, no point copying the old contents.
+    if (CopyUp(&op, mode[0] != 'w') != 0)
+        return NULL;
+
+    fd = fopen(op.delta, mode);
+    if (fd == NULL)
+        return NULL;
+
+    if (!InDelta(op.key)) {
+        bool was_whiteout = GetState(op.key) == NODE_WHITEOUT;
+
+        SetState(op.key, NODE_PRESENT);
+        if (was_whiteout)
+            SaveIndex();
+    }
+
+    return fd;
+}
+
+// open() for creating files, an O_EXCL create fails on files the base has.
+int overlay_Open(const char* p, int flags, int mode)
+{
+    overlay_path op;
+    struct stat st;
+    int fd;
+
+    if (delta_root == NULL)
+        return open(p, flags, mode);
+
+    if (Resolve(p, &op) != 0)
+        return -1;
+
+    if ((flags & O_EXCL) && Lstat(&op, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (CopyUp(&op, !(flags & O_TRUNC)) != 0)
+        return -1;
+
+    fd = open(op.delta, flags, mode);
+    if (fd != -1 && !InDelta(op.key)) {
+        bool was_whiteout = GetState(op.key) == NODE_WHITEOUT;
+
+        SetState(op.key, NODE_PRESENT);
+        if (was_whiteout)
+            SaveIndex();
+    }
+    return fd;
+}
+
+int overlay_Stat(const char* p, struct stat* st)
+{
+    overlay_path op;
+
+    if (delta_root == NULL)
+        return stat(p, st);
+
+    if (Resolve(p, &op) != 0)
+        return -1;
+    return Lstat(&op, st);
+}
+
+int overlay_Remove(const char* p)
+{
+    overlay_path op;
+    struct stat st;
+
+    if (delta_root == NULL) {
+        if (remove(p) != 0)
+            return -1;
+        hostfile_Unlinked(p);
+        return 0;
+    }
+
+    if (Resolve(p, &op) != 0)
+        return -1;
+
+    if (Lstat(&op, &st) != 0)
+        return -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    if (InDelta(op.key)) {
+        if (remove(op.delta) != 0)
+            return -1;
+        hostfile_Unlinked(op.delta);
+    }
+
+    Drop(&op);
+    return 0;
+}
+
+int overlay_Mkdir(const char* p)
+{
+    overlay_path op;
+    struct stat st;
+
+    if (delta_root == NULL)
+        return MKDIR(p);
+
+    if (Resolve(p, &op) != 0)
+        return -1;
+
+    if (Lstat(&op, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (MakeParents(&op) != 0 || MKDIR(op.delta) != 0)
+        return -1;
+
+    if (GetState(op.key) == NODE_WHITEOUT) {
+        SetState(op.key, NODE_OPAQUE);
+        SaveIndex();
+    } else {
+        SetState(op.key, NODE_PRESENT);
+    }
+    return 0;
+}
+
+static int CountEntry(void* arg, const char* name, struct stat* st)
+{
+    (*(u32*)arg)++;
+    return 1; // One is enough.
+}
+
+int overlay_Rmdir(const char* p)
+{
+    overlay_path op;
+    struct stat st;
+    u32 count = 0;
+
+    if (delta_root == NULL)
+        return RMDIR(p);
+
+    if (Resolve(p, &op) != 0)
+        return -1;
+
+    if (Lstat(&op, &st) != 0)
+        return -1;
+
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    overlay_ListDir(p, CountEntry, &count);
+    if (count != 0) {
+        errno = ENOTEMPTY;
+        return -1;
+    }
+
+    if (InDelta(op.key) && RMDIR(op.delta) != 0)
+        return -1;
+
+    Drop(&op);
+    return 0;
+}
+
+int overlay_Rename(const char* from, const char* to)
+{
+    overlay_path src, dst;
+    struct stat st;
+
+    if (delta_root == NULL) {
+        if (rename(from, to) != 0)
+            return -1;
+        hostfile_Renamed(from, to);
+        return 0;
+    }
+
+    if (Resolve(from, &src) != 0 || Resolve(to, &dst) != 0)
+        return -1;
+
+    if (Lstat(&src, &st) != 0)
+        return -1;
+
+    // Would need the whole tree copied up, guests rename files only anyway.
+    if (S_ISDIR(st.st_mode) && BaseVisible(src.key)) {
+        ERROR("Renaming base directories is not supported in overlay mode: %s\n", from);
+        errno = EXDEV;
+        return -1;
+    }
+
+    if (MakeParents(&dst) != 0)
+        return -1;
+
+    if (InDelta(src.key)) {
+        if (rename(src.delta, dst.delta) != 0)
+            return -1;
+        hostfile_Renamed(src.delta, dst.delta);
+    } else {
+        if (CopyFile(src.base, dst.delta) != 0)
+            return -1;
+        hostfile_Unlinked(dst.delta);
+    }
+
+    bool save = GetState(dst.key) == NODE_WHITEOUT;
+    SetState(dst.key, NODE_PRESENT);
+    if (S_ISDIR(st.st_mode)) {
+        ForgetTree(src.key);
+        ScanDelta(dst.key);
+    }
+
+    Drop(&src);
+    if (save)
+        SaveIndex();
+    return 0;
+}
+
+// Opens whichever side of a directory listings should start from, the
+// listing itself is overlay_ListDir.
+DIR* overlay_OpenDir(const char* p)
+{
+    overlay_path op;
+
+    if (delta_root == NULL)
+        return opendir(p);
+
+    if (Resolve(p, &op) != 0)
+        return NULL;
+
+    if (InDelta(op.key))
+        return opendir(op.delta);
+    if (BaseVisible(op.key))
+        return opendir(op.base);
+    return NULL;
+}
+
+static int CompareName(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Calls fn for each entry of the merged directory, delta entries first. A
+// non-zero return of fn stops the listing.
+int overlay_ListDir(const char* p, overlay_list_fn fn, void* arg)
+{
+    char path[OVERLAY_PATH_MAX + 256], key[OVERLAY_PATH_MAX + 256];
+    overlay_path op;
+    struct dirent* ent;
+    struct stat st;
+    char** seen = NULL;
+    u32 num_seen = 0, max_seen = 0;
+    int rc = 0;
+    DIR* dir;
+
+    if (Resolve(p, &op) != 0)
+        return -1;
+
+    if (InDelta(op.key) && (dir = opendir(op.delta)) != NULL) {
+        while (rc == 0 && (ent = readdir(dir)) != NULL) {
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", op.delta, ent->d_name);
+            if (stat(path, &st) != 0)
+                continue;
+
+            if (num_seen == max_seen) {
+                char** n = realloc(seen, sizeof(char*) * (max_seen ? max_seen * 2 : 0x40));
+                if (n == NULL) {
+                    ERROR("Not enough mem.\n");
+                    rc = -1;
+                    break;
+                }
+                seen = n;
+                max_seen = max_seen ? max_seen * 2 : 0x40;
+            }
+
+            if ((seen[num_seen] = malloc(strlen(ent->d_name) + 1)) == NULL) {
+                ERROR("Not enough mem.\n");
+                rc = -1;
+                break;
+            }
+            strcpy(seen[num_seen++], ent->d_name);
+
+            rc = fn(arg, ent->d_name, &st);
+        }
+        closedir(dir);
+    }
+
+    if (rc == 0 && BaseVisible(op.key) && (dir = opendir(op.base)) != NULL) {
+        qsort(seen, num_seen, sizeof(char*), CompareName);
+
+        while (rc == 0 && (ent = readdir(dir)) != NULL) {
+            const char* name = ent->d_name;
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+            if (num_seen != 0 && bsearch(&name, seen, num_seen, sizeof(char*), CompareName) != NULL)
+                continue;
+
+            snprintf(key, sizeof(key), "%s%s%s", op.key, op.key[0] ? "/" : "", name);
+            if (GetState(key) == NODE_WHITEOUT)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s", op.base, name);
+            if (stat(path, &st) != 0)
+                continue;
+
+            rc = fn(arg, name, &st);
+        }
+        closedir(dir);
+    }
+
+    while (num_seen != 0)
+        free(seen[--num_seen]);
+    free(seen);
+    return rc < 0 ? -1 : 0;
+}
@@ -16,6 +16,9 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
+#include <ctype.h>
+
 #include "util.h"
 #include "mem.h"
 #include "handles.h"
@@ -26,63 +29,237 @@
 
 
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 /* RomFS info: this is given by loader. */
 static FILE* in_fd = NULL;
 static u32   romfs_off;
 static u32   romfs_sz;
 
+/* The RomFS part of the image mapped into host memory, NULL if mapping
+   failed and reads have to go through in_fd. */
+static u8*   romfs_map = NULL;
+static void* map_base;
+static u32   map_len;
+#ifdef _WIN32
+static HANDLE map_handle;
+#endif
+
 extern bool loader_encrypted;
 
-/* ____ Raw RomFS ____ */
+/* ____ Decrypted page cache ____ */
 
-static u32 rawromfs_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
+/* Encrypted titles keep their hot RomFS pages around decrypted, so asset
+   re-reads skip the crypto. Pages are evicted least recently used first. */
+
+#define CACHE_PAGE_SIZE 0x10000
+#define CACHE_NUM_PAGES 256 // 16MiB
+#define CACHE_HASH_SIZE 512
+
+typedef struct {
+    u32 index;     // Page number inside RomFS.
+    s32 prev;      // LRU list, most recent first.
+    s32 next;
+    s32 hash_next;
+    u8* data;
+} cache_page;
+
+static cache_page pages[CACHE_NUM_PAGES];
+static s32        hash_heads[CACHE_HASH_SIZE];
+static s32        lru_head;
+static s32        lru_tail;
+static u32        num_pages;
+
+static void CacheReset()
 {
-    *read_out = 0;
+    u32 i;
 
-    if((off >> 32) || (off >= romfs_sz) || ((off+sz) >= romfs_sz)) {
-        ERROR("Invalid read params.\n");
-        return -1;
+    for (i = 0; i < num_pages; i++)
+        free(pages[i].data);
+    for (i = 0; i < CACHE_HASH_SIZE; i++)
+        hash_heads[i] = -1;
+
+    num_pages = 0;
+    lru_head = lru_tail = -1;
+}
+
+static void LruUnlink(s32 i)
+{
+    if (pages[i].prev >= 0)
+        pages[pages[i].prev].next = pages[i].next;
+    else
+        lru_head = pages[i].next;
+
+    if (pages[i].next >= 0)
+        pages[pages[i].next].prev = pages[i].prev;
+    else
+        lru_tail = pages[i].prev;
+}
+
+static void LruPushFront(s32 i)
+{
+    pages[i].prev = -1;
+    pages[i].next = lru_head;
+    if (lru_head >= 0)
+        pages[lru_head].prev = i;
+    lru_head = i;
+    if (lru_tail < 0)
+        lru_tail = i;
+}
+
+static void HashRemove(s32 i)
+{
+    s32* link = &hash_heads[pages[i].index % CACHE_HASH_SIZE];
+
+    while (*link != i)
+        link = &pages[*link].hash_next;
+    *link = pages[i].hash_next;
+}
+
+static int ReadImage(u8* out, u64 off, u32 sz)
+{
+    if (romfs_map != NULL) {
+        memcpy(out, romfs_map + off, sz);
+        return 0;
     }
 
-    if(fseek64(in_fd, romfs_off + off, SEEK_SET) == -1) {
-        ERROR("fseek failed.\n");
+    if (fseek64(in_fd, romfs_off + off, SEEK_SET) == -1 || fread(out, 1, sz, in_fd) != sz) {
+        ERROR("fread failed\n");
         return -1;
     }
+    return 0;
+}
 
-    u8* b = malloc(sz);
-    if(b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
+static u8* CacheGetPage(u32 index)
+{
+    s32 i;
+
+    for (i = hash_heads[index % CACHE_HASH_SIZE]; i >= 0; i = pages[i].hash_next) {
+        if (pages[i].index == index) {
+            LruUnlink(i);
+            LruPushFront(i);
+            return pages[i].data;
+        }
     }
 
-    u32 read = fread(b, 1, sz, in_fd);
-    if(read != sz) { //eshop dose this
-        ERROR("fread failed\n");
-        free(b);
-        return -1;
+    if (num_pages < CACHE_NUM_PAGES) {
+        i = num_pages;
+        pages[i].data = malloc(CACHE_PAGE_SIZE);
+        if (pages[i].data == NULL) {
+            ERROR("Not enough mem.\n");
+            return NULL;
+        }
+        num_pages++;
+    } else {
+        i = lru_tail;
+        LruUnlink(i);
+        HashRemove(i);
     }
 
+    u64 off = (u64)index * CACHE_PAGE_SIZE;
+    u32 sz = romfs_sz - off < CACHE_PAGE_SIZE ? (u32)(romfs_sz - off) : CACHE_PAGE_SIZE;
     ctr_aes_context ctx;
 
-    if (loader_encrypted) {
-        u8* temp = calloc(sz + (off & 0xF) + (sz & 0xF), sizeof(u8));
-        memcpy(temp + (off & 0xF), b, sz);
+    if (ReadImage(pages[i].data, off, sz) == 0) {
+        // Pages are 16 byte aligned, so the counter lines up with the page.
         ncch_extract_prepare(&ctx, &loader_h, NCCHTYPE_ROMFS, loader_key);
         ctr_add_counter(&ctx, (u32)((0x1000 + off) / 0x10)); //this is from loader
-        ctr_crypt_counter(&ctx, temp, temp, sz);
-        memcpy(b, temp + (off & 0xF), sz);
-        free(temp);
+        ctr_crypt_counter(&ctx, pages[i].data, pages[i].data, sz);
+    } else {
+        // Park the slot under an index nobody asks for, it ages out.
+        index = 0xFFFFFFFF;
     }
 
-    if(mem_Write(b, ptr, read) != 0) {
-        ERROR("mem_Write failed.\n");
-        free(b);
+    pages[i].index = index;
+    pages[i].hash_next = hash_heads[index % CACHE_HASH_SIZE];
+    hash_heads[index % CACHE_HASH_SIZE] = i;
+    LruPushFront(i);
+
+    return index != 0xFFFFFFFF ? pages[i].data : NULL;
+}
+
+
+/* ____ Reading ____ */
+
+// Copies RomFS bytes into host memory, through the page cache if encrypted.
+static int ReadToHost(u8* out, u32 sz, u64 off)
+{
+    u32 done = 0;
+
+    if (!loader_encrypted)
+        return ReadImage(out, off, sz);
+
+    while(done < sz) {
+        u64 pos = off + done;
+        u32 in_page = pos % CACHE_PAGE_SIZE;
+        u32 len = CACHE_PAGE_SIZE - in_page;
+        u8* page = CacheGetPage((u32)(pos / CACHE_PAGE_SIZE));
+
+        if(page == NULL)
+            return -1;
+
+        if(len > sz - done)
+            len = sz - done;
+
+        memcpy(out + done, page + in_page, len);
+        done += len;
+    }
+    return 0;
+}
+
+// Copies RomFS bytes straight into guest memory, split only where the
+// destination crosses a guest mapping.
+static int ReadToGuest(u32 ptr, u32 sz, u64 off)
+{
+    u32 done = 0;
+
+    if(!loader_encrypted && romfs_map == NULL && fseek64(in_fd, romfs_off + off, SEEK_SET) == -1) {
+        ERROR("fseek failed.\n");
         return -1;
     }
 
-    *read_out = read;
-    free(b);
+    while(done < sz) {
+        u32 span;
+        u8* dst = mem_rawspan(ptr + done, sz - done, &span);
+
+        if(dst == NULL) {
+            ERROR("mem_Write failed.\n");
+            return -1;
+        }
 
+        if(loader_encrypted) {
+            if(ReadToHost(dst, span, off + done) != 0)
+                return -1;
+        } else if(romfs_map != NULL) {
+            memcpy(dst, romfs_map + off + done, span);
+        } else if(fread(dst, 1, span, in_fd) != span) { //eshop dose this
+            ERROR("fread failed\n");
+            return -1;
+        }
+
+        done += span;
+    }
+    return 0;
+}
+
+
+/* ____ Raw RomFS ____ */
+
+static u32 rawromfs_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
+{
+    *read_out = 0;
+
+    if((off >> 32) || (off >= romfs_sz) || ((off+sz) > romfs_sz)) {
+        ERROR("Invalid read params.\n");
+        return -1;
+    }
+
+    if(ReadToGuest(ptr, sz, off) != 0)
+        return -1;
+
+    *read_out = sz;
     return 0; // Result
 }
 
@@ -99,12 +276,388 @@ static file_type rawromfs_file = {
 };
 
 
+/* ____ Path index ____ */
+
+/* The level 3 metadata is walked once in romfs_Setup. Every directory and
+   file gets its full UTF-16 path put into a hash table, so opening a path
+   is a single lookup instead of a walk down the tree. */
+
+#define ROMFS_NONE 0xFFFFFFFF
+
+typedef struct {
+    u32 header_len;
+    u32 dir_hash_off;
+    u32 dir_hash_len;
+    u32 dir_meta_off;
+    u32 dir_meta_len;
+    u32 file_hash_off;
+    u32 file_hash_len;
+    u32 file_meta_off;
+    u32 file_meta_len;
+    u32 file_data_off;
+} romfs_header;
+
+typedef struct {
+    u16* path;     // Full path, '/' separated, no terminator.
+    u32  path_len; // In characters.
+    bool is_dir;
+    u32  meta;     // Offset into the dir or file metadata.
+} romfs_node;
+
+static romfs_header hdr;
+static u8*          dir_meta;
+static u8*          file_meta;
+
+static romfs_node*  nodes;
+static u32          num_nodes;
+static u32          max_nodes;
+static u32*         node_table; // Index+1 into nodes, 0 is empty.
+static u32          node_mask;
+
+static u32 Get32(const u8* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+static u64 Get64(const u8* p)
+{
+    return Get32(p) | (u64)Get32(p + 4) << 32;
+}
+
+// Dir entry: parent, sibling, first child, first file, hash next, name len, name.
+#define DIR_SIBLING(o)    Get32(dir_meta + (o) + 4)
+#define DIR_CHILD(o)      Get32(dir_meta + (o) + 8)
+#define DIR_FILE(o)       Get32(dir_meta + (o) + 12)
+#define DIR_NAME_LEN(o)   Get32(dir_meta + (o) + 20)
+#define DIR_NAME(o)       (dir_meta + (o) + 24)
+
+// File entry: parent, sibling, data off, data size, hash next, name len, name.
+#define FILE_SIBLING(o)   Get32(file_meta + (o) + 4)
+#define FILE_DATA_OFF(o)  Get64(file_meta + (o) + 8)
+#define FILE_DATA_SIZE(o) Get64(file_meta + (o) + 16)
+#define FILE_NAME_LEN(o)  Get32(file_meta + (o) + 28)
+#define FILE_NAME(o)      (file_meta + (o) + 32)
+
+static u32 HashPath(const u16* path, u32 len)
+{
+    u32 h = 2166136261u;
+    u32 i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ path[i]) * 16777619u;
+    return h;
+}
+
+static romfs_node* FindNode(const u16* path, u32 len)
+{
+    u32 slot;
+
+    if (node_table == NULL)
+        return NULL;
+
+    for (slot = HashPath(path, len) & node_mask; node_table[slot] != 0; slot = (slot + 1) & node_mask) {
+        romfs_node* n = &nodes[node_table[slot] - 1];
+        if (n->path_len == len && memcmp(n->path, path, len * 2) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+static void FreeIndex()
+{
+    u32 i;
+
+    for (i = 0; i < num_nodes; i++)
+        free(nodes[i].path);
+
+    free(nodes);
+    free(node_table);
+    free(dir_meta);
+    free(file_meta);
+
+    nodes = NULL;
+    node_table = NULL;
+    dir_meta = file_meta = NULL;
+    num_nodes = max_nodes = 0;
+}
+
+// Appends "/name" to the parent path. Names are stored as UTF-16 already.
+static int AddNode(const romfs_node* parent, const u8* name, u32 name_len, bool is_dir, u32 meta)
+{
+    romfs_node* n;
+    u32 i, len = name_len / 2;
+
+    if (num_nodes == max_nodes) {
+        u32 max = max_nodes ? max_nodes * 2 : 0x100;
+        romfs_node* tmp = realloc(nodes, max * sizeof(romfs_node));
+        if (tmp == NULL)
+            return -1;
+        nodes = tmp;
+        max_nodes = max;
+    }
+
+    n = &nodes[num_nodes];
+    n->path_len = parent ? parent->path_len + 1 + len : 0;
+    n->path = malloc((n->path_len + 1) * 2);
+    if (n->path == NULL)
+        return -1;
+
+    if (parent) {
+        memcpy(n->path, parent->path, parent->path_len * 2);
+        n->path[parent->path_len] = '/';
+        for (i = 0; i < len; i++)
+            n->path[parent->path_len + 1 + i] = name[2 * i] | name[2 * i + 1] << 8;
+    }
+
+    n->is_dir = is_dir;
+    n->meta = meta;
+    num_nodes++;
+    return 0;
+}
+
+static int LoadMeta(u8** out, u32 off, u32 len)
+{
+    *out = malloc(len + 4);
+    if (*out == NULL)
+        return -1;
+    return ReadToHost(*out, len, off);
+}
+
+static bool ValidDir(u32 o)
+{
+    return o != ROMFS_NONE && o + 24 <= hdr.dir_meta_len && o + 24 + DIR_NAME_LEN(o) <= hdr.dir_meta_len;
+}
+
+static bool ValidFile(u32 o)
+{
+    return o != ROMFS_NONE && o + 32 <= hdr.file_meta_len && o + 32 + FILE_NAME_LEN(o) <= hdr.file_meta_len;
+}
+
+static void BuildIndex()
+{
+    u8 raw[sizeof(romfs_header)];
+    u32 i, size;
+
+    FreeIndex();
+
+    if (romfs_sz < sizeof(raw) || ReadToHost(raw, sizeof(raw), 0) != 0)
+        return;
+
+    for (i = 0; i < sizeof(raw) / 4; i++)
+        ((u32*)&hdr)[i] = Get32(raw + i * 4);
+
+    if (hdr.header_len != sizeof(romfs_header) ||
+            (u64)hdr.dir_meta_off + hdr.dir_meta_len > romfs_sz ||
+            (u64)hdr.file_meta_off + hdr.file_meta_len > romfs_sz) {
+        ERROR("No level 3 RomFS header, only raw reads will work.\n");
+        return;
+    }
+
+    if (LoadMeta(&dir_meta, hdr.dir_meta_off, hdr.dir_meta_len) != 0 ||
+            LoadMeta(&file_meta, hdr.file_meta_off, hdr.file_meta_len) != 0 ||
+            !ValidDir(0) || AddNode(NULL, NULL, 0, true, 0) != 0) {
+        ERROR("Failed to load RomFS metadata.\n");
+        FreeIndex();
+        return;
+    }
+
+    // Nodes are appended while we walk them, breadth first.
+    for (i = 0; i < num_nodes; i++) {
+        u32 o;
+
+        if (!nodes[i].is_dir)
+            continue;
+
+        for (o = DIR_CHILD(nodes[i].meta); ValidDir(o) && num_nodes < 0x100000; o = DIR_SIBLING(o)) {
+            if (AddNode(&nodes[i], DIR_NAME(o), DIR_NAME_LEN(o), true, o) != 0)
+                goto fail;
+        }
+        for (o = DIR_FILE(nodes[i].meta); ValidFile(o) && num_nodes < 0x100000; o = FILE_SIBLING(o)) {
+            if (AddNode(&nodes[i], FILE_NAME(o), FILE_NAME_LEN(o), false, o) != 0)
+                goto fail;
+        }
+    }
+
+    for (size = 16; size < num_nodes * 2; size <<= 1);
+
+    node_table = calloc(size, sizeof(u32));
+    if (node_table == NULL)
+        goto fail;
+    node_mask = size - 1;
+
+    for (i = 0; i < num_nodes; i++) {
+        u32 slot = HashPath(nodes[i].path, nodes[i].path_len) & node_mask;
+        while (node_table[slot] != 0)
+            slot = (slot + 1) & node_mask;
+        node_table[slot] = i + 1;
+    }
+
+    DEBUG("RomFS index: %u entries\n", num_nodes);
+    return;
+
+fail:
+    ERROR("Out of memory building RomFS index.\n");
+    FreeIndex();
+}
+
+// Reads a guest path into UTF-16, dropping a trailing '/'. The root is the
+// empty path.
+static bool GetPath(file_path path, u16* out, u32* len_out)
+{
+    u32 i, len;
+
+    if (path.type == PATH_WCHAR) {
+        len = path.size / 2;
+        if (len > 0x200)
+            return false;
+        for (i = 0; i < len; i++) {
+            out[i] = mem_Read16(path.ptr + i * 2);
+            if (out[i] == 0)
+                break;
+        }
+        len = i;
+    } else if (path.type == PATH_CHAR) {
+        len = path.size;
+        if (len > 0x200)
+            return false;
+        for (i = 0; i < len; i++) {
+            out[i] = mem_Read8(path.ptr + i);
+            if (out[i] == 0)
+                break;
+        }
+        len = i;
+    } else if (path.type == PATH_EMPTY) {
+        len = 0;
+    } else {
+        return false;
+    }
+
+    while (len > 0 && out[len - 1] == '/')
+        len--;
+
+    *len_out = len;
+    return true;
+}
+
+static romfs_node* LookupPath(file_path path)
+{
+    u16 p[0x200];
+    u32 len;
+
+    if (!GetPath(path, p, &len))
+        return NULL;
+    return FindNode(p, len);
+}
+
+
+/* ____ RomFS files ____ */
+
+static u32 romfsfile_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
+{
+    u64 file_sz = self->type_specific.romfs.sz;
+
+    *read_out = 0;
+
+    if (off >= file_sz)
+        return 0;
+    if (sz > file_sz - off)
+        sz = (u32)(file_sz - off);
+
+    if (ReadToGuest(ptr, sz, self->type_specific.romfs.off + off) != 0)
+        return -1;
+
+    *read_out = sz;
+    return 0;
+}
+
+static u64 romfsfile_GetSize(file_type* self)
+{
+    return self->type_specific.romfs.sz;
+}
+
+static u32 romfsfile_Close(file_type* self)
+{
+    free(self);
+    return 0;
+}
+
+
+/* ____ RomFS directories ____ */
+
+// Fills in FS_DirectoryEntry structs of 0x228 bytes each.
+static u32 romfs_ReadDir(dir_type* self, u32 ptr, u32 entrycount, u32* read_out)
+{
+    u8 ent[0x228];
+    u32 count = 0;
+
+    while (count < entrycount) {
+        u32 o, name_len, i, dot = 0;
+        const u8* name;
+        bool is_dir;
+
+        if (ValidDir(self->type_specific.romfs.next_dir)) {
+            o = self->type_specific.romfs.next_dir;
+            self->type_specific.romfs.next_dir = DIR_SIBLING(o);
+            name = DIR_NAME(o);
+            name_len = DIR_NAME_LEN(o) / 2;
+            is_dir = true;
+        } else if (ValidFile(self->type_specific.romfs.next_file)) {
+            o = self->type_specific.romfs.next_file;
+            self->type_specific.romfs.next_file = FILE_SIBLING(o);
+            name = FILE_NAME(o);
+            name_len = FILE_NAME_LEN(o) / 2;
+            is_dir = false;
+        } else {
+            break;
+        }
+
+        memset(ent, 0, sizeof(ent));
+
+        if (name_len > 0x105)
+            name_len = 0x105;
+        memcpy(ent, name, name_len * 2);
+
+        // 8.3 short name, upper case.
+        for (i = 0; i < name_len; i++) {
+            if (name[2 * i] == '.' && name[2 * i + 1] == 0)
+                dot = i;
+        }
+        if (dot == 0 || is_dir)
+            dot = name_len;
+        for (i = 0; i < dot && i < 8; i++)
+            ent[0x20C + i] = toupper(name[2 * i + 1] ? '_' : name[2 * i]);
+        memset(ent + 0x216, ' ', 3);
+        for (i = 0; dot + 1 + i < name_len && i < 3; i++)
+            ent[0x216 + i] = toupper(name[2 * (dot + 1 + i) + 1] ? '_' : name[2 * (dot + 1 + i)]);
+
+        ent[0x21A] = 1;           // Valid
+        ent[0x21C] = is_dir;      // Directory
+        ent[0x21F] = 1;           // Read-only
+
+        if (!is_dir) {
+            u64 sz = FILE_DATA_SIZE(o);
+            for (i = 0; i < 8; i++)
+                ent[0x220 + i] = (u8)(sz >> (8 * i));
+        }
+
+        if (mem_Write(ent, ptr + count * sizeof(ent), sizeof(ent)) != 0) {
+            ERROR("mem_Write failed.\n");
+            return -1;
+        }
+        count++;
+    }
+
+    *read_out = count;
+    return 0;
+}
+
+
 /* ____ RomFS ____ */
 
 bool romfs_FileExists(archive* self, file_path path)
 {
-    DEBUG("romfs_FileExists\n");
-    return false;
+    romfs_node* n = LookupPath(path);
+    return n != NULL && !n->is_dir;
 }
 
 u32 romfs_OpenFile(archive* self, file_path path, u32 flags, u32 attr)
@@ -117,14 +670,68 @@ u32 romfs_OpenFile(archive* self, file_path path, u32 flags, u32 attr)
         return rawromfs_file.handle;
     }
 
-    // XXX: Return actual file handle here
-    return 0;
+    if (flags & (OPEN_WRITE | OPEN_CREATE)) {
+        ERROR("RomFS is read-only.\n");
+        return 0;
+    }
+
+    romfs_node* n = LookupPath(path);
+    if (n == NULL || n->is_dir) {
+        ERROR("File not found in RomFS.\n");
+        return 0;
+    }
+
+    file_type* file = calloc(sizeof(file_type), 1);
+    if (file == NULL) {
+        ERROR("calloc() failed.\n");
+        return 0;
+    }
+
+    file->type_specific.romfs.off = hdr.file_data_off + FILE_DATA_OFF(n->meta);
+    file->type_specific.romfs.sz  = FILE_DATA_SIZE(n->meta);
+
+    if (file->type_specific.romfs.off + file->type_specific.romfs.sz > romfs_sz) {
+        ERROR("RomFS file out of bounds.\n");
+        free(file);
+        return 0;
+    }
+
+    file->fnRead = &romfsfile_Read;
+    file->fnGetSize = &romfsfile_GetSize;
+    file->fnClose = &romfsfile_Close;
+
+    file->handle = handle_New(HANDLE_TYPE_FILE, (uintptr_t)file);
+    return file->handle;
+}
+
+static u32 romfs_OpenDir(archive* self, file_path path)
+{
+    romfs_node* n = LookupPath(path);
+
+    if (n == NULL || !n->is_dir) {
+        ERROR("Dir not found in RomFS.\n");
+        return 0;
+    }
+
+    dir_type* dir = calloc(sizeof(dir_type), 1);
+    if (dir == NULL) {
+        ERROR("calloc() failed.\n");
+        return 0;
+    }
+
+    dir->f_path = path;
+    dir->self = self;
+    dir->fnRead = &romfs_ReadDir;
+    dir->type_specific.romfs.next_dir = DIR_CHILD(n->meta);
+    dir->type_specific.romfs.next_file = DIR_FILE(n->meta);
+
+    return handle_New(HANDLE_TYPE_DIR, (uintptr_t)dir);
 }
 
 
 static archive romfs = {
     .fnCreateDir    = NULL,
-    .fnOpenDir      = NULL,
+    .fnOpenDir      = &romfs_OpenDir,
     .fnFileExists   = &romfs_FileExists,
     .fnOpenFile     = &romfs_OpenFile,
     .fnCreateFile   = NULL,
@@ -152,10 +759,62 @@ archive* romfs_OpenArchive(file_path path)
     return &romfs;
 }
 
+static void UnmapImage()
+{
+    if(romfs_map == NULL)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(map_base);
+    CloseHandle(map_handle);
+#else
+    munmap(map_base, map_len);
+#endif
+    romfs_map = NULL;
+}
+
+// Maps the RomFS range of the image read-only. On failure reads fall back
+// to fread.
+static void MapImage(FILE* fd, u32 off, u32 sz)
+{
+    // 64KiB covers both the page size and the Windows allocation granularity.
+    u32 map_off = off & ~0xFFFF;
+
+    map_len = sz + (off - map_off);
+
+#ifdef _WIN32
+    map_handle = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(fd)), NULL, PAGE_READONLY, 0, 0, NULL);
+    if(map_handle == NULL) {
+        ERROR("CreateFileMapping failed, falling back to fread.\n");
+        return;
+    }
+
+    map_base = MapViewOfFile(map_handle, FILE_MAP_READ, 0, map_off, map_len);
+    if(map_base == NULL) {
+        ERROR("MapViewOfFile failed, falling back to fread.\n");
+        CloseHandle(map_handle);
+        return;
+    }
+#else
+    map_base = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fileno(fd), map_off);
+    if(map_base == MAP_FAILED) {
+        ERROR("mmap failed, falling back to fread.\n");
+        return;
+    }
+#endif
+
+    romfs_map = (u8*)map_base + (off - map_off);
+}
+
 void romfs_Setup(FILE* fd, u32 off, u32 sz)
 {
     // This function is called by loader if loaded file contains RomFS.
     in_fd = fd;
     romfs_off = off;
     romfs_sz  = sz;
+
+    UnmapImage();
+    MapImage(fd, off, sz);
+    CacheReset();
+    BuildIndex();
 }
@@ -30,201 +30,23 @@
 
 /* ____ Save Data implementation ____ */
 
-static u32 savedatafile_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
-{
-    FILE* fd = self->type_specific.sysdata.fd;
-    *read_out = 0;
-
-    if(off >> 32) {
-        ERROR("64-bit offset not supported.\n");
-        return -1;
-    }
-
-    if(fseek64(fd, off, SEEK_SET) == -1) {
-        ERROR("fseek failed.\n");
-        return -1;
-    }
-
-    u8* b = malloc(sz);
-    if(b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
-    }
-
-    u32 read = fread(b, 1, sz, fd);
-    if(read != sz) {
-        ERROR("fread failed\n");
-        free(b);
-        return -1;
-    }
-
-    if(mem_Write(b, ptr, read) != 0) {
-        ERROR("mem_Write failed.\n");
-        free(b);
-        return -1;
-    }
-
-    *read_out = read;
-    free(b);
-
-    return 0; // Result
-}
-
-static u32 savedatafile_Write(file_type* self, u32 ptr, u32 sz, u64 off, u32 flush_flags, u32* written_out)
-{
-    FILE* fd = self->type_specific.sysdata.fd;
-    *written_out = 0;
-
-    if (off >> 32) {
-        ERROR("64-bit offset not supported.\n");
-        return -1;
-    }
-
-    if (fseek64(fd, off, SEEK_SET) == -1) {
-        ERROR("fseek failed.\n");
-        return -1;
-    }
-
-    u8* b = malloc(sz);
-    if (b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
-    }
-
-    if (mem_Read(b, ptr, sz) != 0) {
-        ERROR("mem_Read failed.\n");
-        free(b);
-        return -1;
-    }
-
-    u32 written = fwrite(b, 1, sz, fd);
-    if (written != sz) {
-        ERROR("fwrite failed\n");
-        free(b);
-        return -1;
-    }
-
-	self->type_specific.sysdata.sz = ftell64(fd);
-
-    *written_out = written;
-    free(b);
-	fflush(fd);
-
-    return 0; // Result
-}
-
-static u64 savedatafile_GetSize(file_type* self)
-{
-    return self->type_specific.sysdata.sz;
-}
-
-static u32 savedatafile_SetSize(file_type* self, u64 sz)
-{
-    FILE* fd = self->type_specific.sysdata.fd;
-
-    self->type_specific.sysdata.sz = sz;
-    if(ftruncate(fileno(fd), sz) == -1) {
-        ERROR("ftruncate failed.\n");
-        return -1;
-    }
-
-    return 0;
-}
-
-static u32 savedatafile_Close(file_type* self)
-{
-    // Close file and free yourself
-    fclose(self->type_specific.sysdata.fd);
-    free(self);
-
-    return 0;
-}
-
-u32 savedata_ReadDir(dir_type* self, u32 ptr, u32 entrycount, u32* read_out)
-{
-    u32 current = 0;
-    struct dirent* ent;
-
-    rewinddir(self->dir);
-
-    while (current < entrycount) {
-        errno = 0;
-        if ((ent = readdir(self->dir)) == NULL) {
-            if (errno == 0) {
-                // Dir empty. Memset region?
-                return 0;
-            } else {
-                ERROR("readdir() failed.\n");
-                return -1;
-            }
-        }
-    }
-
-    // Convert file-name to UTF16 and copy.
-    u16 utf16[256];
-    for (u32 i = 0; i<256; i++)
-        utf16[i] = ent->d_name[i];
-
-    mem_Write((uint8_t*)utf16, ptr, sizeof(utf16));
-
-    // XXX: 8.3 name @ 0x20C
-    mem_Write8(ptr + 0x215, 0xA); //unknown
-    // XXX: 8.3 ext @ 0x216
-
-    mem_Write8(ptr + 0x21A, 0x1); // Unknown
-    mem_Write8(ptr + 0x21B, 0x0); // Unknown
-
-    struct stat st;
-
-    char path[256];
-    snprintf(path, sizeof(path), "%s/%s", self->path, ent->d_name);
-    if (stat(path,&st) != 0 ) {
-        ERROR("Failed to stat: %s\n", path);
-        return -1;
-    }
-    // Is directory flag
-    if (S_ISDIR(st.st_mode)) {
-        mem_Write8(ptr + 0x21C, 0x1);
-
-        mem_Write8(ptr + 0x216, ' '); // 8.3 file extension
-        mem_Write8(ptr + 0x217, ' ');
-        mem_Write8(ptr + 0x218, ' ');
-    }
-    else { // Is directory flag
-
-    // XXX: hidden flag @ 0x21D
-    // XXX: archive flag @ 0x21E
-    // XXX: readonly flag @ 0x21F
-
-        mem_Write8(ptr + 0x21C, 0x0);
-        mem_Write32(ptr + 0x220, st.st_size);
-
-#if defined(ENV64BIT)
-        mem_Write32(ptr + 0x224, (st.st_size >> 32));
-#else
-        mem_Write32(ptr + 0x224, 0);
-#endif
-    }
-
-    *read_out = current;
-    return 0;
-}
 static u32 savedata_OpenDir(archive* self, file_path path)
 {
     // Create file object
-    dir_type* dir = (dir_type*)malloc(sizeof(dir_type));
+    dir_type* dir = calloc(sizeof(dir_type), 1);
 
     dir->f_path = path;
     dir->self = self;
 
     // Setup function pointers.
-    dir->fnRead = &savedata_ReadDir;
+    dir->fnRead = &hostdir_Read;
+    dir->fnClose = &hostdir_Close;
 
     char tmp[256];
     snprintf(dir->path, 256, "savedata/%s/%s",
              loader_h.productcode, fs_PathToString(path.type, path.ptr, path.size, tmp, 256));
 
-    dir->dir = opendir(dir->path);
+    dir->dir = overlay_OpenDir((const char*)dir->path);
 
     if (dir->dir == NULL) {
         ERROR("Dir not found: %s.\n", dir->path);
@@ -252,7 +74,7 @@ static bool savedata_FileExists(archive* self, file_path path)
         return false;
     }
 
-    return stat(p, &st) == 0;
+    return overlay_Stat(p, &st) == 0;
 }
 
 static u32 savedata_CreateFile(archive* self, file_path path, u32 size)
@@ -273,7 +95,7 @@ static u32 savedata_CreateFile(archive* self, file_path path, u32 size)
 
     int result;
 
-    int fd = open(p, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
+    int fd = overlay_Open(p, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR);
 
     if(fd == -1)
     {
@@ -293,7 +115,7 @@ static u32 savedata_CreateFile(archive* self, file_path path, u32 size)
 
 static u32 savedata_OpenFile(archive* self, file_path path, u32 flags, u32 attr)
 {
-    char p[256], tmp[256];
+    char p[256], tmp[256], host[OVERLAY_PATH_MAX];
 
     // Generate path on host file system
     snprintf(p, 256, "savedata/%s/%s",
@@ -324,22 +146,13 @@ static u32 savedata_OpenFile(archive* self, file_path path, u32 flags, u32 attr)
 		break;
     }
 
-    FILE* fd = fopen(p, mode);
+    FILE* fd = overlay_FOpen(p, mode, host);
 
     if(fd == NULL) {
         ERROR("Failed to open SaveData, path=%s\n", p);
         return 0;
     }
 
-    fseek(fd, 0, SEEK_END);
-    u32 sz;
-
-    if((sz=ftell(fd)) == -1) {
-        ERROR("ftell() failed.\n");
-        fclose(fd);
-        return 0;
-    }
-
     // Create file object
     file_type* file = calloc(sizeof(file_type), 1);
 
@@ -349,15 +162,12 @@ static u32 savedata_OpenFile(archive* self, file_path path, u32 flags, u32 attr)
         return 0;
     }
 
-    file->type_specific.sysdata.fd = fd;
-    file->type_specific.sysdata.sz = (u64) sz;
-
-    // Setup function pointers.
-    file->fnRead = &savedatafile_Read;
-    file->fnWrite = &savedatafile_Write;
-    file->fnGetSize = &savedatafile_GetSize;
-    file->fnSetSize = &savedatafile_SetSize;
-    file->fnClose = &savedatafile_Close;
+    // Setup function pointers, writes go through the save cache.
+    if (hostfile_OpenCached(file, host, fd, mode) != 0) {
+        fclose(fd);
+        free(file);
+        return 0;
+    }
 
     file->handle = handle_New(HANDLE_TYPE_FILE, (uintptr_t)file);
     return file->handle;
@@ -376,11 +186,22 @@ int savedata_CreateDir(archive* self, file_path path)
         ERROR("Got unsafe path.\n");
         return 0;
     }
-#ifdef _WIN32
-    return _mkdir(p);
-#else
-    return mkdir(p, 0777);
-#endif
+    return overlay_Mkdir(p);
+}
+
+static int savedata_DeleteFile(archive* self, file_path path)
+{
+    char p[256], tmp[256];
+
+    // Generate path on host file system
+    snprintf(p, 256, "savedata/%s/%s",
+             loader_h.productcode, fs_PathToString(path.type, path.ptr, path.size, tmp, 256));
+
+    if (!fs_IsSafePath(p)) {
+        ERROR("Got unsafe path.\n");
+        return 0;
+    }
+    return overlay_Remove(p);
 }
 
 int savedata_DeleteDir(archive* self, file_path path)
@@ -395,11 +216,7 @@ int savedata_DeleteDir(archive* self, file_path path)
 		ERROR("Got unsafe path.\n");
 		return 0;
 	}
-#ifdef _MSC_VER 
-	return _rmdir(p);
-#else
-	return rmdir(p);
-#endif
+	return overlay_Rmdir(p);
 }
 
 static void savedata_Deinitialize(archive* self)
@@ -421,7 +238,7 @@ static u32 savedata_GetResult()
         return false;
     }
 
-    if(stat(p, &st) == 0)
+    if(overlay_Stat(p, &st) == 0)
         return 0;
     else
         return 0xc8a04554; //Not formatted?
@@ -443,8 +260,8 @@ archive* savedata_OpenArchive(file_path path)
     arch->fnCreateFile = &savedata_CreateFile;
     arch->fnOpenFile = &savedata_OpenFile;
     arch->fnCreateFile = &savedata_CreateFile;
-    arch->fnDeleteFile = &savedata_DeleteDir;
-	arch->fnDeleteDir = NULL;
+    arch->fnDeleteFile = &savedata_DeleteFile;
+	arch->fnDeleteDir = &savedata_DeleteDir;
 	arch->fnRenameFile = NULL;
 	arch->fnRenameDir = NULL;
     arch->fnDeinitialize = &savedata_Deinitialize;
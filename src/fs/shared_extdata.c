@@ -28,91 +28,6 @@
 
 /* ____ File implementation ____ */
 
-static u32 sharedextdfile_Write(file_type* self, u32 ptr, u32 sz, u64 off, u32 flush_flags, u32* written_out)
-{
-    FILE* fd = self->type_specific.sysdata.fd;
-    *written_out = 0;
-
-    if (off >> 32) {
-        ERROR("64-bit offset not supported.\n");
-        return -1;
-    }
-
-    if (fseek64(fd, off, SEEK_SET) == -1) {
-        ERROR("fseek failed.\n");
-        return -1;
-    }
-
-    u8* b = malloc(sz);
-    if (b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
-    }
-
-    if (mem_Read(b, ptr, sz) != 0) {
-        ERROR("mem_Write failed.\n");
-        free(b);
-        return -1;
-    }
-
-    u32 write = fwrite(b, 1, sz, fd);
-    if(write != sz) {
-        ERROR("fwrite failed\n");
-        free(b);
-        return -1;
-    }
-
-    *written_out = write;
-    free(b);
-
-    return 0; // Result
-}
-
-static u32 sharedextdfile_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
-{
-    FILE* fd = self->type_specific.sharedextd.fd;
-    *read_out = 0;
-
-    if(off >> 32) {
-        ERROR("64-bit offset not supported.\n");
-        return -1;
-    }
-
-    if(fseek64(fd, off, SEEK_SET) == -1) {
-        ERROR("fseek failed.\n");
-        return -1;
-    }
-
-    u8* b = malloc(sz);
-    if(b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
-    }
-
-    u32 read = fread(b, 1, sz, fd);
-    if(read != sz) {
-        ERROR("fread failed\n");
-        free(b);
-        return -1;
-    }
-
-    if(mem_Write(b, ptr, read) != 0) {
-        ERROR("mem_Write failed.\n");
-        free(b);
-        return -1;
-    }
-
-    *read_out = read;
-    free(b);
-
-    return 0; // Result
-}
-
-static u64 sharedextdfile_GetSize(file_type* self)
-{
-    return self->type_specific.sharedextd.sz;
-}
-
 static u32 sharedextdfile_CreateFile(archive* self, file_path path, u32 size)
 {
     char *p = malloc(256);
@@ -151,14 +66,6 @@ static u32 sharedextdfile_CreateFile(archive* self, file_path path, u32 size)
     return result;
 }
 
-static u32 sharedextdfile_Close(file_type* self)
-{
-    // Close file and free yourself
-    fclose(self->type_specific.sharedextd.fd);
-    free(self);
-
-    return 0;
-}
 
 
 
@@ -211,31 +118,24 @@ static u32 sharedextd_OpenFile(archive* self, file_path path, u32 flags, u32 att
     }
     fclose(fd);
 
+    const char* mode = "rb";
+
     switch (flags& (OPEN_READ | OPEN_WRITE)) {
     case 0:
         ERROR("Error open without write and read fallback to read only, path=%s\n", p);
-        fd = fopen(p, "rb");
         break;
     case OPEN_READ:
-        fd = fopen(p, "rb");
         break;
     case OPEN_WRITE:
         DEBUG("--todo-- write only, path=%s\n", p);
-        fd = fopen(p, "r+b");
+        mode = "r+b";
         break;
     case OPEN_WRITE | OPEN_READ:
-        fd = fopen(p, "r+b");
+        mode = "r+b";
         break;
     }
 
-    fseek(fd, 0, SEEK_END);
-    u32 sz = 0;
-
-    if((sz=ftell(fd)) == -1) {
-        ERROR("ftell() failed.\n");
-        fclose(fd);
-        return 0;
-    }
+    fd = fopen(p, mode);
 
     // Create file object
     file_type* file = calloc(sizeof(file_type), 1);
@@ -246,14 +146,12 @@ static u32 sharedextd_OpenFile(archive* self, file_path path, u32 flags, u32 att
         return 0;
     }
 
-    file->type_specific.sharedextd.fd = fd;
-    file->type_specific.sharedextd.sz = (u64) sz;
-
-    // Setup function pointers.
-    file->fnWrite = &sharedextdfile_Write;
-    file->fnRead = &sharedextdfile_Read;
-    file->fnGetSize = &sharedextdfile_GetSize;
-    file->fnClose = &sharedextdfile_Close;
+    // Setup function pointers, writes go through the save cache.
+    if (hostfile_OpenCached(file, p, fd, mode) != 0) {
+        fclose(fd);
+        free(file);
+        return 0;
+    }
 
     file->handle = handle_New(HANDLE_TYPE_FILE, (uintptr_t)file);
     return file->handle;
@@ -280,7 +178,11 @@ static u32 sharedextd_DeleteFile(archive* self, file_path path)
         return 0;
     }
 
-    return remove(p);
+    if (remove(p) != 0)
+        return -1;
+
+    hostfile_Unlinked(p);
+    return 0;
 }
 
 int sharedextd_DeleteDir(archive* self, file_path path)
@@ -303,87 +205,17 @@ int sharedextd_DeleteDir(archive* self, file_path path)
 #endif
 }
 
-u32 sharedextd_ReadDir(dir_type* self, u32 ptr, u32 entrycount, u32* read_out)
-{
-    u32 current = 0;
-    struct dirent* ent;
-
-    while (current < entrycount) {
-        errno = 0;
-        if ((ent = readdir(self->dir)) == NULL) {
-            if (errno == 0) {
-                // Dir empty. Memset region?
-                return 0;
-            }
-            else {
-                ERROR("readdir() failed.\n");
-                return -1;
-            }
-        }
-        current++;
-    }
-
-    // Convert file-name to UTF16 and copy.
-    u16 utf16[256];
-    for (u32 i = 0; i<256; i++)
-        utf16[i] = ent->d_name[i];
-
-    mem_Write((uint8_t*)utf16, ptr, sizeof(utf16));
-
-    // XXX: 8.3 name @ 0x20C
-    mem_Write8(ptr + 0x215, 0xA); //unknown
-    // XXX: 8.3 ext @ 0x216
-
-    mem_Write8(ptr + 0x21A, 0x1); // Unknown
-    mem_Write8(ptr + 0x21B, 0x0); // Unknown
-
-    struct stat st;
-
-    char path[256];
-    snprintf(path, sizeof(path), "%s/%s", self->path, ent->d_name);
-    if (stat(path,&st) != 0 ) {
-        ERROR("Failed to stat: %s\n", path);
-        return -1;
-    }
-    // Is directory flag
-    if (S_ISDIR(st.st_mode)) {
-        mem_Write8(ptr + 0x21C, 0x1);
-
-        mem_Write8(ptr + 0x216, ' '); // 8.3 file extension
-        mem_Write8(ptr + 0x217, ' ');
-        mem_Write8(ptr + 0x218, ' ');
-    }
-    else { // Is directory flag
-
-    // XXX: hidden flag @ 0x21D
-    // XXX: archive flag @ 0x21E
-    // XXX: readonly flag @ 0x21F
-
-        mem_Write8(ptr + 0x21C, 0x0);
-        mem_Write32(ptr + 0x220, st.st_size);
-
-#if defined(ENV64BIT)
-        mem_Write32(ptr + 0x224, (st.st_size >> 32));
-#else
-        mem_Write32(ptr + 0x224, 0);
-#endif
-    }
-
-
-    *read_out = current;
-    return 0;
-}
-
 static u32 sharedextd_OpenDir(archive* self, file_path path)
 {
     // Create file object
-    dir_type* dir = (dir_type*)malloc(sizeof(dir_type));
+    dir_type* dir = calloc(sizeof(dir_type), 1);
 
     dir->f_path = path;
     dir->self = self;
 
     // Setup function pointers.
-    dir->fnRead = &sharedextd_ReadDir;
+    dir->fnRead = &hostdir_Read;
+    dir->fnClose = &hostdir_Close;
 
     char tmp[256];
 
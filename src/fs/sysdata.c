@@ -28,104 +28,6 @@
 
 #include "config.h"
 
-/* ____ File implementation ____ */
-
-static u32 sysdatafile_Read(file_type* self, u32 ptr, u32 sz, u64 off, u32* read_out)
-{
-    FILE* fd = self->type_specific.sysdata.fd;
-    *read_out = 0;
-
-    if(off >> 32) {
-        ERROR("64-bit offset not supported.\n");
-        return -1;
-    }
-
-    if(fseek64(fd, off, SEEK_SET) == -1) {
-        ERROR("fseek failed.\n");
-        return -1;
-    }
-
-    u8* b = malloc(sz);
-    if(b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
-    }
-
-    u32 read = fread(b, 1, sz, fd);
-    if(read != sz) {
-        ERROR("fread failed\n");
-        free(b);
-        return -1;
-    }
-
-    if(mem_Write(b, ptr, read) != 0) {
-        ERROR("mem_Write failed.\n");
-        free(b);
-        return -1;
-    }
-
-    *read_out = read;
-    free(b);
-
-    return 0; // Result
-}
-static u32 sysdatafile_Write(file_type* self, u32 ptr, u32 sz, u64 off, u32 flush_flags, u32* written_out)
-{
-    FILE* fd = self->type_specific.sysdata.fd;
-    *written_out = 0;
-
-    if (off >> 32) {
-        ERROR("64-bit offset not supported.\n");
-        return -1;
-    }
-
-    if (fseek64(fd, off, SEEK_SET) == -1) {
-        ERROR("fseek failed.\n");
-        return -1;
-    }
-
-    u8* b = malloc(sz);
-    if (b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
-    }
-
-    if (mem_Read(b, ptr, sz) != 0) {
-        ERROR("mem_Write failed.\n");
-        free(b);
-        return -1;
-    }
-
-    u32 write = fwrite(b, 1, sz, fd);
-    if(write != sz) {
-        ERROR("fwrite failed\n");
-        free(b);
-        return -1;
-    }
-
-    *written_out = write;
-    free(b);
-
-    return 0; // Result
-}
-
-
-static u64 sysdatafile_GetSize(file_type* self)
-{
-    return self->type_specific.sysdata.sz;
-}
-
-static u32 sysdatafile_Close(file_type* self)
-{
-    // Close file and free yourself
-    fclose(self->type_specific.sysdata.fd);
-    free(self);
-
-    return 0;
-}
-
-
-
 /* ____ FS implementation ____ */
 
 static bool sysdata_FileExists(archive* self, file_path path)
@@ -256,10 +158,10 @@ static u32 sysdata_OpenFile(archive* self, file_path path, u32 flags, u32 attr)
     file->type_specific.sysdata.sz = (u64) sz;
 
     // Setup function pointers.
-    file->fnWrite = &sysdatafile_Write;
-    file->fnRead = &sysdatafile_Read;
-    file->fnGetSize = &sysdatafile_GetSize;
-    file->fnClose = &sysdatafile_Close;
+    file->fnWrite = &hostfile_Write;
+    file->fnRead = &hostfile_Read;
+    file->fnGetSize = &hostfile_GetSize;
+    file->fnClose = &hostfile_Close;
 
     file->handle = handle_New(HANDLE_TYPE_FILE, (uintptr_t)file);
     return file->handle;
@@ -58,7 +58,6 @@ extern u32 loader_txt;
 extern u32 loader_data;
 extern u32 loader_bss;
 int mem_Write(uint8_t* in_buff, uint32_t addr, uint32_t size);
-extern thread threads[MAX_THREADS];
 
 #define uint32_t u32
 #define uint16_t u16
@@ -70,6 +69,9 @@ extern thread threads[MAX_THREADS];
 s32 gdb_id_loc = -1;
 s32 gdb_id_glob = -1;
 
+u8 gdb_trap_pages[1 << 20];
+u32 gdb_traps = 0;
+
 struct ptid
 {
     /* Process id */
@@ -694,6 +696,40 @@ unsigned int *len_ptr, unsigned char **to_p)
     return 0;
 }
 
+/**
+ * Marks the pages covered by each breakpoint in the list.
+ */
+static void
+mark_traps_gdb( struct breakpoint_gdb *bpoint, uint8_t kind) {
+  for ( ; bpoint != NULL; bpoint = bpoint->next) {
+    uint32_t page = bpoint->addr >> 12;
+    uint32_t last = (bpoint->addr + (bpoint->size ? bpoint->size - 1 : 0)) >> 12;
+
+    while ( 1) {
+      gdb_trap_pages[page] |= kind;
+      if ( page == last)
+        break;
+      page = (page + 1) & 0xFFFFF;
+    }
+    gdb_traps |= kind;
+  }
+}
+
+/**
+ * Rebuilds the trap pages from the breakpoint lists. Only called with the
+ * CPU stalled, packets are not processed otherwise.
+ */
+static void
+update_traps_gdb( struct gdb_stub_state *stub) {
+  memset( gdb_trap_pages, 0, sizeof( gdb_trap_pages));
+  gdb_traps = 0;
+
+  mark_traps_gdb( stub->instr_breakpoints, GDB_TRAP_EXEC);
+  mark_traps_gdb( stub->read_breakpoints, GDB_TRAP_READ);
+  mark_traps_gdb( stub->write_breakpoints, GDB_TRAP_WRITE);
+  mark_traps_gdb( stub->access_breakpoints, GDB_TRAP_READ | GDB_TRAP_WRITE);
+}
+
 /**
  * Returns -1 if there is a socket error.
  */
@@ -1188,6 +1224,9 @@ processPacket_gdb( SOCKET_TYPE sock, const uint8_t *packet,
 	  strcpy( (char *)out_ptr, "E01");
 	  send_size = 3;
 	}
+	else {
+	  update_traps_gdb( stub);
+	}
       }
       break;
 
@@ -1720,68 +1759,53 @@ static uint16_t gdb_prefetch16( void *data, uint32_t adr) {
 /** read 8 bit data value */
 static uint8_t gdb_read8( void *data, uint32_t adr) {
   struct gdb_stub_state *stub = (struct gdb_stub_state *)data;
-  uint8_t value = 0;
   int breakpoint;
 
-  /* pass down to the real memory interace */
-  value = stub->real_cpu_memio->read8( stub->real_cpu_memio->data,
-                                       adr);
-
+  /* the CPU does the access itself, only check for a watchpoint */
   breakpoint = check_breaks_gdb( stub, stub->read_breakpoints, adr, 1,
                                  STOP_RWATCHPOINT);
   if ( !breakpoint)
     check_breaks_gdb( stub, stub->access_breakpoints, adr, 1,
                       STOP_AWATCHPOINT);
 
-  return value;
+  return 0;
 }
 
 /** read 16 bit data value */
 static uint16_t gdb_read16( void *data, uint32_t adr) {
   struct gdb_stub_state *stub = (struct gdb_stub_state *)data;
-  uint16_t value;
   int breakpoint;
 
-  /* pass down to the real memory interace */
-  value = stub->real_cpu_memio->read16( stub->real_cpu_memio->data,
-                                       adr);
-
+  /* the CPU does the access itself, only check for a watchpoint */
   breakpoint = check_breaks_gdb( stub, stub->read_breakpoints, adr, 2,
                                  STOP_RWATCHPOINT);
   if ( !breakpoint)
     check_breaks_gdb( stub, stub->access_breakpoints, adr, 2,
                       STOP_AWATCHPOINT);
 
-  return value;
+  return 0;
 }
 /** read 32 bit data value */
 static uint32_t gdb_read32( void *data, uint32_t adr) {
   struct gdb_stub_state *stub = (struct gdb_stub_state *)data;
-  uint32_t value;
   int breakpoint;
 
-  /* pass down to the real memory interace */
-  value = stub->real_cpu_memio->read32( stub->real_cpu_memio->data,
-                                        adr);
-
+  /* the CPU does the access itself, only check for a watchpoint */
   breakpoint = check_breaks_gdb( stub, stub->read_breakpoints, adr, 4,
                                  STOP_RWATCHPOINT);
   if ( !breakpoint)
     check_breaks_gdb( stub, stub->access_breakpoints, adr, 4,
                       STOP_AWATCHPOINT);
 
-  return value;
+  return 0;
 }
 
 /** write 8 bit data value */
-static void gdb_write8( void *data, uint32_t adr, uint8_t val) {
+static void gdb_write8( void *data, uint32_t adr, UNUSED_PARM(uint8_t val)) {
   struct gdb_stub_state *stub = (struct gdb_stub_state *)data;
   int breakpoint;
 
-  /* pass down to the real memory interace */
-  stub->real_cpu_memio->write8( stub->real_cpu_memio->data,
-                                adr, val);
-
+  /* the CPU does the access itself, only check for a watchpoint */
   breakpoint = check_breaks_gdb( stub, stub->write_breakpoints, adr, 1,
                                  STOP_WATCHPOINT);
   if ( !breakpoint)
@@ -1790,14 +1814,11 @@ static void gdb_write8( void *data, uint32_t adr, uint8_t val) {
 }
 
 /** write 16 bit data value */
-static void gdb_write16( void *data, uint32_t adr, uint16_t val) {
+static void gdb_write16( void *data, uint32_t adr, UNUSED_PARM(uint16_t val)) {
   struct gdb_stub_state *stub = (struct gdb_stub_state *)data;
   int breakpoint;
 
-  /* pass down to the real memory interace */
-  stub->real_cpu_memio->write16( stub->real_cpu_memio->data,
-                                 adr, val);
-
+  /* the CPU does the access itself, only check for a watchpoint */
   breakpoint = check_breaks_gdb( stub, stub->write_breakpoints, adr, 2,
                                  STOP_WATCHPOINT);
   if ( !breakpoint)
@@ -1806,14 +1827,11 @@ static void gdb_write16( void *data, uint32_t adr, uint16_t val) {
 }
 
 /** write 32 bit data value */
-static void gdb_write32( void *data, uint32_t adr, uint32_t val) {
+static void gdb_write32( void *data, uint32_t adr, UNUSED_PARM(uint32_t val)) {
   struct gdb_stub_state *stub = (struct gdb_stub_state *)data;
   int breakpoint;
 
-  /* pass down to the real memory interace */
-  stub->real_cpu_memio->write32( stub->real_cpu_memio->data,
-                                 adr, val);
-
+  /* the CPU does the access itself, only check for a watchpoint */
   breakpoint = check_breaks_gdb( stub, stub->write_breakpoints, adr, 4,
                                  STOP_WATCHPOINT);
   if ( !breakpoint)
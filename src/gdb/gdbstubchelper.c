@@ -35,15 +35,15 @@
 
 #include "mem.h"
 
-#ifdef _WIN32
+// Read without the lock first, the CPU thread checks it every slice and
+// only takes the lock once a stop is pending.
 static volatile bool arm_stall = false;
-#else
-static bool arm_stall = false;
+#ifndef _WIN32
 static pthread_mutex_t arm_stall_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t  arm_stall_cond  = PTHREAD_COND_INITIALIZER;
 #endif
 
-extern ARMul_State s;
+extern THREAD_LOCAL ARMul_State* arm11_state;
 
 
 extern u32 global_gdb_port;
@@ -51,7 +51,6 @@ extern gdbstub_handle_t gdb_stub;
 extern struct armcpu_memory_iface *gdb_memio;
 extern struct armcpu_memory_iface gdb_base_memory_iface;
 extern struct armcpu_ctrl_iface gdb_ctrl_iface;
-extern thread threads[MAX_THREADS];
 
 
 thread_handle_t
@@ -92,6 +91,9 @@ joinThread_gdb( thread_handle_t thread_handle)
 
 void wait_while_stall(void)
 {
+    if (!arm_stall)
+        return;
+
 #ifdef _WIN32
     while(arm_stall)
         Sleep(1);
@@ -113,7 +115,7 @@ void stall_cpu(void *instance)
     pthread_cond_signal(&arm_stall_cond);
     pthread_mutex_unlock(&arm_stall_mutex);
 #endif
-    s.NumInstrsToExecute = 0;
+    arm11_state->NumInstrsToExecute = 0;
 }
 
 void unstall_cpu(void *instance)
@@ -132,15 +134,15 @@ u32 read_cpu_reg(void *instance, u32 reg_num,u32 handle)
 {
     if (handle == threads_GetCurrentThreadHandle()){
 
-        if (reg_num == 0x10)return s.Cpsr;
+        if (reg_num == 0x10)return arm11_state->Cpsr;
 #ifdef impropergdb
         if (reg_num == 0xF) {
-            if (s.NextInstr == PRIMEPIPE)return arm11_R(reg_num);
+            if (arm11_state->NextInstr == PRIMEPIPE)return arm11_R(reg_num);
             else return arm11_R(reg_num) - 4;
         }
 #else
         if (reg_num == 0xF) {
-            if (s.NextInstr >= PRIMEPIPE)
+            if (arm11_state->NextInstr >= PRIMEPIPE)
                 return arm11_R(reg_num);
             return arm11_R(reg_num) - 4;
         }
@@ -196,12 +198,12 @@ void set_cpu_reg(void *instance, u32 reg_num, u32 value, u32 handle)
 void install_post_exec_fn(void *instance, void(*ex_fn)(void *, u32 adr, int thumb), void *fn_data)
 {
     //armcpu_t *armcpu = (armcpu_t *)instance;
-    s.post_ex_fn = ex_fn;
-    s.post_ex_fn_data = fn_data;
+    arm11_state->post_ex_fn = ex_fn;
+    arm11_state->post_ex_fn_data = fn_data;
 }
 void remove_post_exec_fn(void *instance)
 {
-    s.post_ex_fn = NULL;
+    arm11_state->post_ex_fn = NULL;
 }
 u16 gdb_prefetch16(void *data, u32 adr)
 {
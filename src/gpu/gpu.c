@@ -24,6 +24,7 @@
 #include "handles.h"
 #include "mem.h"
 #include "gpu.h"
+#include "savestate.h"
 #include <math.h>
 
 //#define GSP_ENABLE_LOG
@@ -1517,3 +1518,41 @@ u32 get_py_memrestsize(u32 addr)
     if (addr >= 0x20000000 && addr < 0x28000000)return addr - 0x20000000;
     return 0;
 }
+
+void gpu_SaveState()
+{
+    // The register file and the shader memories are mostly zero.
+    savestate_PutPages(GPU_Regs, sizeof(GPU_Regs));
+    savestate_PutPages(GPUshadercodebuffer, sizeof(GPUshadercodebuffer));
+    savestate_PutPages(swizzle_data, sizeof(swizzle_data));
+    savestate_Put(const_vectors, sizeof(const_vectors));
+    savestate_Put(&VSFloatUniformSetuptembuffercurrent, sizeof(VSFloatUniformSetuptembuffercurrent));
+    savestate_Put(VSFloatUniformSetuptembuffer, sizeof(VSFloatUniformSetuptembuffer));
+    savestate_Put(&renderaddr, sizeof(renderaddr));
+    savestate_Put(&unknownaddr, sizeof(unknownaddr));
+
+    // A strip can be half way assembled.
+    savestate_Put(buffer, sizeof(buffer));
+    savestate_Put(&buffer_index, sizeof(buffer_index));
+    savestate_Put(&strip_ready, sizeof(strip_ready));
+
+    gpu_SaveIoState();
+}
+
+void gpu_LoadState()
+{
+    savestate_GetPages(GPU_Regs, sizeof(GPU_Regs));
+    savestate_GetPages(GPUshadercodebuffer, sizeof(GPUshadercodebuffer));
+    savestate_GetPages(swizzle_data, sizeof(swizzle_data));
+    savestate_Get(const_vectors, sizeof(const_vectors));
+    savestate_Get(&VSFloatUniformSetuptembuffercurrent, sizeof(VSFloatUniformSetuptembuffercurrent));
+    savestate_Get(VSFloatUniformSetuptembuffer, sizeof(VSFloatUniformSetuptembuffer));
+    savestate_Get(&renderaddr, sizeof(renderaddr));
+    savestate_Get(&unknownaddr, sizeof(unknownaddr));
+
+    savestate_Get(buffer, sizeof(buffer));
+    savestate_Get(&buffer_index, sizeof(buffer_index));
+    savestate_Get(&strip_ready, sizeof(strip_ready));
+
+    gpu_LoadIoState();
+}
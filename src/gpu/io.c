@@ -1,4 +1,5 @@
 #include "util.h"
+#include "savestate.h"
 
 #define MAX_IO_REGS 0x420000
 static u32 io_regs[MAX_IO_REGS/4];
@@ -28,3 +29,13 @@ u32 gpu_ReadReg32(u32 addr)
 
     return io_regs[addr/4];
 }
+
+void gpu_SaveIoState()
+{
+    savestate_PutPages(io_regs, sizeof(io_regs));
+}
+
+void gpu_LoadIoState()
+{
+    savestate_GetPages(io_regs, sizeof(io_regs));
+}
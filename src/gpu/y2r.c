@@ -0,0 +1,564 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define Y2R_SSE
+#include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "mem.h"
+#include "gpu.h"
+
+/* ____ Y2R ____ */
+
+// The YUV to RGB converter. The hardware is fed and drained by DMA in
+// transfer units separated by gaps, and works in strips of 8 lines: gather
+// the strip's input planes, convert, lay the pixels out linearly or as 8x8
+// tiles, encode the output format and scatter it to the destination.
+//
+// Strips are independent, where each one sits in the source and destination
+// streams follows from its index, so large images are split over a few
+// worker threads.
+
+#define MAX_WIDTH    1024
+#define MAX_WORKERS  3
+#define MIN_PARALLEL (64 * 1024) // Pixels, below that threads cost more than they save.
+
+typedef struct {
+    u8  y[MAX_WIDTH * 8 * 2]; // Also the YUYV plane.
+    u8  u[MAX_WIDTH * 8 / 2];
+    u8  v[MAX_WIDTH * 8 / 2];
+    u32 row[MAX_WIDTH];
+    u32 rgb[MAX_WIDTH * 8];
+    u8  out[MAX_WIDTH * 8 * 4];
+} y2r_scratch;
+
+// Fixed point, rgb_Y, r_V, g_V, g_U, b_U, r, g and b offsets.
+static const s16 standard_coefficients[4][8] = {
+    { 0x100, 0x166, 0xB6, 0x58, 0x1C5, -0x166F, 0x10EE, -0x1C5B }, // ITU Rec. 601
+    { 0x100, 0x193, 0x77, 0x2F, 0x1DB, -0x1933, 0xA7C, -0x1D51 },  // ITU Rec. 709
+    { 0x12A, 0x198, 0xD0, 0x64, 0x204, -0x1BDE, 0x10F2, -0x229B }, // ITU Rec. 601, scaled
+    { 0x12A, 0x1CA, 0x88, 0x36, 0x21C, -0x1F04, 0x99C, -0x2421 },  // ITU Rec. 709, scaled
+};
+
+// Pixel order inside an 8x8 tile, as the GPU reads textures.
+static const u8 morton[64] = {
+    0, 1, 4, 5, 16, 17, 20, 21, 2, 3, 6, 7, 18, 19, 22, 23,
+    8, 9, 12, 13, 24, 25, 28, 29, 10, 11, 14, 15, 26, 27, 30, 31,
+    32, 33, 36, 37, 48, 49, 52, 53, 34, 35, 38, 39, 50, 51, 54, 55,
+    40, 41, 44, 45, 56, 57, 60, 61, 42, 43, 46, 47, 58, 59, 62, 63
+};
+
+static y2r_scratch* scratch[MAX_WORKERS + 1];
+
+// The conversion in flight.
+static const y2r_params* job;
+static struct mem_table* job_mem; // The caller's guest memory.
+static u32 job_strips;
+static volatile u32 job_next, job_done;
+
+static u32 num_workers;
+static bool pool_started;
+
+#ifdef _WIN32
+static HANDLE pool_sem;
+
+#define ATOMIC_INC(x) ((u32)InterlockedIncrement((LONG volatile*)(x)))
+#define BARRIER()     MemoryBarrier()
+#define YIELD()       SwitchToThread()
+#else
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_cond = PTHREAD_COND_INITIALIZER;
+static u32 pool_gen;
+
+#define ATOMIC_INC(x) __sync_add_and_fetch((x), 1)
+#define BARRIER()     __sync_synchronize()
+#define YIELD()       sched_yield()
+#endif
+
+
+static u32 OutputBytes(u8 format)
+{
+    switch (format) {
+    case Y2R_OUTPUT_RGBA8:
+        return 4;
+    case Y2R_OUTPUT_RGB8:
+        return 3;
+    }
+    return 2;
+}
+
+/* ____ DMA ____ */
+
+// Offsets are counted in the data stream, the gaps are not part of it.
+static int DmaRead(const y2r_dma* d, u32 off, u8* out, u32 len)
+{
+    u32 unit = d->unit != 0 ? d->unit : len;
+
+    while (len != 0) {
+        u32 in = off % unit;
+        u32 n = unit - in < len ? unit - in : len;
+
+        if (mem_Read(out, d->addr + (off / unit) * (unit + d->gap) + in, n) != 0)
+            return -1;
+
+        off += n;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int DmaWrite(const y2r_dma* d, u32 off, u8* in, u32 len)
+{
+    u32 unit = d->unit != 0 ? d->unit : len;
+
+    while (len != 0) {
+        u32 at = off % unit;
+        u32 n = unit - at < len ? unit - at : len;
+
+        if (mem_Write(in, d->addr + (off / unit) * (unit + d->gap) + at, n) != 0)
+            return -1;
+
+        off += n;
+        in += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 16 bit input planes, only the low byte of each sample is used.
+static void Narrow(u8* p, u32 count)
+{
+    u32 i = 0;
+
+#ifdef Y2R_SSE
+    __m128i mask = _mm_set1_epi16(0xFF);
+    for (; i + 8 <= count; i += 8) {
+        __m128i w = _mm_and_si128(_mm_loadu_si128((__m128i*)(p + 2*i)), mask);
+        _mm_storel_epi64((__m128i*)(p + i), _mm_packus_epi16(w, w));
+    }
+#endif
+    for (; i < count; i++)
+        p[i] = p[2*i];
+}
+
+static int Gather(const y2r_params* p, y2r_scratch* s, u32 strip, u32 rows)
+{
+    u32 w = p->line_width;
+    u32 wide = p->input_format == Y2R_INPUT_YUV422_16 || p->input_format == Y2R_INPUT_YUV420_16 ? 2 : 1;
+    u32 luma = w * rows, chroma;
+
+    switch (p->input_format) {
+    case Y2R_INPUT_YUYV422:
+        return DmaRead(&p->src_yuyv, strip * w * 8 * 2, s->y, luma * 2);
+
+    case Y2R_INPUT_YUV422_8:
+    case Y2R_INPUT_YUV422_16:
+        chroma = luma / 2;
+        if (DmaRead(&p->src_y, strip * w * 8 * wide, s->y, luma * wide) != 0 ||
+            DmaRead(&p->src_u, strip * w * 4 * wide, s->u, chroma * wide) != 0 ||
+            DmaRead(&p->src_v, strip * w * 4 * wide, s->v, chroma * wide) != 0)
+            return -1;
+        break;
+
+    default:
+        chroma = luma / 4;
+        if (DmaRead(&p->src_y, strip * w * 8 * wide, s->y, luma * wide) != 0 ||
+            DmaRead(&p->src_u, strip * w * 2 * wide, s->u, chroma * wide) != 0 ||
+            DmaRead(&p->src_v, strip * w * 2 * wide, s->v, chroma * wide) != 0)
+            return -1;
+        break;
+    }
+
+    if (wide == 2) {
+        Narrow(s->y, luma);
+        Narrow(s->u, chroma);
+        Narrow(s->v, chroma);
+    }
+    return 0;
+}
+
+/* ____ Conversion ____ */
+
+// Pixels come out with the bytes A, B, G, R, which is RGBA8 in memory.
+static u32 Pixel(const s16* c, s32 y, s32 u, s32 v, u8 alpha)
+{
+    s32 cy = c[0] * y;
+    s32 r = ((cy + c[1] * v) >> 3) + c[5] + 0x18;
+    s32 g = ((cy - c[2] * v - c[3] * u) >> 3) + c[6] + 0x18;
+    s32 b = ((cy + c[4] * u) >> 3) + c[7] + 0x18;
+
+    r >>= 5;
+    g >>= 5;
+    b >>= 5;
+    if (r < 0) r = 0;
+    if (r > 0xFF) r = 0xFF;
+    if (g < 0) g = 0;
+    if (g > 0xFF) g = 0xFF;
+    if (b < 0) b = 0;
+    if (b > 0xFF) b = 0xFF;
+
+    return alpha | b << 8 | g << 16 | (u32)r << 24;
+}
+
+#ifdef Y2R_SSE
+// Eight pixels from 16 bit Y, U and V lanes. The products are exact, madd
+// multiplies the 16 bit pairs into 32 bit sums.
+static void Pixels8(const s16* c, __m128i y, __m128i u, __m128i v, u8 alpha, u32* out)
+{
+    __m128i r_yv = _mm_set1_epi32((u16)c[0] | (u32)(u16)c[1] << 16);
+    __m128i g_yv = _mm_set1_epi32((u16)c[0] | (u32)(u16)-c[2] << 16);
+    __m128i g_u  = _mm_set1_epi32((u16)-c[3]);
+    __m128i b_yu = _mm_set1_epi32((u16)c[0] | (u32)(u16)c[4] << 16);
+    __m128i zero = _mm_setzero_si128();
+    __m128i rgb[3];
+    u32 half, i;
+
+    for (half = 0; half < 2; half++) {
+        __m128i yv = half ? _mm_unpackhi_epi16(y, v) : _mm_unpacklo_epi16(y, v);
+        __m128i yu = half ? _mm_unpackhi_epi16(y, u) : _mm_unpacklo_epi16(y, u);
+        __m128i u0 = half ? _mm_unpackhi_epi16(u, zero) : _mm_unpacklo_epi16(u, zero);
+        __m128i t[3];
+
+        t[0] = _mm_madd_epi16(yv, r_yv);
+        t[1] = _mm_add_epi32(_mm_madd_epi16(yv, g_yv), _mm_madd_epi16(u0, g_u));
+        t[2] = _mm_madd_epi16(yu, b_yu);
+
+        for (i = 0; i < 3; i++) {
+            t[i] = _mm_add_epi32(_mm_srai_epi32(t[i], 3), _mm_set1_epi32(c[5 + i] + 0x18));
+            t[i] = _mm_srai_epi32(t[i], 5);
+            rgb[i] = half ? _mm_packs_epi32(rgb[i], t[i]) : t[i];
+        }
+    }
+
+    // Saturate to bytes, then interleave A, B, G, R.
+    {
+        __m128i r8 = _mm_packus_epi16(rgb[0], rgb[0]);
+        __m128i g8 = _mm_packus_epi16(rgb[1], rgb[1]);
+        __m128i b8 = _mm_packus_epi16(rgb[2], rgb[2]);
+        __m128i ab = _mm_unpacklo_epi8(_mm_set1_epi8((char)alpha), b8);
+        __m128i gr = _mm_unpacklo_epi8(g8, r8);
+
+        _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi16(ab, gr));
+        _mm_storeu_si128((__m128i*)(out + 4), _mm_unpackhi_epi16(ab, gr));
+    }
+}
+#endif
+
+// Converts row y of the strip into s->row.
+static void ConvertRow(const y2r_params* p, y2r_scratch* s, u32 y)
+{
+    const s16* c = p->coefficients;
+    u32 w = p->line_width;
+    u8 alpha = (u8)p->alpha;
+    const u8 *py, *pu, *pv;
+    u32 x = 0;
+
+    switch (p->input_format) {
+    case Y2R_INPUT_YUYV422:
+        py = s->y + y * w * 2;
+#ifdef Y2R_SSE
+        for (; x + 8 <= w; x += 8) {
+            __m128i in = _mm_loadu_si128((const __m128i*)(py + 2*x));
+            __m128i yy = _mm_and_si128(in, _mm_set1_epi16(0xFF));
+            __m128i uv = _mm_srli_epi16(in, 8);
+            __m128i u = _mm_and_si128(uv, _mm_set1_epi32(0xFFFF));
+            __m128i v = _mm_srli_epi32(uv, 16);
+
+            u = _mm_or_si128(u, _mm_slli_epi32(u, 16));
+            v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+            Pixels8(c, yy, u, v, alpha, s->row + x);
+        }
+#endif
+        for (; x < w; x++)
+            s->row[x] = Pixel(c, py[2*x], py[(x & ~1) * 2 + 1], py[(x & ~1) * 2 + 3], alpha);
+        return;
+
+    case Y2R_INPUT_YUV422_8:
+    case Y2R_INPUT_YUV422_16:
+        pu = s->u + y * w / 2;
+        pv = s->v + y * w / 2;
+        break;
+
+    default:
+        pu = s->u + (y / 2) * w / 2;
+        pv = s->v + (y / 2) * w / 2;
+        break;
+    }
+
+    py = s->y + y * w;
+#ifdef Y2R_SSE
+    for (; x + 8 <= w; x += 8) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i yy = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(py + x)), zero);
+        __m128i u = _mm_cvtsi32_si128(*(const int*)(pu + x / 2));
+        __m128i v = _mm_cvtsi32_si128(*(const int*)(pv + x / 2));
+
+        // Each chroma sample covers two pixels.
+        u = _mm_unpacklo_epi8(_mm_unpacklo_epi8(u, u), zero);
+        v = _mm_unpacklo_epi8(_mm_unpacklo_epi8(v, v), zero);
+        Pixels8(c, yy, u, v, alpha, s->row + x);
+    }
+#endif
+    for (; x < w; x++)
+        s->row[x] = Pixel(c, py[x], pu[x / 2], pv[x / 2], alpha);
+}
+
+// Encodes count pixels to the output format, returns the bytes written.
+static u32 Encode(u8 format, const u32* in, u8* out, u32 count)
+{
+    u32 i = 0;
+
+    switch (format) {
+    case Y2R_OUTPUT_RGBA8:
+        memcpy(out, in, count * 4);
+        return count * 4;
+
+    case Y2R_OUTPUT_RGB8:
+        for (i = 0; i < count; i++) {
+            out[3*i] = (u8)(in[i] >> 8);
+            out[3*i + 1] = (u8)(in[i] >> 16);
+            out[3*i + 2] = (u8)(in[i] >> 24);
+        }
+        return count * 3;
+
+    case Y2R_OUTPUT_RGB565:
+    case Y2R_OUTPUT_RGB5A1:
+#ifdef Y2R_SSE
+        for (; i + 8 <= count; i += 8) {
+            __m128i v[2];
+            u32 h;
+
+            for (h = 0; h < 2; h++) {
+                __m128i p = _mm_loadu_si128((const __m128i*)(in + i + 4*h));
+                __m128i r = _mm_slli_epi32(_mm_srli_epi32(p, 27), 11);
+
+                if (format == Y2R_OUTPUT_RGB565)
+                    v[h] = _mm_or_si128(_mm_or_si128(r,
+                        _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(p, 18), _mm_set1_epi32(0x3F)), 5)),
+                        _mm_and_si128(_mm_srli_epi32(p, 11), _mm_set1_epi32(0x1F)));
+                else
+                    v[h] = _mm_or_si128(_mm_or_si128(r,
+                        _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(p, 19), _mm_set1_epi32(0x1F)), 6)),
+                        _mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(p, 11), _mm_set1_epi32(0x1F)), 1),
+                                     _mm_and_si128(_mm_srli_epi32(p, 7), _mm_set1_epi32(1))));
+
+                // packs is signed, bias into range and back.
+                v[h] = _mm_sub_epi32(v[h], _mm_set1_epi32(0x8000));
+            }
+            _mm_storeu_si128((__m128i*)(out + 2*i),
+                             _mm_xor_si128(_mm_packs_epi32(v[0], v[1]), _mm_set1_epi16((short)0x8000)));
+        }
+#endif
+        for (; i < count; i++) {
+            u32 r = in[i] >> 24, g = (in[i] >> 16) & 0xFF, b = (in[i] >> 8) & 0xFF, a = in[i] & 0xFF;
+            u16 v;
+
+            if (format == Y2R_OUTPUT_RGB565)
+                v = (u16)((r >> 3) << 11 | (g >> 2) << 5 | b >> 3);
+            else
+                v = (u16)((r >> 3) << 11 | (g >> 3) << 6 | (b >> 3) << 1 | a >> 7);
+            out[2*i] = (u8)v;
+            out[2*i + 1] = (u8)(v >> 8);
+        }
+        return count * 2;
+    }
+    return 0;
+}
+
+static int Strip(const y2r_params* p, y2r_scratch* s, u32 strip)
+{
+    u32 w = p->line_width;
+    u32 rows = p->lines - strip * 8 < 8 ? p->lines - strip * 8 : 8;
+    u32 pixels, bytes, y, x;
+
+    if (Gather(p, s, strip, rows) != 0) {
+        ERROR("Bad source buffer.\n");
+        return -1;
+    }
+
+    for (y = 0; y < rows; y++) {
+        ConvertRow(p, s, y);
+
+        if (p->block_alignment == Y2R_BLOCK_8X8) {
+            for (x = 0; x < w; x++)
+                s->rgb[(x / 8) * 64 + morton[y * 8 + x % 8]] = s->row[x];
+        } else {
+            memcpy(s->rgb + y * w, s->row, w * 4);
+        }
+    }
+
+    // Tiles are always whole.
+    if (p->block_alignment == Y2R_BLOCK_8X8) {
+        for (; y < 8; y++)
+            for (x = 0; x < w; x++)
+                s->rgb[(x / 8) * 64 + morton[y * 8 + x % 8]] = 0;
+        pixels = w * 8;
+    } else {
+        pixels = w * rows;
+    }
+
+    bytes = Encode(p->output_format, s->rgb, s->out, pixels);
+    if (DmaWrite(&p->dst, strip * w * 8 * OutputBytes(p->output_format), s->out, bytes) != 0) {
+        ERROR("Bad destination buffer.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* ____ Workers ____ */
+
+static void RunStrips(y2r_scratch* s)
+{
+    u32 strip;
+
+    while ((strip = ATOMIC_INC(&job_next) - 1) < job_strips) {
+        Strip(job, s, strip);
+        BARRIER();
+        ATOMIC_INC(&job_done);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Worker(LPVOID arg)
+#else
+static void* Worker(void* arg)
+#endif
+{
+    y2r_scratch* s = arg;
+#ifndef _WIN32
+    u32 seen = 0;
+#endif
+
+    for (;;) {
+#ifdef _WIN32
+        WaitForSingleObject(pool_sem, INFINITE);
+#else
+        pthread_mutex_lock(&pool_lock);
+        while (pool_gen == seen)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        seen = pool_gen;
+        pthread_mutex_unlock(&pool_lock);
+#endif
+        mem_UseTable(job_mem);
+        RunStrips(s);
+    }
+    return 0;
+}
+
+static void StartPool()
+{
+    u32 cpus, i;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    cpus = info.dwNumberOfProcessors;
+    pool_sem = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    cpus = n > 0 ? (u32)n : 1;
+#endif
+
+    pool_started = true;
+
+    // The emulation thread takes a share too.
+    for (i = 0; i + 1 < cpus && i < MAX_WORKERS; i++) {
+        y2r_scratch* s = malloc(sizeof(y2r_scratch));
+#ifdef _WIN32
+        if (s == NULL || CreateThread(NULL, 0, Worker, s, 0, NULL) == NULL) {
+#else
+        pthread_t thread;
+        if (s == NULL || pthread_create(&thread, NULL, Worker, s) != 0) {
+#endif
+            free(s);
+            break;
+        }
+        scratch[++num_workers] = s;
+    }
+}
+
+/* ____ Interface ____ */
+
+void y2r_StandardCoefficients(u32 index, s16* out)
+{
+    memcpy(out, standard_coefficients[index & 3], sizeof(standard_coefficients[0]));
+}
+
+int y2r_Convert(const y2r_params* p)
+{
+    u32 strips;
+
+    if (p->line_width == 0 || p->line_width > MAX_WIDTH || p->line_width % 8 != 0) {
+        ERROR("Unsupported line width %d.\n", p->line_width);
+        return -1;
+    }
+    if (p->rotation != 0)
+        DEBUG("Rotation %d not supported, converting unrotated.\n", p->rotation);
+
+    if (scratch[0] == NULL && (scratch[0] = malloc(sizeof(y2r_scratch))) == NULL) {
+        ERROR("Not enough mem.\n");
+        return -1;
+    }
+
+    strips = (p->lines + 7) / 8;
+
+    if (p->line_width * p->lines >= MIN_PARALLEL && !pool_started)
+        StartPool();
+
+    job = p;
+    job_mem = mem_CurrentTable();
+    job_strips = strips;
+    job_done = 0;
+    BARRIER();
+    job_next = 0;
+
+    if (p->line_width * p->lines >= MIN_PARALLEL && num_workers != 0) {
+        BARRIER();
+#ifdef _WIN32
+        ReleaseSemaphore(pool_sem, num_workers, NULL);
+#else
+        pthread_mutex_lock(&pool_lock);
+        pool_gen++;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+#endif
+    }
+
+    RunStrips(scratch[0]);
+
+    // Workers may still be finishing their last strip.
+    while (job_done < strips)
+        YIELD();
+    BARRIER();
+
+    job = NULL;
+    return 0;
+}
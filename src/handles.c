@@ -22,6 +22,10 @@
 #include "svc.h"
 
 #include "mem.h"
+#include "trace.h"
+#include "bench.h"
+#include "fs.h"
+#include "savestate.h"
 
 #define MAX_NUM_HANDLES 0x1000
 
@@ -30,6 +34,10 @@
 static handleinfo handles[MAX_NUM_HANDLES];
 static u32 handles_num;
 
+THREAD_LOCAL u32 curprocesshandle;
+
+u32* ipc_cmd_buffer = NULL;
+
 
 #define NUM_HANDLE_TYPES ARRAY_SIZE(handle_types)
 
@@ -95,16 +103,34 @@ u32 svcSendSyncRequest()
     if (handle_types[hi->type].fnSyncRequest != NULL) {
         u32 ret;
         bool locked = false;
+        u32* prev_cmd_buffer = ipc_cmd_buffer;
 
-        ret = handle_types[hi->type].fnSyncRequest(hi, &locked);
+        // Resolve the command buffer once so CMD()/RESP() skip the mapping
+        // lookup for the duration of this request.
+        ipc_cmd_buffer = (u32*) mem_rawaddr(arm11_ServiceBufferAddress() + 0x80, 0x180);
 
-        // Handle is locked so we put thread into WAITING state.
-        if (locked) {
-            u32* wait_list = malloc(4);
-            wait_list[0] = handle;
+        if (bench_enabled)
+            bench_Enter(BENCH_SERVICES);
 
-            threads_SetCurrentThreadWaitList(wait_list, true, 1);
-        }
+        if (trace_enabled) {
+            u32 cmd = ipc_cmd_buffer != NULL ? ipc_cmd_buffer[0] : 0;
+            const char* name = hi->type == HANDLE_TYPE_SERVICE ?
+                               services_GetName(hi) : handle_types[hi->type].name;
+            u64 start = trace_Now();
+
+            ret = handle_types[hi->type].fnSyncRequest(hi, &locked);
+            trace_Ipc(name, handle, cmd, start, trace_Now() - start);
+        } else
+            ret = handle_types[hi->type].fnSyncRequest(hi, &locked);
+
+        if (bench_enabled)
+            bench_Leave();
+
+        ipc_cmd_buffer = prev_cmd_buffer;
+
+        // Handle is locked so we put thread into WAITING state.
+        if (locked)
+            threads_SetCurrentThreadWaitList(&handle, true, 1);
 
         return ret;
     } else {
@@ -183,13 +209,9 @@ u32 svcWaitSynchronization1() //todo timeout
 
         ret = handle_types[hi->type].fnWaitSynchronization(hi, &locked);
 
-        if (locked) {
-            // If handle is locked we put thread in WAITING state.
-            u32* wait_list = (u32*) malloc(4);
-            wait_list[0] = handle;
-
-            threads_SetCurrentThreadWaitList(wait_list, true, 1);
-        }
+        // If handle is locked we put thread in WAITING state.
+        if (locked)
+            threads_SetCurrentThreadWaitList(&handle, true, 1);
 
         return ret;
     } else {
@@ -204,12 +226,21 @@ u32 svcWaitSynchronization1() //todo timeout
 
 u32 wrapWaitSynchronizationN(u32 nanoseconds1,u32 handles_ptr,u32 handles_count,u32 wait_all,u32 nanoseconds2,u32 out) // TODO: timeouts
 {
+    u32 wait_list[MAX_WAIT_HANDLES];
     bool all_unlocked = true;
 
+    if (handles_count > MAX_WAIT_HANDLES) {
+        ERROR("too many handles (%u).\n", handles_count);
+        PAUSE();
+        return -1;
+    }
+
     for (u32 i = 0; i < handles_count; i++) {
         u32 handle = mem_Read32(handles_ptr + i * 4);
         handleinfo* hi = handle_Get(handle);
 
+        wait_list[i] = handle;
+
         if (hi == NULL) {
             arm11_SetR(1, i);
             ERROR("handle %08x not found.\n", handle);
@@ -254,10 +285,6 @@ u32 wrapWaitSynchronizationN(u32 nanoseconds1,u32 handles_ptr,u32 handles_count,
     }
 
     // Put thread in WAITING state if not all handles were unlocked.
-
-    u32* wait_list = malloc(handles_count*4);
-    mem_Read((u8 *) wait_list, handles_ptr, handles_count * 4);
-
     threads_SetCurrentThreadWaitList(wait_list, wait_all, handles_count);
     return 0;
 
@@ -280,3 +307,144 @@ u32 nop_SyncRequest(handleinfo* h, bool *locked)
 {
     return 0;
 };
+
+
+/* Save states, see savestate.c. */
+
+#define STATE_VALUE   0 // Plain data, misc_ptr point into guest buffers.
+#define STATE_FILE    1 // file_type follows.
+#define STATE_ARCHIVE 2 // archive follows.
+#define STATE_LOST    3 // Holds host resources, comes back dead.
+
+#define SERVICE_BUFFER_SIZE 0x200 // See srv_GetServiceHandle.
+
+static u32 StateKind(handleinfo* h)
+{
+    switch (h->type) {
+    case HANDLE_TYPE_FILE:
+        return hostfile_IsHostFile((file_type*)h->subtype) ? STATE_LOST : STATE_FILE;
+    case HANDLE_TYPE_ARCHIVE:
+        return h->subtype != 0 ? STATE_ARCHIVE : STATE_VALUE;
+    case HANDLE_TYPE_DIR:
+    case HANDLE_TYPE_SOCKET:
+    case HANDLE_TYPE_HTTPCont:
+        return STATE_LOST;
+    }
+    return STATE_VALUE;
+}
+
+// Returns SAVESTATE_BUSY while a file read is still out on the I/O thread.
+int handle_CollectState()
+{
+    u32 i;
+
+    for (i = 0; i < handles_num; i++) {
+        handleinfo* h = &handles[i];
+
+        if (h->type == HANDLE_TYPE_FILE && h->misc_ptr[0] != NULL)
+            return SAVESTATE_BUSY;
+
+        if (h->type == HANDLE_TYPE_SHAREDMEM && h->subtype == MEM_TYPE_ALLOC)
+            savestate_AddBuffer(h->misc_ptr[0], h->misc[1]);
+
+        if ((h->type == HANDLE_TYPE_SERVICE || h->type == HANDLE_TYPE_SERVICE_UNMOUNTED ||
+                h->type == HANDLE_TYPE_SERVICE_SERVER) && h->subtype == SERVICE_DIRECT)
+            savestate_AddBuffer(h->misc_ptr[0], SERVICE_BUFFER_SIZE);
+    }
+    return 0;
+}
+
+void handle_SaveState()
+{
+    u32 i, j, lost = 0;
+
+    savestate_Put(&handles_num, sizeof(handles_num));
+
+    for (i = 0; i < handles_num; i++) {
+        handleinfo h = handles[i];
+        u32 kind = StateKind(&h);
+
+        h.subtype = kind == STATE_VALUE ? h.subtype : 0;
+        memset(h.misc_ptr, 0, sizeof(h.misc_ptr));
+
+        savestate_Put(&kind, sizeof(kind));
+        savestate_Put(&h, sizeof(h));
+
+        switch (kind) {
+        case STATE_VALUE:
+            for (j = 0; j < ARRAY_SIZE(h.misc_ptr); j++)
+                savestate_PutPtr(handles[i].misc_ptr[j]);
+            break;
+        case STATE_FILE:
+            savestate_Put((file_type*)handles[i].subtype, sizeof(file_type));
+            break;
+        case STATE_ARCHIVE:
+            savestate_Put((archive*)handles[i].subtype, sizeof(archive));
+            break;
+        case STATE_LOST:
+            lost++;
+            break;
+        }
+    }
+
+    if (lost != 0)
+        ERROR("%u host file/dir/socket handles are not kept in the save state.\n", lost);
+}
+
+void handle_LoadState()
+{
+    u32 i, j, num;
+
+    savestate_Get(&num, sizeof(num));
+    if (num > MAX_NUM_HANDLES) {
+        ERROR("not enough handles..\n");
+        num = 0;
+    }
+
+    handles_num = num;
+
+    for (i = 0; i < handles_num; i++) {
+        handleinfo* h = &handles[i];
+        file_type* file;
+        archive* arch;
+        u32 kind;
+
+        savestate_Get(&kind, sizeof(kind));
+        savestate_Get(h, sizeof(handleinfo));
+
+        switch (kind) {
+        case STATE_VALUE:
+            for (j = 0; j < ARRAY_SIZE(h->misc_ptr); j++)
+                h->misc_ptr[j] = savestate_GetPtr();
+            break;
+        case STATE_FILE:
+            file = malloc(sizeof(file_type));
+            if (file == NULL) {
+                ERROR("Not enough mem.\n");
+                savestate_Fail();
+                h->type = HANDLE_TYPE_UNK;
+                break;
+            }
+            savestate_Get(file, sizeof(file_type));
+            savestate_Relocate(file, 5); // fnRead .. fnClose
+            h->subtype = (uintptr_t)file;
+            break;
+        case STATE_ARCHIVE:
+            arch = malloc(sizeof(archive));
+            if (arch == NULL) {
+                ERROR("Not enough mem.\n");
+                savestate_Fail();
+                h->type = HANDLE_TYPE_UNK;
+                break;
+            }
+            savestate_Get(arch, sizeof(archive));
+            savestate_Relocate(arch, 10); // fnRenameFile .. fnDeinitialize
+            h->subtype = (uintptr_t)arch;
+            break;
+        default:
+            h->type = HANDLE_TYPE_UNK;
+            h->locked = false;
+            break;
+        }
+    }
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "util.h"
+#include "hid_user.h"
+
+// Input scripts (-input). One entry per line, '#' comments:
+//
+//   <frame> [<button>...] [touch <x> <y>] [circle <x> <y>]
+//
+// From VBlank <frame> on the pad holds exactly that state, up to the next
+// entry, so "120 A" then "126" is a six frame press of A. Frames count up
+// from boot, entries must come in order.
+
+typedef struct {
+    u32  frame;
+    u32  buttons;
+    bool touch;
+    u16  touch_x, touch_y;
+    s16  circle_x, circle_y;
+} input_entry;
+
+static const struct {
+    const char* name;
+    u32 bit;
+} button_names[] = {
+    { "A", HID_A }, { "B", HID_B }, { "SELECT", HID_SELECT }, { "START", HID_START },
+    { "RIGHT", HID_RIGHT }, { "LEFT", HID_LEFT }, { "UP", HID_UP }, { "DOWN", HID_DOWN },
+    { "R", HID_R }, { "L", HID_L }, { "X", HID_X }, { "Y", HID_Y },
+    { "ZL", HID_ZL }, { "ZR", HID_ZR },
+};
+
+static input_entry* entries;
+static u32 num_entries;
+static u32 next_entry;
+
+static int ParseButton(const char* word, u32* bit)
+{
+    u32 i;
+    char up[16];
+
+    for (i = 0; i + 1 < sizeof(up) && word[i] != '\0'; i++)
+        up[i] = (char)toupper((unsigned char)word[i]);
+    up[i] = '\0';
+
+    for (i = 0; i < ARRAY_SIZE(button_names); i++) {
+        if (strcmp(up, button_names[i].name) == 0) {
+            *bit = button_names[i].bit;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int ParseLine(char* line, input_entry* e)
+{
+    char* word = strtok(line, " \t\r\n");
+    char* end;
+
+    memset(e, 0, sizeof(*e));
+    e->frame = strtoul(word, &end, 0);
+    if (*end != '\0')
+        return -1;
+
+    while ((word = strtok(NULL, " \t\r\n")) != NULL) {
+        if (strcmp(word, "touch") == 0 || strcmp(word, "circle") == 0) {
+            char* x = strtok(NULL, " \t\r\n");
+            char* y = strtok(NULL, " \t\r\n");
+
+            if (x == NULL || y == NULL)
+                return -1;
+
+            if (word[0] == 't') {
+                e->touch = true;
+                e->touch_x = (u16)strtoul(x, NULL, 0);
+                e->touch_y = (u16)strtoul(y, NULL, 0);
+            } else {
+                e->circle_x = (s16)strtol(x, NULL, 0);
+                e->circle_y = (s16)strtol(y, NULL, 0);
+            }
+        } else {
+            u32 bit;
+
+            if (ParseButton(word, &bit) != 0)
+                return -1;
+            e->buttons |= bit;
+        }
+    }
+    return 0;
+}
+
+int input_Load(const char* path)
+{
+    char line[256];
+    u32 max = 0, n = 0;
+    FILE* fd = fopen(path, "r");
+
+    if (fd == NULL) {
+        ERROR("Failed to open %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        char* hash = strchr(line, '#');
+        input_entry e;
+
+        n++;
+        if (hash != NULL)
+            *hash = '\0';
+        if (strspn(line, " \t\r\n") == strlen(line))
+            continue;
+
+        if (ParseLine(line, &e) != 0) {
+            ERROR("%s:%u: bad input entry\n", path, n);
+            fclose(fd);
+            return -1;
+        }
+        if (num_entries != 0 && e.frame < entries[num_entries - 1].frame) {
+            ERROR("%s:%u: frame %u is before the last entry\n", path, n, e.frame);
+            fclose(fd);
+            return -1;
+        }
+
+        if (num_entries == max) {
+            input_entry* grown = realloc(entries, sizeof(input_entry) * (max ? max * 2 : 64));
+            if (grown == NULL) {
+                ERROR("realloc failed\n");
+                fclose(fd);
+                return -1;
+            }
+            entries = grown;
+            max = max ? max * 2 : 64;
+        }
+        entries[num_entries++] = e;
+    }
+
+    fclose(fd);
+    DEBUG("%u input entries from %s\n", num_entries, path);
+    return 0;
+}
+
+// Called at every VBlank.
+void input_Frame(u32 frame)
+{
+    while (next_entry < num_entries && entries[next_entry].frame <= frame) {
+        input_entry* e = &entries[next_entry++];
+
+        // Only the last entry of a frame matters.
+        if (next_entry < num_entries && entries[next_entry].frame <= frame)
+            continue;
+
+        hid_SetPad(e->buttons | (e->touch ? HID_TOUCH : 0), e->circle_x, e->circle_y);
+        hid_SetTouch(e->touch, e->touch_x, e->touch_y);
+    }
+}
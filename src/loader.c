@@ -18,16 +18,23 @@
 
 #include <stdlib.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 #include "util.h"
 #include "arm11.h"
 #include "mem.h"
 #include "fs.h"
 #include "threads.h"
 #include "loader.h"
+#include "profiler.h"
+#include "config.h"
 #include "3dsx.h"
 
 #include "crypto/aes.h"
 #include "crypto/nin_public_crypto.h"
+#include "crypto/sha2.h"
 
 u8 loader_key[0x10];
 u32 loader_txt = 0;
@@ -41,7 +48,6 @@ ctr_ncchheader loader_h;
 exheader_header ex;
 
 
-extern thread threads[MAX_THREADS];
 
 static u32 Read32(uint8_t p[4])
 {
@@ -53,6 +59,13 @@ static u16 Read16(uint8_t p[2])
     u16 temp = p[0] | p[1] << 8;
     return temp;
 }
+static void Write32(uint8_t p[4], u32 v)
+{
+    p[0] = (u8)v;
+    p[1] = (u8)(v >> 8);
+    p[2] = (u8)(v >> 16);
+    p[3] = (u8)(v >> 24);
+}
 
 static u32 AlignPage(u32 in)
 {
@@ -218,20 +231,24 @@ int Load3DSXFile(FILE* f, u32 baseAddr)
     for (i = 0; i < 3; i++)
         if (fread(&relocs[i*nRelocTables], nRelocTables * 4, 1, f) != 1) {
             ERROR("error reading reloc header");
+            free(allMem);
             return 4;
         }
 
     // Read the segments
     if (fread(d.segPtrs[0], hdr.codeSegSize, 1, f) != 1) {
         ERROR("error reading code");
+        free(allMem);
         return 5;
     }
     if (fread(d.segPtrs[1], hdr.rodataSegSize, 1, f) != 1) {
         ERROR("error reading rodata");
+        free(allMem);
         return 5;
     }
     if (fread(d.segPtrs[2], hdr.dataSegSize - hdr.bssSize, 1, f) != 1) {
         ERROR("error reading data");
+        free(allMem);
         return 5;
     }
 
@@ -258,8 +275,10 @@ int Load3DSXFile(FILE* f, u32 baseAddr)
                 u32 toDo = nRelocs > RELOCBUFSIZE ? RELOCBUFSIZE : nRelocs;
                 nRelocs -= toDo;
 
-                if (fread(relocTbl, toDo*sizeof(_3DSX_Reloc), 1, f) != 1)
+                if (fread(relocTbl, toDo*sizeof(_3DSX_Reloc), 1, f) != 1) {
+                    free(allMem);
                     return 6;
+                }
 
                 for (k = 0; k < toDo && pos < endPos; k++) {
                     //DEBUG("(t=%d,skip=%u,patch=%u)\n", j, (u32)relocTbl[k].skip, (u32)relocTbl[k].patch);
@@ -284,12 +303,12 @@ int Load3DSXFile(FILE* f, u32 baseAddr)
         }
     }
 
-    // Write the data
-    if (mem_AddSegment(baseAddr, d.segSizes[0] + d.segSizes[1] + d.segSizes[2], allMem)) {
+    // The buffer becomes the backing store, no copy.
+    if (mem_AdoptMapping(baseAddr, d.segSizes[0] + d.segSizes[1] + d.segSizes[2], allMem, NULL)) {
         ERROR("error in AddSegment");
+        free(allMem);
         return 7;
     }
-    free(allMem);
 
     DEBUG("CODE:   %u pages\n", d.segSizes[0] / 0x1000);
     DEBUG("RODATA: %u pages\n", d.segSizes[1] / 0x1000);
@@ -299,6 +318,36 @@ int Load3DSXFile(FILE* f, u32 baseAddr)
     return 0; // Success.
 }
 
+// Hands the FUNC entries of .symtab to the profiler.
+static void LoadElfSymbols(u8 *addr)
+{
+    u32 *header = (u32*) addr;
+    u8 *shdr = addr + Read32((u8*) &header[8]);
+    u32 shentsize = Read32((u8*) &header[11]) >> 16;
+    u32 shnum = Read32((u8*) &header[12]) & 0xFFFF;
+    u32 i, j;
+
+    if (Read32((u8*) &header[8]) == 0 || shentsize < 40)
+        return;
+
+    for (i = 0; i < shnum; i++) {
+        u32 *sec = (u32*) (shdr + i * shentsize);
+        if (Read32((u8*) &sec[1]) != 2) // SHT_SYMTAB
+            continue;
+
+        u32 *strsec = (u32*) (shdr + Read32((u8*) &sec[6]) * shentsize);
+        char *strtab = (char*) addr + Read32((u8*) &strsec[4]);
+        u8 *sym = addr + Read32((u8*) &sec[4]);
+        u32 num = Read32((u8*) &sec[5]) / 16;
+
+        for (j = 0; j < num; j++, sym += 16) {
+            if ((sym[12] & 0xF) != 2) // STT_FUNC
+                continue;
+            profiler_AddSymbol(Read32(sym + 4), Read32(sym + 8), strtab + Read32(sym));
+        }
+    }
+}
+
 static u32 LoadElfFile(u8 *addr)
 {
     u32 *header = (u32*) addr;
@@ -318,17 +367,23 @@ static u32 LoadElfFile(u8 *addr)
         //round up (this fixes bad malloc implementation in some homebrew)
         memsz = (memsz + 0xFFF)&~0xFFF;
 
-        u8* data = malloc(memsz);
-        memset(data, 0, memsz);
+        // Handed over as the backing store, no second copy.
+        u8* data = calloc(memsz, 1);
+        if (data == NULL) {
+            ERROR("calloc failed\n");
+            continue;
+        }
         memcpy(data, addr + off, filesz);
-        mem_AddSegment(dest, memsz, data);
-
-        free(data);
+        if (mem_AdoptMapping(dest, memsz, data, NULL) != 0)
+            free(data);
 
         if ((phdr[6] & 0x5) == 0x5)loader_txt = dest; //read execute
         if ((phdr[6] & 0x6) == 0x6)loader_data = loader_bss = dest;//read write
     }
 
+    if (profiler_enabled)
+        LoadElfSymbols(addr);
+
     return Read32((u8*) &header[6]);
 }
 
@@ -356,6 +411,229 @@ static void CommonMemSetup()
 
 }
 
+// Reads, decrypts and decompresses a .code section and checks it against the
+// ExeFS header hash. The returned buffer is padded with zeros up to the next
+// page.
+static u8* ReadCodeSection(FILE* fd, u32 ncch_off, u32 exefs_off, u32 sec_off, u32* size_out,
+                           bool decompress, const u8* hash, bool* verified)
+{
+    ctr_aes_context ctx;
+    u32 size = *size_out;
+    u8 digest[32];
+
+    fseek(fd, sec_off + ncch_off, SEEK_SET);
+
+    u8* sec = malloc(AlignPage(size));
+    if (sec == NULL) {
+        ERROR("section malloc failed.\n");
+        return NULL;
+    }
+
+    if (fread(sec, size, 1, fd) != 1) {
+        ERROR("section fread failed.\n");
+        free(sec);
+        return NULL;
+    }
+
+    if (loader_encrypted) {
+        ncch_extract_prepare(&ctx, &loader_h, NCCHTYPE_EXEFS, loader_key);
+        ctr_add_counter(&ctx, (sec_off - (exefs_off)) / 0x10);
+        ctr_crypt_counter(&ctx, sec, sec, size);
+    }
+
+    // The hash covers the section as stored, before decompression. A
+    // mismatch is reported but not fatal, plenty of homebrew builders
+    // leave it unset.
+    sha2(sec, size, digest, 0);
+    *verified = memcmp(digest, hash, sizeof(digest)) == 0;
+    if (!*verified)
+        ERROR("ExeFS .code hash mismatch.\n");
+
+    if (decompress) {
+        u32 dec_size = GetDecompressedSize(sec, size);
+        u8* dec = malloc(AlignPage(dec_size));
+
+        if (!dec) {
+            ERROR("decompressed data block allocation failed.\n");
+            free(sec);
+            return NULL;
+        }
+
+        DEBUG("Decompressing..\n");
+        if (Decompress(sec, size, dec, dec_size) == 0) {
+            ERROR("section decompression failed.\n");
+            free(sec);
+            free(dec);
+            return NULL;
+        }
+        DEBUG("  .. OK\n");
+
+        /*FILE * pFile;
+        pFile = fopen("code.code", "wb");
+        if (pFile != NULL)
+        {
+            fwrite(dec, 1, dec_size, pFile);
+            fclose(pFile);
+        }*/
+
+
+        if (codepath != NULL) {
+            FILE* pFile = fopen(codepath, "rb");
+            if (pFile != NULL) {
+                fread(dec, 1, dec_size, pFile);
+                fclose(pFile);
+            }
+        }
+
+        free(sec);
+        sec = dec;
+        size = dec_size;
+    }
+
+    // Zero the tail, the whole last page gets mapped.
+    memset(sec + size, 0, AlignPage(size) - size);
+
+    *size_out = size;
+    return sec;
+}
+
+/* ____ Code set cache ____ */
+
+// Decrypted and decompressed .code sections are kept in config_codecache_path,
+// named after the program id and the section hash from the ExeFS header.
+// Only sections that matched that hash are stored, so a second launch maps
+// the file copy-on-write and uses it as is, without hashing it again.
+//
+// The section is followed by a trailer, written last. A file cut short, or
+// one that does not fit the exheader code set, is not used.
+
+#define CODECACHE_MAGIC 0x45444F43 // "CODE"
+
+typedef struct {
+    u8 hash[0x20];
+    u8 size[4];
+    u8 magic[4];
+} codecache_trailer;
+
+static void CodeCachePath(char* out, const u8* hash)
+{
+    sprintf(out, "%s/%016llx-%02x%02x%02x%02x%02x%02x%02x%02x.code", config_codecache_path,
+            (unsigned long long)Read32(loader_h.programid) | (unsigned long long)Read32(loader_h.programid + 4) << 32,
+            hash[0], hash[1], hash[2], hash[3], hash[4], hash[5], hash[6], hash[7]);
+}
+
+// Decompressed, text and rodata are page aligned and data follows.
+static bool CodeSizeMatches(u32 size)
+{
+    u32 text = Read32(ex.codesetinfo.text.codesize);
+    u32 ro = Read32(ex.codesetinfo.ro.codesize);
+    u32 data = Read32(ex.codesetinfo.data.codesize);
+
+    return size >= text + ro + data && size <= AlignPage(text) + AlignPage(ro) + AlignPage(data);
+}
+
+static void CodeCacheRelease(u8* data, u32 size)
+{
+#ifdef _WIN32
+    free(data);
+#else
+    munmap(data, AlignPage(size));
+#endif
+}
+
+static u8* CodeCacheLoad(const u8* hash, u32* size_out)
+{
+    char path[0x300];
+    codecache_trailer tr;
+    u8* data;
+    long end;
+    u32 size;
+
+    CodeCachePath(path, hash);
+
+    FILE* fd = fopen(path, "rb");
+    if (fd == NULL)
+        return NULL;
+
+    if (fseek(fd, 0, SEEK_END) != 0 || (end = ftell(fd)) < (long)sizeof(tr) ||
+        fseek(fd, end - sizeof(tr), SEEK_SET) != 0 || fread(&tr, sizeof(tr), 1, fd) != 1) {
+        fclose(fd);
+        return NULL;
+    }
+
+    size = Read32(tr.size);
+    if (Read32(tr.magic) != CODECACHE_MAGIC || memcmp(tr.hash, hash, sizeof(tr.hash)) != 0 ||
+        (long)size != end - (long)sizeof(tr) || !CodeSizeMatches(size)) {
+        ERROR("ignoring stale %s\n", path);
+        fclose(fd);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    // A view can't reach past the end of a read-only file, read it instead.
+    data = calloc(AlignPage(size), 1);
+    fseek(fd, 0, SEEK_SET);
+    if (data != NULL && fread(data, size, 1, fd) != 1) {
+        free(data);
+        data = NULL;
+    }
+#else
+    // Private and writable: guest writes stay in memory. The trailer is
+    // cleared out of the last page, past the end of the file it reads as
+    // zero.
+    data = mmap(NULL, AlignPage(size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fd), 0);
+    if (data == MAP_FAILED)
+        data = NULL;
+    else
+        memset(data + size, 0, AlignPage(size) - size);
+#endif
+    fclose(fd);
+
+    if (data == NULL) {
+        ERROR("failed to map %s\n", path);
+        return NULL;
+    }
+
+    *size_out = size;
+    return data;
+}
+
+static void CodeCacheStore(const u8* hash, const u8* data, u32 size)
+{
+    char path[0x300];
+    char tmp[0x320];
+    codecache_trailer tr;
+
+    if (!CodeSizeMatches(size))
+        return;
+
+    CodeCachePath(path, hash);
+    sprintf(tmp, "%s.%d", path, (int)getpid());
+
+    memcpy(tr.hash, hash, sizeof(tr.hash));
+    Write32(tr.size, size);
+    Write32(tr.magic, CODECACHE_MAGIC);
+
+    // Written aside and renamed, so parallel launches never see half a file.
+    FILE* fd = fopen(tmp, "wb");
+    if (fd == NULL) {
+        ERROR("failed to create %s\n", tmp);
+        return;
+    }
+
+    bool ok = fwrite(data, size, 1, fd) == 1 && fwrite(&tr, sizeof(tr), 1, fd) == 1;
+    ok = fclose(fd) == 0 && ok;
+
+#ifdef _WIN32
+    if (ok)
+        remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        ERROR("failed to write %s\n", path);
+        remove(tmp);
+    }
+}
+
 int loader_LoadFile(FILE* fd)
 {
     u32 ncch_off = 0;
@@ -521,75 +799,36 @@ int loader_LoadFile(FILE* fd)
         bool isfirmNCCH = false;
 
         if (strcmp((char*) eh.section[i].name, ".code") == 0) {
-            sec_off += exefs_off + sizeof(eh);
-            fseek(fd, sec_off + ncch_off, SEEK_SET);
-
-            uint8_t* sec = malloc(AlignPage(sec_size));
-            if (sec == NULL) {
-                ERROR("section malloc failed.\n");
-                return 1;
-            }
-
-            if (fread(sec, sec_size, 1, fd) != 1) {
-                ERROR("section fread failed.\n");
-                free(sec);
-                return 1;
-            }
-
-            if (loader_encrypted) {
-                ncch_extract_prepare(&ctx, &loader_h, NCCHTYPE_EXEFS, loader_key);
-                ctr_add_counter(&ctx, (sec_off - (exefs_off)) / 0x10);
-                ctr_crypt_counter(&ctx, sec, sec, sec_size);
-            }
-
-
-            // Decompress first section if flag set.
-            if (i == 0 && is_compressed) {
-                u32 dec_size = GetDecompressedSize(sec, sec_size);
-                u8* dec = malloc(AlignPage(dec_size));
+            // The ExeFS header keeps a SHA-256 per section, in reverse order.
+            u8* sec_hash = eh.hashes[7 - i];
+            bool use_cache = config_codecache && codepath == NULL &&
+                             (loader_encrypted || (i == 0 && is_compressed));
+            bool sec_mapped = false;
+            uint8_t* sec = NULL;
+
+            if (use_cache)
+                sec = CodeCacheLoad(sec_hash, &sec_size);
+
+            if (sec != NULL) {
+                DEBUG("Using cached code set\n");
+                sec_mapped = true;
+            } else {
+                bool verified;
 
-                if (!dec) {
-                    ERROR("decompressed data block allocation failed.\n");
-                    free(sec);
+                sec = ReadCodeSection(fd, ncch_off, exefs_off, sec_off + exefs_off + sizeof(eh),
+                                      &sec_size, i == 0 && is_compressed, sec_hash, &verified);
+                if (sec == NULL)
                     return 1;
-                }
-
-                u32 firmexpected = Read32(ex.codesetinfo.text.codesize) + Read32(ex.codesetinfo.ro.codesize) + Read32(ex.codesetinfo.data.codesize);
 
-                DEBUG("Decompressing..\n");
-                if (Decompress(sec, sec_size, dec, dec_size) == 0) {
-                    ERROR("section decompression failed.\n");
-                    free(sec);
-                    free(dec);
-                    return 1;
-                }
-                DEBUG("  .. OK\n");
-
-                /*FILE * pFile;
-                pFile = fopen("code.code", "wb");
-                if (pFile != NULL)
-                {
-                    fwrite(dec, 1, dec_size, pFile);
-                    fclose(pFile);
-                }*/
-
-
-                if (codepath != NULL) {
-                    FILE* pFile = fopen(codepath, "rb");
-                    if (pFile != NULL) {
-                        fread(dec, 1, dec_size, pFile);
-                        fclose(pFile);
-                    }
-                }
+                if (use_cache && verified)
+                    CodeCacheStore(sec_hash, sec, sec_size);
+            }
 
-                if (dec_size == firmexpected) {
-                    isfirmNCCH = true;
-                    DEBUG("firm NCCH detected\n");
-                }
+            u32 firmexpected = Read32(ex.codesetinfo.text.codesize) + Read32(ex.codesetinfo.ro.codesize) + Read32(ex.codesetinfo.data.codesize);
 
-                free(sec);
-                sec = dec;
-                sec_size = dec_size;
+            if (i == 0 && is_compressed && sec_size == firmexpected) {
+                isfirmNCCH = true;
+                DEBUG("firm NCCH detected\n");
             }
 
             // Load .code section.
@@ -604,9 +843,22 @@ int loader_LoadFile(FILE* fd)
 
                 mem_AddSegment(Read32(ex.codesetinfo.data.address), Read32(ex.codesetinfo.data.codesize) + Read32(ex.codesetinfo.bsssize), temp);
                 free(temp);
+
+                if (sec_mapped)
+                    CodeCacheRelease(sec, sec_size);
+                else
+                    free(sec);
             } else {
+                // The section buffer becomes the backing store, no copy.
                 sec_size = AlignPage(sec_size);
-                mem_AddSegment(Read32(ex.codesetinfo.text.address), sec_size, sec);
+                if (mem_AdoptMapping(Read32(ex.codesetinfo.text.address), sec_size, sec,
+                                     sec_mapped ? CodeCacheRelease : NULL) != 0) {
+                    if (sec_mapped)
+                        CodeCacheRelease(sec, sec_size);
+                    else
+                        free(sec);
+                    return 1;
+                }
                 // Add .bss segment.
                 u32 bss_off = AlignPage(Read32(ex.codesetinfo.data.address) +
                                         Read32(ex.codesetinfo.data.codesize));
@@ -615,7 +867,6 @@ int loader_LoadFile(FILE* fd)
             loader_txt = Read32(ex.codesetinfo.text.address);
             loader_data = Read32(ex.codesetinfo.ro.address);
             loader_bss = Read32(ex.codesetinfo.data.address);
-            free(sec);
         }
     }
 
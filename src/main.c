@@ -28,7 +28,18 @@
 #include <signal.h>
 #include <SDL.h>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include "config.h"
+#include "trace.h"
+#include "profiler.h"
+#include "fs.h"
+#include "savestate.h"
+#include "dsp.h"
+#include "hid_user.h"
+#include "bench.h"
 
 #ifdef GDB_STUB
 #include "armemu.h"
@@ -40,12 +51,10 @@
 
 #include "armemu.h"
 
-extern ARMul_State s;
+extern THREAD_LOCAL ARMul_State* arm11_state;
 
 int loader_LoadFile(FILE* fd);
 
-u32 curprocesshandle;
-
 #ifdef GDB_STUB
 u32 global_gdb_port = 0;
 gdbstub_handle_t gdb_stub;
@@ -55,7 +64,7 @@ struct armcpu_memory_iface gdb_base_memory_iface;
 struct armcpu_ctrl_iface gdb_ctrl_iface;
 #endif
 
-static int running = 1;
+static volatile int running = 1;
 int noscreen = 0;
 bool disasm = false;
 char* codepath = NULL;
@@ -82,6 +91,10 @@ void AtSig(int t)
 void AtExit(void)
 {
     arm11_Dump();
+    trace_Dump();
+    profiler_Dump();
+    hostfile_CommitAll();
+    dspaudio_Shutdown();
 
     if(!noscreen)
         screen_Free();
@@ -100,6 +113,65 @@ void FPS_Lock(void)
     return;
 }
 
+#ifdef MODULE_SUPPORT
+
+// Every module runs on its own host thread, the application on the main
+// one. They only meet in the kernel, see threads_LockKernel.
+#ifdef _WIN32
+static HANDLE* module_threads;
+
+static DWORD WINAPI ModuleMain(LPVOID arg)
+#else
+static pthread_t* module_threads;
+
+static void* ModuleMain(void* arg)
+#endif
+{
+    ModuleSupport_SwapProcessMem((u32)(uintptr_t)arg);
+
+    while (running)
+        threads_Execute();
+    return 0;
+}
+
+static int StartModules()
+{
+    u32 i;
+
+    module_threads = calloc(modulenum + 1, sizeof(*module_threads));
+    if (module_threads == NULL)
+        return -1;
+
+    for (i = 1; i < modulenum + 1; i++) {
+#ifdef _WIN32
+        module_threads[i] = CreateThread(NULL, 0, ModuleMain, (LPVOID)(uintptr_t)i, 0, NULL);
+        if (module_threads[i] == NULL) {
+#else
+        if (pthread_create(&module_threads[i], NULL, ModuleMain, (void*)(uintptr_t)i) != 0) {
+#endif
+            ERROR("Failed to start module %d.\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void StopModules()
+{
+    u32 i;
+
+    running = 0;
+    for (i = 1; i < modulenum + 1; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(module_threads[i], INFINITE);
+#else
+        pthread_join(module_threads[i], NULL);
+#endif
+    }
+}
+
+#endif
+
 int main(int argc, char* argv[])
 {
 #ifndef WIN32
@@ -117,14 +189,24 @@ int main(int argc, char* argv[])
         printf("Usage:\n");
 
 #ifdef MODULE_SUPPORT
-        printf("%s <in.ncch> [-d|-noscreen|-codepatch <code>|-modules <num> <in.ncch>|-overdrivlist <num> <services>|-sdmc <path>|-sysdata <path>|-sdwrite|-slotone|-configsave|-gdbport <port>]\n", argv[0]);
+        printf("%s <in.ncch> [-d|-noscreen|-codepatch <code>|-modules <num> <in.ncch>|-overdrivlist <num> <services>|-sdmc <path>|-sysdata <path>|-codecache <path>|-overlay <path>|-sdwrite|-slotone|-configsave|-ipcstats <out.csv|out.json>|-ipctrace <out.bin>|-profile <out.folded>|-profileinterval <n>|-wav <out.wav>|-savestate <path> <frame>|-loadstate <path>|-input <script>|-bench <frames>|-gdbport <port>]\n", argv[0]);
 #else
-        printf("%s <in.ncch> [-d|-noscreen|-codepatch <code>|-sdmc <path>|-sysdata <path>|-sdwrite|-slotone|-configsave|-gdbport <port>]\n", argv[0]);
+        printf("%s <in.ncch> [-d|-noscreen|-codepatch <code>|-sdmc <path>|-sysdata <path>|-codecache <path>|-overlay <path>|-sdwrite|-slotone|-configsave|-ipcstats <out.csv|out.json>|-ipctrace <out.bin>|-profile <out.folded>|-profileinterval <n>|-wav <out.wav>|-savestate <path> <frame>|-loadstate <path>|-input <script>|-bench <frames>|-gdbport <port>]\n", argv[0]);
 #endif
 
         return 1;
     }
 
+    char* ipcstats_path = NULL;
+    char* ipctrace_path = NULL;
+    char* profile_path = NULL;
+    u32 profile_interval = PROFILER_DEFAULT_INTERVAL;
+    char* savestate_path = NULL;
+    u32 savestate_frame = 0;
+    char* loadstate_path = NULL;
+    char* wav_path = NULL;
+    char* input_path = NULL;
+
     //disasm = (argc > 2) && (strcmp(argv[2], "-d") == 0);
     //noscreen =    (argc > 2) && (strcmp(argv[2], "-noscreen") == 0);
 
@@ -144,11 +226,52 @@ int main(int argc, char* argv[])
             strcpy(config_sysdataoutpath, argv[i]);
             config_usesys = true;
         }
+        else if ((strcmp(argv[i], "-codecache") == 0)) {
+            i++;
+            strcpy(config_codecache_path, argv[i]);
+            config_codecache = true;
+        }
+        else if ((strcmp(argv[i], "-overlay") == 0)) {
+            i++;
+            strcpy(config_overlay_path, argv[i]);
+            config_overlay = true;
+        }
         else if ((strcmp(argv[i], "-sdwrite") == 0))config_sdmcwriteable = true;
         else if ((strcmp(argv[i], "-slotone") == 0))config_slotone = true;
         else if ((strcmp(argv[i], "-configsave") == 0))config_nand_cfg_save = true;
         else if ((strcmp(argv[i], "-region=EU") == 0))config_region = 2;
         else if ((strcmp(argv[i], "-region=USA") == 0))config_region = 1;
+        else if ((strcmp(argv[i], "-ipcstats") == 0)) {
+            i++;
+            ipcstats_path = argv[i];
+        } else if ((strcmp(argv[i], "-ipctrace") == 0)) {
+            i++;
+            ipctrace_path = argv[i];
+        } else if ((strcmp(argv[i], "-profile") == 0)) {
+            i++;
+            profile_path = argv[i];
+        } else if ((strcmp(argv[i], "-profileinterval") == 0)) {
+            i++;
+            profile_interval = atoi(argv[i]);
+        } else if ((strcmp(argv[i], "-savestate") == 0)) {
+            i++;
+            savestate_path = argv[i];
+            i++;
+            savestate_frame = atoi(argv[i]);
+        } else if ((strcmp(argv[i], "-loadstate") == 0)) {
+            i++;
+            loadstate_path = argv[i];
+        } else if ((strcmp(argv[i], "-wav") == 0)) {
+            i++;
+            wav_path = argv[i];
+        } else if ((strcmp(argv[i], "-input") == 0)) {
+            i++;
+            input_path = argv[i];
+        } else if ((strcmp(argv[i], "-bench") == 0)) {
+            i++;
+            bench_Init(atoi(argv[i]));
+            noscreen = true;
+        }
 
 #ifdef GDB_STUB
         if ((strcmp(argv[i], "-gdbport") == 0)) {
@@ -212,31 +335,42 @@ int main(int argc, char* argv[])
     ModuleSupport_MemInit(modulenum);
 #endif
 
+    if ((ipcstats_path != NULL || ipctrace_path != NULL) && trace_Init(ipcstats_path, ipctrace_path) != 0)
+        return 1;
+
+    if (config_overlay && overlay_Init(config_overlay_path) != 0)
+        return 1;
+
     signal(SIGINT, AtSig);
 
     if (!noscreen)
         screen_Init();
     hid_spvr_init();
     hid_user_init();
+    if (input_path != NULL && input_Load(input_path) != 0)
+        return 1;
     initDSP();
+    if (dspaudio_Init(wav_path) != 0)
+        return 1;
     mcu_GPU_init();
     gpu_Init();
     srv_InitGlobal();
 
 
+    if (profile_path != NULL && profiler_Init(profile_path, profile_interval) != 0)
+        return 1;
+
     arm11_Init();
 
 #ifdef MODULE_SUPPORT
     u32 i;
 
+    // The application is process 0, module i is process i + 1.
     for (i = 0; i<modulenum; i++) {
         u32 handzwei = handle_New(HANDLE_TYPE_PROCESS, 0);
-        curprocesshandle = handzwei;
-        *(curprocesshandlelist + i) = handzwei;
-
-        ModuleSupport_SwapProcessMem(i);
+        *(curprocesshandlelist + i + 1) = handzwei;
 
-        s.NextInstr = RESUME;
+        ModuleSupport_SwapProcessMem(i + 1);
 
         u32 hand = handle_New(HANDLE_TYPE_THREAD, 0);
         threads_New(hand);
@@ -255,8 +389,8 @@ int main(int argc, char* argv[])
     }
 
     u32 handzwei = handle_New(HANDLE_TYPE_PROCESS, 0);
-    *(curprocesshandlelist + modulenum) = handzwei;
-    ModuleSupport_SwapProcessMem(modulenum);
+    *curprocesshandlelist = handzwei;
+    ModuleSupport_SwapProcessMem(0);
 #else
     u32 handzwei = handle_New(HANDLE_TYPE_PROCESS, 0);
     curprocesshandle = handzwei;
@@ -276,11 +410,6 @@ int main(int argc, char* argv[])
         fclose(fd);
         return 1;
     }
-#ifdef MODULE_SUPPORT
-        s.NextInstr = RESUME;
-        ModuleSupport_SwapProcessMem(0);
-#endif
-
 #ifdef GDB_STUB
     if (global_gdb_port) {
         gdb_stub = createStub_gdb(global_gdb_port,
@@ -292,36 +421,41 @@ int main(int argc, char* argv[])
             exit(-1);
         }
         activateStub_gdb(gdb_stub, &gdb_ctrl_iface);
-    } else {
-        gdb_memio = malloc(sizeof(struct armcpu_memory_iface));
-        gdb_memio->prefetch16 = gdb_prefetch16;
-        gdb_memio->prefetch32 = gdb_prefetch32;
-        gdb_memio->read32 = gdb_read32;
-        gdb_memio->write32 = gdb_write32;
-        gdb_memio->read16 = gdb_read16;
-        gdb_memio->write16 = gdb_write16;
-        gdb_memio->read8 = gdb_read8;
-        gdb_memio->write8 = gdb_write8;
     }
 #endif
-    // Execute.
-    while (running) {
+
+    // A state that fails to load leaves the freshly booted title running.
+    if (loadstate_path != NULL && savestate_Load(loadstate_path) == SAVESTATE_LOST)
+        return 1;
+
 #ifdef MODULE_SUPPORT
-        for (u32 i = 0; i < modulenum + 1; i++)
-        {
-            //DEBUG("process:%d\n",i);
-            ModuleSupport_SwapProcessMem(i);
+    if (StartModules() != 0)
+        return 1;
 #endif
-            if (!noscreen)
-                screen_HandleEvent();
-            threads_Execute();
-            //FPS_Lock();
-            //mem_Dbugdump();
-#ifdef MODULE_SUPPORT
+
+    // Execute.
+    while (running) {
+        if (!noscreen)
+            screen_HandleEvent();
+        threads_Execute();
+        trace_Poll();
+        hostfile_Tick();
+
+        // Every thread context is in the thread table here.
+        if (savestate_path != NULL && threads_GetFrameCount() >= savestate_frame) {
+            if (savestate_Save(savestate_path) != SAVESTATE_BUSY)
+                savestate_path = NULL;
         }
-#endif
+        if (bench_enabled && bench_Frame(threads_GetFrameCount()))
+            running = 0;
+        //FPS_Lock();
+        //mem_Dbugdump();
     }
 
+#ifdef MODULE_SUPPORT
+    StopModules();
+#endif
+
 
     fclose(fd);
     return 0;
@@ -16,6 +16,10 @@
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include "util.h"
 #include "arm11.h"
 #include "handles.h"
@@ -23,7 +27,9 @@
 #include "armdefs.h"
 #include "armemu.h"
 #include "threads.h"
+#include "mem.h"
 #include "gpu.h"
+#include "savestate.h"
 
 
 
@@ -35,59 +41,103 @@ extern struct armcpu_memory_iface *gdb_memio;
 #endif
 
 
-extern ARMul_State s;
+extern THREAD_LOCAL ARMul_State* arm11_state;
 
 typedef struct {
     uint32_t base;
     uint32_t size;
     uint8_t* phys;
     bool     ro;
+    mem_release release; // NULL if the memory belongs to someone else.
 #ifdef MEM_TRACE_EXTERNAL
     bool enable_log;
 #endif
 } memmap_t;
 
-#define MAX_MAPPINGS 16
+#define MAX_MAPPINGS 64 // ldr:ro maps every CRO on its own.
+
+struct mem_table {
+    memmap_t map[MAX_MAPPINGS];
+    size_t   num;
+};
 
-static memmap_t mappings[MAX_MAPPINGS];
-static size_t   num_mappings;
+// The mapping table of the process running on this host thread, see
+// ModuleSupport_SwapProcessMem. Process 0 is the application.
+static struct mem_table table_default;
+static THREAD_LOCAL struct mem_table* table = &table_default;
 
 //#define MEM_TRACE 1
 #define PRINT_ILLEGAL 1
 //#define EXIT_ON_ILLEGAL 1
 
 
+// Host threads working for a process, like the FS I/O thread, use its
+// table for the guest memory they touch.
+struct mem_table* mem_CurrentTable()
+{
+    return table;
+}
+
+void mem_UseTable(struct mem_table* t)
+{
+    table = t;
+}
+
+// Only the process itself changes its table, so it reads it without a
+// lock. Other host threads writing into its memory hold map_lock while
+// they do, the process takes it to add, drop or reload mappings.
+#ifdef _WIN32
+static volatile LONG map_lock;
+#else
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void mem_LockMappings()
+{
+#ifdef _WIN32
+    while (InterlockedExchange(&map_lock, 1) != 0)
+        Sleep(1);
+#else
+    pthread_mutex_lock(&map_lock);
+#endif
+}
+
+void mem_UnlockMappings()
+{
+#ifdef _WIN32
+    InterlockedExchange(&map_lock, 0);
+#else
+    pthread_mutex_unlock(&map_lock);
+#endif
+}
+
 #ifdef MODULE_SUPPORT
 
-memmap_t **mappingsproc;
-size_t*   num_mappingsproc;
-u32 currentmap = 0;
+static struct mem_table** tablesproc;
 
 void ModuleSupport_MemInit(u32 modulenum)
 {
-    mappingsproc = (memmap_t **)malloc(sizeof(memmap_t *)*(modulenum + 1));
-
     u32 i;
-    for (i = 0; i < (modulenum + 1); i++) {
-        *(mappingsproc + i) = (memmap_t *)malloc(sizeof(memmap_t)*(MAX_MAPPINGS));
-    }
 
-    num_mappingsproc = (size_t*)malloc(sizeof(size_t*)*(modulenum + 1));
-    memset(num_mappingsproc, 0, sizeof(size_t*)*(modulenum + 1));
+    tablesproc = malloc(sizeof(struct mem_table*) * (modulenum + 1));
+
+    // Process 0 owns whatever was mapped so far.
+    tablesproc[0] = &table_default;
+    for (i = 1; i < modulenum + 1; i++)
+        tablesproc[i] = calloc(1, sizeof(struct mem_table));
 
     ModuleSupport_ThreadsInit(modulenum);
+    ModuleSupport_Arm11Init(modulenum);
 }
 
+// Binds the calling host thread to process newproc. Every process runs on
+// its own host thread, the main thread only swaps while loading them.
 void ModuleSupport_SwapProcessMem(u32 newproc)
 {
-    memcpy(*(mappingsproc + currentmap), mappings, sizeof(memmap_t)*(MAX_MAPPINGS)); //save maps
-    *(num_mappingsproc + currentmap) = num_mappings;
-
-    memcpy(mappings, *(mappingsproc + newproc), sizeof(memmap_t)*(MAX_MAPPINGS)); //save maps
-    num_mappings = *(num_mappingsproc + newproc);
+    table = tablesproc[newproc];
 
     ModuleSupport_SwapProcessThreads(newproc);
-    currentmap = newproc;
+    ModuleSupport_SwapProcessArm11(newproc);
 }
 
 #endif
@@ -97,11 +147,11 @@ void mem_Dbugdump()
 {
     size_t i;
     char name[0x200];
-    for (i = 0; i<num_mappings; i++) {
-        u32 schei = mappings[i].size;
-        sprintf(name, "dump%08X %08X.bin", mappings[i].base, schei);
+    for (i = 0; i<table->num; i++) {
+        u32 schei = table->map[i].size;
+        sprintf(name, "dump%08X %08X.bin", table->map[i].base, schei);
         FILE* data = fopen(name, "wb");
-        fwrite(mappings[i].phys, 1, schei, data);
+        fwrite(table->map[i].phys, 1, schei, data);
         fclose(data);
     }
     FILE* data = fopen("VRAMdump.bin", "wb");
@@ -109,6 +159,11 @@ void mem_Dbugdump()
     fclose(data);
 }
 
+static void FreeBuffer(u8* data, u32 size)
+{
+    free(data);
+}
+
 static int Overlaps(memmap_t* a, memmap_t* b)
 {
     if(a->base <= b->base && b->base < (a->base+a->size))
@@ -128,28 +183,29 @@ static int AddMapping(uint32_t base, uint32_t size)
     if(size == 0)
         return 0;
 
-    if(num_mappings == MAX_MAPPINGS) {
+    if(table->num == MAX_MAPPINGS) {
         ERROR("too many mappings.\n");
         return 1;
     }
 
-    size_t i = num_mappings, j;
-    mappings[i].base = base;
-    mappings[i].size = size;
+    size_t i = table->num, j;
+    table->map[i].base = base;
+    table->map[i].size = size;
 
-    for(j=0; j<num_mappings; j++) {
-        if(Overlaps(&mappings[j], &mappings[i])) {
+    for(j=0; j<table->num; j++) {
+        if(Overlaps(&table->map[j], &table->map[i])) {
             ERROR("trying to add overlapping mapping %08x, size=%08x.\n",
                   base, size);
             return 2;
         }
     }
 
-    mappings[i].phys = calloc(sizeof(uint8_t), size);
-    if(mappings[i].phys == NULL) {
+    table->map[i].phys = calloc(sizeof(uint8_t), size);
+    if(table->map[i].phys == NULL) {
         ERROR("calloc failed for %08x, size=%08x\n", base, size);
         return 3;
     }
+    table->map[i].release = FreeBuffer;
 
 #ifdef MEM_TRACE_EXTERNAL
     if (
@@ -158,39 +214,40 @@ static int AddMapping(uint32_t base, uint32_t size)
         || base == 0x14000000
         //|| base == 0x10002000
     ) {
-        mappings[i].enable_log = true;
+        table->map[i].enable_log = true;
     } else {
-        mappings[i].enable_log = false;
+        table->map[i].enable_log = false;
     }
 #endif
 
-    num_mappings++;
+    table->num++;
     return 0;
 }
 
-int mem_AddMappingShared(uint32_t base, uint32_t size, u8* data)
+static int AddMappingShared(uint32_t base, uint32_t size, u8* data, mem_release release)
 {
     if (size == 0)
         return 0;
 
-    if (num_mappings == MAX_MAPPINGS) {
+    if (table->num == MAX_MAPPINGS) {
         ERROR("too many mappings.\n");
         return 1;
     }
 
-    size_t i = num_mappings, j;
-    mappings[i].base = base;
-    mappings[i].size = size;
+    size_t i = table->num, j;
+    table->map[i].base = base;
+    table->map[i].size = size;
 
-    for (j = 0; j<num_mappings; j++) {
-        if (Overlaps(&mappings[j], &mappings[i])) {
+    for (j = 0; j<table->num; j++) {
+        if (Overlaps(&table->map[j], &table->map[i])) {
             ERROR("trying to add overlapping mapping %08x, size=%08x.\n",
                   base, size);
             return 2;
         }
     }
 
-    mappings[i].phys = data;
+    table->map[i].phys = data;
+    table->map[i].release = release;
 
 #ifdef MEM_TRACE_EXTERNAL
     if (
@@ -199,27 +256,84 @@ int mem_AddMappingShared(uint32_t base, uint32_t size, u8* data)
         || base == 0x14000000
         //|| base == 0x10002000
     ) {
-        mappings[i].enable_log = true;
+        table->map[i].enable_log = true;
     } else {
-        mappings[i].enable_log = false;
+        table->map[i].enable_log = false;
     }
 #endif
 
-    num_mappings++;
+    table->num++;
     return 0;
 }
 
+static int RemoveMappingShared(uint32_t base)
+{
+    size_t i;
+
+    for (i = 0; i < table->num; i++) {
+        if (table->map[i].base == base) {
+            if (table->map[i].release != NULL)
+                table->map[i].release(table->map[i].phys, table->map[i].size);
+
+            // Keep the order, the early mappings are the hot ones.
+            memmove(&table->map[i], &table->map[i + 1], (table->num - i - 1) * sizeof(memmap_t));
+            table->num--;
+            return 0;
+        }
+    }
+
+    ERROR("no mapping at %08x.\n", base);
+    return -1;
+}
+
+int mem_AddMappingShared(uint32_t base, uint32_t size, u8* data)
+{
+    int rc;
+
+    mem_LockMappings();
+    rc = AddMappingShared(base, size, data, NULL);
+    mem_UnlockMappings();
+    return rc;
+}
+
+// Like mem_AddMappingShared, but the mapping takes data over: it is handed
+// to release (free if NULL) once the mapping is dropped or replaced by a
+// save state. On failure data still belongs to the caller.
+int mem_AdoptMapping(uint32_t base, uint32_t size, u8* data, mem_release release)
+{
+    int rc;
+
+    mem_LockMappings();
+    rc = AddMappingShared(base, size, data, release != NULL ? release : FreeBuffer);
+    mem_UnlockMappings();
+    return rc;
+}
+
+// Drops the mapping at base. Shared memory stays with its owner, memory the
+// table owns is released.
+int mem_RemoveMappingShared(uint32_t base)
+{
+    int rc;
+
+    mem_LockMappings();
+    rc = RemoveMappingShared(base);
+    mem_UnlockMappings();
+    return rc;
+}
+
 int mem_AddSegment(uint32_t base, uint32_t size, uint8_t* data)
 {
     DEBUG("adding %08x %08x\n", base, size);
     int rc;
 
+    mem_LockMappings();
     rc = AddMapping(base, size);
+    mem_UnlockMappings();
     if(rc != 0)
         return rc;
 
     if(data != NULL)
-        memcpy(mappings[num_mappings-1].phys, data, size);
+        memcpy(table->map[table->num-1].phys, data, size);
     return 0;
 }
 
@@ -233,12 +347,12 @@ int mem_Write8(uint32_t addr, uint8_t w)
 #endif
 
     size_t i;
-    for(i=0; i<num_mappings; i++) {
-        if(Contains(&mappings[i], addr, 1)) {
+    for(i=0; i<table->num; i++) {
+        if(Contains(&table->map[i], addr, 1)) {
 #ifdef MEM_TRACE_EXTERNAL
-            if (mappings[i].enable_log)fprintf(stderr, "w8 %08x <- w=%02x pc=%08x\n", addr, w & 0xff, s.Reg[15]);
+            if (table->map[i].enable_log)fprintf(stderr, "w8 %08x <- w=%02x pc=%08x\n", addr, w & 0xff, arm11_state->Reg[15]);
 #endif
-            mappings[i].phys[addr - mappings[i].base] = w;
+            table->map[i].phys[addr - table->map[i].base] = w;
             return 0;
         }
     }
@@ -261,13 +375,13 @@ uint8_t mem_Read8(uint32_t addr)
 
     size_t i;
 
-    for(i=0; i<num_mappings; i++) {
-        if(Contains(&mappings[i], addr, 1)) {
+    for(i=0; i<table->num; i++) {
+        if(Contains(&table->map[i], addr, 1)) {
 #ifdef MEM_TRACE_EXTERNAL
-            if (mappings[i].enable_log)fprintf(stderr, "r8 %08x pc=%08x\n", addr, s.Reg[15]);
+            if (table->map[i].enable_log)fprintf(stderr, "r8 %08x pc=%08x\n", addr, arm11_state->Reg[15]);
 #endif
 
-            return mappings[i].phys[addr - mappings[i].base];
+            return table->map[i].phys[addr - table->map[i].base];
         }
     }
 #ifdef PRINT_ILLEGAL
@@ -290,17 +404,17 @@ int mem_Write16(uint32_t addr, uint16_t w)
 #endif
 
     size_t i;
-    for(i=0; i<num_mappings; i++) {
-        if(Contains(&mappings[i], addr, 2)) {
+    for(i=0; i<table->num; i++) {
+        if(Contains(&table->map[i], addr, 2)) {
 #ifdef MEM_TRACE_EXTERNAL
-            if (mappings[i].enable_log)fprintf(stderr, "w16 %08x <- w=%04x pc=%08x\n", addr, w & 0xffff, s.Reg[15]);
+            if (table->map[i].enable_log)fprintf(stderr, "w16 %08x <- w=%04x pc=%08x\n", addr, w & 0xffff, arm11_state->Reg[15]);
 #endif
             // Unaligned.
             if (addr & 1) {
-                mappings[i].phys[addr - mappings[i].base] = (u8)w;
-                mappings[i].phys[addr - mappings[i].base + 1] = (u8)(w >> 8);
+                table->map[i].phys[addr - table->map[i].base] = (u8)w;
+                table->map[i].phys[addr - table->map[i].base + 1] = (u8)(w >> 8);
             } else
-                *(uint16_t*)(&mappings[i].phys[addr - mappings[i].base]) = w;
+                *(uint16_t*)(&table->map[i].phys[addr - table->map[i].base]) = w;
             return 0;
         }
     }
@@ -322,21 +436,21 @@ uint16_t mem_Read16(uint32_t addr)
 #endif
 
     size_t i;
-    for(i=0; i<num_mappings; i++) {
-        if(Contains(&mappings[i], addr, 2)) {
+    for(i=0; i<table->num; i++) {
+        if(Contains(&table->map[i], addr, 2)) {
 
 #ifdef MEM_TRACE_EXTERNAL
-            if (mappings[i].enable_log)fprintf(stderr, "r16 %08x pc=%08x\n", addr, s.Reg[15]);
+            if (table->map[i].enable_log)fprintf(stderr, "r16 %08x pc=%08x\n", addr, arm11_state->Reg[15]);
 #endif
 
 
             // Unaligned.
             if (addr & 1) {
-                uint16_t ret = mappings[i].phys[addr - mappings[i].base + 1] << 8;
-                ret |= mappings[i].phys[addr - mappings[i].base];
+                uint16_t ret = table->map[i].phys[addr - table->map[i].base + 1] << 8;
+                ret |= table->map[i].phys[addr - table->map[i].base];
                 return ret;
             }
-            return *(uint16_t*) (&mappings[i].phys[addr - mappings[i].base]);
+            return *(uint16_t*) (&table->map[i].phys[addr - table->map[i].base]);
         }
     }
 
@@ -361,23 +475,23 @@ int mem_Write32(uint32_t addr, uint32_t w)
     fprintf(stderr, "w32 %08x <- w=%08x\n", addr, w);
 #endif
     size_t i;
-    for(i=0; i<num_mappings; i++) {
-        if(Contains(&mappings[i], addr, 4)) {
+    for(i=0; i<table->num; i++) {
+        if(Contains(&table->map[i], addr, 4)) {
 
 #ifdef MEM_TRACE_EXTERNAL
-            if (mappings[i].enable_log)
-                fprintf(stderr, "w32 %08x <- w=%08x pc=%08x\n", addr, w, s.Reg[15]);
+            if (table->map[i].enable_log)
+                fprintf(stderr, "w32 %08x <- w=%08x pc=%08x\n", addr, w, arm11_state->Reg[15]);
 #endif
 
 
             // Unaligned.
             if (addr & 3) {
-                mappings[i].phys[addr - mappings[i].base] = w;
-                mappings[i].phys[addr - mappings[i].base + 1] = w >> 8;
-                mappings[i].phys[addr - mappings[i].base + 2] = w >> 16;
-                mappings[i].phys[addr - mappings[i].base + 3] = w >> 24;
+                table->map[i].phys[addr - table->map[i].base] = w;
+                table->map[i].phys[addr - table->map[i].base + 1] = w >> 8;
+                table->map[i].phys[addr - table->map[i].base + 2] = w >> 16;
+                table->map[i].phys[addr - table->map[i].base + 3] = w >> 24;
             } else
-                *(uint32_t*) (&mappings[i].phys[addr - mappings[i].base]) = w;
+                *(uint32_t*) (&table->map[i].phys[addr - table->map[i].base]) = w;
             return 0;
         }
     }
@@ -395,8 +509,8 @@ bool mem_test(uint32_t addr)
 {
     size_t i;
 
-    for (i = 0; i<num_mappings; i++) {
-        if (Contains(&mappings[i], addr, 4)) {
+    for (i = 0; i<table->num; i++) {
+        if (Contains(&table->map[i], addr, 4)) {
             return true;
         }
     }
@@ -411,21 +525,21 @@ u32 mem_Read32(uint32_t addr)
         return 0;
     }
     size_t i;
-    for(i=0; i<num_mappings; i++) {
-        if(Contains(&mappings[i], addr, 4)) {
+    for(i=0; i<table->num; i++) {
+        if(Contains(&table->map[i], addr, 4)) {
 
 #ifdef MEM_TRACE_EXTERNAL
-            if (mappings[i].enable_log) {
-                fprintf(stderr, "r32 %08x pc=%08x\n", addr, s.Reg[15]);
+            if (table->map[i].enable_log) {
+                fprintf(stderr, "r32 %08x pc=%08x\n", addr, arm11_state->Reg[15]);
                 //arm11_Dump();
             }
 #endif
 
 
             // Unaligned.
-            u32 temp = *(uint32_t*)(&mappings[i].phys[addr - mappings[i].base]);
+            u32 temp = *(uint32_t*)(&table->map[i].phys[addr - table->map[i].base]);
 #ifdef MEM_TRACE
-            fprintf(stderr, "r32 %08x --> %08x (%08X)\n", addr, temp, s.Reg[15]);
+            fprintf(stderr, "r32 %08x --> %08x (%08X)\n", addr, temp, arm11_state->Reg[15]);
 #endif
             switch (addr & 3) {
             case 0:
@@ -460,19 +574,19 @@ int mem_Write(uint8_t* in_buff, uint32_t addr, uint32_t size)
 
     size_t i;
     uint32_t map = 0xdeadc0de;
-    for (i = 0; i<num_mappings; i++) {
-        if (Contains(&mappings[i], addr, size)) {
-            memcpy(&mappings[i].phys[addr - mappings[i].base],in_buff, size);
+    for (i = 0; i<table->num; i++) {
+        if (Contains(&table->map[i], addr, size)) {
+            memcpy(&table->map[i].phys[addr - table->map[i].base],in_buff, size);
             return 0;
-        } else if (Contains(&mappings[i], addr, 1)) {
+        } else if (Contains(&table->map[i], addr, 1)) {
             map = i;
         }
     }
 
     //If spread across multiple mappings
     if (map != 0xdeadc0de) {
-        uint32_t base = mappings[map].base;
-        uint32_t base_size = mappings[map].size;
+        uint32_t base = table->map[map].base;
+        uint32_t base_size = table->map[map].size;
         uint32_t part2_size = (addr + size) - (base + base_size);
         uint32_t part1_size = size - part2_size;
         mem_Write(in_buff, addr, part1_size);
@@ -498,19 +612,19 @@ int mem_Read(uint8_t* buf_out, uint32_t addr, uint32_t size)
 
     size_t i;
     uint32_t map = 0xdeadc0de;
-    for(i=0; i<num_mappings; i++) {
-        if(Contains(&mappings[i], addr, size)) {
-            memcpy(buf_out, &mappings[i].phys[addr - mappings[i].base], size);
+    for(i=0; i<table->num; i++) {
+        if(Contains(&table->map[i], addr, size)) {
+            memcpy(buf_out, &table->map[i].phys[addr - table->map[i].base], size);
             return 0;
-        } else if (Contains(&mappings[i], addr, 1)) {
+        } else if (Contains(&table->map[i], addr, 1)) {
             map = i;
         }
     }
 
     //If spread across multiple mappings
     if (map != 0xdeadc0de) {
-        uint32_t base = mappings[map].base;
-        uint32_t base_size = mappings[map].size;
+        uint32_t base = table->map[map].base;
+        uint32_t base_size = table->map[map].size;
         uint32_t part2_size = (addr + size) - (base + base_size);
         uint32_t part1_size = size - part2_size;
         mem_Read(buf_out, addr, part1_size);
@@ -535,9 +649,32 @@ u8* mem_rawaddr(uint32_t addr, uint32_t size)
 #endif
 
     size_t i;
-    for (i = 0; i<num_mappings; i++) {
-        if (Contains(&mappings[i], addr, size)) {
-            return (u8*)&mappings[i].phys[addr - mappings[i].base];
+    for (i = 0; i<table->num; i++) {
+        if (Contains(&table->map[i], addr, size)) {
+            return (u8*)&table->map[i].phys[addr - table->map[i].base];
+        }
+    }
+#ifdef PRINT_ILLEGAL
+    ERROR("trying to remap 0x%x bytes unmapped addr %08x\n", size, addr);
+    arm11_Dump();
+#endif
+#ifdef EXIT_ON_ILLEGAL
+    exit(1);
+#endif
+    return NULL;
+}
+
+// Like mem_rawaddr, but the range may cross into the next mapping. Returns
+// the host pointer for addr and how many bytes of the range follow it
+// contiguously in *span.
+u8* mem_rawspan(uint32_t addr, uint32_t size, uint32_t* span)
+{
+    size_t i;
+    for (i = 0; i<table->num; i++) {
+        if (Contains(&table->map[i], addr, 1)) {
+            uint32_t left = table->map[i].base + table->map[i].size - addr;
+            *span = size < left ? size : left;
+            return (u8*)&table->map[i].phys[addr - table->map[i].base];
         }
     }
 #ifdef PRINT_ILLEGAL
@@ -547,5 +684,75 @@ u8* mem_rawaddr(uint32_t addr, uint32_t size)
 #ifdef EXIT_ON_ILLEGAL
     exit(1);
 #endif
+    *span = 0;
     return NULL;
 }
+
+// Save states, see savestate.c. Mapping memory is saved as buffers, the
+// table just points into them.
+int mem_CollectState()
+{
+    size_t i;
+
+    for (i = 0; i < table->num; i++)
+        savestate_AddBuffer(table->map[i].phys, table->map[i].size);
+    return 0;
+}
+
+void mem_SaveState()
+{
+    u32 num = table->num;
+    size_t i;
+
+    savestate_Put(&num, sizeof(num));
+
+    for (i = 0; i < table->num; i++) {
+        u8 ro = table->map[i].ro;
+        u8 owned = table->map[i].release != NULL;
+
+        savestate_Put(&table->map[i].base, sizeof(table->map[i].base));
+        savestate_Put(&table->map[i].size, sizeof(table->map[i].size));
+        savestate_Put(&ro, 1);
+        savestate_Put(&owned, 1);
+        savestate_PutPtr(table->map[i].phys);
+    }
+}
+
+void mem_LoadState()
+{
+    u32 num;
+    size_t i;
+
+    savestate_Get(&num, sizeof(num));
+    if (num > MAX_MAPPINGS) {
+        ERROR("too many mappings.\n");
+        num = 0;
+    }
+
+    mem_LockMappings();
+
+    // The state brings its own copies.
+    for (i = 0; i < table->num; i++)
+        if (table->map[i].release != NULL)
+            table->map[i].release(table->map[i].phys, table->map[i].size);
+
+    memset(table->map, 0, sizeof(table->map));
+    table->num = num;
+
+    for (i = 0; i < table->num; i++) {
+        u8 ro, owned;
+
+        savestate_Get(&table->map[i].base, sizeof(table->map[i].base));
+        savestate_Get(&table->map[i].size, sizeof(table->map[i].size));
+        savestate_Get(&ro, 1);
+        savestate_Get(&owned, 1);
+        table->map[i].ro = ro;
+        table->map[i].phys = savestate_GetPtr();
+
+        // Memory the mapping owned comes back as a loaded buffer of its own,
+        // which it owns from now on. Shared memory stays with its owner.
+        if (owned && savestate_ClaimPtr(table->map[i].phys))
+            table->map[i].release = FreeBuffer;
+    }
+    mem_UnlockMappings();
+}
@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "util.h"
+#include "profiler.h"
+
+// Every <interval> guest instructions the cpu loop hands us pc and lr. We
+// only count raw (pc, lr) pairs while running, symbols are resolved once
+// at exit into a two-frame folded stack "caller;callee count", which
+// flamegraph.pl reads as is. lr is only a guess at the caller (it goes
+// stale in non-leaf functions), but it is free and good enough to tell
+// which routine spins where.
+//
+// Every process cpu counts down on its own (profiler_Countdown), with
+// MODULE_SUPPORT on several host threads. They share one sample table
+// behind a lock, taken once per interval.
+
+#define UNKNOWN_FRAME 0x80000000 // | (addr >> 8), unsymbolized 256 byte block
+
+typedef struct {
+    u32 pc;
+    u32 lr;
+    u64 count;
+} sample;
+
+typedef struct {
+    u32   addr;
+    u32   size;
+    char* name;
+} symbol;
+
+typedef struct {
+    u32 caller;
+    u32 callee;
+    u64 count;
+} frame_pair;
+
+bool profiler_enabled = false;
+
+static char* out_path;
+static u32   sample_interval;
+
+static sample* samples;
+static u32     samples_mask;
+static u32     samples_used;
+
+static symbol* symbols;
+static u32     symbols_num;
+static u32     symbols_max;
+
+#ifdef _WIN32
+static CRITICAL_SECTION lock;
+
+#define LOCK()   EnterCriticalSection(&lock)
+#define UNLOCK() LeaveCriticalSection(&lock)
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOCK()   pthread_mutex_lock(&lock)
+#define UNLOCK() pthread_mutex_unlock(&lock)
+#endif
+
+
+int profiler_Init(const char* path, u32 interval)
+{
+    out_path = malloc(strlen(path) + 1);
+    strcpy(out_path, path);
+
+    sample_interval = interval != 0 ? interval : PROFILER_DEFAULT_INTERVAL;
+
+    samples_mask = 0xFFF;
+    samples = calloc(samples_mask + 1, sizeof(sample));
+    if (samples == NULL) {
+        ERROR("calloc failed\n");
+        return -1;
+    }
+
+#ifdef _WIN32
+    InitializeCriticalSection(&lock);
+#endif
+
+    // Before arm11_Init, every cpu state picks this up when it is set up.
+    profiler_enabled = true;
+
+    // Same file arm11_Dump symbolizes with.
+    profiler_LoadMap("map");
+    return 0;
+}
+
+static u32 HashSample(u32 pc, u32 lr, u32 mask)
+{
+    return ((pc * 0x9E3779B1) ^ (lr * 0x85EBCA6B) ^ (pc >> 16)) & mask;
+}
+
+static void Grow()
+{
+    sample* old = samples;
+    u32 old_size = samples_mask + 1;
+    u32 i;
+
+    samples = calloc(old_size * 2, sizeof(sample));
+    if (samples == NULL) {
+        ERROR("calloc failed\n");
+        exit(1);
+    }
+    samples_mask = old_size * 2 - 1;
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i].count == 0)
+            continue;
+
+        u32 slot = HashSample(old[i].pc, old[i].lr, samples_mask);
+        while (samples[slot].count != 0)
+            slot = (slot + 1) & samples_mask;
+        samples[slot] = old[i];
+    }
+    free(old);
+}
+
+// Countdown a new cpu state starts with, 0 leaves it unsampled.
+u32 profiler_Countdown()
+{
+    return profiler_enabled ? sample_interval : 0;
+}
+
+// Returns the countdown until the next sample.
+u32 profiler_Sample(u32 pc, u32 lr)
+{
+    u32 slot;
+
+    LOCK();
+    slot = HashSample(pc, lr, samples_mask);
+
+    while (samples[slot].count != 0) {
+        if (samples[slot].pc == pc && samples[slot].lr == lr) {
+            samples[slot].count++;
+            UNLOCK();
+            return sample_interval;
+        }
+        slot = (slot + 1) & samples_mask;
+    }
+
+    samples[slot].pc = pc;
+    samples[slot].lr = lr;
+    samples[slot].count = 1;
+
+    if (++samples_used * 2 > samples_mask)
+        Grow();
+    UNLOCK();
+    return sample_interval;
+}
+
+// Size 0 means "up to the next symbol".
+void profiler_AddSymbol(u32 addr, u32 size, const char* name)
+{
+    if (!profiler_enabled || name == NULL || name[0] == '\0')
+        return;
+
+    if (symbols_num == symbols_max) {
+        symbol* n = realloc(symbols, sizeof(symbol) * (symbols_max ? symbols_max * 2 : 0x400));
+        if (n == NULL) {
+            ERROR("realloc failed\n");
+            return;
+        }
+        symbols = n;
+        symbols_max = symbols_max ? symbols_max * 2 : 0x400;
+    }
+
+    symbol* sym = &symbols[symbols_num++];
+    sym->addr = addr & ~1; // Thumb bit.
+    sym->size = size;
+    sym->name = malloc(strlen(name) + 1);
+    strcpy(sym->name, name);
+}
+
+// Loads a "0x<addr> <size> <name>" map, the format arm11_Dump uses.
+int profiler_LoadMap(const char* path)
+{
+    char line[256];
+    char name[256];
+    FILE* fd = fopen(path, "r");
+
+    if (fd == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        u32 addr, size;
+        if (sscanf(line, "0x%08x %08u %255s", &addr, &size, name) == 3)
+            profiler_AddSymbol(addr, size, name);
+    }
+    fclose(fd);
+    return 0;
+}
+
+static int CompareSymbol(const void* a, const void* b)
+{
+    const symbol* x = a;
+    const symbol* y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int ComparePair(const void* a, const void* b)
+{
+    const frame_pair* x = a;
+    const frame_pair* y = b;
+    if (x->caller != y->caller)
+        return x->caller < y->caller ? -1 : 1;
+    return x->callee < y->callee ? -1 : x->callee > y->callee;
+}
+
+static u32 Resolve(u32 addr)
+{
+    u32 lo = 0, hi = symbols_num;
+
+    addr &= ~1;
+
+    // Last symbol starting at or below addr.
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo != 0) {
+        symbol* sym = &symbols[lo - 1];
+        u32 size = sym->size;
+
+        // Unsized symbols reach up to the next one, the last gets 64KiB.
+        if (size == 0 && lo == symbols_num)
+            size = 0x10000;
+        if (size == 0 || addr - sym->addr < size)
+            return lo - 1;
+    }
+    return UNKNOWN_FRAME | (addr >> 8);
+}
+
+static void WriteFrame(FILE* fd, u32 frame)
+{
+    if (frame & UNKNOWN_FRAME)
+        fprintf(fd, "0x%08x", (frame & ~UNKNOWN_FRAME) << 8);
+    else
+        fprintf(fd, "%s", symbols[frame].name);
+}
+
+void profiler_Dump()
+{
+    frame_pair* pairs;
+    u32 i, num = 0;
+    u64 total = 0;
+
+    if (!profiler_enabled)
+        return;
+
+    qsort(symbols, symbols_num, sizeof(symbol), CompareSymbol);
+
+    // Module threads may still be running.
+    LOCK();
+
+    pairs = malloc(sizeof(frame_pair) * (samples_used + 1));
+    if (pairs == NULL) {
+        ERROR("malloc failed\n");
+        UNLOCK();
+        return;
+    }
+
+    for (i = 0; i <= samples_mask; i++) {
+        if (samples[i].count == 0)
+            continue;
+
+        pairs[num].caller = Resolve(samples[i].lr);
+        pairs[num].callee = Resolve(samples[i].pc);
+        pairs[num].count = samples[i].count;
+        total += samples[i].count;
+        num++;
+    }
+
+    UNLOCK();
+
+    qsort(pairs, num, sizeof(frame_pair), ComparePair);
+
+    FILE* fd = fopen(out_path, "w");
+    if (fd == NULL) {
+        ERROR("failed to open %s\n", out_path);
+        free(pairs);
+        return;
+    }
+
+    for (i = 0; i < num; i++) {
+        u64 count = pairs[i].count;
+
+        while (i + 1 < num && pairs[i + 1].caller == pairs[i].caller &&
+               pairs[i + 1].callee == pairs[i].callee)
+            count += pairs[++i].count;
+
+        // Still inside the same routine, lr says nothing about the caller.
+        if (pairs[i].caller != pairs[i].callee) {
+            WriteFrame(fd, pairs[i].caller);
+            fprintf(fd, ";");
+        }
+        WriteFrame(fd, pairs[i].callee);
+        fprintf(fd, " %llu\n", (unsigned long long)count);
+    }
+    fclose(fd);
+    free(pairs);
+
+    DEBUG("profiler: %llu samples every %u instructions, %u symbols\n",
+          (unsigned long long)total, sample_interval, symbols_num);
+}
@@ -0,0 +1,595 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "gpu.h"
+#include "loader.h"
+#include "savestate.h"
+
+// A save state is taken between two rounds of threads_Execute, when every
+// thread's context sits in the thread table. It is restored into a fresh
+// instance that has booted the same title with the same build, which has
+// already set up everything that is not guest visible (screen, services,
+// loader) the same way.
+//
+// Host buffers the guest sees (mappings, shared memory, the per service
+// IPC buffers) are collected first and written once each, every pointer
+// into them is then stored as (buffer, offset). Buffers are stored page by
+// page, zero pages are only a bit in a bitmap: most of the 128MiB linear
+// heap is never touched. Pages that are stored are read straight back into
+// place, one fread per run.
+//
+// Function pointers in archive and file objects are relocated against the
+// address of savestate_Save, which takes care of ASLR. Objects that hold
+// host resources (save/SD files, directories, sockets, http contexts) are
+// not carried over, their handles come back as dead ones.
+
+#define SAVESTATE_MAGIC   0x53534D33 // "3MSS"
+#define SAVESTATE_VERSION 6
+#define SAVESTATE_PAGE    0x1000
+
+#define NO_BUFFER 0xFFFFFFFF
+
+typedef struct {
+    u8*  ptr;
+    u64  size;
+    bool fixed; // Allocated at startup, restored in place.
+    bool owned; // Loaded, and handed to whoever claimed it.
+} state_buffer;
+
+static FILE* fd;
+static bool  failed;
+static uintptr_t reloc_delta;
+
+static state_buffer* buffers;
+static u32 num_buffers;
+static u32 max_buffers;
+
+extern u8 HIDsharedbuff[0x2000];
+extern u8 HIDsharedbuffSPVR[0x2000];
+
+// Everything with state of its own, saved and loaded in this order. Each
+// module stores its own state. collect runs first, adds the host buffers
+// the guest can see and returns SAVESTATE_BUSY while the module is
+// somewhere it can't be saved.
+static const struct {
+    int  (*collect)();
+    void (*save)();
+    void (*load)();
+} modules[] = {
+    { NULL,                   &threads_SaveState,  &threads_LoadState  },
+    { &handle_CollectState,   &handle_SaveState,   &handle_LoadState   },
+    { &mem_CollectState,      &mem_SaveState,      &mem_LoadState      },
+    { NULL,                   &memory_SaveState,   &memory_LoadState   },
+    { NULL,                   &gpu_SaveState,      &gpu_LoadState      },
+    { NULL,                   &dspaudio_SaveState, &dspaudio_LoadState },
+    { NULL,                   &csnd_SaveState,     &csnd_LoadState     },
+    { NULL,                   &ldr_ro_SaveState,   &ldr_ro_LoadState   },
+    { &apt_u_CollectState,    &apt_u_SaveState,    &apt_u_LoadState    },
+    { &apt_s_CollectState,    &apt_s_SaveState,    &apt_s_LoadState    },
+    { NULL,                   &cecd_u_SaveState,   &cecd_u_LoadState   },
+    { &csnd_SND_CollectState, &csnd_SND_SaveState, &csnd_SND_LoadState },
+    { NULL,                   &dsp_dsp_SaveState,  &dsp_dsp_LoadState  },
+    { NULL,                   &gsp_gpu_SaveState,  &gsp_gpu_LoadState  },
+    { NULL,                   &hid_user_SaveState, &hid_user_LoadState },
+    { NULL,                   &hid_SPVR_SaveState, &hid_SPVR_LoadState },
+    { &httpc_CollectState,    NULL,                NULL                },
+    { NULL,                   &ir_u_SaveState,     &ir_u_LoadState     },
+    { NULL,                   &mcu_GPU_SaveState,  &mcu_GPU_LoadState  },
+    { &soc_u_CollectState,    &soc_u_SaveState,    &soc_u_LoadState    },
+    { NULL,                   &srv_SaveState,      &srv_LoadState      },
+    { NULL,                   &y2r_u_SaveState,    &y2r_u_LoadState    }
+};
+
+
+void savestate_Put(const void* data, u64 size)
+{
+    if (!failed && size != 0 && fwrite(data, 1, size, fd) != size)
+        failed = true;
+}
+
+void savestate_Get(void* data, u64 size)
+{
+    if (failed || fread(data, 1, size, fd) != size) {
+        failed = true;
+        memset(data, 0, size);
+    }
+}
+
+static void PushBuffer(u8* ptr, u64 size, bool fixed)
+{
+    if (num_buffers == max_buffers) {
+        state_buffer* n = realloc(buffers, sizeof(state_buffer) * (max_buffers ? max_buffers * 2 : 0x40));
+        if (n == NULL) {
+            ERROR("Not enough mem.\n");
+            failed = true;
+            return;
+        }
+        buffers = n;
+        max_buffers = max_buffers ? max_buffers * 2 : 0x40;
+    }
+
+    buffers[num_buffers].ptr = ptr;
+    buffers[num_buffers].size = size;
+    buffers[num_buffers].fixed = fixed;
+    buffers[num_buffers].owned = false;
+    num_buffers++;
+}
+
+static void AddBuffer(void* ptr, u64 size, bool fixed)
+{
+    u8* p = ptr;
+    u32 i;
+
+    if (p == NULL || size == 0)
+        return;
+
+    for (i = 0; i < num_buffers; i++) {
+        // Already covered, e.g. a mapping of the linear heap.
+        if (buffers[i].ptr <= p && p + size <= buffers[i].ptr + buffers[i].size)
+            return;
+    }
+
+    // Swallows buffers that turn out to be part of this one.
+    for (i = 0; i < num_buffers; ) {
+        if (!buffers[i].fixed && p <= buffers[i].ptr &&
+                buffers[i].ptr + buffers[i].size <= p + size)
+            buffers[i] = buffers[--num_buffers];
+        else
+            i++;
+    }
+
+    PushBuffer(p, size, fixed);
+}
+
+void savestate_AddBuffer(void* ptr, u64 size)
+{
+    AddBuffer(ptr, size, false);
+}
+
+void savestate_PutPtr(const void* ptr)
+{
+    const u8* p = ptr;
+    u32 index = NO_BUFFER;
+    u64 off = 0;
+    u32 i;
+
+    for (i = 0; p != NULL && i < num_buffers; i++) {
+        if (buffers[i].ptr <= p && p < buffers[i].ptr + buffers[i].size) {
+            index = i;
+            off = p - buffers[i].ptr;
+            break;
+        }
+    }
+
+    if (p != NULL && index == NO_BUFFER)
+        ERROR("Host pointer %p is not in a guest buffer, dropped.\n", ptr);
+
+    savestate_Put(&index, sizeof(index));
+    savestate_Put(&off, sizeof(off));
+}
+
+void* savestate_GetPtr()
+{
+    u32 index;
+    u64 off;
+
+    savestate_Get(&index, sizeof(index));
+    savestate_Get(&off, sizeof(off));
+
+    if (index == NO_BUFFER)
+        return NULL;
+
+    if (index >= num_buffers || off >= buffers[index].size) {
+        ERROR("Bad buffer reference.\n");
+        failed = true;
+        return NULL;
+    }
+    return buffers[index].ptr + off;
+}
+
+// For a load: true if ptr is the start of a loaded buffer the caller may
+// free once done with it. Each buffer is handed out once, and fixed ones
+// never.
+bool savestate_ClaimPtr(void* ptr)
+{
+    u32 i;
+
+    for (i = 0; ptr != NULL && i < num_buffers; i++) {
+        if (buffers[i].ptr == ptr) {
+            if (buffers[i].fixed || buffers[i].owned)
+                return false;
+
+            buffers[i].owned = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool IsZeroPage(const u8* p, u64 size)
+{
+    u64 i;
+
+    for (i = 0; i + 8 <= size; i += 8)
+        if (*(const u64*)(p + i) != 0)
+            return false;
+    for (; i < size; i++)
+        if (p[i] != 0)
+            return false;
+    return true;
+}
+
+// Bitmap of the non-zero pages, then those pages.
+void savestate_PutPages(const void* data, u64 size)
+{
+    const u8* p = data;
+    u64 num = (size + SAVESTATE_PAGE - 1) / SAVESTATE_PAGE;
+    u8* bitmap = calloc(1, (num + 7) / 8 + 1);
+    u64 i;
+
+    if (bitmap == NULL) {
+        ERROR("Not enough mem.\n");
+        failed = true;
+        return;
+    }
+
+    for (i = 0; i < num; i++) {
+        u64 off = i * SAVESTATE_PAGE;
+        u64 len = size - off < SAVESTATE_PAGE ? size - off : SAVESTATE_PAGE;
+
+        if (!IsZeroPage(p + off, len))
+            bitmap[i / 8] |= 1 << (i % 8);
+    }
+
+    savestate_Put(bitmap, (num + 7) / 8);
+
+    for (i = 0; i < num; ) {
+        u64 run = 0;
+
+        while (i + run < num && (bitmap[(i + run) / 8] & (1 << ((i + run) % 8))))
+            run++;
+
+        if (run == 0) {
+            i++;
+            continue;
+        }
+
+        u64 off = i * SAVESTATE_PAGE;
+        u64 len = run * SAVESTATE_PAGE;
+        if (off + len > size)
+            len = size - off;
+
+        savestate_Put(p + off, len);
+        i += run;
+    }
+    free(bitmap);
+}
+
+void savestate_GetPages(void* data, u64 size)
+{
+    u8* p = data;
+    u64 num = (size + SAVESTATE_PAGE - 1) / SAVESTATE_PAGE;
+    u8* bitmap = malloc((num + 7) / 8 + 1);
+    u64 i;
+
+    if (bitmap == NULL) {
+        ERROR("Not enough mem.\n");
+        failed = true;
+        return;
+    }
+
+    savestate_Get(bitmap, (num + 7) / 8);
+
+    for (i = 0; i < num; ) {
+        bool set = (bitmap[i / 8] & (1 << (i % 8))) != 0;
+        u64 run = 0;
+
+        while (i + run < num && ((bitmap[(i + run) / 8] & (1 << ((i + run) % 8))) != 0) == set)
+            run++;
+
+        u64 off = i * SAVESTATE_PAGE;
+        u64 len = run * SAVESTATE_PAGE;
+        if (off + len > size)
+            len = size - off;
+
+        if (set)
+            savestate_Get(p + off, len);
+        else
+            memset(p + off, 0, len);
+        i += run;
+    }
+    free(bitmap);
+}
+
+// Adds the ASLR slide to an array of function pointers, NULLs stay NULL.
+void savestate_Relocate(void* fn_ptrs, u32 num)
+{
+    uintptr_t* p = fn_ptrs;
+    u32 i;
+
+    for (i = 0; i < num; i++)
+        if (p[i] != 0)
+            p[i] += reloc_delta;
+}
+
+void savestate_Fail()
+{
+    failed = true;
+}
+
+static void AddFixedBuffers()
+{
+    num_buffers = 0;
+
+    AddBuffer(LINEmembuffer, 0x8000000, true);
+    AddBuffer(VRAMbuff, 0x800000, true);
+    AddBuffer(GSPsharedbuff, GSPsharebuffsize, true);
+    AddBuffer(HIDsharedbuff, sizeof(HIDsharedbuff), true);
+    AddBuffer(HIDsharedbuffSPVR, sizeof(HIDsharedbuffSPVR), true);
+}
+
+// Finds every buffer the guest can point at.
+static int Collect()
+{
+    u32 i;
+    int rc;
+
+    failed = false;
+    AddFixedBuffers();
+
+    for (i = 0; i < ARRAY_SIZE(modules); i++) {
+        if (modules[i].collect != NULL && (rc = modules[i].collect()) != 0)
+            return rc;
+    }
+    return failed ? -1 : 0;
+}
+
+// Writes what Collect found to fd.
+static void Write()
+{
+    uintptr_t anchor = (uintptr_t)&savestate_Save;
+    u32 magic = SAVESTATE_MAGIC, version = SAVESTATE_VERSION;
+    u32 i;
+
+    savestate_Put(&magic, sizeof(magic));
+    savestate_Put(&version, sizeof(version));
+    savestate_Put(&anchor, sizeof(anchor));
+    savestate_Put(loader_h.productcode, sizeof(loader_h.productcode));
+
+    savestate_Put(&num_buffers, sizeof(num_buffers));
+    for (i = 0; i < num_buffers; i++) {
+        u8 fixed = buffers[i].fixed;
+
+        savestate_Put(&fixed, 1);
+        savestate_Put(&buffers[i].size, sizeof(buffers[i].size));
+        savestate_PutPages(buffers[i].ptr, buffers[i].size);
+    }
+
+    for (i = 0; i < ARRAY_SIZE(modules); i++)
+        if (modules[i].save != NULL)
+            modules[i].save();
+}
+
+// Checks the header of fd, nothing is touched yet.
+static int ReadHeader(const char* path)
+{
+    uintptr_t anchor;
+    u8 productcode[sizeof(loader_h.productcode)];
+    u32 magic, version;
+
+    failed = false;
+    savestate_Get(&magic, sizeof(magic));
+    savestate_Get(&version, sizeof(version));
+    savestate_Get(&anchor, sizeof(anchor));
+    savestate_Get(productcode, sizeof(productcode));
+
+    if (failed || magic != SAVESTATE_MAGIC || version != SAVESTATE_VERSION) {
+        ERROR("%s is not a save state of this version.\n", path);
+        return -1;
+    }
+
+    if (memcmp(productcode, loader_h.productcode, sizeof(productcode)) != 0) {
+        ERROR("%s was saved from a different title.\n", path);
+        return -1;
+    }
+
+    reloc_delta = (uintptr_t)&savestate_Save - anchor;
+    return 0;
+}
+
+// Reads the rest of fd into the machine. On failure the machine is left
+// half overwritten.
+static int ReadBody()
+{
+    state_buffer fixed[8];
+    u32 num, num_fixed, i;
+
+    // Fixed buffers come in the same order they were added in.
+    AddFixedBuffers();
+    num_fixed = num_buffers;
+    memcpy(fixed, buffers, sizeof(state_buffer) * num_fixed);
+    num_buffers = 0;
+
+    savestate_Get(&num, sizeof(num));
+
+    for (i = 0; i < num && !failed; i++) {
+        u8 is_fixed;
+        u64 size;
+        u8* ptr;
+
+        savestate_Get(&is_fixed, 1);
+        savestate_Get(&size, sizeof(size));
+
+        if (is_fixed) {
+            if (num_buffers >= num_fixed || fixed[num_buffers].size != size) {
+                ERROR("Save state does not match this build.\n");
+                failed = true;
+                break;
+            }
+            ptr = fixed[num_buffers].ptr;
+        } else if ((ptr = malloc(size)) == NULL) {
+            ERROR("Not enough mem.\n");
+            failed = true;
+            break;
+        }
+
+        savestate_GetPages(ptr, size);
+        PushBuffer(ptr, size, is_fixed);
+    }
+
+    // Only the fixed buffers are overwritten so far.
+    if (failed)
+        return -1;
+
+    for (i = 0; i < ARRAY_SIZE(modules); i++)
+        if (modules[i].load != NULL)
+            modules[i].load();
+
+    return failed ? -1 : 0;
+}
+
+static void FreeBuffers(state_buffer* list, u32 num)
+{
+    u32 i;
+
+    // Claimed ones went with their owner.
+    for (i = 0; i < num; i++)
+        if (!list[i].fixed && !list[i].owned)
+            free(list[i].ptr);
+    free(list);
+}
+
+int savestate_Save(const char* path)
+{
+    int rc;
+
+#ifdef MODULE_SUPPORT
+    ERROR("Save states are not supported with modules.\n");
+    return -1;
+#endif
+
+    rc = Collect();
+    if (rc != 0)
+        return rc;
+
+    fd = fopen(path, "wb");
+    if (fd == NULL) {
+        ERROR("Failed to open %s\n", path);
+        return -1;
+    }
+
+    Write();
+
+    if (fclose(fd) != 0)
+        failed = true;
+
+    if (failed) {
+        ERROR("Failed to write %s\n", path);
+        return -1;
+    }
+
+    DEBUG("Saved state to %s, %u buffers.\n", path, num_buffers);
+    return 0;
+}
+
+// The machine as it is goes to a temporary file first. Should the state
+// turn out to be broken half way through, that is loaded back, so a failed
+// load returns with the machine where it was. Host resources (open save
+// files, sockets) don't survive the round trip, their handles are dead.
+int savestate_Load(const char* path)
+{
+    state_buffer* loaded;
+    u32 num_loaded;
+    FILE *state, *undo;
+    int rc;
+
+#ifdef MODULE_SUPPORT
+    ERROR("Save states are not supported with modules.\n");
+    return -1;
+#endif
+
+    fd = fopen(path, "rb");
+    if (fd == NULL) {
+        ERROR("Failed to open %s\n", path);
+        return -1;
+    }
+
+    if (ReadHeader(path) != 0) {
+        fclose(fd);
+        return -1;
+    }
+
+    undo = tmpfile();
+    if (undo == NULL) {
+        ERROR("Failed to create a temporary file.\n");
+        fclose(fd);
+        return -1;
+    }
+
+    state = fd;
+
+    rc = Collect();
+    if (rc == 0) {
+        fd = undo;
+        Write();
+        if (fflush(undo) != 0)
+            failed = true;
+    }
+
+    if (rc != 0 || failed) {
+        ERROR("Can't load %s, the current state could not be kept.\n", path);
+        fclose(undo);
+        fclose(state);
+        return rc == SAVESTATE_BUSY ? SAVESTATE_BUSY : -1;
+    }
+
+    fd = state;
+    rc = ReadBody();
+    fclose(state);
+
+    if (rc == 0) {
+        fclose(undo);
+        DEBUG("Loaded state from %s.\n", path);
+        return 0;
+    }
+
+    ERROR("Failed to load %s, going back.\n", path);
+
+    // What the broken state brought in is freed once nothing points at it.
+    loaded = buffers;
+    num_loaded = num_buffers;
+    buffers = NULL;
+    num_buffers = max_buffers = 0;
+
+    fd = undo;
+    rewind(undo);
+    if (ReadHeader("the current state") != 0 || ReadBody() != 0) {
+        ERROR("Going back failed, the machine state is lost.\n");
+        fclose(undo);
+        return SAVESTATE_LOST;
+    }
+
+    FreeBuffers(loaded, num_loaded);
+    fclose(undo);
+    return -1;
+}
@@ -20,6 +20,7 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
@@ -172,7 +173,7 @@ SERVICE_CMD(0x4b00c2)   //AppletUtility
 SERVICE_END();
 
 
-u32 LockHandles = 0;
+static u32 LockHandles = 0;
 
 SERVICE_START(apt_s);
 
@@ -391,3 +392,23 @@ SERVICE_CMD(0xe0080)
 }
 
 SERVICE_END();
+
+int apt_s_CollectState()
+{
+    savestate_AddBuffer(APTs_sharedfont, APTs_sharedfontsize + 4);
+    return 0;
+}
+
+void apt_s_SaveState()
+{
+    savestate_PutPtr(APTs_sharedfont);
+    savestate_Put(&APTs_sharedfontsize, sizeof(APTs_sharedfontsize));
+    savestate_Put(&LockHandles, sizeof(LockHandles));
+}
+
+void apt_s_LoadState()
+{
+    APTs_sharedfont = savestate_GetPtr();
+    savestate_Get(&APTs_sharedfontsize, sizeof(APTs_sharedfontsize));
+    savestate_Get(&LockHandles, sizeof(LockHandles));
+}
@@ -20,6 +20,7 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
@@ -29,7 +30,7 @@ u32 event_handles[2];
 u8* APTsharedfont = NULL;
 size_t APTsharedfontsize = 0;
 
-u32 LockHandle = 0;
+static u32 LockHandle = 0;
 
 SERVICE_START(apt_u);
 
@@ -286,3 +287,26 @@ SERVICE_CMD(0x4f0080)
 }
 
 SERVICE_END();
+
+// The font is mapped into the guest, the event handles are shared with APT:S.
+int apt_u_CollectState()
+{
+    savestate_AddBuffer(APTsharedfont, APTsharedfontsize + 4);
+    return 0;
+}
+
+void apt_u_SaveState()
+{
+    savestate_PutPtr(APTsharedfont);
+    savestate_Put(&APTsharedfontsize, sizeof(APTsharedfontsize));
+    savestate_Put(event_handles, sizeof(event_handles));
+    savestate_Put(&LockHandle, sizeof(LockHandle));
+}
+
+void apt_u_LoadState()
+{
+    APTsharedfont = savestate_GetPtr();
+    savestate_Get(&APTsharedfontsize, sizeof(APTsharedfontsize));
+    savestate_Get(event_handles, sizeof(event_handles));
+    savestate_Get(&LockHandle, sizeof(LockHandle));
+}
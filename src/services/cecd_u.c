@@ -19,6 +19,7 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
@@ -51,3 +52,14 @@ SERVICE_CMD(0x000D0082) //unknown
 }
 
 SERVICE_END();
+
+// lock_handle is shared with APT:U and APT:S.
+void cecd_u_SaveState()
+{
+    savestate_Put(&lock_handle, sizeof(lock_handle));
+}
+
+void cecd_u_LoadState()
+{
+    savestate_Get(&lock_handle, sizeof(lock_handle));
+}
@@ -20,16 +20,19 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "dsp.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
 u8* CSND_sharedmem = NULL;
 u32 CSND_sharedmemsize = 0;
-u32 CSND_mutex = 0;
-u32 CSND_offset0;
+static u32 CSND_mutex = 0;
+static u32 CSND_offset0;
 u32 CSND_offset1;
 u32 CSND_offset2;
-u32 CSND_offset3;
+static u32 CSND_offset3;
+static u32 CSND_capunits = 0;
 
 SERVICE_START(csnd_SND);
 SERVICE_CMD(0x00010140)   // Initialize
@@ -41,7 +44,8 @@ SERVICE_CMD(0x00010140)   // Initialize
     CSND_offset3 = CMD(5);
     DEBUG("Initialize %08X %08X %08X %08X %08X\n", CSND_sharedmemsize, CSND_offset0, CSND_offset1, CSND_offset2, CSND_offset3);
     if (CSND_sharedmem)free(CSND_sharedmem);
-    CSND_sharedmem = (u8*)malloc(CSND_sharedmemsize);
+    CSND_sharedmem = (u8*)calloc(1, CSND_sharedmemsize);
+    csnd_Reset();
 
     // Init some event handles.
     if (!CSND_mutex) {
@@ -58,11 +62,101 @@ SERVICE_CMD(0x00010140)   // Initialize
 
     return 0;
 }
-SERVICE_CMD(0x00050000)
+SERVICE_CMD(0x00020000)   // Shutdown
 {
-    DEBUG("unknown 0x00050000\n");
+    DEBUG("Shutdown\n");
+    csnd_Reset();
+    RESP(1, 0); // Result
+    return 0;
+}
+SERVICE_CMD(0x00030040)   // ExecuteCommands
+{
+    DEBUG("ExecuteCommands %08X\n", CMD(1));
+    csnd_ExecuteCommands(CMD(1));
+    RESP(1, 0); // Result
+    return 0;
+}
+SERVICE_CMD(0x00050000)   // AcquireSoundChannels
+{
+    DEBUG("AcquireSoundChannels\n");
+    RESP(1, 0x0); // Result
+    RESP(2, 0xFFFFFF00); // Channels 0-7 are the DSP's.
+    return 0;
+}
+SERVICE_CMD(0x00060000)   // ReleaseSoundChannels
+{
+    DEBUG("ReleaseSoundChannels\n");
+    RESP(1, 0x0); // Result
+    return 0;
+}
+SERVICE_CMD(0x00070000)   // AcquireCapUnit
+{
+    u32 unit;
+
+    for (unit = 0; unit < 2; unit++)
+        if (!(CSND_capunits & (1 << unit)))
+            break;
+
+    DEBUG("AcquireCapUnit %d\n", unit);
+    if (unit == 2) {
+        RESP(1, 0xC8A0BFEF); // Out of resource
+        return 0;
+    }
+
+    CSND_capunits |= 1 << unit;
+    RESP(1, 0x0); // Result
+    RESP(2, unit);
+    return 0;
+}
+SERVICE_CMD(0x00080040)   // ReleaseCapUnit
+{
+    DEBUG("ReleaseCapUnit %d\n", CMD(1));
+    CSND_capunits &= ~(1 << (CMD(1) & 1));
+    RESP(1, 0x0); // Result
+    return 0;
+}
+SERVICE_CMD(0x00090082)   // FlushDataCache
+SERVICE_CMD(0x000A0082)   // StoreDataCache
+SERVICE_CMD(0x000B0082)   // InvalidateDataCache
+{
+    RESP(1, 0x0); // Result
+    return 0;
+}
+SERVICE_CMD(0x000C0000)   // Reset
+{
+    DEBUG("Reset\n");
+    csnd_Reset();
     RESP(1, 0x0); // Result
-    RESP(2, 0x0000000F); // bitmask of ?engines that are read to use we have 4?
     return 0;
 }
 SERVICE_END();
+
+int csnd_SND_CollectState()
+{
+    savestate_AddBuffer(CSND_sharedmem, CSND_sharedmemsize);
+    return 0;
+}
+
+void csnd_SND_SaveState()
+{
+    savestate_PutPtr(CSND_sharedmem);
+    savestate_Put(&CSND_sharedmemsize, sizeof(CSND_sharedmemsize));
+    savestate_Put(&CSND_mutex, sizeof(CSND_mutex));
+    savestate_Put(&CSND_offset0, sizeof(CSND_offset0));
+    savestate_Put(&CSND_offset1, sizeof(CSND_offset1));
+    savestate_Put(&CSND_offset2, sizeof(CSND_offset2));
+    savestate_Put(&CSND_offset3, sizeof(CSND_offset3));
+    savestate_Put(&CSND_capunits, sizeof(CSND_capunits));
+}
+
+void csnd_SND_LoadState()
+{
+    CSND_sharedmem = savestate_GetPtr();
+    savestate_Get(&CSND_sharedmemsize, sizeof(CSND_sharedmemsize));
+    savestate_Get(&CSND_mutex, sizeof(CSND_mutex));
+    savestate_Get(&CSND_offset0, sizeof(CSND_offset0));
+    savestate_Get(&CSND_offset1, sizeof(CSND_offset1));
+    savestate_Get(&CSND_offset2, sizeof(CSND_offset2));
+    savestate_Get(&CSND_offset3, sizeof(CSND_offset3));
+    savestate_Get(&CSND_capunits, sizeof(CSND_capunits));
+}
@@ -21,8 +21,10 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "dsp.h"
+#include "savestate.h"
 
-u32 mutex_handle;
+static u32 mutex_handle;
 
 u32 myeventhandel = 0;
 
@@ -72,13 +74,10 @@ u32 dsp_dsp_SyncRequest()
         mem_Read(outbuff, buffer, size);
         fwrite(outbuff, size, 1, out);
         fclose(out);
-#endif
-
-        //DSP_LoadFirm(outbuff);
-
-#ifdef DUMP_DSPFIRM
         free(outbuff);
 #endif
+
+        // The firmware is not run, audio is mixed by dsp/audio.c.
         mem_Write32(arm11_ServiceBufferAddress() + 0x84, 0x0); //no error
         mem_Write32(arm11_ServiceBufferAddress() + 0x88, 0x1); //loaded
         return 0;
@@ -115,9 +114,20 @@ u32 dsp_dsp_SyncRequest()
         u32 size = mem_Read32(arm11_ServiceBufferAddress() + 0x88);
         u32 buffer = mem_Read32(arm11_ServiceBufferAddress() + 0x90);
         DEBUG("WriteProcessPipe %08X %08X %08X\n", numb, size, buffer);
-        for (unsigned int i = 0; i < size; i++) {
-            if (i % 16 == 0) printf("\n");
-            printf("%02X ", mem_Read8(buffer + i));
+
+        // Audio pipe, the first byte is the new state of the component.
+        if (numb == 2 && size >= 1) {
+            switch (mem_Read8(buffer)) {
+            case 0: //Initialize
+                ReadPipeIfPossibleCount = 0;
+                dspaudio_Start();
+                break;
+            case 1: //Shutdown
+                dspaudio_Stop();
+                break;
+            default: //Wakeup, Sleep
+                break;
+            }
         }
         mem_Write32(arm11_ServiceBufferAddress() + 0x84, 0); //no error
         return 0;
@@ -180,3 +190,15 @@ u32 dsp_dsp_SyncRequest()
     PAUSE();
     return 0;
 }
+
+void dsp_dsp_SaveState()
+{
+    savestate_Put(&mutex_handle, sizeof(mutex_handle));
+    savestate_Put(&myeventhandel, sizeof(myeventhandel));
+}
+
+void dsp_dsp_LoadState()
+{
+    savestate_Get(&mutex_handle, sizeof(mutex_handle));
+    savestate_Get(&myeventhandel, sizeof(myeventhandel));
+}
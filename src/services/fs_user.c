@@ -20,9 +20,8 @@ static char tmp[256];
 #endif
 
 
-SERVICE_START(fs_user);
 
-SERVICE_CMD(0x08010002)   // Initialize
+SERVICE_HANDLER(fs_user_Initialize)
 {
     DEBUG("Initialize\n");
 
@@ -30,7 +29,7 @@ SERVICE_CMD(0x08010002)   // Initialize
     return 0;
 }
 
-SERVICE_CMD(0x08040142)   // DeleteFile
+SERVICE_HANDLER(fs_user_DeleteFile)
 {
     u32 transaction = CMD(1);
     u32 handle_arch_lo = CMD(2);
@@ -78,7 +77,7 @@ SERVICE_CMD(0x08040142)   // DeleteFile
     return 0;
 }
 
-SERVICE_CMD(0x08050244)   // RenameFile
+SERVICE_HANDLER(fs_user_RenameFile)
 {
     u32 transaction = CMD(1);
     u32 src_handle_arch_lo = CMD(2);
@@ -156,7 +155,7 @@ SERVICE_CMD(0x08050244)   // RenameFile
     return 0;
 }
 
-SERVICE_CMD(0x08060142)   // DeleteDirectory
+SERVICE_HANDLER(fs_user_DeleteDirectory)
 {
     u32 transaction = CMD(1);
     u32 handle_arch_lo = CMD(2);
@@ -204,7 +203,7 @@ SERVICE_CMD(0x08060142)   // DeleteDirectory
     return 0;
 }
 
-SERVICE_CMD(0x08070142)   // DeleteDirectoryRecursively
+SERVICE_HANDLER(fs_user_DeleteDirectoryRecursively)
 {
     u32 transaction = CMD(1);
     u32 handle_arch_lo = CMD(2);
@@ -252,7 +251,7 @@ SERVICE_CMD(0x08070142)   // DeleteDirectoryRecursively
     return 0;
 }
 
-SERVICE_CMD(0x08090182)   // CreateDirectory
+SERVICE_HANDLER(fs_user_CreateDirectory)
 {
     u32 transaction = CMD(1);
     u32 handle_arch_lo = CMD(2);
@@ -304,7 +303,7 @@ SERVICE_CMD(0x08090182)   // CreateDirectory
     return 0;
 }
 
-SERVICE_CMD(0x080A0244)   // RenameDirectory
+SERVICE_HANDLER(fs_user_RenameDirectory)
 {
     u32 transaction = CMD(1);
     u32 src_handle_arch_lo = CMD(2);
@@ -381,7 +380,7 @@ SERVICE_CMD(0x080A0244)   // RenameDirectory
     RESP(1, 0); // Result
     return 0;
 }
-SERVICE_CMD(0x080201C2)   // OpenFile
+SERVICE_HANDLER(fs_user_OpenFile)
 {
     u32 transaction       = CMD(1);
     u32 handle_arch_lo    = CMD(2);
@@ -441,7 +440,7 @@ SERVICE_CMD(0x080201C2)   // OpenFile
     RESP(3, file_handle); // File handle
     return 0;
 }
-SERVICE_CMD(0x080b0102) //OpenDirectory
+SERVICE_HANDLER(fs_user_OpenDirectory)
 {
     u32 handle_arch_lo = CMD(1);
     u32 handle_arch = CMD(2);
@@ -490,7 +489,7 @@ SERVICE_CMD(0x080b0102) //OpenDirectory
     RESP(3, file_handle); // File handle
     return 0;
 }
-SERVICE_CMD(0x08030204)   // OpenFileDirectly
+SERVICE_HANDLER(fs_user_OpenFileDirectly)
 {
     u32 transaction       = CMD(1);
     u32 arch_id           = CMD(2);
@@ -561,7 +560,7 @@ SERVICE_CMD(0x08030204)   // OpenFileDirectly
     return 0;
 }
 
-SERVICE_CMD(0x08080202)   // CreateFile
+SERVICE_HANDLER(fs_user_CreateFile)
 {
     u32 transaction = CMD(1);
     u32 handle_arch_lo = CMD(2);
@@ -620,7 +619,7 @@ SERVICE_CMD(0x08080202)   // CreateFile
     return 0;
 }
 
-SERVICE_CMD(0x080C00C2)   // OpenArchive
+SERVICE_HANDLER(fs_user_OpenArchive)
 {
     u32 arch_id           = CMD(1);
     u32 arch_lowpath_type = CMD(2);
@@ -669,7 +668,7 @@ SERVICE_CMD(0x080C00C2)   // OpenArchive
     return 0;
 }
 
-SERVICE_CMD(0x080E0080)   // CloseArchive
+SERVICE_HANDLER(fs_user_CloseArchive)
 {
     DEBUG("CloseArchive\n");
 
@@ -698,7 +697,7 @@ SERVICE_CMD(0x080E0080)   // CloseArchive
     return 0;
 }
 
-SERVICE_CMD(0x080F0180)   // FormatThisUserSaveData
+SERVICE_HANDLER(fs_user_FormatThisUserSaveData)
 {
     DEBUG("FormatThisUserSaveData %08x %08x %08x %08x %08x %08x %08x %08x --todo--\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8));
 
@@ -707,14 +706,10 @@ SERVICE_CMD(0x080F0180)   // FormatThisUserSaveData
 
     RESP(1, 0);
 
-#ifdef _WIN32
-    return _mkdir(p);
-#else
-    return mkdir(p, 0777);
-#endif
+    return overlay_Mkdir(p);
 }
 
-SERVICE_CMD(0x08170000)   // IsSdmcDetected
+SERVICE_HANDLER(fs_user_IsSdmcDetected)
 {
     DEBUG("IsSdmcDetected\n");
 
@@ -726,19 +721,19 @@ SERVICE_CMD(0x08170000)   // IsSdmcDetected
     return 0;
 }
 
-SERVICE_CMD(0x08180000)   //IsSdmcWritable
+SERVICE_HANDLER(fs_user_IsSdmcWritable)
 {
     DEBUG("IsSdmcWritable\n");
 
     RESP(1, 0);
-    if (config_sdmcwriteable)
+    if (config_sdmcwriteable || overlay_Enabled()) // Overlay writes go to the delta.
         RESP(2, 1); //true
     else
         RESP(2, 0); //false
     return 0;
 }
 
-SERVICE_CMD(0x08210000)   // CardSlotIsInserted
+SERVICE_HANDLER(fs_user_CardSlotIsInserted)
 {
     DEBUG("CardSlotIsInserted\n");
 
@@ -750,7 +745,7 @@ SERVICE_CMD(0x08210000)   // CardSlotIsInserted
     return 0;
 }
 
-SERVICE_CMD(0x08330082)   // EnumerateExtSaveData
+SERVICE_HANDLER(fs_user_EnumerateExtSaveData)
 {
     DEBUG("EnumerateExtSaveData -- TODO --\n");
 
@@ -758,7 +753,7 @@ SERVICE_CMD(0x08330082)   // EnumerateExtSaveData
     return 0;
 }
 
-SERVICE_CMD(0x08490040)   // GetArchiveResource
+SERVICE_HANDLER(fs_user_GetArchiveResource)
 {
     DEBUG("GetArchiveResource -- TODO --\n");
 
@@ -766,7 +761,7 @@ SERVICE_CMD(0x08490040)   // GetArchiveResource
     return 0;
 }
 
-SERVICE_CMD(0x08610042)   // InitializeWithSdkVersion
+SERVICE_HANDLER(fs_user_InitializeWithSdkVersion)
 {
     DEBUG("InitializeWithSdkVersion -- TODO --\n");
 
@@ -774,7 +769,7 @@ SERVICE_CMD(0x08610042)   // InitializeWithSdkVersion
     return 0;
 }
 
-SERVICE_CMD(0x08620040)   // SetPriority
+SERVICE_HANDLER(fs_user_SetPriority)
 {
     priority = CMD(1);
     DEBUG("SetPriority, prio=%x\n", priority);
@@ -783,7 +778,7 @@ SERVICE_CMD(0x08620040)   // SetPriority
     return 0;
 }
 
-SERVICE_CMD(0x08630000)   // GetPriority
+SERVICE_HANDLER(fs_user_GetPriority)
 {
     DEBUG("GetPriority\n");
 
@@ -791,15 +786,24 @@ SERVICE_CMD(0x08630000)   // GetPriority
     RESP(2, priority);
     return 0;
 }
-SERVICE_CMD(0x080D0144)   // ControlArchive
+SERVICE_HANDLER(fs_user_ControlArchive)
 {
-    DEBUG("ControlArchive %08x %08x %08x %08x %08x %08x %08x %08x --todo--\n",CMD(1),CMD(2),CMD(3),CMD(4),CMD(5),CMD(6),CMD(7),CMD(8));
+    u32 action = CMD(3);
+
+    DEBUG("ControlArchive %08x %08x %08x %08x %08x %08x %08x %08x\n",CMD(1),CMD(2),CMD(3),CMD(4),CMD(5),CMD(6),CMD(7),CMD(8));
+
+    // Action 0 commits the save data, write out what the save cache holds.
+    if (action == 0 && hostfile_CommitAll() != 0) {
+        ERROR("ControlArchive commit failed.\n");
+        RESP(1, -1);
+        return 0;
+    }
 
     RESP(1, 0);
     return 0;
 }
 
-SERVICE_CMD(0x084500c2)   // GetFormatInfo
+SERVICE_HANDLER(fs_user_GetFormatInfo)
 {
 	DEBUG("GetFormatInfo %08x %08x %08x %08x %08x %08x %08x %08x --todo--\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8));
 
@@ -811,7 +815,7 @@ SERVICE_CMD(0x084500c2)   // GetFormatInfo
 	return 0;
 }
 
-SERVICE_CMD(0x084c0242)   // FormatSaveData
+SERVICE_HANDLER(fs_user_FormatSaveData)
 {
 	DEBUG("FormatSaveData %08x %08x %08x %08x %08x %08x %08x %08x --todo--\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8));
 
@@ -820,15 +824,11 @@ SERVICE_CMD(0x084c0242)   // FormatSaveData
 
     RESP(1, 0);
 
-#ifdef _WIN32
-    return _mkdir(p);
-#else
-    return mkdir(p, 0777);
-#endif
+    return overlay_Mkdir(p);
 	return 0;
 }
 
-SERVICE_CMD(0x08300182)   // CreateExtSaveData
+SERVICE_HANDLER(fs_user_CreateExtSaveData)
 {
     DEBUG("CreateExtSaveData %08x %08x %08x %08x %08x %08x %08x %08x --todo--\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8));
 
@@ -836,7 +836,7 @@ SERVICE_CMD(0x08300182)   // CreateExtSaveData
     return 0;
 }
 
-SERVICE_CMD(0x08350080)   // DeleteExtSaveData
+SERVICE_HANDLER(fs_user_DeleteExtSaveData)
 {
     DEBUG("DeleteExtSaveData %08x %08x %08x %08x %08x %08x %08x %08x --todo--\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8));
 
@@ -844,15 +844,71 @@ SERVICE_CMD(0x08350080)   // DeleteExtSaveData
     return 0;
 }
 
-SERVICE_END();
+SERVICE_TABLE_START(fs_user_unlocked)
+    SERVICE_TABLE_CMD(0x08010002, fs_user_Initialize)
+    SERVICE_TABLE_CMD(0x08040142, fs_user_DeleteFile)
+    SERVICE_TABLE_CMD(0x08050244, fs_user_RenameFile)
+    SERVICE_TABLE_CMD(0x08060142, fs_user_DeleteDirectory)
+    SERVICE_TABLE_CMD(0x08070142, fs_user_DeleteDirectoryRecursively)
+    SERVICE_TABLE_CMD(0x08090182, fs_user_CreateDirectory)
+    SERVICE_TABLE_CMD(0x080A0244, fs_user_RenameDirectory)
+    SERVICE_TABLE_CMD(0x080201C2, fs_user_OpenFile)
+    SERVICE_TABLE_CMD(0x080b0102, fs_user_OpenDirectory)
+    SERVICE_TABLE_CMD(0x08030204, fs_user_OpenFileDirectly)
+    SERVICE_TABLE_CMD(0x08080202, fs_user_CreateFile)
+    SERVICE_TABLE_CMD(0x080C00C2, fs_user_OpenArchive)
+    SERVICE_TABLE_CMD(0x080E0080, fs_user_CloseArchive)
+    SERVICE_TABLE_CMD(0x080F0180, fs_user_FormatThisUserSaveData)
+    SERVICE_TABLE_CMD(0x08170000, fs_user_IsSdmcDetected)
+    SERVICE_TABLE_CMD(0x08180000, fs_user_IsSdmcWritable)
+    SERVICE_TABLE_CMD(0x08210000, fs_user_CardSlotIsInserted)
+    SERVICE_TABLE_CMD(0x08330082, fs_user_EnumerateExtSaveData)
+    SERVICE_TABLE_CMD(0x08490040, fs_user_GetArchiveResource)
+    SERVICE_TABLE_CMD(0x08610042, fs_user_InitializeWithSdkVersion)
+    SERVICE_TABLE_CMD(0x08620040, fs_user_SetPriority)
+    SERVICE_TABLE_CMD(0x08630000, fs_user_GetPriority)
+    SERVICE_TABLE_CMD(0x080D0144, fs_user_ControlArchive)
+    SERVICE_TABLE_CMD(0x084500c2, fs_user_GetFormatInfo)
+    SERVICE_TABLE_CMD(0x084c0242, fs_user_FormatSaveData)
+    SERVICE_TABLE_CMD(0x08300182, fs_user_CreateExtSaveData)
+    SERVICE_TABLE_CMD(0x08350080, fs_user_DeleteExtSaveData)
+SERVICE_TABLE_END(fs_user_unlocked);
+
+// The archive backends are shared with the I/O thread, see fs/async.c.
+u32 fs_user_SyncRequest(handleinfo* h, bool *locked)
+{
+    u32 rc;
+
+    fsasync_Lock();
+    rc = fs_user_unlocked_SyncRequest(h, locked);
+    fsasync_Unlock();
+    return rc;
+}
 
 
 
 /* ____ File Service ____ */
 
-SERVICE_START(file);
 
-SERVICE_CMD(0x080200C2)   // Read
+// A read still queued on the file fails, the file is gone. Its caller gets
+// the reply right away. Caller holds the FS lock.
+static void CancelRead(handleinfo* h)
+{
+    u32* cmd_buffer = h->misc_ptr[1];
+    u32 rc, read;
+
+    if (h->misc_ptr[0] == NULL)
+        return;
+
+    fsasync_Cancel(h->misc_ptr[0]);
+    fsasync_Poll(h->misc_ptr[0], &rc, &read);
+
+    h->misc_ptr[0] = NULL;
+    cmd_buffer[1] = rc; // Result
+    cmd_buffer[2] = read;
+}
+
+SERVICE_HANDLER(file_Read)
 {
     u32 rc, read;
     u64 off = CMD(1) | (((u64) CMD(2)) << 32);
@@ -863,6 +919,19 @@ SERVICE_CMD(0x080200C2)   // Read
 
     file_type* type = (file_type*) h->subtype;
 
+    // Large reads go to the I/O thread, the caller waits on the file handle
+    // and gets its reply from file_WaitSynchronization.
+    if (h->misc_ptr[0] == NULL && ipc_cmd_buffer != NULL) {
+        fsasync_req* req = fsasync_Read(type, ptr, sz, off);
+
+        if (req != NULL) {
+            h->misc_ptr[0] = req;
+            h->misc_ptr[1] = ipc_cmd_buffer;
+            *locked = true;
+            return 0;
+        }
+    }
+
     if(type->fnRead != NULL) {
         rc = type->fnRead(type, ptr, sz, off, &read);
     } else {
@@ -876,7 +945,7 @@ SERVICE_CMD(0x080200C2)   // Read
     return 0;
 }
 
-SERVICE_CMD(0x08030102)   // Write
+SERVICE_HANDLER(file_Write)
 {
     u32 rc, written=0;
     u64 off = CMD(1) | ((u64) CMD(2)) << 32;
@@ -901,7 +970,7 @@ SERVICE_CMD(0x08030102)   // Write
     return 0;
 }
 
-SERVICE_CMD(0x08010100)   // OpenSubFile
+SERVICE_HANDLER(file_OpenSubFile)
 {
 
     DEBUG("OpenSubFile, %08x %08x %08x %08x --stub--\n", CMD(1), CMD(2), CMD(3), CMD(4));
@@ -912,7 +981,7 @@ SERVICE_CMD(0x08010100)   // OpenSubFile
     return 0;
 }
 
-SERVICE_CMD(0x08040000)   // GetSize
+SERVICE_HANDLER(file_GetSize)
 {
     u32 rc = 0;
     u64 sz = 0;
@@ -934,7 +1003,7 @@ SERVICE_CMD(0x08040000)   // GetSize
     return 0;
 }
 
-SERVICE_CMD(0x08050080)   // SetSize
+SERVICE_HANDLER(file_SetSize)
 {
     u32 rc;
     u64 sz = CMD(1) | ((u64)CMD(2)) << 32;
@@ -954,27 +1023,29 @@ SERVICE_CMD(0x08050080)   // SetSize
     return 0;
 }
 
-SERVICE_CMD(0x08080000)   // Close
+SERVICE_HANDLER(file_Close)
 {
     u32 rc = 0;
     file_type* type = (file_type*) h->subtype;
 
     DEBUG("Close\n");
 
+    CancelRead(h);
+
     if(type->fnClose != NULL)
         rc = type->fnClose(type);
 
     RESP(1, rc);
     return 0;
 }
-SERVICE_CMD(0x08090000)   // Flush
+SERVICE_HANDLER(file_Flush)
 {
     DEBUG("Flush\n");
     RESP(1, 0);
     return 0;
 }
 
-SERVICE_CMD(0x080A0040)   // SetPriority
+SERVICE_HANDLER(file_SetPriority)
 {
     priority = CMD(1);
     DEBUG("SetPriority, prio=%x\n", priority);
@@ -982,7 +1053,7 @@ SERVICE_CMD(0x080A0040)   // SetPriority
     return 0;
 }
 
-SERVICE_CMD(0x080B0000)   // GetPriority
+SERVICE_HANDLER(file_GetPriority)
 {
     DEBUG("GetPriority\n");
 
@@ -991,7 +1062,7 @@ SERVICE_CMD(0x080B0000)   // GetPriority
     return 0;
 }
 
-SERVICE_CMD(0x080C0000)   // OpenLinkFile
+SERVICE_HANDLER(file_OpenLinkFile)
 {
     file_type* type = (file_type*)h->subtype;
 
@@ -1001,16 +1072,61 @@ SERVICE_CMD(0x080C0000)   // OpenLinkFile
     return 0;
 }
 
-SERVICE_END();
+SERVICE_TABLE_START(file_unlocked)
+    SERVICE_TABLE_CMD(0x080200C2, file_Read)
+    SERVICE_TABLE_CMD(0x08030102, file_Write)
+    SERVICE_TABLE_CMD(0x08010100, file_OpenSubFile)
+    SERVICE_TABLE_CMD(0x08040000, file_GetSize)
+    SERVICE_TABLE_CMD(0x08050080, file_SetSize)
+    SERVICE_TABLE_CMD(0x08080000, file_Close)
+    SERVICE_TABLE_CMD(0x08090000, file_Flush)
+    SERVICE_TABLE_CMD(0x080A0040, file_SetPriority)
+    SERVICE_TABLE_CMD(0x080B0000, file_GetPriority)
+    SERVICE_TABLE_CMD(0x080C0000, file_OpenLinkFile)
+SERVICE_TABLE_END(file_unlocked);
+
+u32 file_SyncRequest(handleinfo* h, bool *locked)
+{
+    u32 rc;
+
+    fsasync_Lock();
+    rc = file_unlocked_SyncRequest(h, locked);
+    fsasync_Unlock();
+    return rc;
+}
 
 u32 file_CloseHandle(ARMul_State *state, handleinfo* h)
 {
     DEBUG("file_CloseHandle - STUB\n");
+
+    fsasync_Lock();
+    CancelRead(h);
+    fsasync_Unlock();
+    return 0;
+}
+
+// Only blocks while an asynchronous read is in flight on the file.
+u32 file_WaitSynchronization(handleinfo* h, bool *locked)
+{
+    u32* cmd_buffer = h->misc_ptr[1];
+    u32 rc, read;
+
+    *locked = false;
+    if (h->misc_ptr[0] == NULL)
+        return 0;
+
+    if (!fsasync_Poll(h->misc_ptr[0], &rc, &read)) {
+        *locked = true;
+        return 0;
+    }
+
+    h->misc_ptr[0] = NULL;
+    cmd_buffer[1] = rc; // Result
+    cmd_buffer[2] = read;
     return 0;
 }
 
-SERVICE_START(dir);
-SERVICE_CMD(0x08010042)   // Read
+SERVICE_HANDLER(dir_Read)
 {
     u32 rc;
     u32 max_out_count = CMD(1);
@@ -1034,18 +1150,31 @@ SERVICE_CMD(0x08010042)   // Read
     return 0;
 }
 
-SERVICE_CMD(0x08020000)   // Close
+SERVICE_HANDLER(dir_Close)
 {
     u32 rc = 0;
-    file_type* type = (file_type*)h->subtype;
+    dir_type* type = (dir_type*)h->subtype;
 
     DEBUG("CloseDir\n");
 
-    //if (type->fnDirClose != NULL)
-    //    rc = type->fnDirClose(type);
+    if (type->fnClose != NULL)
+        rc = type->fnClose(type);
 
     RESP(1, rc);
     return 0;
 }
 
-SERVICE_END();
+SERVICE_TABLE_START(dir_unlocked)
+    SERVICE_TABLE_CMD(0x08010042, dir_Read)
+    SERVICE_TABLE_CMD(0x08020000, dir_Close)
+SERVICE_TABLE_END(dir_unlocked);
+
+u32 dir_SyncRequest(handleinfo* h, bool *locked)
+{
+    u32 rc;
+
+    fsasync_Lock();
+    rc = dir_unlocked_SyncRequest(h, locked);
+    fsasync_Unlock();
+    return rc;
+}
@@ -24,11 +24,13 @@
 
 #include "screen.h"
 #include "color.h"
+#include "bench.h"
+#include "savestate.h"
 #include "service_macros.h"
 
 
-u32 numReqQueue = 1;
-u32 trigevent = 0;
+static u32 numReqQueue = 1;
+static u32 trigevent = 0;
 
 //#define DUMP_CMDLIST
 
@@ -320,9 +322,8 @@ u32 GPURegisterInterruptRelayQueue(u32 flags, u32 Kevent, u32*threadID, u32*outM
 }
 
 
-SERVICE_START(gsp_gpu);
 
-SERVICE_CMD(0x10082) // WriteHWRegs
+SERVICE_HANDLER(gsp_gpu_WriteHWRegs)
 {
     u32 inaddr  = CMD(4);
     u32 length  = CMD(2);
@@ -364,7 +365,7 @@ SERVICE_CMD(0x10082) // WriteHWRegs
     return 0;
 }
 
-SERVICE_CMD(0x20084) // WriteHWRegsWithMask
+SERVICE_HANDLER(gsp_gpu_WriteHWRegsWithMask)
 {
     u32 inmask  = CMD(6);
     u32 inaddr  = CMD(4);
@@ -408,7 +409,7 @@ SERVICE_CMD(0x20084) // WriteHWRegsWithMask
     return 0;
 }
 
-SERVICE_CMD(0x30082) // WriteHWRegsRepeat
+SERVICE_HANDLER(gsp_gpu_WriteHWRegsRepeat)
 {
     u32 inaddr  = CMD(4);
     u32 length  = CMD(2);
@@ -450,7 +451,7 @@ SERVICE_CMD(0x30082) // WriteHWRegsRepeat
 }
 
 
-SERVICE_CMD(0x40080) // ReadHWRegs
+SERVICE_HANDLER(gsp_gpu_ReadHWRegs)
 {
     u32 outaddr = EXTENDED_CMD(1);
     u32 length  = CMD(2);
@@ -486,7 +487,7 @@ SERVICE_CMD(0x40080) // ReadHWRegs
     return 0;
 }
 
-SERVICE_CMD(0x50200) // SetBufferSwap
+SERVICE_HANDLER(gsp_gpu_SetBufferSwap)
 {
     GPUDEBUG("SetBufferSwap screen=%08x\n", CMD(1));
 
@@ -508,14 +509,14 @@ SERVICE_CMD(0x50200) // SetBufferSwap
     return 0;
 }
 
-SERVICE_CMD(0x80082) // FlushDataCache
+SERVICE_HANDLER(gsp_gpu_FlushDataCache)
 {
     GPUDEBUG("FlushDataCache addr=%08x, size=%08x, h=%08x\n", CMD(1), CMD(2), CMD(4));
     RESP(1, 0);
     return 0;
 }
 
-SERVICE_CMD(0xB0040) // SetLcdForceBlack
+SERVICE_HANDLER(gsp_gpu_SetLcdForceBlack)
 {
     u8 flag = mem_Read8(arm11_ServiceBufferAddress() + 0x84);
     GPUDEBUG("SetLcdForceBlack %02x\n", flag);
@@ -533,16 +534,21 @@ SERVICE_CMD(0xB0040) // SetLcdForceBlack
     return 0;
 }
 
-SERVICE_CMD(0xC0000) // TriggerCmdReqQueue
+SERVICE_HANDLER(gsp_gpu_TriggerCmdReqQueue)
 {
     GPUDEBUG("TriggerCmdReqQueue\n");
+
+    if (bench_enabled)
+        bench_Enter(BENCH_GPU);
     gsp_ExecuteCommandFromSharedMem();
+    if (bench_enabled)
+        bench_Leave();
 
     RESP(1, 0);
     return 0;
 }
 
-SERVICE_CMD(0x00100040) // SetAxiConfigQoSMode
+SERVICE_HANDLER(gsp_gpu_SetAxiConfigQoSMode)
 {
     GPUDEBUG("SetAxiConfigQoSMode\n");
 
@@ -550,7 +556,7 @@ SERVICE_CMD(0x00100040) // SetAxiConfigQoSMode
     return 0;
 }
 
-SERVICE_CMD(0x130042) // RegisterInterruptRelayQueue
+SERVICE_HANDLER(gsp_gpu_RegisterInterruptRelayQueue)
 {
     GPUDEBUG("RegisterInterruptRelayQueue %08x %08x\n",
           mem_Read32(arm11_ServiceBufferAddress() + 0x84),
@@ -568,21 +574,34 @@ SERVICE_CMD(0x130042) // RegisterInterruptRelayQueue
     return 0;
 }
 
-SERVICE_CMD(0x160042) // AcquireRight
+SERVICE_HANDLER(gsp_gpu_AcquireRight)
 {
     GPUDEBUG("AcquireRight %08x %08x --todo--\n", mem_Read32(arm11_ServiceBufferAddress() + 0x84), mem_Read32(arm11_ServiceBufferAddress() + 0x8C));
     mem_Write32(arm11_ServiceBufferAddress() + 0x84, 0); //no error
     return 0;
 }
 
-SERVICE_CMD(0x1E0080) // SetInternalPriorities
+SERVICE_HANDLER(gsp_gpu_SetInternalPriorities)
 {
     GPUDEBUG("SetInternalPriorities %08x %08x %08x %08x %08x %08x %08x %08x --todo--\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8));
     RESP(1, 0);
     return 0;
 }
 
-SERVICE_END();
+SERVICE_TABLE_START(gsp_gpu)
+    SERVICE_TABLE_CMD(0x10082, gsp_gpu_WriteHWRegs)
+    SERVICE_TABLE_CMD(0x20084, gsp_gpu_WriteHWRegsWithMask)
+    SERVICE_TABLE_CMD(0x30082, gsp_gpu_WriteHWRegsRepeat)
+    SERVICE_TABLE_CMD(0x40080, gsp_gpu_ReadHWRegs)
+    SERVICE_TABLE_CMD(0x50200, gsp_gpu_SetBufferSwap)
+    SERVICE_TABLE_CMD(0x80082, gsp_gpu_FlushDataCache)
+    SERVICE_TABLE_CMD(0xB0040, gsp_gpu_SetLcdForceBlack)
+    SERVICE_TABLE_CMD(0xC0000, gsp_gpu_TriggerCmdReqQueue)
+    SERVICE_TABLE_CMD(0x00100040, gsp_gpu_SetAxiConfigQoSMode)
+    SERVICE_TABLE_CMD(0x130042, gsp_gpu_RegisterInterruptRelayQueue)
+    SERVICE_TABLE_CMD(0x160042, gsp_gpu_AcquireRight)
+    SERVICE_TABLE_CMD(0x1E0080, gsp_gpu_SetInternalPriorities)
+SERVICE_TABLE_END(gsp_gpu);
 
 
 /*
@@ -628,3 +647,15 @@ void gpu_SendInterruptToAll(u32 ID)
     }
 
 }
+
+void gsp_gpu_SaveState()
+{
+    savestate_Put(&numReqQueue, sizeof(numReqQueue));
+    savestate_Put(&trigevent, sizeof(trigevent));
+}
+
+void gsp_gpu_LoadState()
+{
+    savestate_Get(&numReqQueue, sizeof(numReqQueue));
+    savestate_Get(&trigevent, sizeof(trigevent));
+}
@@ -19,12 +19,13 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
 u8 HIDsharedbuffSPVR[0x2000];
 
-u32 memhandel2;
+static u32 memhandel2;
 
 
 
@@ -76,3 +77,13 @@ SERVICE_CMD(0x160000)
 }
 
 SERVICE_END();
+
+void hid_SPVR_SaveState()
+{
+    savestate_Put(&memhandel2, sizeof(memhandel2));
+}
+
+void hid_SPVR_LoadState()
+{
+    savestate_Get(&memhandel2, sizeof(memhandel2));
+}
@@ -20,15 +20,17 @@
 #include "arm11.h"
 #include "handles.h"
 #include "mem.h"
+#include "savestate.h"
 #include "service_macros.h"
+#include "hid_user.h"
 #include <SDL.h>
 
-extern ARMul_State s;
+extern THREAD_LOCAL ARMul_State* arm11_state;
 
 extern u8 HIDsharedbuffSPVR[0x2000];
 u8 HIDsharedbuff[0x2000];
 
-u32 memhandel;
+static u32 memhandel;
 
 void hid_user_init()
 {
@@ -39,9 +41,8 @@ void hid_user_init()
     *(u32*)&HIDsharedbuffSPVR[0x8] = *(u32*)&HIDsharedbuff[0x8] = 1;
 }
 
-SERVICE_START(hid_user);
 
-SERVICE_CMD(0xA0000)   //GetIPCHandles
+SERVICE_HANDLER(hid_user_GetIPCHandles)
 {
     RESP(1, 0); // Result
     RESP(2, 0xDEADF00D); // Unused
@@ -54,32 +55,32 @@ SERVICE_CMD(0xA0000)   //GetIPCHandles
     return 0;
 }
 
-SERVICE_CMD(0x110000)   //EnableAccelerometer
+SERVICE_HANDLER(hid_user_EnableAccelerometer)
 {
     RESP(1, 0); // Result
     return 0;
 }
 
-SERVICE_CMD(0x130000)   //EnableGyroscopeLow
+SERVICE_HANDLER(hid_user_EnableGyroscopeLow)
 {
     RESP(1, 0); // Result
     return 0;
 }
-SERVICE_CMD(0x150000)
+SERVICE_HANDLER(hid_user_GetGyroscopeLowRawToDpsCoefficient)
 {
     DEBUG("GetGyroscopeLowRawToDpsCoefficient (not working yet)\n");
 
     RESP(1, 0); // Result
     return 0;
 }
-SERVICE_CMD(0x160000)
+SERVICE_HANDLER(hid_user_GetGyroscopeLowCalibrateParam)
 {
     DEBUG("GetGyroscopeLowCalibrateParam (not working yet)\n");
 
     RESP(1, 0); // Result
     return 0;
 }
-SERVICE_CMD(0x170000)
+SERVICE_HANDLER(hid_user_GetSoundVolume)
 {
     DEBUG("GetSoundVolume --todo--\n");
 
@@ -88,7 +89,14 @@ SERVICE_CMD(0x170000)
     return 0;
 }
 
-SERVICE_END();
+SERVICE_TABLE_START(hid_user)
+    SERVICE_TABLE_CMD(0xA0000, hid_user_GetIPCHandles)
+    SERVICE_TABLE_CMD(0x110000, hid_user_EnableAccelerometer)
+    SERVICE_TABLE_CMD(0x130000, hid_user_EnableGyroscopeLow)
+    SERVICE_TABLE_CMD(0x150000, hid_user_GetGyroscopeLowRawToDpsCoefficient)
+    SERVICE_TABLE_CMD(0x160000, hid_user_GetGyroscopeLowCalibrateParam)
+    SERVICE_TABLE_CMD(0x170000, hid_user_GetSoundVolume)
+SERVICE_TABLE_END(hid_user);
 
 u32 translate_to_bit(const SDL_KeyboardEvent* key)
 {
@@ -126,15 +134,15 @@ void hid_update() //todo
 {
     *(u64*)&HIDsharedbuff[0x8] = *(u64*)&HIDsharedbuff[0x0];
     *(u64*)&HIDsharedbuffSPVR[0x8] = *(u64*)&HIDsharedbuffSPVR[0x0];
-    *(u64*)&HIDsharedbuff[0x0] = s.NumInstrs;
-    *(u64*)&HIDsharedbuffSPVR[0x0] = s.NumInstrs;
+    *(u64*)&HIDsharedbuff[0x0] = arm11_state->NumInstrs;
+    *(u64*)&HIDsharedbuffSPVR[0x0] = arm11_state->NumInstrs;
 }
 void hid_updatetouch() //todo
 {
     *(u64*)&HIDsharedbuff[0xB0] = *(u64*)&HIDsharedbuff[0xA8];
     *(u64*)&HIDsharedbuffSPVR[0xB0] = *(u64*)&HIDsharedbuffSPVR[0xA8];
-    *(u64*)&HIDsharedbuff[0xA8] = s.NumInstrs;
-    *(u64*)&HIDsharedbuffSPVR[0xA8] = s.NumInstrs;
+    *(u64*)&HIDsharedbuff[0xA8] = arm11_state->NumInstrs;
+    *(u64*)&HIDsharedbuffSPVR[0xA8] = arm11_state->NumInstrs;
 }
 
 void hid_position(const Sint32 x, const Sint32 y)
@@ -167,46 +175,86 @@ void hid_position(const Sint32 x, const Sint32 y)
     }
 }
 
-void hid_keyup(const SDL_KeyboardEvent* key)
+// The pad section, 0x0 to 0xA8, gets a new ring entry per change: state,
+// newly pressed, newly released and the circle pad.
+void hid_SetPad(u32 buttons, s16 circle_x, s16 circle_y)
 {
-    *(u32*)&HIDsharedbuff[0x1C] &= ~translate_to_bit(key);
-    *(u32*)&HIDsharedbuffSPVR[0x1C] = *(u32*)&HIDsharedbuff[0x1C];
+    u32 old = *(u32*)&HIDsharedbuff[0x1C];
     u32 offset = *(u32*)&HIDsharedbuff[0x10];
+    u8* entry;
+
+    // The circle pad doubles as a d-pad.
+    buttons &= ~(0xFu << 28);
+    if (circle_x > HID_CIRCLE_DEADZONE)
+        buttons |= HID_CIRCLE_RIGHT;
+    if (circle_x < -HID_CIRCLE_DEADZONE)
+        buttons |= HID_CIRCLE_LEFT;
+    if (circle_y > HID_CIRCLE_DEADZONE)
+        buttons |= HID_CIRCLE_UP;
+    if (circle_y < -HID_CIRCLE_DEADZONE)
+        buttons |= HID_CIRCLE_DOWN;
+
     if (offset == 7)offset = 0;
     else offset++;
 
-    *(u32*)&HIDsharedbuff[0x28 + offset * 0x10] = *(u32*)&HIDsharedbuffSPVR[0x1C]; //	Current PAD state
-    *(u32*)&HIDsharedbuffSPVR[0x28 + offset * 0x10] = *(u32*)&HIDsharedbuff[0x28 + offset * 0x10];
-
-    *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 4] = 0; //pressed
-    *(u32*)&HIDsharedbuffSPVR[0x28 + offset * 0x10 + 4] = *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 4];
+    *(u32*)&HIDsharedbuff[0x1C] = buttons;
+    *(s16*)&HIDsharedbuff[0x20] = circle_x;
+    *(s16*)&HIDsharedbuff[0x22] = circle_y;
 
-    *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 8] = translate_to_bit(key); //released
-    *(u32*)&HIDsharedbuffSPVR[0x28 + offset * 0x10 + 8] = *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 8];
+    entry = &HIDsharedbuff[0x28 + offset * 0x10];
+    *(u32*)&entry[0] = buttons; //	Current PAD state
+    *(u32*)&entry[4] = buttons & ~old; //pressed
+    *(u32*)&entry[8] = old & ~buttons; //released
+    *(s16*)&entry[12] = circle_x;
+    *(s16*)&entry[14] = circle_y;
 
     *(u32*)&HIDsharedbuff[0x10] = offset;
-    *(u32*)&HIDsharedbuffSPVR[0x10] = *(u32*)&HIDsharedbuff[0x10];
-
+    memcpy(&HIDsharedbuffSPVR[0x10], &HIDsharedbuff[0x10], 0xA8 - 0x10);
     hid_update();
 }
-void hid_keypress(const SDL_KeyboardEvent* key)
+
+// Touch section, 0xA8 to 0x108: raw position, then 8 ring entries.
+void hid_SetTouch(bool down, u16 x, u16 y)
 {
-    *(u32*)&HIDsharedbuff[0x1C] |= translate_to_bit(key);
-    *(u32*)&HIDsharedbuffSPVR[0x1C] = *(u32*)&HIDsharedbuff[0x1C];
+    u32 offset = *(u32*)&HIDsharedbuff[0xB8];
+    u8* entry;
 
-    u32 offset = *(u32*)&HIDsharedbuff[0x10];
     if (offset == 7)offset = 0;
     else offset++;
 
-    *(u32*)&HIDsharedbuff[0x28 + offset * 0x10] = *(u32*)&HIDsharedbuffSPVR[0x1C]; //	Current PAD state
-    *(u32*)&HIDsharedbuffSPVR[0x28 + offset * 0x10] = *(u32*)&HIDsharedbuff[0x28 + offset * 0x10];
+    hid_updatetouch();
 
-    *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 4] = translate_to_bit(key); //pressed
-    *(u32*)&HIDsharedbuffSPVR[0x28 + offset * 0x10 + 4] = *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 4];
+    *(u16*)&HIDsharedbuff[0xC0] = down ? x : 0;
+    *(u16*)&HIDsharedbuff[0xC2] = down ? y : 0;
+    *(u32*)&HIDsharedbuff[0xC4] = down;
 
-    *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 8] = 0; //released
-    *(u32*)&HIDsharedbuffSPVR[0x28 + offset * 0x10 + 8] = *(u32*)&HIDsharedbuff[0x28 + offset * 0x10 + 8];
+    entry = &HIDsharedbuff[0xC8 + offset * 0x8];
+    *(u16*)&entry[0] = down ? x : 0;
+    *(u16*)&entry[2] = down ? y : 0;
+    *(u32*)&entry[4] = down; //contain data
 
-    *(u32*)&HIDsharedbuffSPVR[0x10] = *(u32*)&HIDsharedbuff[0x10] = offset;
-    hid_update();
+    *(u32*)&HIDsharedbuff[0xB8] = offset;
+    memcpy(&HIDsharedbuffSPVR[0xB8], &HIDsharedbuff[0xB8], 0x108 - 0xB8);
+}
+
+void hid_keyup(const SDL_KeyboardEvent* key)
+{
+    hid_SetPad(*(u32*)&HIDsharedbuff[0x1C] & ~translate_to_bit(key),
+               *(s16*)&HIDsharedbuff[0x20], *(s16*)&HIDsharedbuff[0x22]);
+}
+void hid_keypress(const SDL_KeyboardEvent* key)
+{
+    hid_SetPad(*(u32*)&HIDsharedbuff[0x1C] | translate_to_bit(key),
+               *(s16*)&HIDsharedbuff[0x20], *(s16*)&HIDsharedbuff[0x22]);
+}
+
+// The shared memory itself is one of the fixed buffers.
+void hid_user_SaveState()
+{
+    savestate_Put(&memhandel, sizeof(memhandel));
+}
+
+void hid_user_LoadState()
+{
+    savestate_Get(&memhandel, sizeof(memhandel));
 }
@@ -15,218 +15,942 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef _WIN32
+
+#define WINVER 0x0600
+#define _WIN32_WINNT 0x0600
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#define SOCKET_FAILED(s) ((s) == INVALID_SOCKET)
+#define WOULDBLOCK()     (WSAGetLastError() == WSAEWOULDBLOCK)
+#define poll             WSAPoll
+#define strncasecmp      _strnicmp
+
+#else
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <strings.h>
+#include <pthread.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET   (-1)
+#define SOCKET_FAILED(s) ((s) < 0)
+#define WOULDBLOCK()     (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)
+#define closesocket(s)   close(s)
+
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#include <ctype.h>
+
 #include "util.h"
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
-
-#include "http/HTTPClient.h"
+#include "threads.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
-#define HTTP_CLIENT_BUFFER_SIZE     8192
+// Transfers run on a network thread of their own, one poll() loop over the
+// non-blocking sockets of every context. The body goes into a ring per
+// context, ReceiveData copies from there straight into the guest buffer.
+// A guest thread is parked on the context handle only when it asks for
+// something that is not there yet, httpc_WaitSynchronization finishes the
+// request once it is.
 
-SERVICE_START(http_c);
+#define HTTPC_RING_SIZE      0x10000 // Power of two.
+#define HTTPC_HEAD_MAX       0x2000
+#define HTTPC_MAX_ACTIVE     32
+
+#define HTTPC_RESULT_DOWNLOADPENDING 0xD840A02B
+#define HTTPC_RESULT_FAILED          0xFFFFFFFF
+
+enum {
+    STATE_START,     // Waiting for the network thread.
+    STATE_CONNECTING,
+    STATE_SENDING,
+    STATE_HEADERS,
+    STATE_BODY,
+    STATE_DONE
+};
+
+enum {
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER
+};
+
+enum {
+    WAIT_NONE,
+    WAIT_HEADERS, // BeginRequest, GetResponseStatusCode
+    WAIT_DATA     // ReceiveData
+};
+
+typedef struct _httpc_context httpc_context;
+
+struct _httpc_context {
+    char* url;
+    u32   method;
+    char** headers; // Name, value, name, value..
+    u32   num_headers;
+
+    // Network thread only.
+    SOCKET sock;
+    u32   state;
+    char* request;
+    u32   request_len;
+    u32   request_sent;
+    char  head[HTTPC_HEAD_MAX];
+    u32   head_len;
+    bool  chunked;
+    u32   chunk_state;
+    u32   chunk_line; // Characters on the current trailer line.
+    bool  chunk_ext;  // Past the size on the current size line.
+    u64   body_left;  // Identity bodies with a length.
+    bool  body_sized;
+
+    // Shared, under the lock.
+    bool  started;
+    bool  cancel;
+    bool  headers_done;
+    bool  done;
+    bool  failed;
+    u32   status;
+    u32   content_length;
+    u32   downloaded;   // Handed to the guest so far.
+    u32   ring_read;
+    u32   ring_write;
+    u8    ring[HTTPC_RING_SIZE];
+
+    // Parked guest request, emulation thread only.
+    u32   wait;
+    u32*  cmd_buffer;
+    u32   dst;
+    u32   size;
+
+    httpc_context* next;
+};
+
+static bool started;
+static httpc_context* active; // Owned by the network thread once started.
+static u32 num_parked; // Guest threads waiting on a context, emulation thread only.
 
 #ifdef _WIN32
-SERVICE_CMD(0x00010044)
+static CRITICAL_SECTION lock;
+
+// WSAPoll only takes sockets, a UDP socket connected to itself stands in
+// for the wake-up pipe.
+static SOCKET wake_sock = INVALID_SOCKET;
+
+#define LOCK()   EnterCriticalSection(&lock)
+#define UNLOCK() LeaveCriticalSection(&lock)
+#define WAKE_FD  wake_sock
+#else
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_pipe[2] = { -1, -1 };
+
+#define LOCK()   pthread_mutex_lock(&lock)
+#define UNLOCK() pthread_mutex_unlock(&lock)
+#define WAKE_FD  wake_pipe[0]
+#endif
+
+static void Wake()
 {
+    char c = 0;
 
 #ifdef _WIN32
-    // Windows Specific - Sockets initialization
-    unsigned short      wVersionRequested;
-    WSADATA             wsaData;
-    UINT32              nErr = 0;
-    // We want to use Winsock v 1.2 (can be higher)
-    wVersionRequested = MAKEWORD(1, 2);
-    nErr = WSAStartup(wVersionRequested, &wsaData);
+    if (send(wake_sock, &c, 1, 0) < 0 && !WOULDBLOCK())
+#else
+    if (write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
 #endif
+        ERROR("wake-up write failed.\n");
+}
 
-    DEBUG("Initialize %08x\n", CMD(1));
-    RESP(1, 0); // Result
-    return 0;
+static void FreeContext(httpc_context* c)
+{
+    u32 i;
+
+    if (!SOCKET_FAILED(c->sock))
+        closesocket(c->sock);
+    for (i = 0; i < c->num_headers * 2; i++)
+        free(c->headers[i]);
+    free(c->headers);
+    free(c->request);
+    free(c->url);
+    free(c);
 }
-SERVICE_CMD(0x00020082)
+
+
+/* ____ Network thread ____ */
+
+static void Fail(httpc_context* c, const char* why)
 {
-    u32 size = CMD(1);
-    DEBUG("CreateContext %08x %02x %08x\n", size, CMD(2), CMD(4));
-    u32 handle = handle_New(HANDLE_TYPE_HTTPCont, 0);
+    ERROR("%s: %s\n", c->url, why);
 
-    handleinfo* h = handle_Get(handle);
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        PAUSE();
-        return -1;
+    LOCK();
+    c->failed = true;
+    c->headers_done = true;
+    UNLOCK();
+    c->state = STATE_DONE;
+}
+
+static void Finished(httpc_context* c)
+{
+    LOCK();
+    c->done = true;
+    c->headers_done = true;
+    UNLOCK();
+    c->state = STATE_DONE;
+}
+
+static u32 RingFree(httpc_context* c)
+{
+    u32 used;
+
+    LOCK();
+    used = c->ring_write - c->ring_read;
+    UNLOCK();
+    return HTTPC_RING_SIZE - used;
+}
+
+// Caller made sure there is room.
+static void RingPut(httpc_context* c, const u8* data, u32 len)
+{
+    u32 pos = c->ring_write & (HTTPC_RING_SIZE - 1);
+    u32 first = HTTPC_RING_SIZE - pos < len ? HTTPC_RING_SIZE - pos : len;
+
+    memcpy(&c->ring[pos], data, first);
+    memcpy(c->ring, data + first, len - first);
+
+    LOCK();
+    c->ring_write += len;
+    UNLOCK();
+}
+
+static void FeedChunked(httpc_context* c, const u8* data, u32 len)
+{
+    while (len != 0 && c->state != STATE_DONE) {
+        switch (c->chunk_state) {
+        case CHUNK_SIZE: {
+            char ch = *data++;
+            len--;
+
+            if (ch == '\n') {
+                c->chunk_state = c->body_left != 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                c->chunk_line = 0;
+                c->chunk_ext = false;
+            } else if (!c->chunk_ext && isxdigit((unsigned char)ch))
+                c->body_left = c->body_left * 16 + (isdigit((unsigned char)ch) ? ch - '0' : (tolower((unsigned char)ch) - 'a' + 10));
+            else if (ch != '\r')
+                c->chunk_ext = true;
+            break;
+        }
+        case CHUNK_DATA: {
+            u32 n = c->body_left < len ? (u32)c->body_left : len;
+
+            RingPut(c, data, n);
+            data += n;
+            len -= n;
+            c->body_left -= n;
+            if (c->body_left == 0)
+                c->chunk_state = CHUNK_DATA_END;
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (*data == '\n')
+                c->chunk_state = CHUNK_SIZE;
+            data++;
+            len--;
+            break;
+        case CHUNK_TRAILER:
+            if (*data == '\n') {
+                if (c->chunk_line == 0)
+                    Finished(c);
+                c->chunk_line = 0;
+            } else if (*data != '\r')
+                c->chunk_line++;
+            data++;
+            len--;
+            break;
+        }
     }
-    h->misc_ptr[0] = NULL;
-    h->misc_ptr[1] = NULL;
-    h->misc_ptr[2] = NULL;
+}
 
-    u8* b = malloc(size + 1);
-    if (b == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
+// Body bytes that came in with the headers or through the scratch buffer.
+static void Feed(httpc_context* c, const u8* data, u32 len)
+{
+    if (c->chunked) {
+        FeedChunked(c, data, len);
+        return;
     }
-    memset(b, 0, size + 1);
-    if (mem_Read(b, CMD(4), size) != 0) {
-        ERROR("mem_Read failed.\n");
-        free(b);
-        return -1;
+
+    if (c->body_sized && len > c->body_left)
+        len = (u32)c->body_left;
+    RingPut(c, data, len);
+
+    if (c->body_sized && (c->body_left -= len) == 0)
+        Finished(c);
+}
+
+static bool HeaderIs(const char* line, const char* name)
+{
+    return strncasecmp(line, name, strlen(name)) == 0;
+}
+
+// Parses what is in head[] once the blank line is there.
+static void ParseHead(httpc_context* c, u32 end)
+{
+    char* line = c->head;
+    u32 status = 0;
+    u32 length = 0;
+
+    c->head[end - 2] = '\0';
+    if (sscanf(line, "HTTP/%*u.%*u %u", &status) != 1) {
+        Fail(c, "bad status line");
+        return;
     }
 
-    h->misc_ptr[0] = malloc(size + 1);
-    strncpy(h->misc_ptr[0], b, size + 1);
+    while ((line = strchr(line, '\n')) != NULL) {
+        line++;
+        if (HeaderIs(line, "Content-Length:")) {
+            c->body_sized = true;
+            c->body_left = strtoull(line + 15, NULL, 10);
+            length = (u32)c->body_left;
+        } else if (HeaderIs(line, "Transfer-Encoding:") && strstr(line, "chunked") != NULL)
+            c->chunked = true;
+    }
 
-    DEBUG("address %s\n", h->misc_ptr[0]);
+    if (c->chunked) {
+        c->body_sized = false;
+        c->body_left = 0;
+        length = 0;
+    }
 
-    RESP(2, handle);
-    RESP(1, 0); // Result
+    LOCK();
+    c->status = status;
+    c->content_length = length;
+    c->headers_done = true;
+    UNLOCK();
+
+    c->state = STATE_BODY;
+    if (c->method == 3 || status == 204 || status == 304 || (c->body_sized && c->body_left == 0))
+        Finished(c);
+}
+
+static int SetNonBlocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long on = 1;
+    return ioctlsocket(s, FIONBIO, &on);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+// Resolving blocks, but only this thread.
+static void Connect(httpc_context* c)
+{
+    static const char* methods[] = { "GET", "GET", "POST", "HEAD", "PUT", "DELETE" };
+    char host[256];
+    char port[8] = "80";
+    const char* path;
+    const char* p;
+    struct addrinfo hints, *info;
+    u32 i, len;
+
+    if (strncmp(c->url, "http://", 7) != 0) {
+        Fail(c, "only http:// is supported");
+        return;
+    }
+
+    p = c->url + 7;
+    len = (u32)strcspn(p, ":/");
+    if (len == 0 || len >= sizeof(host)) {
+        Fail(c, "bad host");
+        return;
+    }
+    memcpy(host, p, len);
+    host[len] = '\0';
+    p += len;
+
+    if (*p == ':') {
+        len = (u32)strcspn(++p, "/");
+        if (len == 0 || len >= sizeof(port)) {
+            Fail(c, "bad port");
+            return;
+        }
+        memcpy(port, p, len);
+        port[len] = '\0';
+        p += len;
+    }
+    path = *p != '\0' ? p : "/";
+
+    // Request first, the connect may complete right away.
+    len = (u32)(strlen(path) + strlen(host) + 64);
+    for (i = 0; i < c->num_headers * 2; i++)
+        len += (u32)strlen(c->headers[i]) + 4;
+
+    c->request = malloc(len);
+    if (c->request == NULL) {
+        Fail(c, "not enough mem");
+        return;
+    }
+    c->request_len = sprintf(c->request, "%s %s HTTP/1.1\r\nHost: %s\r\n",
+                             methods[c->method < ARRAY_SIZE(methods) ? c->method : 0], path, host);
+    for (i = 0; i < c->num_headers; i++)
+        c->request_len += sprintf(c->request + c->request_len, "%s: %s\r\n", c->headers[i * 2], c->headers[i * 2 + 1]);
+    c->request_len += sprintf(c->request + c->request_len, "Connection: close\r\n\r\n");
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &info) != 0) {
+        Fail(c, "host not found");
+        return;
+    }
+
+    c->sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (SOCKET_FAILED(c->sock) || SetNonBlocking(c->sock) != 0) {
+        freeaddrinfo(info);
+        Fail(c, "socket failed");
+        return;
+    }
+
+    if (connect(c->sock, info->ai_addr, (int)info->ai_addrlen) != 0 && !WOULDBLOCK()) {
+        freeaddrinfo(info);
+        Fail(c, "connect failed");
+        return;
+    }
+    freeaddrinfo(info);
+    c->state = STATE_CONNECTING;
+}
+
+static void Step(httpc_context* c)
+{
+    u8 scratch[0x2000];
+    int n;
+
+    switch (c->state) {
+    case STATE_CONNECTING: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0 || err != 0) {
+            Fail(c, "connect failed");
+            return;
+        }
+        c->state = STATE_SENDING;
+        // Fall through, it is writable.
+    }
+    case STATE_SENDING:
+        n = send(c->sock, c->request + c->request_sent, c->request_len - c->request_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (!WOULDBLOCK())
+                Fail(c, "send failed");
+            return;
+        }
+        c->request_sent += n;
+        if (c->request_sent == c->request_len)
+            c->state = STATE_HEADERS;
+        return;
+
+    case STATE_HEADERS: {
+        char* end;
+
+        n = recv(c->sock, c->head + c->head_len, HTTPC_HEAD_MAX - 1 - c->head_len, 0);
+        if (n <= 0) {
+            if (n == 0 || !WOULDBLOCK())
+                Fail(c, "connection lost in headers");
+            return;
+        }
+        c->head_len += n;
+        c->head[c->head_len] = '\0';
+
+        end = strstr(c->head, "\r\n\r\n");
+        if (end == NULL) {
+            if (c->head_len == HTTPC_HEAD_MAX - 1)
+                Fail(c, "headers too long");
+            return;
+        }
+
+        u32 body = (u32)(end + 4 - c->head);
+        ParseHead(c, body);
+        if (c->state == STATE_BODY && c->head_len > body)
+            Feed(c, (u8*)c->head + body, c->head_len - body);
+        return;
+    }
+
+    case STATE_BODY: {
+        u32 room = RingFree(c);
+
+        if (room == 0)
+            return;
+
+        // Identity bodies go straight into the ring.
+        if (!c->chunked) {
+            u32 pos = c->ring_write & (HTTPC_RING_SIZE - 1);
+            u32 want = HTTPC_RING_SIZE - pos < room ? HTTPC_RING_SIZE - pos : room;
+
+            if (c->body_sized && want > c->body_left)
+                want = (u32)c->body_left;
+
+            n = recv(c->sock, (char*)&c->ring[pos], want, 0);
+            if (n > 0) {
+                LOCK();
+                c->ring_write += n;
+                UNLOCK();
+                if (c->body_sized && (c->body_left -= n) == 0)
+                    Finished(c);
+                return;
+            }
+        } else {
+            n = recv(c->sock, (char*)scratch, room < sizeof(scratch) ? room : sizeof(scratch), 0);
+            if (n > 0) {
+                Feed(c, scratch, n);
+                return;
+            }
+        }
+
+        if (n == 0) {
+            // Without a length the body ends with the connection.
+            if (!c->body_sized && !c->chunked)
+                Finished(c);
+            else
+                Fail(c, "connection lost in body");
+        } else if (!WOULDBLOCK())
+            Fail(c, "recv failed");
+        return;
+    }
+    }
+}
+
+static void Init()
+{
+#ifdef _WIN32
+    static bool inited;
+
+    if (!inited) {
+        InitializeCriticalSection(&lock);
+        inited = true;
+    }
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Worker(LPVOID arg)
+#else
+static void* Worker(void* arg)
+#endif
+{
+    struct pollfd fds[HTTPC_MAX_ACTIVE + 1];
+    httpc_context* list[HTTPC_MAX_ACTIVE];
+    httpc_context* polled[HTTPC_MAX_ACTIVE];
+
+    for (;;) {
+        httpc_context** it;
+        u32 i, num = 0, n = 0;
+
+        // Drop what was closed or finished. Only this thread frees, so the
+        // snapshot stays valid without the lock.
+        LOCK();
+        for (it = &active; *it != NULL;) {
+            httpc_context* c = *it;
+
+            if (c->cancel) {
+                *it = c->next;
+                FreeContext(c);
+                continue;
+            }
+            if (c->state == STATE_DONE && !SOCKET_FAILED(c->sock)) {
+                closesocket(c->sock);
+                c->sock = INVALID_SOCKET;
+            }
+            if (c->state != STATE_DONE && num < HTTPC_MAX_ACTIVE)
+                list[num++] = c;
+            it = &c->next;
+        }
+        UNLOCK();
+
+        for (i = 0; i < num; i++) {
+            httpc_context* c = list[i];
+            short events = 0;
+
+            if (c->state == STATE_START)
+                Connect(c);
+
+            if (c->state == STATE_CONNECTING || c->state == STATE_SENDING)
+                events = POLLOUT;
+            else if (c->state == STATE_HEADERS || (c->state == STATE_BODY && RingFree(c) != 0))
+                events = POLLIN;
+
+            if (events != 0 && n < HTTPC_MAX_ACTIVE) {
+                fds[n].fd = c->sock;
+                fds[n].events = events;
+                fds[n].revents = 0;
+                polled[n++] = c;
+            }
+        }
+
+        fds[n].fd = WAKE_FD;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+
+        if (poll(fds, n + 1, -1) > 0 && fds[n].revents != 0) {
+            char drain[64];
+#ifdef _WIN32
+            while (recv(wake_sock, drain, sizeof(drain), 0) > 0);
+#else
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+#endif
+        }
+
+        for (i = 0; i < n; i++) {
+            if (fds[i].revents != 0)
+                Step(polled[i]);
+        }
+    }
     return 0;
 }
-SERVICE_CMD(0x80042)
+
+#ifdef _WIN32
+static int OpenWakeSocket()
 {
-    DEBUG("InitializeConnectionSession %08x --stubed--\n", CMD(1));
-    RESP(1, 0); // Result
+    struct sockaddr_in addr;
+    int len = sizeof(addr);
+
+    wake_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (SOCKET_FAILED(wake_sock))
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(wake_sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname(wake_sock, (struct sockaddr*)&addr, &len) != 0 ||
+        connect(wake_sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        SetNonBlocking(wake_sock) != 0) {
+        closesocket(wake_sock);
+        wake_sock = INVALID_SOCKET;
+        return -1;
+    }
     return 0;
 }
-SERVICE_CMD(0x00090040)
+#endif
+
+static int Start()
 {
-    DEBUG("BeginRequest %08x\n", CMD(1));
+#ifdef _WIN32
+    if (OpenWakeSocket() != 0 || CreateThread(NULL, 0, Worker, NULL, 0, NULL) == NULL) {
+#else
+    pthread_t thread;
 
-    handleinfo* h = handle_Get(CMD(1));
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        PAUSE();
+    if (pipe(wake_pipe) != 0 || fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) != 0 ||
+        pthread_create(&thread, NULL, Worker, NULL) != 0) {
+#endif
+        ERROR("Failed to start the HTTP thread.\n");
         return -1;
     }
 
-    INT32                  nRetCode;
-    HTTP_SESSION_HANDLE     pHTTP;
-    pHTTP = HTTPClientOpenRequest(0);
+    started = true;
+    return 0;
+}
 
-    if ((nRetCode = HTTPClientSetVerb(pHTTP, VerbGet)) != HTTP_CLIENT_SUCCESS) {
-        RESP(1, 0xFFFFFFFF); // Result
-        return 0;
+
+/* ____ Guest requests ____ */
+
+// Tries to finish the parked request of c, called with the lock held.
+// Returns false if it has to wait some more.
+static bool Finish(httpc_context* c)
+{
+    u32* cmd = c->cmd_buffer;
+
+    switch (c->wait) {
+    case WAIT_HEADERS:
+        if (!c->headers_done)
+            return false;
+
+        cmd[1] = c->failed ? HTTPC_RESULT_FAILED : 0; // Result
+        cmd[2] = c->status;
+        break;
+
+    case WAIT_DATA: {
+        u32 avail = c->ring_write - c->ring_read;
+        u32 n = avail < c->size ? avail : c->size;
+        u32 pos = c->ring_read & (HTTPC_RING_SIZE - 1);
+        u32 first = HTTPC_RING_SIZE - pos < n ? HTTPC_RING_SIZE - pos : n;
+        u8* dst;
+
+        if (n == 0 && !c->done && !c->failed && c->size != 0)
+            return false;
+
+        // Straight from the ring into the guest buffer.
+        dst = mem_rawaddr(c->dst, n);
+        if (dst != NULL) {
+            memcpy(dst, &c->ring[pos], first);
+            memcpy(dst + first, c->ring, n - first);
+        } else if (mem_Write(&c->ring[pos], c->dst, first) != 0 ||
+                   mem_Write(c->ring, c->dst + first, n - first) != 0) {
+            ERROR("mem_Write failed.\n");
+            n = 0;
+        }
+
+        if (avail == HTTPC_RING_SIZE && n != 0)
+            Wake(); // It stopped reading, the ring was full.
+
+        c->ring_read += n;
+        c->downloaded += n;
+
+        if (c->failed && c->ring_read == c->ring_write)
+            cmd[1] = HTTPC_RESULT_FAILED;
+        else if (c->done && c->ring_read == c->ring_write)
+            cmd[1] = 0;
+        else
+            cmd[1] = HTTPC_RESULT_DOWNLOADPENDING;
+        break;
+    }
     }
 
-    // Set authentication
+    c->wait = WAIT_NONE;
+    return true;
+}
 
-    if ((nRetCode = HTTPClientSetAuth(pHTTP, AuthSchemaNone, NULL)) != HTTP_CLIENT_SUCCESS) {
-        RESP(1, 0xFFFFFFFF); // Result
-        return 0;
+// Answers right away if it can, parks the calling thread otherwise.
+static void Request(u32 handle, httpc_context* c, u32 wait, u32 dst, u32 size)
+{
+    bool ready;
+
+    if (ipc_cmd_buffer == NULL) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return;
     }
-    int i;
-    for (i = 0; i < (int)h->misc[2]; i++)
-    {
-        if (HTTPClientAddRequestHeaders(pHTTP, *((char**)(h->misc_ptr[2]) + i * 2), *((char**)(h->misc_ptr[2]) + i * 2 + 1), true))
-        {
-            RESP(1, 0xFFFFFFFF); // Result
-            return 0;
-        }
+
+    c->wait = wait;
+    c->cmd_buffer = ipc_cmd_buffer;
+    c->dst = dst;
+    c->size = size;
+
+    LOCK();
+    ready = Finish(c);
+    UNLOCK();
+
+    if (!ready) {
+        num_parked++;
+        threads_SetCurrentThreadWaitList(&handle, true, 1);
     }
-    // Send a request for the home page
-    if(HTTPClientSendRequest(pHTTP, h->misc_ptr[0], NULL, 0, FALSE, 0, 0) != HTTP_CLIENT_SUCCESS) {
-        RESP(1, 0xFFFFFFFF); // Result
-        return 0;
+}
+
+static httpc_context* GetContext(u32 handle)
+{
+    handleinfo* h = handle_Get(handle);
+
+    if (h == NULL || h->type != HANDLE_TYPE_HTTPCont)
+        return NULL;
+    return h->misc_ptr[0];
+}
+
+static char* ReadString(u32 addr, u32 size)
+{
+    char* s = malloc(size + 1);
+
+    if (s == NULL) {
+        ERROR("Not enough mem.\n");
+        return NULL;
+    }
+    if (mem_Read((u8*)s, addr, size) != 0) {
+        ERROR("mem_Read failed.\n");
+        free(s);
+        return NULL;
     }
+    s[size] = '\0';
+    return s;
+}
 
-    h->misc[0] = HTTPClientRecvResponse(pHTTP, 3);
+u32 httpc_WaitSynchronization(handleinfo* h, bool *locked)
+{
+    httpc_context* c = h->misc_ptr[0];
 
-    nRetCode = h->misc[0];
+    *locked = false;
+    if (c == NULL || c->wait == WAIT_NONE)
+        return 0;
 
-    h->misc[1] = 0;
+    LOCK();
+    *locked = !Finish(c);
+    UNLOCK();
 
-    h->misc_ptr[1] = NULL;
+    if (!*locked)
+        num_parked--;
+    return 0;
+}
+
+SERVICE_START(http_c);
 
-    h->misc[2] = 0;
+SERVICE_CMD(0x00010044)
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
 
-    h->misc_ptr[2] = NULL;
+    DEBUG("Initialize %08x\n", CMD(1));
+    RESP(1, 0); // Result
+    return 0;
+}
+SERVICE_CMD(0x00020082)
+{
+    DEBUG("CreateContext %08x %02x %08x\n", CMD(1), CMD(2), CMD(4));
 
-    int nSize = HTTP_CLIENT_BUFFER_SIZE;
+    Init();
 
-    while (nRetCode == HTTP_CLIENT_SUCCESS || nRetCode == HTTP_CLIENT_ERROR_BAD_STATE) {
-        h->misc_ptr[1] = realloc(h->misc_ptr[1], h->misc[1] + HTTP_CLIENT_BUFFER_SIZE);
-        // Set the size of our buffer
-        int nSize = HTTP_CLIENT_BUFFER_SIZE;
+    httpc_context* c = calloc(1, sizeof(httpc_context));
+    if (c == NULL) {
+        ERROR("Not enough mem.\n");
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
+    }
 
-        // Get the data
-        nRetCode = HTTPClientReadData(pHTTP, (u8*)h->misc_ptr[1] + h->misc[1], nSize, 0, &nSize);
-        h->misc[1] += nSize;
+    c->url = ReadString(CMD(4), CMD(1));
+    if (c->url == NULL) {
+        free(c);
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
     }
-    HTTPClientCloseRequest(&pHTTP);
+    c->method = CMD(2);
+    c->sock = INVALID_SOCKET;
 
+    u32 handle = handle_New(HANDLE_TYPE_HTTPCont, 0);
+    handle_Get(handle)->misc_ptr[0] = c;
+
+    DEBUG("address %s\n", c->url);
 
+    RESP(2, handle);
+    RESP(1, 0); // Result
+    return 0;
+}
+SERVICE_CMD(0x80042)
+{
+    DEBUG("InitializeConnectionSession %08x --stubed--\n", CMD(1));
     RESP(1, 0); // Result
     return 0;
 }
+SERVICE_CMD(0x00090040) //BeginRequest
+SERVICE_CMD(0x000A0040) //BeginRequestAsync
+{
+    DEBUG("BeginRequest %08x\n", CMD(1));
+
+    httpc_context* c = GetContext(CMD(1));
+    if (c == NULL || c->started) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
+    }
+    if (!started && Start() != 0) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
+    }
+
+    LOCK();
+    c->started = true;
+    c->next = active;
+    active = c;
+    UNLOCK();
+    Wake();
+
+    // The blocking one returns once the headers are in.
+    if (CMD(0) == 0x00090040)
+        Request(CMD(1), c, WAIT_HEADERS, 0, 0);
+    else
+        RESP(1, 0); // Result
+    return 0;
+}
 SERVICE_CMD(0x220040)
 {
     DEBUG("GetResponseStatusCode %08x\n", CMD(1));
 
-    handleinfo* h = handle_Get(CMD(1));
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        PAUSE();
-        return -1;
+    httpc_context* c = GetContext(CMD(1));
+    if (c == NULL || !c->started) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
     }
-    if (h->misc[0] == HTTP_CLIENT_SUCCESS) //todo
-        RESP(2, 200);
-    else
-        RESP(2, 404);
-    RESP(1, 0); // Result
+
+    Request(CMD(1), c, WAIT_HEADERS, 0, 0);
     return 0;
 }
 SERVICE_CMD(0x00060040)
 {
     DEBUG("GetDownloadSizeState %08x\n", CMD(1));
 
-    handleinfo* h = handle_Get(CMD(1));
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        PAUSE();
-        return -1;
+    httpc_context* c = GetContext(CMD(1));
+    if (c == NULL) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
     }
-    RESP(3, h->misc[1]); //buffer is full
-    RESP(2, h->misc[1]);
+
+    LOCK();
+    RESP(3, c->content_length); // 0 while unknown
+    RESP(2, c->downloaded);
+    UNLOCK();
     RESP(1, 0); // Result
     return 0;
 }
 SERVICE_CMD(0x000B0082)
 {
-    DEBUG("GetDownloadSizeState %08x %08x %08x\n", CMD(1), CMD(2), CMD(4));
-
-    handleinfo* h = handle_Get(CMD(1));
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        PAUSE();
-        return -1;
-    }
+    DEBUG("ReceiveData %08x %08x %08x\n", CMD(1), CMD(2), CMD(4));
 
-    if (mem_Write(h->misc_ptr[1], CMD(4), CMD(2)) != 0) {
-        ERROR("mem_Write failed.\n");
-        free(h->misc_ptr[1]);
-        return -1;
+    httpc_context* c = GetContext(CMD(1));
+    if (c == NULL || !c->started) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
     }
 
-    RESP(1, 0); // Result
+    Request(CMD(1), c, WAIT_DATA, CMD(4), CMD(2));
     return 0;
 }
 
 SERVICE_CMD(0x00030040)
 {
-    DEBUG("CloseContext %08x --stub--\n", CMD(1));
+    DEBUG("CloseContext %08x\n", CMD(1));
 
     handleinfo* h = handle_Get(CMD(1));
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        PAUSE();
-        return -1;
+    httpc_context* c = GetContext(CMD(1));
+    if (c == NULL) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
+    }
+    // A thread still parked on the context gets its answer now, its wait
+    // ends as soon as the handle has no context.
+    if (c->wait != WAIT_NONE) {
+        c->cmd_buffer[1] = HTTPC_RESULT_FAILED;
+        c->wait = WAIT_NONE;
+        num_parked--;
     }
+    h->misc_ptr[0] = NULL;
 
-    if(h->misc_ptr[0]);
-    free(h->misc_ptr[0]);
-    if (h->misc_ptr[1]);
-    free(h->misc_ptr[1]);
+    // A running transfer is freed by the network thread.
+    LOCK();
+    if (c->started)
+        c->cancel = true;
+    UNLOCK();
+
+    if (c->started)
+        Wake();
+    else
+        FreeContext(c);
 
     RESP(1, 0); // Result
     return 0;
@@ -268,49 +992,30 @@ SERVICE_CMD(0x001100C4) //AddRequestHeader
 {
     DEBUG("AddRequestHeader %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3),CMD(5),CMD(7));
 
-    //HTTPClientAddRequestHeaders
-
-    handleinfo* h = handle_Get(CMD(1));
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        PAUSE();
-        return -1;
-    }
-
-    u32 size1 = CMD(2);
-    u32 size2 = CMD(3);
-
-    u8* a = malloc(size1 + 1);
-    if (a == NULL) {
-        ERROR("Not enough mem.\n");
-        return -1;
-    }
-    memset(a, 0, size1 + 1);
-    if (mem_Read(a, CMD(5), size1) != 0) {
-        ERROR("mem_Read failed.\n");
-        free(a);
-        return -1;
+    httpc_context* c = GetContext(CMD(1));
+    if (c == NULL || c->started) {
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
     }
 
-    u8* b = malloc(size2 + 1);
-    if (b == NULL) {
-        ERROR("Not enough mem.\n");
-         return -1;
-    }
-    memset(b, 0, size2 + 1);
-    if (mem_Read(b, CMD(7), size2) != 0) {
-        ERROR("mem_Read failed.\n");
-        free(b);
-        return -1;
+    char* name = ReadString(CMD(5), CMD(2));
+    char* value = ReadString(CMD(7), CMD(3));
+    char** headers = realloc(c->headers, sizeof(char*) * 2 * (c->num_headers + 1));
+    if (name == NULL || value == NULL || headers == NULL) {
+        free(name);
+        free(value);
+        if (headers != NULL)
+            c->headers = headers;
+        RESP(1, HTTPC_RESULT_FAILED);
+        return 0;
     }
 
+    c->headers = headers;
+    c->headers[c->num_headers * 2] = name;
+    c->headers[c->num_headers * 2 + 1] = value;
+    c->num_headers++;
 
-    h->misc_ptr[2] = (char*)realloc(h->misc_ptr[2], sizeof(char*) * 2 * (h->misc[2] + 1));
-    *((char**)(h->misc_ptr[2]) + h->misc[2] * 2) = a;
-    *((char**)(h->misc_ptr[2]) + h->misc[2] * 2 + 1) = b;
-    h->misc[2]++;
-
-    DEBUG("name %s val %s\n", a,b);
+    DEBUG("name %s val %s\n", name, value);
 
     RESP(1, 0); // Result
     return 0;
@@ -331,5 +1036,10 @@ SERVICE_CMD(0x002a0040)
     return 0;
 }
 
-#endif
 SERVICE_END();
+
+// Contexts come back dead, a thread parked on one would never wake up.
+int httpc_CollectState()
+{
+    return num_parked != 0 ? SAVESTATE_BUSY : 0;
+}
@@ -20,11 +20,12 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
 
-u32 ir_event_handle;
+static u32 ir_event_handle;
 
 
 void ir_u_init()
@@ -90,3 +91,13 @@ SERVICE_CMD(0x00180182)   //InitializeIrnopShared
 }
 
 SERVICE_END();
+
+void ir_u_SaveState()
+{
+    savestate_Put(&ir_event_handle, sizeof(ir_event_handle));
+}
+
+void ir_u_LoadState()
+{
+    savestate_Get(&ir_event_handle, sizeof(ir_event_handle));
+}
@@ -17,27 +17,885 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "util.h"
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "profiler.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
+/* ____ CRO ____ */
+
+// A CRS describes the exe, the CROs are the modules loaded next to it. The
+// header starts after the 0x80 byte hash area; from CRO_CODE on it is a list
+// of (offset, count) pairs. Loading rebases all of those to addresses, so
+// the guest's nn::ro can walk the tables itself afterwards.
+//
+// Code refers to symbols by segment tag: segment index in the low 4 bits,
+// offset into the segment above. Imports point at a batch of relocations in
+// the external relocation table, the first entry of a batch says whether it
+// is resolved.
+
+#define CRO_MAGIC          0x80
+#define CRO_NAME           0x84
+#define CRO_NEXT           0x88
+#define CRO_PREVIOUS       0x8C
+#define CRO_FILE_SIZE      0x90
+#define CRO_ON_UNRESOLVED  0xAC
+#define CRO_CODE           0xB0
+#define CRO_DATA           0xB8
+#define CRO_MODULE_NAME    0xC0
+#define CRO_SEGMENTS       0xC8  // offset, size, type
+#define CRO_EXPORT_NAMED   0xD0  // name, tag
+#define CRO_EXPORT_INDEXED 0xD8  // tag
+#define CRO_EXPORT_STRINGS 0xE0
+#define CRO_EXPORT_TREE    0xE8
+#define CRO_IMPORT_MODULES 0xF0  // name, indexed table, num, anonymous table, num
+#define CRO_EXTERNAL_RELOC 0xF8  // tag, type, batch end, batch resolved, addend
+#define CRO_IMPORT_NAMED   0x100 // name, batch
+#define CRO_IMPORT_INDEXED 0x108 // export index, batch
+#define CRO_IMPORT_ANON    0x110 // tag, batch
+#define CRO_IMPORT_STRINGS 0x118
+#define CRO_STATIC_ANON    0x120 // tag, batch, patches the CRS
+#define CRO_INTERNAL_RELOC 0x128 // tag, type, symbol segment, addend
+#define CRO_STATIC_RELOC   0x130 // like the external ones
+#define CRO_HEADER_SIZE    0x138
+
+#define SEGMENT_DATA 2
+#define SEGMENT_BSS  3
+
+#define RO_ALREADY_INITIALIZED 0xD9612FF9
+#define RO_NOT_INITIALIZED     0xD9612FF8
+#define RO_BAD_CRO             0xD9012C19
+#define RO_NOT_LOADED          0xD8A12C0D
+
+#define MAX_MODULES 64
+
+typedef struct {
+    u32  address;     // Where the image is mapped.
+    u32  buffer;      // The guest buffer behind it.
+    u32  size;
+    u32  data_offset; // Of the .data image in the file.
+    bool crs;
+    bool linked;
+    u8*  image;       // Host view, the guest sees the same bytes.
+    u32  name_hash;
+} cro_module;
+
+// Entry sizes of the pairs from CRO_CODE on.
+static const u32 entry_size[] = { 1, 1, 1, 12, 8, 4, 1, 8, 20, 12, 8, 8, 8, 1, 8, 12, 12 };
+
+// In list order, the CRS first.
+static cro_module modules[MAX_MODULES];
+static u32 num_modules;
+
+static u32 Read32(const u8* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
+
+static void Write32(u8* p, u32 w)
+{
+    p[0] = (u8)w;
+    p[1] = (u8)(w >> 8);
+    p[2] = (u8)(w >> 16);
+    p[3] = (u8)(w >> 24);
+}
+
+static u32 Field(cro_module* m, u32 field)
+{
+    return Read32(m->image + field);
+}
+
+static void SetField(cro_module* m, u32 field, u32 w)
+{
+    Write32(m->image + field, w);
+}
+
+// Host pointer to len bytes of the image at guest address addr.
+static u8* Span(cro_module* m, u32 addr, u32 len)
+{
+    if (addr < m->address || addr - m->address > m->size || len > m->size - (addr - m->address))
+        return NULL;
+    return m->image + (addr - m->address);
+}
+
+// Tables are checked when the module is rebased.
+static u8* Entry(cro_module* m, u32 table, u32 i)
+{
+    return m->image + Field(m, table) - m->address + i * entry_size[(table - CRO_CODE) / 8];
+}
+
+static u32 Count(cro_module* m, u32 table)
+{
+    return Field(m, table + 4);
+}
+
+static const char* String(cro_module* m, u32 addr)
+{
+    u8* p = Span(m, addr, 1);
+
+    if (p == NULL || memchr(p, 0, m->image + m->size - p) == NULL)
+        return NULL;
+    return (const char*)p;
+}
+
+static const char* ModuleName(cro_module* m)
+{
+    if (Count(m, CRO_MODULE_NAME) == 0)
+        return "";
+    return (const char*)Span(m, Field(m, CRO_MODULE_NAME), 1);
+}
+
+static u32 TagAddress(cro_module* m, u32 tag)
+{
+    u8* segment;
+
+    if ((tag & 0xF) >= Count(m, CRO_SEGMENTS))
+        return 0;
+
+    segment = Entry(m, CRO_SEGMENTS, tag & 0xF);
+    if (tag >> 4 >= Read32(segment + 4))
+        return 0;
+    return Read32(segment) + (tag >> 4);
+}
+
+static u32 HashName(const char* name)
+{
+    u32 hash = 0x811C9DC5;
+
+    while (*name != '\0')
+        hash = (hash ^ (u8)*name++) * 0x01000193;
+    return hash;
+}
+
+/* ____ Export hash ____ */
+
+// Every named export of the linked modules, so imports resolve without
+// walking the modules' export tables. First module in the list wins.
+
+typedef struct {
+    const char* name; // NULL when free.
+    u32 hash;
+    u32 address;
+    u32 module;
+} export_slot;
+
+static export_slot* exports;
+static u32 exports_mask;
+static u32 exports_used;
+
+static export_slot* FindExport(const char* name)
+{
+    u32 hash = HashName(name), slot;
+
+    if (exports == NULL)
+        return NULL;
+
+    for (slot = hash & exports_mask; exports[slot].name != NULL; slot = (slot + 1) & exports_mask)
+        if (exports[slot].hash == hash && strcmp(exports[slot].name, name) == 0)
+            return &exports[slot];
+    return NULL;
+}
+
+static void InsertExport(export_slot* e)
+{
+    u32 slot = e->hash & exports_mask;
+
+    while (exports[slot].name != NULL)
+        slot = (slot + 1) & exports_mask;
+    exports[slot] = *e;
+}
+
+static void AddExport(const char* name, u32 address, u32 module)
+{
+    export_slot e;
+    u32 i;
+
+    if (FindExport(name) != NULL)
+        return;
+
+    if ((exports_used + 1) * 2 > exports_mask) {
+        export_slot* old = exports;
+        u32 old_size = exports != NULL ? exports_mask + 1 : 0;
+
+        exports_mask = old_size != 0 ? old_size * 2 - 1 : 0x3FF;
+        exports = calloc(exports_mask + 1, sizeof(export_slot));
+        if (exports == NULL) {
+            ERROR("calloc failed\n");
+            exit(1);
+        }
+        for (i = 0; i < old_size; i++)
+            if (old[i].name != NULL)
+                InsertExport(&old[i]);
+        free(old);
+    }
+
+    e.name = name;
+    e.hash = HashName(name);
+    e.address = address;
+    e.module = module;
+    InsertExport(&e);
+    exports_used++;
+}
+
+static void AddModuleExports(u32 index)
+{
+    cro_module* m = &modules[index];
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_EXPORT_NAMED); i++) {
+        u8* e = Entry(m, CRO_EXPORT_NAMED, i);
+        const char* name = String(m, Read32(e));
+        u32 address = TagAddress(m, Read32(e + 4));
+
+        if (name != NULL && address != 0)
+            AddExport(name, address, index);
+    }
+}
+
+static void RebuildExports()
+{
+    u32 i;
+
+    if (exports != NULL)
+        memset(exports, 0, (exports_mask + 1) * sizeof(export_slot));
+    exports_used = 0;
+
+    for (i = 0; i < num_modules; i++)
+        if (modules[i].linked)
+            AddModuleExports(i);
+}
+
+/* ____ Relocation ____ */
+
+static void Relocate(u32 target, u8 type, u32 addend, u32 symbol)
+{
+    u32 value = symbol + addend, insn, off;
+
+    switch (type) {
+    case 0:
+        break;
+
+    case 2:  // R_ARM_ABS32
+    case 38: // R_ARM_TARGET1
+        mem_Write32(target, value);
+        break;
+
+    case 3:  // R_ARM_REL32
+        mem_Write32(target, value - target);
+        break;
+
+    case 28: // R_ARM_CALL
+    case 29: // R_ARM_JUMP24
+        insn = mem_Read32(target);
+        off = (value & ~1) - target;
+        if (type == 28 && (value & 1))
+            insn = 0xFA000000 | ((off >> 1) & 1) << 24; // blx
+        else if (insn >> 28 == 0xF)
+            insn = 0xEB000000; // blx to arm code, back to bl
+        mem_Write32(target, (insn & 0xFF000000) | ((off >> 2) & 0xFFFFFF));
+        break;
+
+    case 10: // R_ARM_THM_CALL, no Thumb-2 on the arm11
+        if (value & 1) {
+            off = (value & ~1) - target;
+            mem_Write16(target + 2, 0xF800 | ((off >> 1) & 0x7FF));
+        } else {
+            off = value - (target & ~3); // blx
+            mem_Write16(target + 2, 0xE800 | ((off >> 1) & 0x7FE));
+        }
+        mem_Write16(target, 0xF000 | ((off >> 12) & 0x7FF));
+        break;
+
+    case 42: // R_ARM_PREL31
+        mem_Write32(target, (mem_Read32(target) & 0x80000000) | ((value - target) & 0x7FFFFFFF));
+        break;
+
+    default:
+        ERROR("Unknown relocation type %d at %08x\n", type, target);
+        break;
+    }
+}
+
+// The batch at address batch of m's table, the targets are in dest. Static
+// relocations patch the CRS, everything else the module itself.
+static void ApplyBatch(cro_module* m, u32 table, cro_module* dest, u32 batch, u32 symbol, bool resolved)
+{
+    u8* end = Entry(m, table, Count(m, table));
+    u8* first = Span(m, batch, 12);
+    u8* e;
+
+    if (first == NULL || first < Entry(m, table, 0) || first + 12 > end) {
+        ERROR("Bad relocation batch %08x\n", batch);
+        return;
+    }
+
+    for (e = first; e + 12 <= end; e += 12) {
+        u32 target = TagAddress(dest, Read32(e));
+
+        if (target != 0)
+            Relocate(target, e[4], Read32(e + 8), symbol);
+        if (e[5] != 0) // End of batch.
+            break;
+    }
+    first[6] = resolved;
+}
+
+static bool BatchResolved(cro_module* m, u32 batch)
+{
+    u8* first = Span(m, batch, 12);
+    return first == NULL || first[6] != 0;
+}
+
+// All imports of m go to its unresolved handler.
+static void ResetExternalRelocations(cro_module* m)
+{
+    u32 unresolved = TagAddress(m, Field(m, CRO_ON_UNRESOLVED));
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_EXTERNAL_RELOC); i++) {
+        u8* e = Entry(m, CRO_EXTERNAL_RELOC, i);
+        u32 target = TagAddress(m, Read32(e));
+
+        if (target != 0)
+            Relocate(target, e[4], Read32(e + 8), unresolved);
+        e[6] = 0;
+    }
+}
+
+// Relocations inside the module. Those into .data go to the file's copy,
+// which is moved to the .data buffer afterwards.
+static int ApplyInternalRelocations(cro_module* m)
+{
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_INTERNAL_RELOC); i++) {
+        u8* e = Entry(m, CRO_INTERNAL_RELOC, i);
+        u32 tag = Read32(e), target = TagAddress(m, tag);
+        u8* segment;
+
+        if (target == 0 || e[5] >= Count(m, CRO_SEGMENTS))
+            return -1;
+
+        if (Read32(Entry(m, CRO_SEGMENTS, tag & 0xF) + 8) == SEGMENT_DATA)
+            target = m->address + m->data_offset + (tag >> 4);
+
+        segment = Entry(m, CRO_SEGMENTS, e[5]);
+        Relocate(target, e[4], Read32(e + 8), Read32(segment));
+    }
+    return 0;
+}
+
+/* ____ Rebase ____ */
+
+static bool HeaderValid(cro_module* m)
+{
+    u32 field;
+
+    if (m->size < CRO_HEADER_SIZE || memcmp(m->image + CRO_MAGIC, "CRO0", 4) != 0 ||
+            Field(m, CRO_FILE_SIZE) != m->size)
+        return false;
+
+    for (field = CRO_CODE; field <= CRO_STATIC_RELOC; field += 8) {
+        u64 end = (u64)Field(m, field) + (u64)Count(m, field) * entry_size[(field - CRO_CODE) / 8];
+        if (Count(m, field) != 0 && end > m->size)
+            return false;
+    }
+    return true;
+}
+
+// Turns the file offsets of the header into addresses, or back with a
+// negative delta.
+static void RebaseHeader(cro_module* m, u32 delta)
+{
+    u32 field;
+
+    SetField(m, CRO_NAME, Field(m, CRO_NAME) + delta);
+    for (field = CRO_CODE; field <= CRO_STATIC_RELOC; field += 8)
+        SetField(m, field, Field(m, field) + delta);
+}
+
+// Same for the offsets in the tables, the header has to hold addresses.
+static void RebaseTables(cro_module* m, u32 delta)
+{
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_EXPORT_NAMED); i++) {
+        u8* e = Entry(m, CRO_EXPORT_NAMED, i);
+        Write32(e, Read32(e) + delta);
+    }
+
+    for (i = 0; i < Count(m, CRO_IMPORT_MODULES); i++) {
+        u8* e = Entry(m, CRO_IMPORT_MODULES, i);
+        Write32(e, Read32(e) + delta);
+        Write32(e + 4, Read32(e + 4) + delta);
+        Write32(e + 12, Read32(e + 12) + delta);
+    }
+
+    for (i = 0; i < Count(m, CRO_IMPORT_NAMED); i++) {
+        u8* e = Entry(m, CRO_IMPORT_NAMED, i);
+        Write32(e, Read32(e) + delta);
+        Write32(e + 4, Read32(e + 4) + delta);
+    }
+
+    for (i = 0; i < Count(m, CRO_IMPORT_INDEXED); i++) {
+        u8* e = Entry(m, CRO_IMPORT_INDEXED, i);
+        Write32(e + 4, Read32(e + 4) + delta);
+    }
+
+    for (i = 0; i < Count(m, CRO_IMPORT_ANON); i++) {
+        u8* e = Entry(m, CRO_IMPORT_ANON, i);
+        Write32(e + 4, Read32(e + 4) + delta);
+    }
+
+    for (i = 0; i < Count(m, CRO_STATIC_ANON); i++) {
+        u8* e = Entry(m, CRO_STATIC_ANON, i);
+        Write32(e + 4, Read32(e + 4) + delta);
+    }
+}
+
+// The CRS describes the exe where it already is, its segments stay.
+static int RebaseSegments(cro_module* m, u32 data, u32 data_size, u32 bss, u32 bss_size)
+{
+    u32 pass, i;
+
+    // Checks everything before changing anything.
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < Count(m, CRO_SEGMENTS); i++) {
+            u8* e = Entry(m, CRO_SEGMENTS, i);
+            u32 offset = Read32(e), size = Read32(e + 4);
+
+            switch (Read32(e + 8)) {
+            case SEGMENT_DATA:
+                if (size == 0)
+                    break;
+                if (size > data_size || (u64)offset + size > m->size)
+                    return -1;
+                if (pass == 1) {
+                    m->data_offset = offset;
+                    Write32(e, data);
+                }
+                break;
+
+            case SEGMENT_BSS:
+                if (size == 0)
+                    break;
+                if (size > bss_size)
+                    return -1;
+                if (pass == 1)
+                    Write32(e, bss);
+                break;
+
+            default:
+                if (offset == 0)
+                    break;
+                if ((u64)offset + size > m->size)
+                    return -1;
+                if (pass == 1)
+                    Write32(e, offset + m->address);
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+static void UnrebaseSegments(cro_module* m)
+{
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_SEGMENTS); i++) {
+        u8* e = Entry(m, CRO_SEGMENTS, i);
+
+        switch (Read32(e + 8)) {
+        case SEGMENT_DATA:
+            if (Read32(e + 4) != 0)
+                Write32(e, m->data_offset);
+            break;
+        case SEGMENT_BSS:
+            Write32(e, 0);
+            break;
+        default:
+            if (Read32(e) != 0)
+                Write32(e, Read32(e) - m->address);
+            break;
+        }
+    }
+}
+
+// Import subtables must stay inside the image, strings be terminated.
+static bool TablesValid(cro_module* m)
+{
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_IMPORT_MODULES); i++) {
+        u8* e = Entry(m, CRO_IMPORT_MODULES, i);
+
+        if (String(m, Read32(e)) == NULL ||
+                (Read32(e + 8) != 0 && Span(m, Read32(e + 4), Read32(e + 8) * 8) == NULL) ||
+                (Read32(e + 16) != 0 && Span(m, Read32(e + 12), Read32(e + 16) * 8) == NULL))
+            return false;
+    }
+
+    if (Count(m, CRO_MODULE_NAME) != 0 &&
+            memchr(Span(m, Field(m, CRO_MODULE_NAME), 1), 0, Count(m, CRO_MODULE_NAME)) == NULL)
+        return false;
+    return true;
+}
+
+/* ____ Linking ____ */
+
+static s32 FindModule(const char* name, bool linked)
+{
+    u32 hash = HashName(name), i;
+
+    for (i = 0; i < num_modules; i++)
+        if (modules[i].name_hash == hash && (modules[i].linked || !linked) &&
+                strcmp(ModuleName(&modules[i]), name) == 0)
+            return i;
+    return -1;
+}
+
+static s32 FindModuleAt(u32 address)
+{
+    u32 i;
+
+    for (i = 0; i < num_modules; i++)
+        if (modules[i].address == address)
+            return i;
+    return -1;
+}
+
+// The whole-module imports of m from modules[src]: by index into its
+// indexed export table, or by tag.
+static void ApplyModuleImport(cro_module* m, u8* e, cro_module* src, bool reset)
+{
+    u32 unresolved = TagAddress(m, Field(m, CRO_ON_UNRESOLVED));
+    u8* table;
+    u32 i;
+
+    table = Span(m, Read32(e + 4), Read32(e + 8) * 8);
+    for (i = 0; i < Read32(e + 8); i++) {
+        u32 index = Read32(table + 8*i), batch = Read32(table + 8*i + 4), address = 0;
+
+        if (reset) {
+            if (BatchResolved(m, batch))
+                ApplyBatch(m, CRO_EXTERNAL_RELOC, m, batch, unresolved, false);
+            continue;
+        }
+        if (BatchResolved(m, batch))
+            continue;
+
+        if (index < Count(src, CRO_EXPORT_INDEXED))
+            address = TagAddress(src, Read32(Entry(src, CRO_EXPORT_INDEXED, index)));
+        if (address != 0)
+            ApplyBatch(m, CRO_EXTERNAL_RELOC, m, batch, address, true);
+    }
+
+    table = Span(m, Read32(e + 12), Read32(e + 16) * 8);
+    for (i = 0; i < Read32(e + 16); i++) {
+        u32 tag = Read32(table + 8*i), batch = Read32(table + 8*i + 4), address;
+
+        if (reset) {
+            if (BatchResolved(m, batch))
+                ApplyBatch(m, CRO_EXTERNAL_RELOC, m, batch, unresolved, false);
+            continue;
+        }
+        if (BatchResolved(m, batch))
+            continue;
+
+        address = TagAddress(src, tag);
+        if (address != 0)
+            ApplyBatch(m, CRO_EXTERNAL_RELOC, m, batch, address, true);
+    }
+}
+
+// Resolves what m still imports from the linked modules. Resolved batches
+// are skipped, so this is cheap to repeat whenever a module comes in.
+static void ResolveImports(cro_module* m)
+{
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_IMPORT_NAMED); i++) {
+        u8* e = Entry(m, CRO_IMPORT_NAMED, i);
+        const char* name;
+        export_slot* slot;
+
+        if (BatchResolved(m, Read32(e + 4)) || (name = String(m, Read32(e))) == NULL)
+            continue;
+
+        slot = FindExport(name);
+        if (slot != NULL)
+            ApplyBatch(m, CRO_EXTERNAL_RELOC, m, Read32(e + 4), slot->address, true);
+    }
+
+    for (i = 0; i < Count(m, CRO_IMPORT_MODULES); i++) {
+        u8* e = Entry(m, CRO_IMPORT_MODULES, i);
+        s32 src = FindModule(String(m, Read32(e)), true);
+
+        if (src >= 0)
+            ApplyModuleImport(m, e, &modules[src], false);
+    }
+}
+
+// Points the imports m resolved from modules[gone] back at its unresolved
+// handler. Runs before gone leaves the export hash.
+static void ResetImportsFrom(cro_module* m, u32 gone)
+{
+    u32 unresolved = TagAddress(m, Field(m, CRO_ON_UNRESOLVED));
+    u32 i;
+
+    for (i = 0; i < Count(m, CRO_IMPORT_NAMED); i++) {
+        u8* e = Entry(m, CRO_IMPORT_NAMED, i);
+        const char* name = String(m, Read32(e));
+        export_slot* slot;
+
+        if (name == NULL || !BatchResolved(m, Read32(e + 4)))
+            continue;
+
+        slot = FindExport(name);
+        if (slot != NULL && slot->module == gone)
+            ApplyBatch(m, CRO_EXTERNAL_RELOC, m, Read32(e + 4), unresolved, false);
+    }
+
+    for (i = 0; i < Count(m, CRO_IMPORT_MODULES); i++) {
+        u8* e = Entry(m, CRO_IMPORT_MODULES, i);
+
+        if (FindModule(String(m, Read32(e)), true) == (s32)gone)
+            ApplyModuleImport(m, e, NULL, true);
+    }
+}
+
+// The static anonymous symbols of m patch the CRS.
+static void ApplyStaticSymbols(cro_module* m)
+{
+    u32 i;
+
+    if (num_modules == 0 || !modules[0].crs)
+        return;
+
+    for (i = 0; i < Count(m, CRO_STATIC_ANON); i++) {
+        u8* e = Entry(m, CRO_STATIC_ANON, i);
+        u32 address = TagAddress(m, Read32(e));
+
+        if (address != 0)
+            ApplyBatch(m, CRO_STATIC_RELOC, &modules[0], Read32(e + 4), address, true);
+    }
+}
+
+static void Link(u32 index)
+{
+    u32 i;
+
+    if (modules[index].linked)
+        return;
+
+    modules[index].linked = true;
+    AddModuleExports(index);
+    ApplyStaticSymbols(&modules[index]);
+
+    for (i = 0; i < num_modules; i++)
+        if (modules[i].linked)
+            ResolveImports(&modules[i]);
+}
+
+static void Unlink(u32 index)
+{
+    u32 i;
+
+    if (!modules[index].linked)
+        return;
+
+    for (i = 0; i < num_modules; i++)
+        if (i != index && modules[i].linked)
+            ResetImportsFrom(&modules[i], index);
+    ResetExternalRelocations(&modules[index]);
+
+    modules[index].linked = false;
+    RebuildExports();
+}
+
+// The guest's nn::ro follows the module list in the headers.
+static void ChainModules()
+{
+    u32 i;
+
+    for (i = 0; i < num_modules; i++) {
+        SetField(&modules[i], CRO_NEXT, i + 1 < num_modules ? modules[i + 1].address : 0);
+        SetField(&modules[i], CRO_PREVIOUS, modules[i != 0 ? i - 1 : num_modules - 1].address);
+    }
+}
+
+/* ____ Loading ____ */
+
+// Maps the guest buffer at address, the image is used in place.
+static int MapModule(cro_module* m, u32 buffer, u32 address, u32 size)
+{
+    m->buffer = buffer;
+    m->address = address;
+    m->size = size;
+    m->image = mem_rawaddr(buffer, size);
+
+    if (m->image == NULL)
+        return -1;
+    if (address != buffer && mem_AddMappingShared(address, size, m->image) != 0)
+        return -1;
+    return 0;
+}
+
+static void UnmapModule(cro_module* m)
+{
+    if (m->address != m->buffer)
+        mem_RemoveMappingShared(m->address);
+}
+
+static u32 LoadModule(bool crs, u32 buffer, u32 address, u32 size,
+                      u32 data, u32 data_size, u32 bss, u32 bss_size, bool link)
+{
+    cro_module* m;
+    u32 i;
+
+    if (num_modules == MAX_MODULES) {
+        ERROR("Too many modules\n");
+        return RO_BAD_CRO;
+    }
+
+    m = &modules[num_modules];
+    memset(m, 0, sizeof(*m));
+    m->crs = crs;
+
+    if (MapModule(m, buffer, address, size) != 0) {
+        ERROR("Failed to map module %08x at %08x\n", buffer, address);
+        return RO_BAD_CRO;
+    }
+
+    if (!HeaderValid(m)) {
+        ERROR("Bad module header at %08x\n", buffer);
+        UnmapModule(m);
+        return RO_BAD_CRO;
+    }
+
+    RebaseHeader(m, address);
+    RebaseTables(m, address);
+    if (!TablesValid(m) || (!crs && RebaseSegments(m, data, data_size, bss, bss_size) != 0)) {
+        ERROR("Bad module tables at %08x\n", buffer);
+        RebaseTables(m, -address);
+        RebaseHeader(m, -address);
+        UnmapModule(m);
+        return RO_BAD_CRO;
+    }
+
+    m->name_hash = HashName(ModuleName(m));
+    ResetExternalRelocations(m);
+
+    if (!crs) {
+        if (ApplyInternalRelocations(m) != 0)
+            ERROR("Bad internal relocation in %s\n", ModuleName(m));
+
+        for (i = 0; i < Count(m, CRO_SEGMENTS); i++) {
+            u8* e = Entry(m, CRO_SEGMENTS, i);
+
+            u8* zero;
+
+            if (Read32(e + 8) == SEGMENT_DATA && Read32(e + 4) != 0)
+                mem_Write(m->image + m->data_offset, data, Read32(e + 4));
+            else if (Read32(e + 8) == SEGMENT_BSS && Read32(e + 4) != 0 &&
+                     (zero = mem_rawaddr(bss, Read32(e + 4))) != NULL)
+                memset(zero, 0, Read32(e + 4));
+        }
+    }
+
+    if (profiler_enabled) {
+        for (i = 0; i < Count(m, CRO_EXPORT_NAMED); i++) {
+            u8* e = Entry(m, CRO_EXPORT_NAMED, i);
+
+            if ((Read32(e + 4) & 0xF) == 0) // .text
+                profiler_AddSymbol(TagAddress(m, Read32(e + 4)), 0, String(m, Read32(e)));
+        }
+    }
+
+    DEBUG("Loaded %s at %08x, %d exports, %d imports\n", ModuleName(m),
+          address, Count(m, CRO_EXPORT_NAMED), Count(m, CRO_IMPORT_NAMED));
+
+    num_modules++;
+    if (link)
+        Link(num_modules - 1);
+    ChainModules();
+    return 0;
+}
+
+static void UnloadModule(u32 index)
+{
+    cro_module* m = &modules[index];
+
+    Unlink(index);
+    if (!m->crs)
+        UnrebaseSegments(m);
+    RebaseTables(m, -m->address);
+    RebaseHeader(m, -m->address);
+    SetField(m, CRO_NEXT, 0);
+    SetField(m, CRO_PREVIOUS, 0);
+    UnmapModule(m);
+
+    memmove(m, m + 1, (num_modules - index - 1) * sizeof(cro_module));
+    num_modules--;
+    RebuildExports();
+    ChainModules();
+}
+
+/* ____ Save states ____ */
+
+void ldr_ro_SaveState()
+{
+    savestate_Put(&num_modules, sizeof(num_modules));
+    savestate_Put(modules, sizeof(modules));
+}
+
+void ldr_ro_LoadState()
+{
+    u32 i;
+
+    savestate_Get(&num_modules, sizeof(num_modules));
+    savestate_Get(modules, sizeof(modules));
+    if (num_modules > MAX_MODULES)
+        num_modules = 0;
+
+    // The mappings are back already, only the host views move.
+    for (i = 0; i < num_modules; i++)
+        modules[i].image = mem_rawaddr(modules[i].buffer, modules[i].size);
+    RebuildExports();
+}
+
+/* ____ Service ____ */
 
 SERVICE_START(ldr_ro);
 
 SERVICE_CMD(0x100C2)   //Initialize
 {
-    DEBUG("Initialize -- stubbed -- %08x,%08x,%08x,%08x,%08x\n",
-          CMD(1), CMD(2), CMD(3), CMD(4), CMD(5));
+    u32 ret;
 
-    RESP(1, 0); // Result
+    DEBUG("Initialize %08x,%08x,%08x\n", CMD(1), CMD(2), CMD(3));
+
+    if (num_modules != 0) {
+        RESP(1, RO_ALREADY_INITIALIZED); // Result
+        return 0;
+    }
+
+    // CRS, buffer, mapped address, size
+    ret = LoadModule(true, CMD(1), CMD(3), CMD(2), 0, 0, 0, 0, true);
+    RESP(1, ret); // Result
     return 0;
 }
 
 SERVICE_CMD(0x20082)   //LoadCRR
 {
+    // The hashes in the CRR are not checked.
     DEBUG("LoadCRR -- stubbed -- %08x,%08x,%08x,%08x\n",
           CMD(1), CMD(2), CMD(3), CMD(4));
 
@@ -45,38 +903,89 @@ SERVICE_CMD(0x20082)   //LoadCRR
     return 0;
 }
 
-SERVICE_CMD(0x30042)   //UnloadCCR
+SERVICE_CMD(0x30042)   //UnloadCRR
 {
-    DEBUG("UnloadCCR -- stubbed -- %08x,%08x,%08x\n",
+    DEBUG("UnloadCRR -- stubbed -- %08x,%08x,%08x\n",
           CMD(1), CMD(2), CMD(3));
 
     RESP(1, 0); // Result
     return 0;
 }
 
-SERVICE_CMD(0x402C2)   //LoadExeCRO
+SERVICE_CMD(0x402C2)   //LoadCRO
+SERVICE_CMD(0x902C2)   //LoadCRO_New
 {
-    DEBUG("LoadExeCRO -- stubbed -- %08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x\n",
-          CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8), CMD(9), CMD(10), CMD(11), CMD(12), CMD(13));
+    u32 ret;
+
+    DEBUG("LoadCRO %08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x,%08x\n",
+          CMD(1), CMD(2), CMD(3), CMD(4), CMD(5), CMD(6), CMD(7), CMD(8), CMD(9), CMD(10), CMD(11));
+
+    if (num_modules == 0) {
+        RESP(1, RO_NOT_INITIALIZED); // Result
+        return 0;
+    }
+
+    // buffer, mapped address, size, .data, 0, .data size, .bss, .bss size, auto link
+    ret = LoadModule(false, CMD(1), CMD(2), CMD(3), CMD(4), CMD(6), CMD(7), CMD(8), CMD(9) & 0xFF);
+    RESP(1, ret); // Result
+    RESP(2, ret == 0 ? CMD(3) : 0); // Size after fixing, nothing is freed.
+    return 0;
+}
 
+SERVICE_CMD(0x500C2)   //UnloadCRO
+{
+    s32 index = FindModuleAt(CMD(1));
+
+    DEBUG("UnloadCRO %08x,%08x,%08x\n", CMD(1), CMD(2), CMD(3));
+
+    if (index <= 0 || modules[index].crs) {
+        RESP(1, RO_NOT_LOADED); // Result
+        return 0;
+    }
+
+    UnloadModule(index);
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x60042)   //LinkCRO
+{
+    s32 index = FindModuleAt(CMD(1));
+
+    DEBUG("LinkCRO %08x\n", CMD(1));
+
+    if (index < 0) {
+        RESP(1, RO_NOT_LOADED); // Result
+        return 0;
+    }
+
+    Link(index);
     RESP(1, 0); // Result
-    RESP(2, 0); // Unknown
     return 0;
 }
 
-SERVICE_CMD(0x500C2)   //LoadCROSymbols
+SERVICE_CMD(0x70042)   //UnlinkCRO
 {
-    DEBUG("LoadCROSymbols -- stubbed -- %08x,%08x,%08x,%08x,%08x\n",
-          CMD(1), CMD(2), CMD(3), CMD(4), CMD(5));
+    s32 index = FindModuleAt(CMD(1));
 
+    DEBUG("UnlinkCRO %08x\n", CMD(1));
+
+    if (index < 0) {
+        RESP(1, RO_NOT_LOADED); // Result
+        return 0;
+    }
+
+    Unlink(index);
     RESP(1, 0); // Result
     return 0;
 }
 
 SERVICE_CMD(0x80042)   //Shutdown
 {
-    DEBUG("Shutdown -- stubbed -- %08x,%08x,%08x\n",
-          CMD(1), CMD(2), CMD(3));
+    DEBUG("Shutdown %08x\n", CMD(1));
+
+    while (num_modules != 0)
+        UnloadModule(num_modules - 1);
 
     RESP(1, 0); // Result
     return 0;
@@ -19,11 +19,12 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
 
-u32 mcumutex = 0;
+static u32 mcumutex = 0;
 
 void mcu_GPU_init()
 {
@@ -118,3 +119,13 @@ SERVICE_CMD(0x000B0040)   //unk 0xB
 
 
 SERVICE_END();
+
+void mcu_GPU_SaveState()
+{
+    savestate_Put(&mcumutex, sizeof(mcumutex));
+}
+
+void mcu_GPU_LoadState()
+{
+    savestate_Get(&mcumutex, sizeof(mcumutex));
+}
@@ -19,15 +19,22 @@
 
 void IPC_debugprint(u32 addr);
 
+// Host pointer to the command buffer of the thread whose request is being
+// handled, or NULL outside of a SyncRequest (see svcSendSyncRequest).
+extern u32* ipc_cmd_buffer;
+
 #define CMD(n)                                  \
-    mem_Read32(arm11_ServiceBufferAddress() + 0x80 + 4*(n))
+    (ipc_cmd_buffer != NULL ? ipc_cmd_buffer[(n)] : \
+     mem_Read32(arm11_ServiceBufferAddress() + 0x80 + 4*(n)))
 
 #define EXTENDED_CMD(n)                         \
-    mem_Read32(arm11_ServiceBufferAddress() + 0x180 + 4*(n))
+    (ipc_cmd_buffer != NULL ? ipc_cmd_buffer[0x40 + (n)] : \
+     mem_Read32(arm11_ServiceBufferAddress() + 0x180 + 4*(n)))
 
 
 #define RESP(n, w)                              \
-    mem_Write32(arm11_ServiceBufferAddress() + 0x80 + 4*(n), w)
+    (ipc_cmd_buffer != NULL ? (void)(ipc_cmd_buffer[(n)] = (w)) : \
+     (void)mem_Write32(arm11_ServiceBufferAddress() + 0x80 + 4*(n), w))
 
 #undef SERVICE_START
 #define SERVICE_START(name)                                 \
@@ -45,3 +52,39 @@ void IPC_debugprint(u32 addr);
         }                                                       \
         return -1;                                              \
     }
+
+// Table based services: every command is its own handler and the command
+// id -> handler hash is built on the first request.
+
+typedef u32 (*service_handler)(handleinfo* h, bool *locked);
+
+typedef struct {
+    u32 id;
+    service_handler fn;
+} service_cmd;
+
+typedef struct {
+    service_cmd* slots;
+    u32 mask;
+} service_cmd_table;
+
+// services/service_table.c
+u32 service_Dispatch(service_cmd_table* table, const service_cmd* cmds, u32 num_cmds,
+                     handleinfo* h, bool *locked);
+
+#define SERVICE_HANDLER(fn)                     \
+    static u32 fn(handleinfo* h, bool *locked)
+
+#define SERVICE_TABLE_START(name)               \
+    static const service_cmd name ## _cmds[] = {
+
+#define SERVICE_TABLE_CMD(id, fn)               \
+        { (id), &(fn) },
+
+#define SERVICE_TABLE_END(name)                                         \
+    };                                                                  \
+    u32 name ## _SyncRequest(handleinfo* h, bool *locked) {             \
+        static service_cmd_table table;                                 \
+        return service_Dispatch(&table, name ## _cmds,                  \
+                                ARRAY_SIZE(name ## _cmds), h, locked);  \
+    }
@@ -0,0 +1,86 @@
+/*
+* Copyright (C) 2014 - plutoo
+* Copyright (C) 2014 - ichfly
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+
+#include "util.h"
+#include "handles.h"
+#include "mem.h"
+#include "arm11.h"
+
+#include "service_macros.h"
+
+// The command index lives in the upper half of the header, the lower half
+// is the parameter layout. Mix both so headers that only differ in layout
+// still land in different slots.
+static u32 HashCmd(u32 id, u32 mask)
+{
+    return ((id >> 16) ^ (id * 0x9E3779B1)) & mask;
+}
+
+static int BuildTable(service_cmd_table* table, const service_cmd* cmds, u32 num_cmds)
+{
+    u32 size = 8;
+    u32 i;
+
+    // Keep the load factor under 1/2 so probes stay short.
+    while (size < num_cmds * 2)
+        size <<= 1;
+
+    table->slots = calloc(size, sizeof(service_cmd));
+    if (table->slots == NULL) {
+        ERROR("calloc failed\n");
+        return -1;
+    }
+    table->mask = size - 1;
+
+    for (i = 0; i < num_cmds; i++) {
+        u32 slot = HashCmd(cmds[i].id, table->mask);
+
+        while (table->slots[slot].fn != NULL) {
+            if (table->slots[slot].id == cmds[i].id) {
+                ERROR("duplicate cmd %08x\n", cmds[i].id);
+                break;
+            }
+            slot = (slot + 1) & table->mask;
+        }
+        table->slots[slot] = cmds[i];
+    }
+    return 0;
+}
+
+u32 service_Dispatch(service_cmd_table* table, const service_cmd* cmds, u32 num_cmds,
+                     handleinfo* h, bool *locked)
+{
+    u32 id = CMD(0);
+
+    if (table->slots == NULL && BuildTable(table, cmds, num_cmds) != 0)
+        return -1;
+
+    u32 slot = HashCmd(id, table->mask);
+
+    while (table->slots[slot].fn != NULL) {
+        if (table->slots[slot].id == id)
+            return table->slots[slot].fn(h, locked);
+        slot = (slot + 1) & table->mask;
+    }
+
+    IPC_debugprint(arm11_ServiceBufferAddress() + 0x80);
+    ERROR("Not implemented cmd %08x\n", id);
+    return -1;
+}
@@ -43,12 +43,16 @@ static WSADATA wsaData;
 #define ERRNO(x)  WSA##x
 #define GET_ERRNO WSAGetLastError()
 
+#define poll WSAPoll
+
 #else
 
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 
 typedef int SOCKET;
 #define SOCKET_FAILED(s) ((s) < 0)
@@ -59,14 +63,70 @@ typedef int SOCKET;
 
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define SOC_EPOLL
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 #include <stdint.h>
 
 #include "util.h"
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "threads.h"
+#include "trace.h"
+#include "savestate.h"
 #include "service_macros.h"
 
+// Guest side flags, they do not match the host ones.
+#define SOC_F_GETFL      3
+#define SOC_F_SETFL      4
+#define SOC_O_NONBLOCK   0x4
+#define SOC_MSG_OOB      0x1
+#define SOC_MSG_PEEK     0x2
+#define SOC_MSG_DONTWAIT 0x4
+#define SOC_POLLIN       0x01
+#define SOC_POLLPRI      0x02
+#define SOC_POLLHUP      0x04
+#define SOC_POLLERR      0x08
+#define SOC_POLLOUT      0x10
+#define SOC_POLLNVAL     0x20
+
+#define SOC_MAX_POLL     64
+
+// Socket handles: misc_ptr[0] is the host socket, misc[0] the guest
+// fcntl flags and misc[1] what the socket is armed for in epoll.
+#define SOCK(h)          ((SOCKET)(uintptr_t)(h)->misc_ptr[0])
+#define WATCH_ADDED      (1u << 31)
+#define WATCH_MASK       (POLLIN | POLLPRI | POLLOUT)
+#define SOCKET_CLOSED    ((SOCKET)-1)
+
+#define SOCKET_WOULDBLOCK(e) ((e) == ERRNO(EWOULDBLOCK) || (e) == ERRNO(EAGAIN))
+
+// Host sockets never block. A guest thread whose call would block is parked
+// on its own event and its request is run again, from the command buffer it
+// left behind, once the socket is ready.
+typedef struct {
+    bool used;
+    bool parked;   // Still blocked after the last run.
+    u32  cmd_addr; // Command buffer of the parked thread.
+    u32  event;    // What the thread waits on.
+    u64  deadline; // poll() timeout in trace_Now() time, 0 for none.
+} soc_waiter;
+
+static soc_waiter waiters[MAX_THREADS];
+static soc_waiter* retrying; // Set while a parked request is run again.
+static u32 num_waiting;
+
+#ifdef SOC_EPOLL
+static int epoll_fd = -1;
+#endif
+
 static u32 soc_shared_size = 0;
 static u32 soc_shared_mem_handle = 0;
 
@@ -74,6 +134,163 @@ static void init_error_map(void);
 static int translate_error(int error);
 static int load_sockaddr(struct sockaddr *saddr, socklen_t *addrlen, uint32_t src);
 static int save_sockaddr(struct sockaddr *saddr, socklen_t addrlen, uint32_t dst, socklen_t dstlen);
+static void Watch(handleinfo* sock, u32 events);
+static int Park(handleinfo* sock, u32 events, u64 deadline);
+static void RetryAll();
+
+static handleinfo* GetSocket(u32 fd)
+{
+    handleinfo* h = handle_Get(fd + HANDLES_BASE); //bit(31) must not be set
+
+    if (h == NULL || h->type != HANDLE_TYPE_SOCKET)
+        return NULL;
+    return h;
+}
+
+static int SetNonBlocking(SOCKET s)
+{
+#ifdef _WIN32
+    u_long on = 1;
+    return ioctlsocket(s, FIONBIO, &on);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+// Whether a call that failed with err should park the thread.
+static bool ShouldPark(handleinfo* h, int err, u32 flags)
+{
+    return SOCKET_WOULDBLOCK(err) && !(h->misc[0] & SOC_O_NONBLOCK) && !(flags & SOC_MSG_DONTWAIT);
+}
+
+static void NewSocket(u32* handle_out, SOCKET s)
+{
+    u32 handle = handle_New(HANDLE_TYPE_SOCKET, 0);
+    handleinfo* h = handle_Get(handle);
+
+    h->misc_ptr[0] = (void*)(uintptr_t)s;
+    h->misc[0] = 0;
+    h->misc[1] = 0;
+    *handle_out = handle;
+}
+
+static void SendTo(u32 fd, u32 len, u32 flags, u32 addrlen, u32 addr_src, u32 src)
+{
+    struct sockaddr_storage addr;
+    struct sockaddr         *saddr = (struct sockaddr*)&addr;
+    socklen_t               hostlen = addrlen;
+    u8*                     bounce = NULL;
+    u8*                     buffer;
+
+    handleinfo* h = GetSocket(fd);
+    if (h == NULL) {
+        DEBUG("failed to get Handle\n");
+        RESP(2, translate_error(ERRNO(EBADF)));
+        RESP(1, 0);
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (addrlen != 0 && load_sockaddr(saddr, &hostlen, addr_src) != 0)
+        return;
+
+    // Straight from guest memory unless the buffer crosses a mapping.
+    buffer = mem_rawaddr(src, len);
+    if (buffer == NULL && len != 0) {
+        bounce = buffer = (u8*)malloc(len);
+        if (buffer == NULL) {
+            ERROR("Not enough mem.\n");
+            RESP(2, translate_error(ENOMEM));
+            RESP(1, 0);
+            return;
+        }
+        if (mem_Read(buffer, src, len) != 0) {
+            ERROR("mem_Read failed.\n");
+            RESP(2, translate_error(ERRNO(EFAULT)));
+            RESP(1, 0);
+            free(bounce);
+            return;
+        }
+    }
+
+    ssize_t rc = sendto(SOCK(h), (const char*)buffer, len, (flags & SOC_MSG_OOB) | MSG_NOSIGNAL,
+                        addrlen != 0 ? saddr : NULL, addrlen != 0 ? hostlen : 0);
+    int err = GET_ERRNO;
+    free(bounce);
+
+    if (rc < 0) {
+        if (ShouldPark(h, err, flags) && Park(h, POLLOUT, 0) == 0)
+            return;
+        RESP(2, translate_error(err));
+        RESP(1, 0);
+        return;
+    }
+
+    RESP(2, (uint32_t)rc);
+    RESP(1, 0);
+}
+
+static void RecvFrom(u32 fd, u32 len, u32 flags, u32 addrlen, u32 addr_dst, u32 dst)
+{
+    struct sockaddr_storage addr;
+    struct sockaddr         *saddr = (struct sockaddr*)&addr;
+    socklen_t               hostlen = sizeof(addr);
+    u8*                     bounce = NULL;
+    u8*                     buffer;
+
+    handleinfo* h = GetSocket(fd);
+    if (h == NULL) {
+        DEBUG("failed to get Handle\n");
+        RESP(2, translate_error(ERRNO(EBADF)));
+        RESP(1, 0);
+        return;
+    }
+
+    // Straight into guest memory unless the buffer crosses a mapping.
+    buffer = mem_rawaddr(dst, len);
+    if (buffer == NULL && len != 0) {
+        bounce = buffer = (u8*)malloc(len);
+        if (buffer == NULL) {
+            ERROR("Not enough mem.\n");
+            RESP(2, translate_error(ENOMEM));
+            RESP(1, 0);
+            return;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    ssize_t rc = recvfrom(SOCK(h), (char*)buffer, len, flags & (SOC_MSG_OOB | SOC_MSG_PEEK),
+                          addrlen != 0 ? saddr : NULL, addrlen != 0 ? &hostlen : NULL);
+    int err = GET_ERRNO;
+
+    if (rc < 0) {
+        free(bounce);
+        if (ShouldPark(h, err, flags) && Park(h, (flags & SOC_MSG_OOB) ? POLLPRI : POLLIN, 0) == 0)
+            return;
+        RESP(2, translate_error(err));
+        RESP(1, 0);
+        return;
+    }
+
+    if (bounce != NULL) {
+        int fault = mem_Write(bounce, dst, (uint32_t)rc);
+        free(bounce);
+
+        if (fault != 0) {
+            ERROR("mem_Write failed.\n");
+            RESP(2, translate_error(ERRNO(EFAULT)));
+            RESP(1, 0);
+            return;
+        }
+    }
+
+    if (addrlen != 0 && hostlen != 0 && save_sockaddr(saddr, hostlen, addr_dst, addrlen) != 0)
+        return;
+
+    RESP(2, (uint32_t)rc);
+    RESP(1, 0);
+}
 
 SERVICE_START(soc_u)
 
@@ -81,7 +298,11 @@ SERVICE_CMD(0x00010044)   //InitializeSockets
 {
     DEBUG("InitializeSockets %08x %08x\n", CMD(1), CMD(5));
 #ifdef _WIN32
-    WSAStartup(MAKEWORD(1, 1), &wsaData);
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+#ifdef SOC_EPOLL
+    if (epoll_fd < 0)
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 #endif
     init_error_map();
     soc_shared_size       = CMD(1);
@@ -159,23 +380,22 @@ SERVICE_CMD(0x000200c2) //socket
 {
     DEBUG("socket %d %d %d\n", CMD(1), CMD(2), CMD(3));
 
-    u32 handle = handle_New(HANDLE_TYPE_SOCKET, 0);
-    handleinfo* h = handle_Get(handle);
-    if (h == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        RESP(2, translate_error(ENOMEM));
+    u32 handle;
+    SOCKET s = socket(CMD(1), CMD(2), CMD(3));
+    if (SOCKET_FAILED(s)) {
+        DEBUG("failed to get newly created SOCKET\n");
+        RESP(2, translate_error(GET_ERRNO));
         RESP(1, 0);
         return 0;
     }
 
-    SOCKET s = socket(CMD(1), CMD(2), CMD(3));
-    if (SOCKET_FAILED(s)) {
-        DEBUG("failed to get newly created SOCKET\n");
+    if (SetNonBlocking(s) != 0) {
         RESP(2, translate_error(GET_ERRNO));
         RESP(1, 0);
+        closesocket(s);
         return 0;
     }
-    h->misc_ptr[0] = (void*)(uintptr_t)s;
+    NewSocket(&handle, s);
 
     RESP(2, handle - HANDLES_BASE); //bit(31) must not be set
     RESP(1, 0);
@@ -189,9 +409,8 @@ SERVICE_CMD(0x00050084) //bind
     struct sockaddr_storage addr;
     struct sockaddr         *saddr = (struct sockaddr*)&addr;
     socklen_t               addrlen = CMD(2);
-    SOCKET                  s;
 
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
+    handleinfo* h = GetSocket(CMD(1));
     if (h == NULL) {
         DEBUG("failed to get Handle\n");
         RESP(2, translate_error(ERRNO(EBADF)));
@@ -203,8 +422,7 @@ SERVICE_CMD(0x00050084) //bind
     if (load_sockaddr(saddr, &addrlen, CMD(6)) != 0)
         return 0;
 
-    s = (uintptr_t)h->misc_ptr[0];
-    int rc = bind(s, saddr, addrlen);
+    int rc = bind(SOCK(h), saddr, addrlen);
     if (rc != 0) {
         RESP(2, translate_error(GET_ERRNO));
         RESP(1, 0);
@@ -216,13 +434,15 @@ SERVICE_CMD(0x00050084) //bind
     return 0;
 }
 
-SERVICE_CMD(0x00030082) //listen
+SERVICE_CMD(0x00060084) //connect
 {
-    DEBUG("listen %08X %08X\n", CMD(1), CMD(2));
+    DEBUG("connect %08X %08X %08X\n", CMD(1), CMD(2), CMD(6));
 
-    SOCKET s;
+    struct sockaddr_storage addr;
+    struct sockaddr         *saddr = (struct sockaddr*)&addr;
+    socklen_t               addrlen = CMD(2);
 
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
+    handleinfo* h = GetSocket(CMD(1));
     if (h == NULL) {
         DEBUG("failed to get Handle\n");
         RESP(2, translate_error(ERRNO(EBADF)));
@@ -230,12 +450,24 @@ SERVICE_CMD(0x00030082) //listen
         return 0;
     }
 
-    s = (uintptr_t)h->misc_ptr[0];
-    int rc = listen(s, CMD(2));
-    if (rc != 0) {
-        RESP(2, translate_error(GET_ERRNO));
-        RESP(1, 0);
+    memset(&addr, 0, sizeof(addr));
+    if (load_sockaddr(saddr, &addrlen, CMD(6)) != 0)
         return 0;
+
+    int rc = connect(SOCK(h), saddr, addrlen);
+    int err = GET_ERRNO;
+    if (rc != 0) {
+        // The host socket is always non-blocking, a blocking guest connect
+        // waits for it to become writable and asks again.
+        bool pending = err == ERRNO(EINPROGRESS) || err == ERRNO(EALREADY) || SOCKET_WOULDBLOCK(err);
+
+        if (pending && !(h->misc[0] & SOC_O_NONBLOCK) && Park(h, POLLOUT, 0) == 0)
+            return 0;
+        if (!(err == ERRNO(EISCONN) && retrying != NULL)) {
+            RESP(2, translate_error(err));
+            RESP(1, 0);
+            return 0;
+        }
     }
 
     RESP(2, 0);
@@ -243,13 +475,11 @@ SERVICE_CMD(0x00030082) //listen
     return 0;
 }
 
-SERVICE_CMD(0x000B0042) //close
+SERVICE_CMD(0x00030082) //listen
 {
-    DEBUG("close %08X --todo--\n", CMD(1));
-
-    SOCKET s;
+    DEBUG("listen %08X %08X\n", CMD(1), CMD(2));
 
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
+    handleinfo* h = GetSocket(CMD(1));
     if (h == NULL) {
         DEBUG("failed to get Handle\n");
         RESP(2, translate_error(ERRNO(EBADF)));
@@ -257,8 +487,7 @@ SERVICE_CMD(0x000B0042) //close
         return 0;
     }
 
-    s = (uintptr_t)h->misc_ptr[0];
-    int rc = closesocket(s);
+    int rc = listen(SOCK(h), CMD(2));
     if (rc != 0) {
         RESP(2, translate_error(GET_ERRNO));
         RESP(1, 0);
@@ -267,21 +496,14 @@ SERVICE_CMD(0x000B0042) //close
 
     RESP(2, 0);
     RESP(1, 0);
-
-    /* TODO cleanup h */
     return 0;
 }
 
-SERVICE_CMD(0x00040082) //accept
+SERVICE_CMD(0x000B0042) //close
 {
-    DEBUG("accept %08X %08X %08X\n", CMD(1), CMD(2), EXTENDED_CMD(1));
-
-    struct sockaddr_storage addr;
-    struct sockaddr         *saddr = (struct sockaddr*)&addr;
-    socklen_t               addrlen = sizeof(addr);
-    SOCKET                  s;
+    DEBUG("close %08X\n", CMD(1));
 
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
+    handleinfo* h = GetSocket(CMD(1));
     if (h == NULL) {
         DEBUG("failed to get Handle\n");
         RESP(2, translate_error(ERRNO(EBADF)));
@@ -289,47 +511,37 @@ SERVICE_CMD(0x00040082) //accept
         return 0;
     }
 
-    u32 handle = handle_New(HANDLE_TYPE_SOCKET, 0);
-    handleinfo* ha = handle_Get(handle);
-    if (ha == NULL) {
-        DEBUG("failed to get newly created Handle\n");
-        RESP(2, translate_error(ENOMEM));
-        RESP(1, 0);
-        return 0;
-    }
+    // Closing also drops the socket from epoll.
+    int rc = closesocket(SOCK(h));
+    int err = GET_ERRNO;
+    h->misc_ptr[0] = (void*)(uintptr_t)SOCKET_CLOSED;
+    h->misc[1] = 0;
 
-    s = (uintptr_t)h->misc_ptr[0];
-    s = accept(s, saddr, &addrlen);
-    if (SOCKET_FAILED(s)) {
-        DEBUG("failed to get newly created SOCKET\n");
-        RESP(2, translate_error(GET_ERRNO));
-        RESP(1, 0);
-        return 0;
-    }
-    ha->misc_ptr[0] = (void*)(uintptr_t)s;
+    // Threads still blocked on it now get EBADF.
+    RetryAll();
 
-    if (save_sockaddr(saddr, addrlen, EXTENDED_CMD(1), CMD(2)) != 0) {
-        shutdown(s, SHUT_RDWR);
-        closesocket(s);
-        /* TODO cleanup ha */
+    if (rc != 0) {
+        RESP(2, translate_error(err));
+        RESP(1, 0);
         return 0;
     }
 
-    RESP(2, handle - HANDLES_BASE); //bit(31) must not be set
+    RESP(2, 0);
     RESP(1, 0);
     return 0;
 }
 
-SERVICE_CMD(0x00090106) //sendto_other
+SERVICE_CMD(0x00040082) //accept
 {
-    DEBUG("sendto_other %08X %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(8), CMD(10));
+    DEBUG("accept %08X %08X %08X\n", CMD(1), CMD(2), EXTENDED_CMD(1));
 
     struct sockaddr_storage addr;
     struct sockaddr         *saddr = (struct sockaddr*)&addr;
-    socklen_t               addrlen = CMD(4);
+    socklen_t               addrlen = sizeof(addr);
     SOCKET                  s;
+    u32                     handle;
 
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
+    handleinfo* h = GetSocket(CMD(1));
     if (h == NULL) {
         DEBUG("failed to get Handle\n");
         RESP(2, translate_error(ERRNO(EBADF)));
@@ -337,41 +549,37 @@ SERVICE_CMD(0x00090106) //sendto_other
         return 0;
     }
 
-    u8 *buffer = (u8*)malloc(CMD(2));
-    if (buffer == NULL) {
-        ERROR("Not enough mem.\n");
-        RESP(2, translate_error(ENOMEM));
+    s = accept(SOCK(h), saddr, &addrlen);
+    if (SOCKET_FAILED(s)) {
+        int err = GET_ERRNO;
+
+        if (ShouldPark(h, err, 0) && Park(h, POLLIN, 0) == 0)
+            return 0;
+        DEBUG("failed to get newly created SOCKET\n");
+        RESP(2, translate_error(err));
         RESP(1, 0);
         return 0;
     }
 
-    if (mem_Read(buffer, CMD(10), CMD(2)) != 0) {
-        ERROR("mem_Read failed.\n");
+    if (SetNonBlocking(s) != 0 || save_sockaddr(saddr, addrlen, EXTENDED_CMD(1), CMD(2)) != 0) {
         RESP(2, translate_error(ERRNO(EFAULT)));
         RESP(1, 0);
-        free(buffer);
+        shutdown(s, SHUT_RDWR);
+        closesocket(s);
         return 0;
     }
+    NewSocket(&handle, s);
 
-    memset(&addr, 0, sizeof(addr));
-    if (load_sockaddr(saddr, &addrlen, CMD(8)) != 0) {
-        free(buffer);
-        return 0;
-    }
+    RESP(2, handle - HANDLES_BASE); //bit(31) must not be set
+    RESP(1, 0);
+    return 0;
+}
 
-    // TODO detect that we are doing send()
-    s = (uintptr_t)h->misc_ptr[0];
-    ssize_t rc = sendto(s, buffer, CMD(2), CMD(3), saddr, addrlen);
-    if (rc < 0) {
-        RESP(2, translate_error(GET_ERRNO));
-        RESP(1, 0);
-        free(buffer);
-        return 0;
-    }
+SERVICE_CMD(0x00090106) //sendto_other
+{
+    DEBUG("sendto_other %08X %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(8), CMD(10));
 
-    RESP(2, 0);
-    RESP(1, (uint32_t)rc);
-    free(buffer);
+    SendTo(CMD(1), CMD(2), CMD(3), CMD(4), CMD(8), CMD(10));
     return 0;
 }
 
@@ -379,67 +587,31 @@ SERVICE_CMD(0x000a0106) //sendto
 {
     DEBUG("sendto %08X %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(8), CMD(10));
 
-    struct sockaddr_storage addr;
-    struct sockaddr         *saddr = (struct sockaddr*)&addr;
-    socklen_t               addrlen = CMD(4);
-    SOCKET                  s;
-
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
-    if (h == NULL) {
-        DEBUG("failed to get Handle\n");
-        RESP(2, translate_error(ERRNO(EBADF)));
-        RESP(1, 0);
-        return 0;
-    }
-
-    u8 *buffer = (u8*)malloc(CMD(2));
-    if (buffer == NULL) {
-        ERROR("Not enough mem.\n");
-        RESP(2, translate_error(ENOMEM));
-        RESP(1, 0);
-        return 0;
-    }
+    SendTo(CMD(1), CMD(2), CMD(3), CMD(4), CMD(10), CMD(8));
+    return 0;
+}
 
-    if (mem_Read(buffer, CMD(8), CMD(2)) != 0) {
-        ERROR("mem_Read failed.\n");
-        RESP(2, translate_error(ERRNO(EFAULT)));
-        RESP(1, 0);
-        free(buffer);
-        return 0;
-    }
+SERVICE_CMD(0x00070104) //recvfrom_other
+{
+    DEBUG("recvfrom_other %08X %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(8), EXTENDED_CMD(1));
 
-    memset(&addr, 0, sizeof(addr));
-    if (load_sockaddr(saddr, &addrlen, CMD(10)) != 0) {
-        free(buffer);
-        return 0;
-    }
+    RecvFrom(CMD(1), CMD(2), CMD(3), CMD(4), EXTENDED_CMD(1), CMD(8));
+    return 0;
+}
 
-    // TODO detect that we are doing send()
-    s = (uintptr_t)h->misc_ptr[0];
-    ssize_t rc = sendto(s, buffer, CMD(2), CMD(3), saddr, addrlen);
-    if (rc < 0) {
-        RESP(2, translate_error(GET_ERRNO));
-        RESP(1, 0);
-        free(buffer);
-        return 0;
-    }
+SERVICE_CMD(0x00080102) //recvfrom
+{
+    DEBUG("recvfrom %08X %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3), CMD(4), EXTENDED_CMD(1), EXTENDED_CMD(3));
 
-    RESP(2, 0);
-    RESP(1, (uint32_t)rc);
-    free(buffer);
+    RecvFrom(CMD(1), CMD(2), CMD(3), CMD(4), EXTENDED_CMD(3), EXTENDED_CMD(1));
     return 0;
 }
 
-SERVICE_CMD(0x00070104) //recvfrom_other
+SERVICE_CMD(0x001300C2) //fcntl
 {
-    DEBUG("recvfrom_other %08X %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3), CMD(4), CMD(8), EXTENDED_CMD(1));
-
-    struct sockaddr_storage addr;
-    struct sockaddr         *saddr = (struct sockaddr*)&addr;
-    socklen_t               addrlen = CMD(4);
-    SOCKET                  s;
+    DEBUG("fcntl %08X %08X %08X\n", CMD(1), CMD(2), CMD(3));
 
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
+    handleinfo* h = GetSocket(CMD(1));
     if (h == NULL) {
         DEBUG("failed to get Handle\n");
         RESP(2, translate_error(ERRNO(EBADF)));
@@ -447,110 +619,102 @@ SERVICE_CMD(0x00070104) //recvfrom_other
         return 0;
     }
 
-    u8 *buffer = (u8*)malloc(CMD(2));
-    if (buffer == NULL) {
-        ERROR("Not enough mem.\n");
-        RESP(2, translate_error(ENOMEM));
-        RESP(1, 0);
-        return 0;
-    }
-
-    memset(&addr, 0, sizeof(addr));
-    if (load_sockaddr(saddr, &addrlen, EXTENDED_CMD(1)) != 0) {
-        free(buffer);
-        return 0;
+    // Only O_NONBLOCK exists, and it only changes whether we park.
+    switch (CMD(2)) {
+    case SOC_F_GETFL:
+        RESP(2, h->misc[0]);
+        break;
+    case SOC_F_SETFL:
+        h->misc[0] = CMD(3) & SOC_O_NONBLOCK;
+        RESP(2, 0);
+        break;
+    default:
+        RESP(2, translate_error(ERRNO(EINVAL)));
+        break;
     }
+    RESP(1, 0);
+    return 0;
+}
 
-    // TODO detect that we are doing recv()
-    s = (uintptr_t)h->misc_ptr[0];
-    ssize_t rc = recvfrom(s, buffer, CMD(2), CMD(3), saddr, &addrlen);
-    if (rc < 0) {
-        ERROR("recvfrom failed.\n");
-        RESP(2, translate_error(GET_ERRNO));
+SERVICE_CMD(0x00140084) //poll
+{
+    DEBUG("poll %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(6), EXTENDED_CMD(1));
+
+    struct {
+        s32 fd;
+        s32 events;
+        s32 revents;
+    } fds[SOC_MAX_POLL];
+    struct pollfd host[SOC_MAX_POLL];
+    u32 nfds = CMD(1);
+    s32 timeout = CMD(2);
+    u32 i, ready = 0;
+
+    if (nfds > SOC_MAX_POLL || mem_Read((u8*)fds, CMD(6), nfds * sizeof(fds[0])) != 0) {
+        RESP(2, translate_error(ERRNO(EINVAL)));
         RESP(1, 0);
-        free(buffer);
         return 0;
     }
 
-    if (mem_Write(buffer, CMD(8), (uint32_t)rc) != 0) {
-        ERROR("mem_Write failed.\n");
-        RESP(2, translate_error(ERRNO(EFAULT)));
-        RESP(1, 0);
-        free(buffer);
-        return 0;
-    }
+    for (i = 0; i < nfds; i++) {
+        handleinfo* h = GetSocket(fds[i].fd);
 
-    if (save_sockaddr(saddr, addrlen, EXTENDED_CMD(1), CMD(4)) != 0) {
-        free(buffer);
-        return 0;
+        host[i].fd = h != NULL ? SOCK(h) : SOCKET_CLOSED;
+        host[i].events = ((fds[i].events & SOC_POLLIN)  ? POLLIN  : 0) |
+                         ((fds[i].events & SOC_POLLPRI) ? POLLPRI : 0) |
+                         ((fds[i].events & SOC_POLLOUT) ? POLLOUT : 0);
+        host[i].revents = 0;
     }
 
-    RESP(2, 0);
-    RESP(1, (uint32_t)rc);
-    free(buffer);
-    return 0;
-}
-
-SERVICE_CMD(0x00080102) //recvfrom
-{
-    DEBUG("recvfrom %08X %08X %08X %08X %08X %08X\n", CMD(1), CMD(2), CMD(3), CMD(4), EXTENDED_CMD(1), EXTENDED_CMD(3));
-
-    struct sockaddr_storage addr;
-    struct sockaddr         *saddr = (struct sockaddr*)&addr;
-    socklen_t               addrlen = CMD(4);
-    SOCKET                  s;
-
-    handleinfo* h = handle_Get(CMD(1) + HANDLES_BASE); //bit(31) must not be set
-    if (h == NULL) {
-        DEBUG("failed to get Handle\n");
-        RESP(2, translate_error(ERRNO(EBADF)));
+    // Never blocks, the waiting is done by parking.
+    if (nfds != 0 && poll(host, nfds, 0) < 0) {
+        RESP(2, translate_error(GET_ERRNO));
         RESP(1, 0);
         return 0;
     }
 
-    u8 *buffer = (u8*)malloc(CMD(2));
-    if (buffer == NULL) {
-        ERROR("Not enough mem.\n");
-        RESP(2, translate_error(ENOMEM));
-        RESP(1, 0);
-        return 0;
+    for (i = 0; i < nfds; i++) {
+        s32 r = host[i].revents;
+
+        if (host[i].fd == SOCKET_CLOSED)
+            r = POLLNVAL;
+        fds[i].revents = ((r & POLLIN)   ? SOC_POLLIN   : 0) |
+                         ((r & POLLPRI)  ? SOC_POLLPRI  : 0) |
+                         ((r & POLLOUT)  ? SOC_POLLOUT  : 0) |
+                         ((r & POLLERR)  ? SOC_POLLERR  : 0) |
+                         ((r & POLLHUP)  ? SOC_POLLHUP  : 0) |
+                         ((r & POLLNVAL) ? SOC_POLLNVAL : 0);
+        if (fds[i].revents != 0)
+            ready++;
     }
 
-    if (load_sockaddr(saddr, &addrlen, EXTENDED_CMD(3)) != 0) {
-        free(buffer);
-        return 0;
-    }
+    if (ready == 0 && timeout != 0) {
+        u64 deadline = 0;
 
-    // TODO detect that we are doing recv()
-    s = (uintptr_t)h->misc_ptr[0];
-    ssize_t rc = recvfrom(s, buffer, CMD(2), CMD(3), saddr, &addrlen);
-    if (rc < 0) {
-        ERROR("recvfrom failed.\n");
-        RESP(2, translate_error(GET_ERRNO));
-        RESP(1, 0);
-        free(buffer);
-        return 0;
+        if (retrying != NULL)
+            deadline = retrying->deadline;
+        else if (timeout > 0)
+            deadline = trace_Now() + (u64)timeout * 1000000;
+
+        if (deadline == 0 || trace_Now() < deadline) {
+            for (i = 0; i < nfds; i++)
+                Watch(GetSocket(fds[i].fd), host[i].events);
+            if (Park(NULL, 0, deadline) == 0)
+                return 0;
+        }
     }
 
-    if (mem_Write(buffer, CMD(1), (uint32_t)rc) != 0) {
-        ERROR("mem_Write failed.\n");
+    if (mem_Write((u8*)fds, EXTENDED_CMD(1), nfds * sizeof(fds[0])) != 0) {
         RESP(2, translate_error(ERRNO(EFAULT)));
         RESP(1, 0);
-        free(buffer);
-        return 0;
-    }
-
-    if (save_sockaddr(saddr, addrlen, EXTENDED_CMD(3), CMD(4)) != 0) {
-        free(buffer);
         return 0;
     }
 
-    RESP(2, 0);
-    RESP(1, (uint32_t)rc);
-    free(buffer);
+    RESP(2, ready);
+    RESP(1, 0);
     return 0;
-
 }
+
 SERVICE_CMD(0x001A00C0)   //ShutdownSockets
 {
     DEBUG("ShutdownSockets");
@@ -561,13 +725,152 @@ SERVICE_CMD(0x001A00C0)   //ShutdownSockets
 SERVICE_CMD(0x00190000)   //GetNetworkOpt
 {
     DEBUG("GetNetworkOpt %08x %08x %08x --STUB--", CMD(1), CMD(2), CMD(3));
-    RESP(3, 6); //Output optlen 
+    RESP(3, 6); //Output optlen
     RESP(2, 0); //POSIX
     RESP(1, 0); //result code
     return 0;
 }
 SERVICE_END()
 
+// Arms epoll for the socket, one-shot, so a fired socket stays quiet until
+// some request waits on it again.
+static void Watch(handleinfo* sock, u32 events)
+{
+#ifdef SOC_EPOLL
+    struct epoll_event ev;
+    u32 want;
+
+    if (sock == NULL || SOCK(sock) == SOCKET_CLOSED)
+        return;
+
+    want = (sock->misc[1] & WATCH_MASK) | events;
+    if ((sock->misc[1] & WATCH_ADDED) && want == (sock->misc[1] & WATCH_MASK))
+        return;
+    if (epoll_fd < 0)
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    // EPOLLIN/PRI/OUT have the values of their poll() counterparts.
+    ev.events = want | EPOLLONESHOT;
+    ev.data.ptr = sock; // Handles never move.
+    if (epoll_ctl(epoll_fd, (sock->misc[1] & WATCH_ADDED) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, SOCK(sock), &ev) != 0) {
+        ERROR("epoll_ctl failed for %08x\n", sock->handle);
+        return;
+    }
+    sock->misc[1] = WATCH_ADDED | want;
+#endif
+}
+
+// Blocks the current thread until the socket is ready for events, or
+// until the deadline. poll() watches its sockets itself and passes NULL.
+static int Park(handleinfo* sock, u32 events, u64 deadline)
+{
+    soc_waiter* w = retrying;
+    u32 i;
+
+    Watch(sock, events);
+
+    if (w == NULL) {
+        for (i = 0; i < MAX_THREADS && waiters[i].used; i++);
+        if (i == MAX_THREADS) {
+            ERROR("Too many threads blocked in soc:u.\n");
+            return -1;
+        }
+        w = &waiters[i];
+
+        if (w->event == 0) {
+            w->event = handle_New(HANDLE_TYPE_EVENT, 0);
+            handle_Get(w->event)->locktype = LOCK_TYPE_ONESHOT;
+        }
+        handle_Get(w->event)->locked = true;
+
+        w->used = true;
+        w->cmd_addr = arm11_ServiceBufferAddress() + 0x80;
+        threads_SetCurrentThreadWaitList(&w->event, true, 1);
+        num_waiting++;
+    }
+
+    w->parked = true;
+    w->deadline = deadline;
+    return 0;
+}
+
+// Runs the request of a parked thread again, against its own command
+// buffer. The thread is woken up unless the request parked again.
+static void Retry(soc_waiter* w)
+{
+    u32* prev_cmd_buffer = ipc_cmd_buffer;
+    soc_waiter* prev_retrying = retrying;
+
+    ipc_cmd_buffer = (u32*)mem_rawaddr(w->cmd_addr, 0x180);
+    w->parked = false;
+
+    if (ipc_cmd_buffer != NULL) {
+        retrying = w;
+        soc_u_SyncRequest(NULL, NULL);
+        retrying = prev_retrying;
+    } else
+        ERROR("command buffer %08x of a parked thread is gone.\n", w->cmd_addr);
+
+    ipc_cmd_buffer = prev_cmd_buffer;
+
+    if (!w->parked) {
+        handle_Get(w->event)->locked = false;
+        w->used = false;
+        num_waiting--;
+    }
+}
+
+static void RetryAll()
+{
+    u32 i;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        if (waiters[i].used && &waiters[i] != retrying)
+            Retry(&waiters[i]);
+    }
+}
+
+u32 soc_NumWaiting()
+{
+    return num_waiting;
+}
+
+// Finishes the requests whose sockets became ready, waiting up to timeout
+// milliseconds for one. Returns how many threads are still blocked.
+u32 soc_Poll(u32 timeout)
+{
+    u64 now = trace_Now();
+    u64 next = 0; // Nearest poll() deadline.
+    u32 i;
+
+    for (i = 0; i < MAX_THREADS; i++) {
+        if (waiters[i].used && waiters[i].deadline != 0 && (next == 0 || waiters[i].deadline < next))
+            next = waiters[i].deadline;
+    }
+    if (next != 0 && next <= now)
+        timeout = 0;
+    else if (next != 0 && (next - now + 999999) / 1000000 < timeout)
+        timeout = (u32)((next - now + 999999) / 1000000);
+
+#ifdef SOC_EPOLL
+    struct epoll_event ev[16];
+    int n = epoll_fd < 0 ? 0 : epoll_wait(epoll_fd, ev, ARRAY_SIZE(ev), timeout);
+
+    for (i = 0; n > 0 && i < (u32)n; i++) {
+        handleinfo* h = ev[i].data.ptr;
+
+        // One-shot, it is disarmed now.
+        h->misc[1] &= ~WATCH_MASK;
+    }
+
+    if (n > 0 || (next != 0 && next <= trace_Now()))
+        RetryAll();
+#else
+    // Nothing to wait on, ask every socket again.
+    RetryAll();
+#endif
+    return num_waiting;
+}
 
 static int load_sockaddr(struct sockaddr *saddr, socklen_t *addrlen, uint32_t src)
 {
@@ -739,3 +1042,21 @@ static int translate_error(int error)
         return -((error_map_t*)result)->to;
     return error;
 }
+
+// Sockets come back dead, a thread parked on one would never wake up.
+int soc_u_CollectState()
+{
+    return num_waiting != 0 ? SAVESTATE_BUSY : 0;
+}
+
+void soc_u_SaveState()
+{
+    savestate_Put(&soc_shared_size, sizeof(soc_shared_size));
+    savestate_Put(&soc_shared_mem_handle, sizeof(soc_shared_mem_handle));
+}
+
+void soc_u_LoadState()
+{
+    savestate_Get(&soc_shared_size, sizeof(soc_shared_size));
+    savestate_Get(&soc_shared_mem_handle, sizeof(soc_shared_mem_handle));
+}
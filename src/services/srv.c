@@ -20,10 +20,11 @@
 #include "arm11.h"
 #include "handles.h"
 #include "mem.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
-extern ARMul_State s;
+extern THREAD_LOCAL ARMul_State* arm11_state;
 u32 apt_u_SyncRequest();
 u32 gsp_gpu_SyncRequest();
 u32 hid_user_SyncRequest();
@@ -454,6 +455,41 @@ static struct {
 
 #define NUM_HANDLE_TYPES ARRAY_SIZE(handle_types)
 
+// Lookup tables over services[], filled in by srv_InitGlobal. Both store
+// index+1 so that 0 means empty.
+#define MAX_SERVICE_TYPES  0x40
+#define SERVICE_HASH_SIZE  0x80
+
+static u32 service_by_subtype[MAX_SERVICE_TYPES];
+static u32 service_by_name[SERVICE_HASH_SIZE];
+
+static u32 HashServiceName(const char* name, size_t len)
+{
+    u32 hash = 0x811C9DC5; // FNV-1a
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (u8)name[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static s32 FindService(const char* name)
+{
+    size_t len = _strnlen(name, 8);
+    u32 slot = HashServiceName(name, len) & (SERVICE_HASH_SIZE - 1);
+
+    while (service_by_name[slot] != 0) {
+        u32 i = service_by_name[slot] - 1;
+
+        if (_strnlen(services[i].name, 8) == len && memcmp(name, services[i].name, len) == 0)
+            return i;
+        slot = (slot + 1) & (SERVICE_HASH_SIZE - 1);
+    }
+    return -1;
+}
+
 
 #define MAX_ownservice 0x100
 typedef struct {
@@ -469,15 +505,20 @@ static u32 ownservice_num;
 
 
 
-u32 services_SyncRequest(handleinfo* h, bool *locked)
+const char* services_GetName(handleinfo* h)
 {
-    u32 i;
+    if (h->subtype < MAX_SERVICE_TYPES && service_by_subtype[h->subtype] != 0)
+        return services[service_by_subtype[h->subtype] - 1].name;
+    if (h->subtype == SERVICE_DIRECT)
+        return "direct";
+    return "service";
+}
 
+u32 services_SyncRequest(handleinfo* h, bool *locked)
+{
     // Lookup which requested service in table.
-    for(i=0; i<ARRAY_SIZE(services); i++) {
-        if(services[i].subtype == h->subtype)
-            return services[i].fnSyncRequest();
-    }
+    if (h->subtype < MAX_SERVICE_TYPES && service_by_subtype[h->subtype] != 0)
+        return services[service_by_subtype[h->subtype] - 1].fnSyncRequest();
 
     if (h->subtype == SERVICE_DIRECT) {
         if (h->misc[0] & HANDLE_SERV_STAT_ACKING) {
@@ -500,7 +541,7 @@ u32 services_SyncRequest(handleinfo* h, bool *locked)
     return 0;
 }
 
-u32 eventhandle;
+static u32 eventhandle;
 
 u32 srv_InitHandle()
 {
@@ -530,6 +571,18 @@ void srv_InitGlobal()
     u32 i;
     for(i=0; i<ARRAY_SIZE(services); i++) {
         services[i].handle = handle_New(HANDLE_TYPE_SERVICE, services[i].subtype);
+
+        // First entry wins, same as the linear scans this replaces.
+        if (services[i].subtype < MAX_SERVICE_TYPES && service_by_subtype[services[i].subtype] == 0)
+            service_by_subtype[services[i].subtype] = i + 1;
+
+        if (FindService(services[i].name) == -1) {
+            u32 slot = HashServiceName(services[i].name, _strnlen(services[i].name, 8)) & (SERVICE_HASH_SIZE - 1);
+
+            while (service_by_name[slot] != 0)
+                slot = (slot + 1) & (SERVICE_HASH_SIZE - 1);
+            service_by_name[slot] = i + 1;
+        }
     }
 }
 
@@ -660,27 +713,23 @@ u32 srv_SyncRequest()
                     // Write result.
                     mem_Write32(arm11_ServiceBufferAddress() + 0x84, 0);
 
-                    s.NumInstrsToExecute = 0; //this will make it wait a round so the server has time to take the service
+                    arm11_state->NumInstrsToExecute = 0; //this will make it wait a round so the server has time to take the service
                     return 0;
                 }
             }
         }
 #endif
 
-        u32 i;
-        for(i=0; i<ARRAY_SIZE(services); i++) {
-            // Find service in list.
-            if(memcmp(req.name, services[i].name, _strnlen(services[i].name, 8)) == 0) {
-
-
-                // Write result.
-                mem_Write32(arm11_ServiceBufferAddress() + 0x84, 0);
+        // Find service in list.
+        s32 idx = FindService(req.name);
+        if (idx != -1) {
+            // Write result.
+            mem_Write32(arm11_ServiceBufferAddress() + 0x84, 0);
 
-                // Write handle_out.
-                mem_Write32(arm11_ServiceBufferAddress() + 0x8C, services[i].handle);
+            // Write handle_out.
+            mem_Write32(arm11_ServiceBufferAddress() + 0x8C, services[idx].handle);
 
-                return 0;
-            }
+            return 0;
         }
 
         ERROR("Unimplemented service: %s\n", req.name);
@@ -937,3 +986,13 @@ u32 svc_serverWaitSynchronization(handleinfo* h, bool *locked)
         return 0;
     }
 }
+
+void srv_SaveState()
+{
+    savestate_Put(&eventhandle, sizeof(eventhandle));
+}
+
+void srv_LoadState()
+{
+    savestate_Get(&eventhandle, sizeof(eventhandle));
+}
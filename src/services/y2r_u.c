@@ -20,98 +20,366 @@
 #include "handles.h"
 #include "mem.h"
 #include "arm11.h"
+#include "gpu.h"
+#include "savestate.h"
 
 #include "service_macros.h"
 
+static y2r_params params;
+static bool transfer_end_interrupt;
+static u32 transfer_end_event;
+
+static void SetDma(y2r_dma* d)
+{
+    d->addr = CMD(1);
+    d->size = CMD(2);
+    d->unit = CMD(3);
+    d->gap = CMD(4);
+}
 
 SERVICE_START(y2r_u);
 
-SERVICE_CMD(0x000D0040)   // ???
+SERVICE_CMD(0x00010040)   // SetInputFormat
+{
+    params.input_format = CMD(1) <= Y2R_INPUT_YUYV422 ? CMD(1) : Y2R_INPUT_YUV422_8;
+    DEBUG("SetInputFormat %d\n", params.input_format);
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x00020000)   // GetInputFormat
+{
+    RESP(1, 0); // Result
+    RESP(2, params.input_format);
+    return 0;
+}
+
+SERVICE_CMD(0x00030040)   // SetOutputFormat
+{
+    params.output_format = CMD(1) & 3;
+    DEBUG("SetOutputFormat %d\n", params.output_format);
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x00040000)   // GetOutputFormat
 {
-    DEBUG("Unknown_D0040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    RESP(1, 0); // Result
+    RESP(2, params.output_format);
+    return 0;
+}
+
+SERVICE_CMD(0x00050040)   // SetRotation
+{
+    params.rotation = CMD(1) & 3;
+    DEBUG("SetRotation %d\n", params.rotation);
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x00060000)   // GetRotation
+{
+    RESP(1, 0); // Result
+    RESP(2, params.rotation);
+    return 0;
+}
+
+SERVICE_CMD(0x00070040)   // SetBlockAlignment
+{
+    params.block_alignment = CMD(1) & 1;
+    DEBUG("SetBlockAlignment %d\n", params.block_alignment);
+    RESP(1, 0); // Result
+    return 0;
+}
 
+SERVICE_CMD(0x00080000)   // GetBlockAlignment
+{
     RESP(1, 0); // Result
+    RESP(2, params.block_alignment);
     return 0;
 }
 
-SERVICE_CMD(0x000F0000)   // ???
+SERVICE_CMD(0x00090040)   // SetSpacialDithering
+SERVICE_CMD(0x000B0040)   // SetTemporalDithering
+SERVICE_CMD(0x00240200)   // SetDitheringWeightParams
 {
-    DEBUG("Unknown_F0000 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    // No dithering.
+    RESP(1, 0); // Result
+    return 0;
+}
 
+SERVICE_CMD(0x000A0000)   // GetSpacialDithering
+SERVICE_CMD(0x000C0000)   // GetTemporalDithering
+{
     RESP(1, 0); // Result
+    RESP(2, 0);
     return 0;
 }
 
-SERVICE_CMD(0x00010040)   // ???
+SERVICE_CMD(0x000D0040)   // SetTransferEndInterrupt
 {
-    DEBUG("Unknown_10040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    transfer_end_interrupt = CMD(1) & 1;
+    DEBUG("SetTransferEndInterrupt %d\n", transfer_end_interrupt);
+    RESP(1, 0); // Result
+    return 0;
+}
 
+SERVICE_CMD(0x000E0000)   // GetTransferEndInterrupt
+{
     RESP(1, 0); // Result
+    RESP(2, transfer_end_interrupt);
     return 0;
 }
 
-SERVICE_CMD(0x0001a0040)   // ???
+SERVICE_CMD(0x000F0000)   // GetTransferEndEvent
 {
-    DEBUG("Unknown_1a0040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    if (!transfer_end_event) {
+        transfer_end_event = handle_New(HANDLE_TYPE_EVENT, 0);
+        handleinfo* h = handle_Get(transfer_end_event);
+        h->locked = true;
+        h->locktype = LOCK_TYPE_ONESHOT;
+    }
 
+    DEBUG("GetTransferEndEvent %08x\n", transfer_end_event);
     RESP(1, 0); // Result
+    RESP(2, 0);
+    RESP(3, transfer_end_event);
     return 0;
 }
 
-SERVICE_CMD(0x0001c0040)   // ???
+SERVICE_CMD(0x00100102)   // SetSendingY
 {
-    DEBUG("Unknown_1c0040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    SetDma(&params.src_y);
+    DEBUG("SetSendingY %08x %08x %08x %08x\n", CMD(1), CMD(2), CMD(3), CMD(4));
+    RESP(1, 0); // Result
+    return 0;
+}
 
+SERVICE_CMD(0x00110102)   // SetSendingU
+{
+    SetDma(&params.src_u);
+    DEBUG("SetSendingU %08x %08x %08x %08x\n", CMD(1), CMD(2), CMD(3), CMD(4));
     RESP(1, 0); // Result
     return 0;
 }
 
-SERVICE_CMD(0x00200040)   // ???
+SERVICE_CMD(0x00120102)   // SetSendingV
 {
-    DEBUG("Unknown_200040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    SetDma(&params.src_v);
+    DEBUG("SetSendingV %08x %08x %08x %08x\n", CMD(1), CMD(2), CMD(3), CMD(4));
+    RESP(1, 0); // Result
+    return 0;
+}
 
+SERVICE_CMD(0x00130102)   // SetSendingYUYV
+{
+    SetDma(&params.src_yuyv);
+    DEBUG("SetSendingYUYV %08x %08x %08x %08x\n", CMD(1), CMD(2), CMD(3), CMD(4));
     RESP(1, 0); // Result
     return 0;
 }
 
-SERVICE_CMD(0x00220040)   // ???
+SERVICE_CMD(0x00140000)   // IsFinishedSendingYuv
+SERVICE_CMD(0x00150000)   // IsFinishedSendingY
+SERVICE_CMD(0x00160000)   // IsFinishedSendingU
+SERVICE_CMD(0x00170000)   // IsFinishedSendingV
+SERVICE_CMD(0x00190000)   // IsFinishedReceiving
 {
-    DEBUG("Unknown_220040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    // Conversions finish within StartConversion.
+    RESP(1, 0); // Result
+    RESP(2, 1);
+    return 0;
+}
 
+SERVICE_CMD(0x00180102)   // SetReceiving
+{
+    SetDma(&params.dst);
+    DEBUG("SetReceiving %08x %08x %08x %08x\n", CMD(1), CMD(2), CMD(3), CMD(4));
     RESP(1, 0); // Result
     return 0;
 }
 
-SERVICE_CMD(0x002B0000)   // ???
+SERVICE_CMD(0x001A0040)   // SetInputLineWidth
 {
-    DEBUG("Init?_2B0000 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    params.line_width = CMD(1);
+    DEBUG("SetInputLineWidth %d\n", params.line_width);
+    RESP(1, 0); // Result
+    return 0;
+}
 
+SERVICE_CMD(0x001B0000)   // GetInputLineWidth
+{
     RESP(1, 0); // Result
+    RESP(2, params.line_width);
     return 0;
 }
 
-SERVICE_CMD(0x00030040)   // ???
+SERVICE_CMD(0x001C0040)   // SetInputLines
 {
-    DEBUG("Unknown_30040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    params.lines = CMD(1);
+    DEBUG("SetInputLines %d\n", params.lines);
+    RESP(1, 0); // Result
+    return 0;
+}
 
+SERVICE_CMD(0x001D0000)   // GetInputLines
+{
     RESP(1, 0); // Result
+    RESP(2, params.lines);
     return 0;
 }
 
-SERVICE_CMD(0x00050040)   // ???
+SERVICE_CMD(0x001E0100)   // SetCoefficient
 {
-    DEBUG("Unknown_50040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    u32 i;
 
+    for (i = 0; i < 8; i++)
+        params.coefficients[i] = (s16)(CMD(1 + i / 2) >> (16 * (i & 1)));
     RESP(1, 0); // Result
     return 0;
 }
 
-SERVICE_CMD(0x00070040)   // ???
+SERVICE_CMD(0x001F0000)   // GetCoefficient
 {
-    DEBUG("Unknown_70040 --todo-- %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    u32 i;
+
+    RESP(1, 0); // Result
+    for (i = 0; i < 4; i++)
+        RESP(2 + i, (u16)params.coefficients[2*i] | (u32)(u16)params.coefficients[2*i + 1] << 16);
+    return 0;
+}
 
+SERVICE_CMD(0x00200040)   // SetStandardCoefficient
+{
+    DEBUG("SetStandardCoefficient %d\n", CMD(1));
+    y2r_StandardCoefficients(CMD(1), params.coefficients);
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x00210040)   // GetStandardCoefficientParams
+{
+    s16 c[8];
+    u32 i;
+
+    y2r_StandardCoefficients(CMD(1), c);
+    RESP(1, 0); // Result
+    for (i = 0; i < 4; i++)
+        RESP(2 + i, (u16)c[2*i] | (u32)(u16)c[2*i + 1] << 16);
+    return 0;
+}
+
+SERVICE_CMD(0x00220040)   // SetAlpha
+{
+    params.alpha = CMD(1);
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x00230000)   // GetAlpha
+{
+    RESP(1, 0); // Result
+    RESP(2, params.alpha);
+    return 0;
+}
+
+SERVICE_CMD(0x00250000)   // GetDitheringWeightParams
+{
+    u32 i;
+
+    RESP(1, 0); // Result
+    for (i = 0; i < 8; i++)
+        RESP(2 + i, 0);
+    return 0;
+}
+
+SERVICE_CMD(0x00260000)   // StartConversion
+{
+    handleinfo* h;
+
+    DEBUG("StartConversion %dx%d %d -> %d\n", params.line_width, params.lines,
+          params.input_format, params.output_format);
+    y2r_Convert(&params);
+
+    h = handle_Get(transfer_end_event);
+    if (h != NULL)
+        h->locked = false;
+
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x00270000)   // StopConversion
+{
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x00280000)   // IsBusyConversion
+{
+    RESP(1, 0); // Result
+    RESP(2, 0);
+    return 0;
+}
+
+SERVICE_CMD(0x002900C0)   // SetConversionParams
+SERVICE_CMD(0x00290180)
+{
+    params.input_format = CMD(1) & 0xFF;
+    params.output_format = (CMD(1) >> 8) & 3;
+    params.rotation = (CMD(1) >> 16) & 3;
+    params.block_alignment = (CMD(1) >> 24) & 1;
+    params.line_width = CMD(2) & 0xFFFF;
+    params.lines = CMD(2) >> 16;
+    y2r_StandardCoefficients(CMD(3) & 0xFF, params.coefficients);
+    params.alpha = CMD(3) >> 16;
+
+    if (params.input_format > Y2R_INPUT_YUYV422)
+        params.input_format = Y2R_INPUT_YUV422_8;
+
+    DEBUG("SetConversionParams %08x %08x %08x\n", CMD(1), CMD(2), CMD(3));
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x002A0000)   // PingProcess
+{
+    RESP(1, 0); // Result
+    RESP(2, 0);
+    return 0;
+}
+
+SERVICE_CMD(0x002B0000)   // DriverInitialize
+{
+    DEBUG("DriverInitialize\n");
+    memset(&params, 0, sizeof(params));
+    params.alpha = 0xFF;
+    y2r_StandardCoefficients(0, params.coefficients);
+    transfer_end_interrupt = false;
+
+    RESP(1, 0); // Result
+    return 0;
+}
+
+SERVICE_CMD(0x002C0000)   // DriverFinalize
+{
+    DEBUG("DriverFinalize\n");
     RESP(1, 0); // Result
     return 0;
 }
 
 SERVICE_END();
+
+void y2r_u_SaveState()
+{
+    savestate_Put(&params, sizeof(params));
+    savestate_Put(&transfer_end_interrupt, sizeof(transfer_end_interrupt));
+    savestate_Put(&transfer_end_event, sizeof(transfer_end_event));
+}
+
+void y2r_u_LoadState()
+{
+    savestate_Get(&params, sizeof(params));
+    savestate_Get(&transfer_end_interrupt, sizeof(transfer_end_interrupt));
+    savestate_Get(&transfer_end_event, sizeof(transfer_end_event));
+}
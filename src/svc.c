@@ -22,8 +22,10 @@
 #include "svc.h"
 
 #include "mem.h"
+#include "trace.h"
+#include "bench.h"
 
-extern ARMul_State s;
+extern THREAD_LOCAL ARMul_State* arm11_state;
 
 
 static const char* names[256] = {
@@ -140,14 +142,44 @@ static const char* names[256] = {
 };
 
 
-void svc_Execute(ARMul_State * state, u8 num)
+const char* svc_GetName(u8 num)
 {
     const char* name = names[num & 0xFF];
 
     if (name == NULL)
         name = "Unknown";
+    return name;
+}
+
+static void svc_Dispatch(ARMul_State * state, u8 num);
+
+void svc_Execute(ARMul_State * state, u8 num)
+{
+    u64 start;
+
+    LOG("\n>> svc%s (0x%x)\n", svc_GetName(num), num);
+
+    threads_LockKernel();
 
-    LOG("\n>> svc%s (0x%x)\n", name, num);
+    if (bench_enabled)
+        bench_Enter(BENCH_SVC);
+
+    if (!trace_enabled) {
+        svc_Dispatch(state, num);
+    } else {
+        start = trace_Now();
+        svc_Dispatch(state, num);
+        trace_Svc(num, start, trace_Now() - start);
+    }
+
+    if (bench_enabled)
+        bench_Leave();
+
+    threads_UnlockKernel();
+}
+
+static void svc_Dispatch(ARMul_State * state, u8 num)
+{
 
     switch (num) {
     case 1:
@@ -239,8 +271,8 @@ void svc_Execute(ARMul_State * state, u8 num)
         arm11_SetR(0, svcDuplicateHandle());
         return;
     case 0x28: //GetSystemTick
-        arm11_SetR(0, (u32)s.NumInstrs);
-        arm11_SetR(1, (u32)(s.NumInstrs >> 32));
+        arm11_SetR(0, (u32)arm11_state->NumInstrs);
+        arm11_SetR(1, (u32)(arm11_state->NumInstrs >> 32));
         return;
     case 0x2B:
         DEBUG("svcGetProcessInfo=%08x\n", arm11_R(2));
@@ -17,6 +17,7 @@
 
 #include "util.h"
 #include "mem.h"
+#include "savestate.h"
 #include "handles.h"
 #include "arm11.h"
 #include "gpu.h"
@@ -35,7 +36,7 @@
 
 #define CONTROL_GSP_FLAG 0x10000
 
-u32 linearalloced = 0;
+static u32 linearalloced = 0;
 
 u32 svcControlMemory()
 {
@@ -378,3 +379,13 @@ u32 svcCreateMemoryBlock() // TODO
     arm11_SetR(1, handle);
     return 0;
 }
+
+void memory_SaveState()
+{
+    savestate_Put(&linearalloced, sizeof(linearalloced));
+}
+
+void memory_LoadState()
+{
+    savestate_Get(&linearalloced, sizeof(linearalloced));
+}
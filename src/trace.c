@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2014 - plutoo
+ * Copyright (C) 2014 - ichfly
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "util.h"
+#include "svc.h"
+#include "trace.h"
+
+// Per host-thread counters. Every emulation thread owns its table, pushed
+// onto a global list once, which trace_Dump walks and sums up. Each table
+// has its own lock, only contended while a dump reads the counters and
+// writes out the ring tail of that thread.
+
+#define TRACE_IPC_SLOTS    0x400 // Power of two.
+#define TRACE_NUM_BUCKETS  8     // <1us, <4us, .. <4ms, >=4ms
+#define TRACE_RING_SIZE    0x10000
+
+typedef struct {
+    u64 calls;
+    u64 total_ns;
+    u64 max_ns;
+    u64 buckets[TRACE_NUM_BUCKETS];
+} trace_counter;
+
+typedef struct {
+    const char* service;
+    u32 cmd;
+    trace_counter c;
+} trace_ipc_entry;
+
+typedef struct trace_table {
+    trace_counter   svc[256];
+    trace_ipc_entry ipc[TRACE_IPC_SLOTS];
+    u64             ipc_dropped;
+
+    trace_record    ring[TRACE_RING_SIZE];
+    u32             ring_pos;
+
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t  lock;
+#endif
+
+    struct trace_table* next;
+} trace_table;
+
+#ifdef _WIN32
+#define LOCK(l)   EnterCriticalSection(&(l))
+#define UNLOCK(l) LeaveCriticalSection(&(l))
+#else
+#define LOCK(l)   pthread_mutex_lock(&(l))
+#define UNLOCK(l) pthread_mutex_unlock(&(l))
+#endif
+
+bool trace_enabled = false;
+
+static THREAD_LOCAL trace_table* local_table;
+static trace_table* volatile all_tables;
+
+static char* stats_path;
+static FILE* ring_file;
+
+static volatile sig_atomic_t dump_requested;
+
+
+#ifdef SIGUSR1
+static void AtUsr1(int sig)
+{
+    dump_requested = 1;
+}
+#endif
+
+int trace_Init(const char* stats, const char* ring)
+{
+    if (stats != NULL) {
+        stats_path = malloc(strlen(stats) + 1);
+        strcpy(stats_path, stats);
+    }
+
+    if (ring != NULL) {
+        ring_file = fopen(ring, "wb");
+        if (ring_file == NULL) {
+            ERROR("failed to open %s\n", ring);
+            return -1;
+        }
+    }
+
+#ifdef SIGUSR1
+    signal(SIGUSR1, AtUsr1);
+#endif
+
+    trace_enabled = true;
+    return 0;
+}
+
+u64 trace_Now()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (u64)(now.QuadPart * (1000000000.0 / freq.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static trace_table* GetTable()
+{
+    trace_table* t = local_table;
+
+    if (t != NULL)
+        return t;
+
+    t = calloc(1, sizeof(trace_table));
+    if (t == NULL) {
+        ERROR("calloc failed\n");
+        exit(1);
+    }
+
+#ifdef _WIN32
+    InitializeCriticalSection(&t->lock);
+#else
+    pthread_mutex_init(&t->lock, NULL);
+#endif
+
+    // Lock-free push onto the global list.
+    do {
+        t->next = all_tables;
+    }
+#ifdef _WIN32
+    while (InterlockedCompareExchangePointer((PVOID volatile*)&all_tables, t, t->next) != t->next);
+#else
+    while (!__sync_bool_compare_and_swap(&all_tables, t->next, t));
+#endif
+
+    local_table = t;
+    return t;
+}
+
+static void Count(trace_counter* c, u64 ns)
+{
+    u32 bucket = 0;
+    u64 limit = 1000;
+
+    while (bucket < TRACE_NUM_BUCKETS - 1 && ns >= limit) {
+        limit *= 4;
+        bucket++;
+    }
+
+    c->calls++;
+    c->total_ns += ns;
+    c->buckets[bucket]++;
+    if (ns > c->max_ns)
+        c->max_ns = ns;
+}
+
+static void FlushRing(trace_table* t)
+{
+    if (ring_file != NULL && t->ring_pos != 0)
+        fwrite(t->ring, sizeof(trace_record), t->ring_pos, ring_file);
+    t->ring_pos = 0;
+}
+
+static void Record(trace_table* t, u16 kind, u16 svc, u32 handle, u32 cmd, u64 start_ns, u64 latency_ns)
+{
+    trace_record* r;
+
+    if (ring_file == NULL)
+        return;
+
+    r = &t->ring[t->ring_pos++];
+    r->start_ns   = start_ns;
+    r->latency_ns = latency_ns > 0xFFFFFFFF ? 0xFFFFFFFF : (u32)latency_ns;
+    r->kind       = kind;
+    r->svc        = svc;
+    r->handle     = handle;
+    r->cmd        = cmd;
+
+    // Stream the ring out whenever it wraps.
+    if (t->ring_pos == TRACE_RING_SIZE)
+        FlushRing(t);
+}
+
+void trace_Svc(u8 num, u64 start_ns, u64 latency_ns)
+{
+    trace_table* t = GetTable();
+
+    LOCK(t->lock);
+    Count(&t->svc[num], latency_ns);
+    Record(t, TRACE_KIND_SVC, num, 0, 0, start_ns, latency_ns);
+    UNLOCK(t->lock);
+}
+
+void trace_Ipc(const char* service, u32 handle, u32 cmd, u64 start_ns, u64 latency_ns)
+{
+    trace_table* t = GetTable();
+    u32 slot = ((u32)(uintptr_t)service ^ cmd ^ (cmd >> 16)) * 0x9E3779B1 >> 22;
+    u32 probes;
+
+    LOCK(t->lock);
+
+    for (probes = 0; probes < TRACE_IPC_SLOTS; probes++) {
+        trace_ipc_entry* e = &t->ipc[slot];
+
+        if (e->service == NULL) {
+            e->service = service;
+            e->cmd = cmd;
+        }
+        if (e->service == service && e->cmd == cmd) {
+            Count(&e->c, latency_ns);
+            break;
+        }
+        slot = (slot + 1) & (TRACE_IPC_SLOTS - 1);
+    }
+
+    if (probes == TRACE_IPC_SLOTS)
+        t->ipc_dropped++;
+
+    Record(t, TRACE_KIND_IPC, 0x32, handle, cmd, start_ns, latency_ns);
+    UNLOCK(t->lock);
+}
+
+static void Merge(trace_counter* to, const trace_counter* from)
+{
+    u32 i;
+
+    to->calls += from->calls;
+    to->total_ns += from->total_ns;
+    if (from->max_ns > to->max_ns)
+        to->max_ns = from->max_ns;
+    for (i = 0; i < TRACE_NUM_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+}
+
+static void WriteRow(FILE* fd, bool json, bool* first, const char* kind, const char* name, u32 id, const trace_counter* c)
+{
+    u32 i;
+
+    if (json) {
+        fprintf(fd, "%s\n  {\"kind\": \"%s\", \"name\": \"%s\", \"id\": \"0x%08x\", \"calls\": %llu, "
+                "\"total_ns\": %llu, \"avg_ns\": %llu, \"max_ns\": %llu, \"hist\": [",
+                *first ? "" : ",", kind, name, id, (unsigned long long)c->calls,
+                (unsigned long long)c->total_ns, (unsigned long long)(c->total_ns / c->calls),
+                (unsigned long long)c->max_ns);
+        for (i = 0; i < TRACE_NUM_BUCKETS; i++)
+            fprintf(fd, "%s%llu", i ? ", " : "", (unsigned long long)c->buckets[i]);
+        fprintf(fd, "]}");
+    } else {
+        fprintf(fd, "%s,%s,0x%08x,%llu,%llu,%llu,%llu", kind, name, id,
+                (unsigned long long)c->calls, (unsigned long long)c->total_ns,
+                (unsigned long long)(c->total_ns / c->calls), (unsigned long long)c->max_ns);
+        for (i = 0; i < TRACE_NUM_BUCKETS; i++)
+            fprintf(fd, ",%llu", (unsigned long long)c->buckets[i]);
+        fprintf(fd, "\n");
+    }
+    *first = false;
+}
+
+// Writes the summed counters of all threads, CSV unless the file ends in .json,
+// and the ring tails of all threads.
+void trace_Dump()
+{
+    static trace_counter svc[256];
+    static trace_ipc_entry ipc[TRACE_IPC_SLOTS];
+    trace_table* t;
+    u32 i, j, num_ipc = 0;
+    u64 dropped = 0;
+    bool first = true;
+
+    if (!trace_enabled)
+        return;
+
+    memset(svc, 0, sizeof(svc));
+    memset(ipc, 0, sizeof(ipc));
+
+    for (t = all_tables; t != NULL; t = t->next) {
+        LOCK(t->lock);
+
+        for (i = 0; i < 256; i++)
+            Merge(&svc[i], &t->svc[i]);
+
+        for (i = 0; i < TRACE_IPC_SLOTS; i++) {
+            if (t->ipc[i].service == NULL)
+                continue;
+
+            for (j = 0; j < num_ipc; j++) {
+                if (ipc[j].service == t->ipc[i].service && ipc[j].cmd == t->ipc[i].cmd)
+                    break;
+            }
+            if (j == num_ipc) {
+                ipc[j].service = t->ipc[i].service;
+                ipc[j].cmd = t->ipc[i].cmd;
+                num_ipc++;
+            }
+            Merge(&ipc[j].c, &t->ipc[i].c);
+        }
+
+        dropped += t->ipc_dropped;
+
+        FlushRing(t);
+        UNLOCK(t->lock);
+    }
+
+    if (ring_file != NULL)
+        fflush(ring_file);
+
+    if (stats_path == NULL)
+        return;
+
+    FILE* fd = fopen(stats_path, "w");
+    if (fd == NULL) {
+        ERROR("failed to open %s\n", stats_path);
+        return;
+    }
+
+    size_t len = strlen(stats_path);
+    bool json = len > 5 && strcmp(stats_path + len - 5, ".json") == 0;
+
+    if (json)
+        fprintf(fd, "[");
+    else
+        fprintf(fd, "kind,name,id,calls,total_ns,avg_ns,max_ns,lt1us,lt4us,lt16us,lt64us,lt256us,lt1ms,lt4ms,ge4ms\n");
+
+    for (i = 0; i < 256; i++) {
+        if (svc[i].calls != 0)
+            WriteRow(fd, json, &first, "svc", svc_GetName(i), i, &svc[i]);
+    }
+    for (i = 0; i < num_ipc; i++)
+        WriteRow(fd, json, &first, "ipc", ipc[i].service, ipc[i].cmd, &ipc[i].c);
+
+    if (json)
+        fprintf(fd, "\n]\n");
+    fclose(fd);
+
+    if (dropped != 0)
+        ERROR("%llu ipc samples dropped, table full\n", (unsigned long long)dropped);
+}
+
+// Called from the main loop, dumps outside of signal context.
+void trace_Poll()
+{
+    if (dump_requested) {
+        dump_requested = 0;
+        trace_Dump();
+    }
+}
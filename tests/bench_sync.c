@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../inc/util.h"
+#include "../inc/arm11.h"
+#include "../inc/handles.h"
+#include "../inc/mem.h"
+#include "../inc/svc.h"
+
+#define ASSERT(expr, ...)                                \
+    if(!(expr)) {                                        \
+        fprintf(stderr, "%s:%d ", __FILE__, __LINE__);   \
+        fprintf(stderr, __VA_ARGS__);                    \
+        exit(1);                                         \
+    }
+
+#ifdef GDB_STUB
+#include "armemu.h"
+#include "armdefs.h"
+
+#include "gdb/gdbstub.h"
+#include "gdb/gdbstubchelper.h"
+
+struct armcpu_memory_iface *gdb_memio;
+
+#endif
+
+char *codepath = NULL;
+int noscreen = 1;
+
+#define NUM_SYNC_REQUESTS 1000000
+#define NUM_WAIT_N_CALLS  100000
+#define WAIT_N_HANDLES    64
+#define HANDLES_ADDR      0x10000000
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t heap_top()
+{
+#ifdef _WIN32
+    return 0;
+#else
+    return (size_t) sbrk(0);
+#endif
+}
+
+// An unmounted service handle with no pending sessions always blocks, so
+// every call below goes down the "put thread into WAITING state" path.
+static u32 new_blocking_handle()
+{
+    u32 handle = handle_New(HANDLE_TYPE_SERVICE_UNMOUNTED, SERVICE_DIRECT);
+    handle_Get(handle)->misc[0] = 0;
+    return handle;
+}
+
+int main()
+{
+    u32 i;
+    double start, end;
+    size_t heap_before;
+
+    arm11_Init();
+    threads_New(handle_New(HANDLE_TYPE_THREAD, 0));
+
+    // Thread command buffers, as mapped by the loader.
+    ASSERT(mem_AddSegment(0xFFFF0000 - 0x1000 * MAX_THREADS, 0x1000 * (MAX_THREADS+1), NULL) == 0,
+           "mapping failed\n");
+    ASSERT(mem_AddSegment(HANDLES_ADDR, 0x1000, NULL) == 0, "mapping failed\n");
+    for (i = 0; i < WAIT_N_HANDLES; i++)
+        mem_Write32(HANDLES_ADDR + i * 4, new_blocking_handle());
+
+    u32 handle = new_blocking_handle();
+
+    heap_before = heap_top();
+    start = now_ns();
+    for (i = 0; i < NUM_SYNC_REQUESTS; i++) {
+        arm11_SetR(0, handle);
+        svcSendSyncRequest();
+    }
+    end = now_ns();
+
+    printf("svcSendSyncRequest:     %d calls, %.1f ns/call\n",
+           NUM_SYNC_REQUESTS, (end - start) / NUM_SYNC_REQUESTS);
+
+    start = now_ns();
+    for (i = 0; i < NUM_WAIT_N_CALLS; i++)
+        wrapWaitSynchronizationN(0, HANDLES_ADDR, WAIT_N_HANDLES, false, 0, 0);
+    end = now_ns();
+
+    printf("WaitSynchronizationN:   %d calls x %d handles, %.1f ns/call\n",
+           NUM_WAIT_N_CALLS, WAIT_N_HANDLES, (end - start) / NUM_WAIT_N_CALLS);
+
+    printf("heap growth: %zu bytes\n", heap_top() - heap_before);
+    ASSERT(heap_top() - heap_before < 0x10000, "blocking calls are allocating\n");
+
+    return 0;
+}